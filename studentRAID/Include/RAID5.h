@@ -25,19 +25,24 @@ struct RAID5Params:public RAIDParams
 
 class CRAID5Processor:public CRAIDProcessor
 {
-    ///the buffer used for parity computation
-    unsigned char* m_pXORBuffer;
+    ///offset of the buffers used for parity computation within the scratch arena
+    size_t m_XORBuffer;
 protected:
       ///Check if it is possible to correct a given combination of erasures
     ///If yes, the method should initialize the internal data structures
     ///and be ready to do the actual erasure correction. This combination of erasures
     /// is uniquely identified by ErasureID
     ///@return true if the specified combination of erasures is correctable
-    virtual bool IsCorrectable(unsigned ErasureSetID///identifies the erasure combination. This will not exceed m_Length-1
+    virtual bool IsCorrectable(unsigned ErasureSetID///identifies the erasure combination. This will not exceed GetNumOfErasureSets()-1
                               )
     {
         return GetNumOfErasures(ErasureSetID)<=1;
     };
+    ///a single erasure is always correctable
+    virtual unsigned GetCorrectingCapability()const
+    {
+        return 1;
+    };
     ///reset the erasure correction engine
     /// this will be called if the set of failed disks changes
     virtual void ResetErasures()
@@ -81,6 +86,15 @@ protected:
                                           const unsigned char* pData,///new payload data symbols
                                           size_t ThreadID ///the ID of the calling thread
                  );
+    ///compute the differences between the new and old values of the check symbols caused by an update of some information symbols
+    ///@return true on success
+    virtual bool ComputeCheckDeltas(unsigned ErasureSetID,///identifies the load balancing offset
+                                    unsigned StripeUnitID,///the first stripe unit to be updated
+                                    unsigned Units2Update,///the number of units to be updated
+                                    const unsigned char* pDelta,///the differences between the new and old values of the units
+                                    unsigned char* pCheckDeltas,///output: the differences of all check symbols
+                                    size_t ThreadID ///the ID of the calling thread
+                                   );
     ///make sure that the codeword is a legal one
     ///@return true on success
     bool CheckCodeword(unsigned long long StripeID,///identifies the codeword to be validated
@@ -101,6 +115,11 @@ public:
     virtual bool Attach(CDiskArray* pArray,///the disk array
                         unsigned ConcurrentThreads ///the number of concurrent processing threads that will make calls to the processor
                        );    
+    ///@return true, since the parity difference is the sum of the differences of the updated symbols
+    virtual bool CanComputeCheckDeltas()const
+    {
+        return true;
+    };
   
   
 };
@@ -12,6 +12,9 @@
 
 
 #include <stdlib.h>
+#include "sync.h"
+#include "scratch.h"
+#include "layout.h"
 
 
 class  CDiskArray;
@@ -31,11 +34,23 @@ struct RAIDParams
   unsigned StripeUnitSize;
   ///number of independent arrays 
   unsigned InterleavingOrder;
-  RAIDParams(int type,unsigned Dimension,unsigned interleavingOrder,unsigned stripeUnitSize):
+  ///the mapping of codeword symbols onto disks (eLayoutTypes)
+  int Layout;
+  ///the number of disks in each subarray (0 if this is given by the code length)
+  unsigned PoolSize;
+  ///the number of disks worth of distributed spare space in each subarray
+  unsigned SpareDisks;
+  ///the number of consecutive stripes with the same symbol to disk mapping (cyclic, left-symmetric and weighted layouts)
+  unsigned RotationPeriod;
+  ///the relative load of each disk of a subarray (weighted layout). Zero entries stand for 1
+  unsigned char Weights[MAXWEIGHTEDDISKS];
+  RAIDParams(int type,unsigned Dimension,unsigned interleavingOrder,unsigned stripeUnitSize,
+             int layout=ltCyclic,unsigned poolSize=0,unsigned spareDisks=0,unsigned rotationPeriod=1,const char* weights=0):
         Type(type),CodeDimension(Dimension),
-            StripeUnitSize(stripeUnitSize),InterleavingOrder(interleavingOrder)
+            StripeUnitSize(stripeUnitSize),InterleavingOrder(interleavingOrder),
+            Layout(layout),PoolSize(poolSize),SpareDisks(spareDisks),RotationPeriod(rotationPeriod)
   {
-    
+    ParseWeights(weights,Weights);
   }; 
 };
 #pragma pack(pop)
@@ -43,8 +58,15 @@ struct RAIDParams
 
 
 ///this is a base class for all RAID data processing algorithms
-///It implements also cyclic load balancing across the drives
-///each derived class must be able to support a given number of parallel calls
+///It implements also load balancing across the drives by means of a CLayout object
+///each derived class must be able to support any number of parallel calls. The temporary buffers needed by a call
+///are reserved by ReserveScratch() and located in the scratch arena identified by the ThreadID argument.
+///
+///An erasure configuration (ErasureSetID) identifies the subarray, the symbol to disk mapping pattern of the stripe,
+///and the view of the array. View 0 is the normal one. During the rebuild of a failed disk into the spare space,
+///view 1 is used for the stripes already rebuilt, where the symbols of that disk are relocated to their spare units.
+///If a replacement disk is being reconstructed in place, its symbols are reported as erased in view 0 only.
+///View 2 is used to write the relocated symbols only: all other symbols are reported as erased in this view
 class CRAIDProcessor
 {
     ///the full configuration record
@@ -53,12 +75,32 @@ class CRAIDProcessor
     unsigned m_ConfigSize;
     ///provides interface for reading and writing data on disks
     CDiskArray* m_pArray;
-    ///number of offline disks in each of the subarrays
+    ///maps codeword symbols onto disks
+    CLayout* m_pLayout;
+    ///the number of disks in a subarray
+    unsigned m_DisksPerSubarray;
+    ///the number of distinct symbol to disk mappings used by the layout
+    unsigned m_NumOfPatterns;
+    ///the number of erasure configurations in a single view
+    unsigned m_NumOfErasureSets;
+    ///number of offline disks in each of the subarrays, which were not relocated to the spare space
     unsigned* m_pNumOfOfflineDisks;
-    ///IDs of offline disks for each of the subarrays
-    unsigned** m_ppOfflineDisks;
-    ///the temporary buffer for data update
-    unsigned char* m_pUpdateBuffer;
+    ///the number of erased symbols for each erasure configuration
+    unsigned* m_pNumOfErasures;
+    ///erased symbols for each erasure configuration (m_Length entries per configuration, sorted in ascending order)
+    unsigned short* m_pErasedPositions;
+    ///offset of the temporary buffer for data update within the scratch arena
+    size_t m_UpdateBuffer;
+    ///offset of the buffer for the check symbol differences of a parity logged update within the scratch arena
+    size_t m_CheckDeltaBuffer;
+    ///the scratch arenas used by concurrent calls
+    CScratchPool m_Scratch;
+    ///the number of bytes reserved in each scratch arena
+    size_t m_ScratchSize;
+    ///true for the erasure configurations already prepared by IsCorrectable()
+    volatile bool* m_pPrepared;
+    ///serializes the preparation of erasure configurations
+    tCriticalSection m_PrepareLock;
 protected:
     ///length of the array code
     unsigned m_Length;
@@ -74,7 +116,7 @@ protected:
     ///Read from disks a contiguous set of stripe units corresponding to the same symbol
     ///In other words, read a number of subsymbols corresponding to some symbol
     ///This function will not check if the requested range crosses the stripe boundary
-    ///This function provides also load balancing by cyclically mapping symbols onto disks (offset is given by ErasureSetID)
+    ///The symbols are mapped onto disks by the layout, taking into account the relocations specified by the view of ErasureSetID
     ///@return true on success
     bool ReadStripeUnit ( unsigned long long StripeID,///identifies the codeword (stripe)
                           unsigned ErasureSetID,///identifies the load balancing offset
@@ -86,7 +128,7 @@ protected:
     ///Write to disks a contiguous set of stripe units corresponding to the same symbol
     ///In other words, read a number of subsymbols corresponding to some symbol
     ///This function will not check if the requested range crosses the stripe boundary
-    ///This function provides also load balancing by cyclically mapping symbols onto disks (offset is given by ErasureSetID)
+    ///The symbols are mapped onto disks by the layout, taking into account the relocations specified by the view of ErasureSetID
     ///@return true on success
     bool WriteStripeUnit ( unsigned long long StripeID,///identifies the codeword (stripe)
                            unsigned ErasureSetID,///identifies the load balancing offset
@@ -95,36 +137,84 @@ protected:
                            unsigned Units2Write,///number of stripe units to be loaded
                            const void* pSrc ///the data to be written (Units2Read*m_StripeUnitSize bytes)
                          );
+    ///Read an entire check symbol to be updated by a small write. The symbols of the recently updated stripes
+    ///are taken from the parity cache of the array, if any, and the ones read from the disk are placed into it
+    ///@return true on success
+    bool ReadCheckSymbol ( unsigned long long StripeID,///identifies the codeword (stripe)
+                           unsigned ErasureSetID,///identifies the load balancing offset
+                           unsigned SymbolID,///identifies the check symbol. This must be not less than m_Dimension
+                           void* pDest ///the destination buffer. Must have size m_StripeUnitsPerSymbol*m_StripeUnitSize
+                         );
     ///Check if it is possible to correct a given combination of erasures
     ///If yes, the method should initialize the internal data structures
     ///and be ready to do the actual erasure correction. This combination of erasures
     /// is uniquely identified by ErasureID
     ///@return true if the specified combination of erasures is correctable
-    virtual bool IsCorrectable(unsigned ErasureSetID///identifies the erasure combination. This will not exceed m_Length-1
+    virtual bool IsCorrectable(unsigned ErasureSetID///identifies the erasure combination. This will not exceed GetNumOfErasureSets()-1
                               )=0;
+    ///@return the number of erasures which can be corrected irrespective of their positions,
+    ///so that the array can be declared mountable without calling IsCorrectable() for each erasure configuration
+    virtual unsigned GetCorrectingCapability()const
+    {
+        return 0;
+    };
+    ///call IsCorrectable() for the given erasure configuration, unless it was already done
+    ///since the last ResetErasures() call. Can be called concurrently
+    ///@return true if the erasure configuration is correctable
+    bool PrepareErasureSet(unsigned ErasureSetID ///identifies the erasure combination
+                          )
+    {
+        if (m_pPrepared[ErasureSetID])
+        {
+            //pairs with the barrier preceding the flag update, so that the decoder state is not read before the flag
+            FullBarrier();
+            return true;
+        };
+        return PrepareErasureSetSlow(ErasureSetID);
+    };
+    ///the non-inlined part of PrepareErasureSet()
+    bool PrepareErasureSetSlow(unsigned ErasureSetID);
+    ///@return the total number of erasure configurations in all views. The derived classes should use it to allocate per-configuration data
+    unsigned GetNumOfErasureSets()const
+    {
+        return 3*m_NumOfErasureSets;
+    };
     ///get the total number of erasures
     unsigned GetNumOfErasures(unsigned ErasureSetID)const
     {
-        return m_pNumOfOfflineDisks[ErasureSetID/m_Length];
+        return m_pNumOfErasures[ErasureSetID];
     };
     ///@return the i-th erased symbol, or -1 if it does not exist
     int GetErasedPosition(unsigned ErasureSetID,///the erasure combination
                           unsigned i ///ID of the erased symbol
                          )const
     {
-        unsigned SubarrayID=ErasureSetID/m_Length;
-        ErasureSetID=ErasureSetID%m_Length;
-        if (i>=m_pNumOfOfflineDisks[SubarrayID])
+        if (i>=m_pNumOfErasures[ErasureSetID])
             return -1;
-        //cyclic load balancing for disks
-        int Res=m_ppOfflineDisks[SubarrayID][i]-ErasureSetID;
-        if (Res<0)
-            Res+=m_Length;
-        return Res;
+        return m_pErasedPositions[ErasureSetID*m_Length+i];
     };
     ///@return true if the i-th symbol is erased
     bool IsErased(unsigned ErasureSetID,///the erasure combination (identifies the load balancing offset)
-                  unsigned i)const;
+                  unsigned i)const
+    {
+        const unsigned short* pErased=m_pErasedPositions+ErasureSetID*m_Length;
+        for(unsigned j=0;j<m_pNumOfErasures[ErasureSetID];j++)
+            if (pErased[j]==i)
+                return true;
+        return false;
+    };
+    ///@return the erasure configuration to be used for a given stripe
+    unsigned GetErasureSetID(unsigned long long StripeID,///the stripe
+                             unsigned SubarrayID ///the subarray
+                            )const;
+    ///find the disk and the symbol row where a codeword symbol is stored in a given view of the array
+    void GetSymbolLocation(unsigned long long StripeID,///the stripe
+                           unsigned SubarrayID,///the subarray
+                           unsigned View,///the view of the array
+                           unsigned SymbolID,///the symbol
+                           unsigned& DiskID,///output: the disk within the array
+                           unsigned long long& Row ///output: the symbol row on this disk
+                          )const;
     
     ///decode a number of payload subsymbols from a given symbol
     ///@return true on success
@@ -170,6 +260,30 @@ protected:
                                           const unsigned char* pData,///new payload data symbols
                                           size_t ThreadID ///the ID of the calling thread
                  )=0;
+    ///compute the differences between the new and old values of the check symbols caused by an update of some information symbols.
+    ///The codes supporting this must override CanComputeCheckDeltas() as well
+    ///@return true on success
+    virtual bool ComputeCheckDeltas(unsigned /*ErasureSetID*/,///identifies the load balancing offset
+                                    unsigned /*StripeUnitID*/,///the first stripe unit to be updated
+                                    unsigned /*Units2Update*/,///the number of units to be updated
+                                    const unsigned char* /*pDelta*/,///the differences between the new and old values of the units
+                                    unsigned char* /*pCheckDeltas*/,///output: the differences of all check symbols. Must have size at least (m_Length-m_Dimension)*m_StripeUnitsPerSymbol*m_StripeUnitSize
+                                    size_t /*ThreadID*/ ///the ID of the calling thread
+                                   )
+    {
+        return false;
+    };
+    ///update some information symbols, and append the differences of the check symbols to the parity log,
+    ///or update them in place if this is not possible
+    ///@return true on success
+    bool LogInformationSymbols(unsigned long long StripeID,///the stripe to be updated
+                               unsigned SubarrayID,///identifies the subarray
+                               unsigned ErasureSetID,///identifies the load balancing offset
+                               unsigned StripeUnitID,///the first stripe unit to be updated
+                               unsigned Units2Update,///the number of units to be updated
+                               const unsigned char* pData,///new payload data symbols
+                               size_t ThreadID ///the ID of the calling thread
+                              );
     ///check if the codeword is consistent
     virtual bool CheckCodeword(unsigned long long StripeID,///the stripe to be checked
                                unsigned ErasureSetID,///identifies the load balancing offset
@@ -210,6 +324,34 @@ public:
     {   
         return m_InterleavingOrder;
     };
+    ///@return the mapping of the codeword symbols onto disks
+    const CLayout& GetLayout()const
+    {
+        return *m_pLayout;
+    };
+    ///@return the total number of disks used by the array
+    unsigned GetNumOfDisks()const
+    {
+        return m_DisksPerSubarray*m_InterleavingOrder;
+    };
+    ///@return the number of stripes which fit into a given number of symbol rows on each disk
+    unsigned long long GetNumOfStripes(unsigned long long DiskRows)const
+    {
+        return m_pLayout->GetNumOfStripes(DiskRows);
+    };
+    ///@return the number of stripes which fit into the disks of different size. Each subarray must fit them
+    unsigned long long GetNumOfStripes(const unsigned long long* pDiskRows ///the number of symbol rows on each disk
+                                      )const
+    {
+        unsigned long long NumOfStripes=m_pLayout->GetNumOfStripesOnDisks(pDiskRows);
+        for(unsigned j=1;j<m_InterleavingOrder;j++)
+        {
+            unsigned long long S=m_pLayout->GetNumOfStripesOnDisks(pDiskRows+j*m_DisksPerSubarray);
+            if (S<NumOfStripes)
+                NumOfStripes=S;
+        };
+        return NumOfStripes;
+    };
     ///get the full configuration record of the code
     ///@return record size
     unsigned GetConfiguration(const void*& pData)
@@ -227,19 +369,43 @@ public:
     ///attach to the disk array
     ///Prepare for multi-threaded processing
     ///The derived classes must override this method, and the overridden one
-    ///must make a call to the one in the parent class AFTER all general initialization has been done.
+    ///must make a call to the one in the parent class AFTER all general initialization has been done,
+    ///including the reservation of the scratch buffers.
     ///This method will make a call to ResetErasures() method
     ///@return true on success
     virtual bool Attach(CDiskArray* pArray,///the disk array
-                        unsigned ConcurrentThreads ///the number of concurrent processing threads that will make calls to the processor
+                        unsigned ConcurrentThreads ///the expected number of concurrent calls. More of them are allowed, but need additional allocations
                        );
+    ///reserve a buffer in each scratch arena. This may be called only before Attach()
+    ///@return offset of the buffer within the arena
+    size_t ReserveScratch(size_t Size ///the number of bytes needed by each call
+                         );
+    ///obtain a scratch arena for the duration of a call
+    ///@return the ID to be passed as ThreadID argument
+    size_t AcquireScratch()
+    {
+        return m_Scratch.Acquire();
+    };
+    ///return the scratch arena obtained by AcquireScratch()
+    void ReleaseScratch(size_t ThreadID ///the value returned by AcquireScratch()
+                       )
+    {
+        m_Scratch.Release(ThreadID);
+    };
+    ///@return the start of the scratch arena of a calling thread. The buffers reserved by ReserveScratch() are located at the returned offsets
+    unsigned char* GetScratch(size_t ThreadID ///calling thread ID
+                             )const
+    {
+        return m_Scratch.Get(ThreadID);
+    };
     ///reset the erasure correction engine
     /// this will be called if the set of failed disks changes
     /// The derived class must first call the method in the parent one
     virtual void ResetErasures();
 
     ///check if we have sufficient amount of online disks in the array
-    ///so that the data can be recovered
+    ///so that the data can be recovered. The erasure configurations are prepared lazily
+    ///on first access, unless the correcting capability of the code is insufficient to decide this
     ///@return true if read and write access to the data is possible
     bool IsMountable();
 
@@ -264,11 +430,60 @@ public:
     ///make sure that the codeword is a legal one
     ///@return true on success
     bool VerifyStripe(unsigned long long StripeID,///identifies the codeword to be validated
+                      unsigned SubarrayID,///identifies the subarray to be used
                       size_t ThreadID ///calling thread ID
-          )
+          );
+    ///@return true if the differences of the check symbols can be computed by ComputeCheckDeltas(), so that the small writes can be parity logged
+    virtual bool CanComputeCheckDeltas()const
     {
-        return CheckCodeword(StripeID,StripeID%m_Length,ThreadID);
+        return false;
     };
+    ///add the accumulated differences to the check symbols of a stripe. The erased check symbols are skipped
+    ///@return true on success
+    bool ApplyCheckDeltas(unsigned long long StripeID,///the stripe to be updated
+                          unsigned SubarrayID,///identifies the subarray
+                          const unsigned char* pCheckDeltas,///the differences of all check symbols
+                          size_t ThreadID ///calling thread ID
+                         );
+    ///recompute the check symbols of a stripe from its payload symbols stored on the disks
+    ///@return true on success, false if some payload symbols are erased or cannot be read
+    bool ReencodeStripe(unsigned long long StripeID,///the stripe to be re-encoded
+                        unsigned SubarrayID,///identifies the subarray
+                        size_t ThreadID ///calling thread ID
+                       );
+    ///@return true if the symbols of a stripe can be copied to another one by CopyStripe()
+    bool CanCopyStripe(unsigned long long SrcStripeID,///the stripe to be copied
+                       unsigned long long DestStripeID,///the stripe to be overwritten
+                       unsigned SubarrayID ///identifies the subarray
+                      )const;
+    ///copy all symbols of a stripe, including the check ones, to the same positions of another stripe, so that
+    ///nothing is decoded or encoded. Both stripes must be locked by the caller
+    ///@return true on success
+    bool CopyStripe(unsigned long long SrcStripeID,///the stripe to be copied
+                    unsigned long long DestStripeID,///the stripe to be overwritten
+                    unsigned SubarrayID,///identifies the subarray
+                    size_t ThreadID ///calling thread ID
+                   );
+    ///@return true if some of the payload symbols covering a range of stripe units are erased, so that they must be decoded on read
+    bool IsDegraded(unsigned long long StripeID,///the stripe
+                    unsigned StripeUnitID,///the first payload stripe unit
+                    unsigned SubarrayID,///identifies the subarray
+                    unsigned NumOfUnits ///the number of units
+                   )const;
+    ///reconstruct the symbols of a stripe which are relocated to the spare space by the rebuild in progress,
+    ///and write them to their spare units. The stripe must be locked by the caller
+    ///@return true on success
+    bool RebuildStripe(unsigned long long StripeID,///the stripe to be rebuilt
+                       unsigned SubarrayID,///identifies the subarray
+                       size_t ThreadID ///calling thread ID
+                      );
+    ///release the disk space occupied by all symbols of a range of stripes, including the check ones.
+    ///The stripes must be locked by the caller, and their content is undefined afterwards
+    ///@return true on success
+    bool DiscardStripes(unsigned long long FirstStripe,///the first stripe to be discarded
+                        unsigned long long LastStripe,///the stripe following the last one
+                        unsigned SubarrayID ///identifies the subarray
+                       );
 
 };
 
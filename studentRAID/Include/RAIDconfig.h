@@ -165,10 +165,12 @@ typedef CRAIDProcessor* (*tRAIDParser)(cfg_t* cfg);
 //if config header was included, provide the option list implementation
 #ifdef _cfg_h_
 ///config specification  for a given RAID. It includes the common parameters (RAIDParams)
-#define CFGOPTIONLIST(name,count,...) cfg_opt_t name##_opts[] ={ CFG_unsigned("Dimension",0,CFGF_NONE),CFG_unsigned("InterleavingOrder",1,CFGF_NONE),  CFG_unsigned("StripeUnitSize",0,CFGF_NONE), DECLARECONFIG__(count,(__VA_ARGS__)) };
+#define CFGOPTIONLIST(name,count,...) cfg_opt_t name##_opts[] ={ CFG_unsigned("Dimension",0,CFGF_NONE),CFG_unsigned("InterleavingOrder",1,CFGF_NONE),  CFG_unsigned("StripeUnitSize",0,CFGF_NONE), \
+            CFG_STR("Layout","cyclic",CFGF_NONE), CFG_unsigned("PoolSize",0,CFGF_NONE), CFG_unsigned("SpareDisks",0,CFGF_NONE), CFG_unsigned("RotationPeriod",1,CFGF_NONE), CFG_STR("Weights",NULL,CFGF_NONE), DECLARECONFIG__(count,(__VA_ARGS__)) };
 ///generates a constructor body from a configuration file section
 #define CFGCONSTRUCTORIMPL(name,count,...) name##Params::name##Params(cfg_t* cfg):\
-            RAIDParams(rt##name,cfg_getint(cfg,"Dimension"),cfg_getint(cfg,"InterleavingOrder"),cfg_getint(cfg,"StripeUnitSize"))INITPARAM__(count,(cfg,__VA_ARGS__))\
+            RAIDParams(rt##name,cfg_getint(cfg,"Dimension"),cfg_getint(cfg,"InterleavingOrder"),cfg_getint(cfg,"StripeUnitSize"), \
+                       GetLayoutType(cfg_getstr(cfg,"Layout")),cfg_getint(cfg,"PoolSize"),cfg_getint(cfg,"SpareDisks"),cfg_getint(cfg,"RotationPeriod"),cfg_getstr(cfg,"Weights"))INITPARAM__(count,(cfg,__VA_ARGS__))\
   {}
 #define CFG_int CFG_INT
 #define CFG_bool CFG_BOOL
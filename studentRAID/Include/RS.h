@@ -37,8 +37,8 @@ class CRSProcessor:public CRAIDProcessor
 
     //true if cyclotomic processing is used
     bool m_CyclotomicProcessing;
-    ///temporary array for cyclotomic processing
-    GFValue* m_pCyclotomicTemp;
+    ///offset of the temporary array for cyclotomic processing within the scratch arena
+    size_t m_CyclotomicTemp;
     //true if the check symbol locators are optimized ones
     bool m_OptimizedCheckLocators;
 
@@ -47,19 +47,19 @@ class CRSProcessor:public CRAIDProcessor
     ///values of \alpha^{1-b}/\Lambda'(1/X_i) (needed by Forney algorithm)
     ///where X_i are locators of check symbols
     int* m_pCheckLocatorsPrime;
-	///syndromes for each stripe unit
-	GFValue* m_pSyndromes;
-	///the erasure evaluator polynomial
-	GFValue* m_pErasureEvaluator;
+	///offset of the syndromes for each stripe unit within the scratch arena
+	size_t m_Syndromes;
+	///offset of the erasure evaluator polynomial within the scratch arena
+	size_t m_ErasureEvaluator;
 	///the erasure locator polynomial for each erasure configuration
 	GFValue* m_pErasureLocators;
     ///values of \alpha^{1-b}/\Lambda'(1/X_i) (needed by Forney algorithm)
     ///where X_i are locators of erased symbols
     int* m_pErasureLocatorsPrime;
-	///buffer for fetching the codeword symbols
-	GFValue* m_pSymbols;
-	///pointers to the fetched symbols
-	const GFValue ** m_ppSymbols;
+	///offset of the buffer for fetching the codeword symbols within the scratch arena
+	size_t m_Symbols;
+	///offset of the pointers to the fetched symbols within the scratch arena. The unused ones remain zero
+	size_t m_SymbolPointers;
 		 
 protected:
 	///attach to the disk array
@@ -76,8 +76,13 @@ protected:
     ///and be ready to do the actual erasure correction. This combination of erasures
     /// is uniquely identified by ErasureID
     ///@return true if the specified combination of erasures is correctable
-    virtual bool IsCorrectable(unsigned ErasureSetID///identifies the erasure combination. This will not exceed m_Length-1
+    virtual bool IsCorrectable(unsigned ErasureSetID///identifies the erasure combination. This will not exceed GetNumOfErasureSets()-1
                               );
+    ///Reed-Solomon codes are MDS, so any m_Redundancy erasures are correctable
+    virtual unsigned GetCorrectingCapability()const
+    {
+        return m_Redundancy;
+    };
     ///This is a stub which should never be called
     virtual bool DecodeDataSubsymbols(unsigned long long StripeID,///the stripe to be processed
                                   unsigned ErasureSetID,///identifies the load balancing offset
@@ -115,6 +120,15 @@ protected:
                                           const unsigned char* pData,///new payload data symbols
                                           size_t ThreadID ///the ID of the calling thread
                  );
+    ///compute the differences between the new and old values of the check symbols caused by an update of some information symbols
+    ///@return true on success
+    virtual bool ComputeCheckDeltas(unsigned ErasureSetID,///identifies the load balancing offset
+                                    unsigned StripeUnitID,///the first stripe unit to be updated
+                                    unsigned Units2Update,///the number of units to be updated
+                                    const unsigned char* pDelta,///the differences between the new and old values of the units
+                                    unsigned char* pCheckDeltas,///output: the differences of all check symbols
+                                    size_t ThreadID ///the ID of the calling thread
+                                   );
     ///check if the codeword is consistent
     virtual bool CheckCodeword(unsigned long long StripeID,///the stripe to be checked
                                unsigned ErasureSetID,///identifies the load balancing offset
@@ -130,6 +144,11 @@ protected:
 public:
     CRSProcessor( RSParams* pParams);
     ~CRSProcessor();
+    ///@return true, since the code is linear, so that the differences of the check symbols are obtained by encoding the differences of the updated symbols
+    virtual bool CanComputeCheckDeltas()const
+    {
+        return true;
+    };
 
 };
 
@@ -11,9 +11,21 @@
 #define ARRAY_H
 
 #include <string>
+#include <vector>
 #include "disk.h"
 #include "RAIDProcessor.h"
 #include "locker.h"
+#include "scheduler.h"
+#include "journal.h"
+#include "cache.h"
+#include "paritylog.h"
+#include "paritycache.h"
+#include "deferredparity.h"
+#include "dedup.h"
+#include "compression.h"
+#include "coalescer.h"
+#include "taskpool.h"
+#include "hashtree.h"
 
 
 ///possible states of a disk array
@@ -33,9 +45,52 @@ struct DiskConf {
     const char* pFileName;
     ///true of the disk is online
     bool Online;
+    ///the capacity of the disk, or 0 if it is the same as for the other disks
+    size_t Capacity;
 
 };
 
+///optional features of a disk array. The default values disable all of them
+struct ArrayConf
+{
+    ///the name of the file emulating the journal device, or 0 if no journal is needed
+    const char* pJournalFile;
+    ///the capacity of the journal device
+    size_t JournalCapacity;
+    ///true if the hash tree over the payload stripes must be maintained
+    bool HashTree;
+    ///configuration of the cache device or the mirrored tier, or 0 if no cache is needed
+    const CacheConf* pCache;
+    ///the name of the file emulating the parity log device, or 0 if the check symbols are updated in place
+    const char* pParityLogFile;
+    ///the capacity of the parity log device
+    size_t ParityLogCapacity;
+    ///the size of the check symbol cache in bytes, or 0 if no cache is needed
+    size_t ParityCacheCapacity;
+    ///the name of the file emulating the device keeping the bitmap of the stripes with stale check symbols,
+    ///or 0 if the check symbols are updated together with the payload ones
+    const char* pDeferredParityFile;
+    ///the maximal time the check symbols of a stripe may remain stale in seconds, or 0 if it is not limited
+    double MaxStaleness;
+    ///the name of the file emulating the deduplication index device, or 0 if the stripe units are not deduplicated
+    const char* pDedupFile;
+    ///the name of the file emulating the compression map device, or 0 if the data is not compressed
+    const char* pCompressionFile;
+    ///size of the logical blocks compressed as a whole. This must be a multiple of the stripe unit size
+    unsigned CompressionBlock;
+    ///the time the small writes wait for the concurrent writes to the same stripe (sec), or 0 if they are not merged
+    double CoalescingWindow;
+    ///the number of stripes the large reads and writes lock at once, or 0 if the whole request is locked
+    unsigned LockWindow;
+    ///true if the reads of a healthy array may proceed without locking the stripes
+    bool OptimisticReads;
+    ArrayConf():pJournalFile(0),JournalCapacity(0),HashTree(false),pCache(0),pParityLogFile(0),ParityLogCapacity(0),
+        ParityCacheCapacity(0),pDeferredParityFile(0),MaxStaleness(0),pDedupFile(0),pCompressionFile(0),CompressionBlock(0),
+        CoalescingWindow(0),LockWindow(0),OptimisticReads(false)
+    {
+    };
+};
+
 
 ///A redundant array of independent disks
 ///This is a wrapper for various FEC algorithms
@@ -50,11 +105,16 @@ class CDiskArray {
     unsigned m_UnitsPerStripePrim;
     ///the number of payload stripe units within each stripe
     unsigned m_UnitsPerStripe;
-    ///the total number of stripes within the array
+    ///the total number of stripes within the array, including the ones keeping the hashes and the allocation map
     unsigned long long m_NumOfStripes;
+    ///the first stripe keeping the hashes of the payload. The hash stripes follow the payload ones, and are not visible to the users.
+    ///This is the same as m_MapStripe if the hash tree is not maintained
+    unsigned long long m_HashStripe;
+    ///the first stripe keeping the allocation map. The map stripes follow the hash ones, and are not visible to the users
+    unsigned long long m_MapStripe;
     ///size of each payload stripe in bytes
     unsigned m_StripeSize;
-    ///the number of working threads
+    ///the expected number of working threads. The scratch arenas are preallocated for them, but more threads may access the array
     unsigned m_NumOfThreads;
     ///current mount state
     eMountState m_MountState;
@@ -63,28 +123,294 @@ class CDiskArray {
 
     ///underlying disks
     CDisk* m_pDisks;
-    ///the computational engine. It must be able to support m_NumOfThreads concurrent calls
+    ///the computational engine
     CRAIDProcessor& m_Engine;
-    ///temporary buffer for partial stripe unit read/write operations
-    unsigned char* m_pPartialRWBuffer;
-    ///provides stripe range locking
-    CRangeLocker m_Locker;
+    ///offset of the temporary buffer for partial stripe unit read/write operations within the engine scratch arena
+    size_t m_PartialRWBuffer;
+    ///provide stripe range locking. Each subarray has its own lock domain, so the requests
+    ///accessing different subarrays of the same stripes do not block each other
+    CRangeLocker** m_ppLockers;
+    ///offset of the IDs of the locks held in each lock domain ((size_t)-1 if none) within the engine scratch arena
+    size_t m_LockIDs;
+    ///offset of the descriptors of the per-subarray parts of a request within the engine scratch arena
+    size_t m_SubarrayRequests;
+    ///the number of stripes the large reads and writes lock at once, or 0 if the whole request is locked for its duration
+    unsigned m_LockWindow;
+    ///true if the reads of a healthy array may proceed without locking the stripes
+    bool m_OptimisticReads;
+    ///offset of the versions of the stripes read without locking them in each lock domain within the engine scratch arena
+    size_t m_ReadVersions;
+    ///the number of reads in progress which do not lock the stripes
+    volatile long m_OptimisticReaders;
+    ///nonzero if the reads must lock the stripes, since the array configuration is being changed
+    volatile long m_ReadsSuspended;
+    ///protects the wait for the reads which do not lock the stripes
+    tCriticalSection m_ReadersLock;
+    ///signalled when the last read which does not lock the stripes completes while they are suspended
+    tCondVariable m_ReadersIdle;
+    ///executes the parts of a request belonging to different subarrays concurrently
+    CTaskPool m_Workers;
+    ///admission control for client and background requests
+    CIOScheduler m_Scheduler;
+    ///the first block of the area reserved for the mirrored tier on each disk
+    unsigned long long m_MirrorBlock;
+    ///the number of blocks reserved for the mirrored tier on each disk (0 if there is no mirrored tier)
+    unsigned long long m_MirrorBlocks;
+    ///the first block of the array state record on each disk
+    unsigned long long m_StateBlock;
+    ///the number of blocks reserved for the array state record (0 if the layout has no spare space)
+    unsigned m_StateBlocks;
+    ///generation of the array state record
+    unsigned long long m_StateGeneration;
+    ///the spare slot each disk was relocated to, or -1
+    int* m_pSpareSlots;
+    ///the names of the files attached to the disks replaced at runtime
+    std::string* m_pReplacementFiles;
+    ///the disk being rebuilt, or -1
+    int m_RebuildDisk;
+    ///the spare slot used by the rebuild in progress, or -1 if the disk is reconstructed in place
+    int m_RebuildSlot;
+    ///the subarray containing the disk being rebuilt
+    unsigned m_RebuildSubarray;
+    ///nonzero for the stripes already rebuilt. One byte per stripe is used, so that concurrent updates do not interfere
+    unsigned char* m_pRebuilt;
+    ///the first stripe not yet assigned to a rebuild thread
+    unsigned long long m_NextRebuildStripe;
+    ///the number of stripes which could not be rebuilt
+    unsigned long long m_RebuildFailures;
+    ///the number of stripes rebuilt by the degraded reads before the rebuild threads reached them
+    unsigned long long m_RepairedStripes;
+    ///protects m_NextRebuildStripe, m_RebuildFailures and m_RepairedStripes
+    tCriticalSection m_RebuildLock;
+    ///the write journal, or 0 if the writes are made in place
+    CJournal* m_pJournal;
+    ///the cache tier, or 0 if the disks are accessed directly
+    CCacheDevice* m_pCache;
+    ///the parity log, or 0 if the check symbols are updated in place
+    CParityLog* m_pParityLog;
+    ///the cache of the check symbols of the recently updated stripes, or 0 if they are always read from the disks
+    CParityCache* m_pParityCache;
+    ///the bitmap of the stripes with stale check symbols, or 0 if the check symbols are updated together with the payload ones
+    CDeferredParity* m_pDeferredParity;
+    ///the deduplication index, or 0 if the users address the payload stripe units directly
+    CDedup* m_pDedup;
+    ///the compression map, or 0 if the users address the payload stripe units directly
+    CCompression* m_pCompression;
+    ///merges the concurrent small writes to the same stripes, or 0 if they are written independently
+    CWriteCoalescer* m_pCoalescer;
+    ///allocation map: bit i*n+j is set if subarray j of payload stripe i was written since it was initialized or discarded,
+    ///where n is the number of subarrays. The stripes which are not allocated read as zeroes without disk access
+    unsigned char* m_pAllocated;
+    ///serializes the allocation map updates. It also protects the hash and map stripes, which are updated without range locking
+    tCriticalSection m_MapLock;
+    ///a payload stripe filled with zeroes
+    unsigned char* m_pZeroes;
+    ///the content of the hash stripes, or 0 if the hash tree is not maintained. This is a HashTreeHeader, the hash of each payload
+    ///stripe unit, and the leaves of the last verified tree, each of them padded to whole stripe units
+    unsigned char* m_pHashes;
+    ///the hash of each payload stripe unit within m_pHashes. It is zero for the units filled with zeroes
+    unsigned long long* m_pUnitHashes;
+    ///the leaves of the last verified tree within m_pHashes
+    unsigned long long* m_pVerifiedLeaves;
+    ///nonzero for the stripe units of m_pHashes modified since they were written to the array
+    unsigned char* m_pHashesDirty;
+    ///the hash tree over the current content of the payload stripes. Each leaf is the hash of the unit hashes of a stripe
+    CHashTree* m_pHashTree;
+    ///the hash tree over the content of the payload stripes at the time they were last verified by Scrub()
+    CHashTree* m_pVerifiedTree;
+    ///the hash of a stripe unit filled with zeroes, which is excluded from the unit hashes
+    unsigned long long m_ZeroUnitHash;
+    ///protects the hash trees and m_pHashesDirty. The unit hashes are updated by the threads holding the locks of their stripes
+    tCriticalSection m_HashLock;
     ///CRAIDProcessor will directly access m_pDisks
     friend class CRAIDProcessor;
+    ///CJournal applies the records via Read and Write
+    friend class CJournal;
+    ///CCacheDevice accesses the disks via Transfer, writes back the lines under the stripe locks, and keeps the mirrored tier on the disks
+    friend class CCacheDevice;
+    ///CParityLog applies the check symbol differences and re-encodes the stripes via the engine under the stripe locks
+    friend class CParityLog;
+    ///CDeferredParity re-encodes the stale stripes via the engine under the stripe locks
+    friend class CDeferredParity;
+    ///CDedup maps the logical units to the payload ones, and accesses them via Read and Write under the stripe locks
+    friend class CDedup;
+    ///CCompression maps the logical blocks to the extents of payload units, and accesses them via Read and Write under the stripe locks
+    friend class CCompression;
+    ///CWriteCoalescer writes the merged writes via Read and Write under the stripe locks, and admits them via the scheduler
+    friend class CWriteCoalescer;
     ///read a number of stripe units. The array must be mounted
     ///@return true on success
     bool Read(unsigned long long StripeUnitID, ///the first stripe unit
             unsigned long long Units2Read, ///the number of stripe units to be read
             unsigned char* pDest, ///destination buffer. Must have size for Units2Read*m_StripeUnitSize bytes
-            size_t ThreadID ///the ID of a calling thread obtained from m_Locker  
+            size_t ThreadID ///the scratch arena of a calling thread obtained from LockStripes()
             );
     ///write a number of stripe units. The array must be write-mounted
     ///@return true on success
     bool Write(unsigned long long StripeUnitID, ///the first stripe unit
             unsigned long long Units2Write, ///the number of stripe units to be written
             const unsigned char* pSrc, ///source buffer. Must have size for Units2Write*m_StripeUnitSize bytes
-            size_t ThreadID ///the ID of a calling thread obtained from m_Locker  
+            size_t ThreadID ///the scratch arena of a calling thread obtained from LockStripes()
             );
+    ///read or write a number of stripe units, processing the subarrays concurrently
+    ///@return true on success
+    bool Transfer(unsigned long long StripeUnitID, ///the first stripe unit
+                  unsigned long long NumOfUnits, ///the number of stripe units
+                  unsigned char* pData, ///the data buffer. Must have size for NumOfUnits*m_StripeUnitSize bytes
+                  bool Write, ///true if the data must be written
+                  size_t ThreadID ///the scratch arena of a calling thread obtained from LockStripes()
+                 );
+    ///read or write the stripe units of a range which belong to a single subarray
+    ///@return true on success
+    bool TransferSubarray(unsigned long long StripeUnitID, ///the first stripe unit of the range
+                          unsigned long long NumOfUnits, ///the number of stripe units in the range
+                          unsigned char* pData, ///the data buffer for the whole range
+                          bool Write, ///true if the data must be written
+                          unsigned SubarrayID, ///the subarray
+                          size_t ThreadID ///the scratch arena of a calling thread obtained from LockStripes()
+                         );
+    ///execute a part of a request via TransferSubarray()
+    static void TransferTask(void* pParams ///must be a pointer to SubarrayRequest
+                            );
+    ///find the stripes containing the units of a range which belong to a subarray
+    void GetSubarrayStripes(unsigned long long FirstUnit,///the first stripe unit of the range
+                            unsigned long long LastUnit,///the unit following the last one
+                            unsigned SubarrayID,///the subarray
+                            unsigned long long& FirstStripe,///output: the first stripe
+                            unsigned long long& LastStripe ///output: the stripe following the last one, or FirstStripe if none
+                           )const
+    {
+        unsigned long long Last=LastUnit-1;
+        FirstStripe=FirstUnit/m_UnitsPerStripe+((FirstUnit%m_UnitsPerStripe>=(SubarrayID+1)*m_UnitsPerStripePrim)?1:0);
+        LastStripe=Last/m_UnitsPerStripe+((Last%m_UnitsPerStripe>=SubarrayID*m_UnitsPerStripePrim)?1:0);
+        if ((LastUnit<=FirstUnit)||(LastStripe<FirstStripe))
+            LastStripe=FirstStripe;
+    };
+    ///lock a range of whole stripes in the lock domains of all subarrays or a single one,
+    ///and obtain a scratch arena for the engine calls made while it is locked
+    ///@return the scratch arena to be passed to the engine and UnlockStripes()
+    size_t LockStripes(unsigned long long FirstStripe,///the first stripe to be locked
+                       unsigned long long LastStripe,///the stripe following the last one to be locked
+                       int SubarrayID=-1 ///the subarray to be locked, or -1 for all of them
+                      );
+    ///lock two stripes in the lock domains of all subarrays with a single request per domain, and obtain a scratch arena
+    ///@return the scratch arena to be passed to the engine and UnlockStripes()
+    size_t LockStripePair(unsigned long long FirstStripe,///the first stripe to be locked
+                          unsigned long long SecondStripe ///the second stripe to be locked
+                         );
+    ///lock the stripes containing a range of stripe units in the lock domains of the subarrays
+    ///the units belong to, and obtain a scratch arena
+    ///@return the scratch arena to be passed to the engine and UnlockStripes()
+    size_t LockUnits(unsigned long long FirstUnit,///the first stripe unit to be locked
+                     unsigned long long LastUnit ///the unit following the last one to be locked
+                    );
+    ///release the stripes and the scratch arena obtained by LockStripes() or LockUnits()
+    void UnlockStripes(size_t ThreadID ///the scratch arena
+                      );
+    ///lock all stripes, and wait for the reads which do not lock them, so that the array configuration can be changed
+    ///@return the scratch arena to be passed to the engine and UnlockArray()
+    size_t LockArray();
+    ///release the stripes and the scratch arena obtained by LockArray()
+    void UnlockArray(size_t ThreadID ///the scratch arena
+                    );
+    ///make the new reads lock the stripes, and wait for the reads in progress which do not lock them
+    void SuspendOptimisticReads();
+    ///let the reads proceed without locking the stripes again
+    void ResumeOptimisticReads();
+    ///obtain the versions of the stripes containing a range of stripe units in the lock domains of the subarrays the units belong to
+    ///@return false if some of the stripes are locked
+    bool BeginReadUnits(unsigned long long FirstUnit,///the first stripe unit to be read
+                        unsigned long long LastUnit,///the unit following the last one to be read
+                        unsigned long long* pVersions ///output: the version of the stripes in each lock domain
+                       )const;
+    ///@return true if the stripes containing a range of stripe units were not locked since BeginReadUnits()
+    bool EndReadUnits(unsigned long long FirstUnit,///the first stripe unit read
+                      unsigned long long LastUnit,///the unit following the last one read
+                      const unsigned long long* pVersions ///the versions obtained by BeginReadUnits()
+                     )const;
+    ///@return true if the part of the stripe within a subarray may contain nonzero data. The hash and map stripes are always allocated
+    bool IsAllocated(unsigned long long StripeID, ///the stripe
+                     unsigned SubarrayID ///the subarray
+                    )const
+    {
+        unsigned long long Bit=StripeID*GetNumOfSubarrays()+SubarrayID;
+        return (StripeID>=m_HashStripe)||((m_pAllocated[Bit/8]>>(Bit%8))&1);
+    };
+    ///mark the parts of a range of payload stripes within a subarray as allocated or not, and write the modified part
+    ///of the allocation map to the array. The stripes must be locked by the caller
+    ///@return true on success
+    bool UpdateMap(unsigned long long FirstStripe,///the first stripe
+                   unsigned long long LastStripe,///the stripe following the last one
+                   unsigned SubarrayID,///the subarray
+                   bool Allocated,///the new state of the stripes
+                   size_t ThreadID ///the scratch arena of a calling thread obtained from LockStripes()
+                  );
+    ///load the allocation map from the array. The array must be mounted
+    ///@return true on success
+    bool LoadMap();
+    ///encode a subarray of a stripe filled with zeroes, disregarding the old content of the disks. The stripe must be locked by the caller
+    ///@return true on success
+    bool ClearStripe(unsigned long long StripeID,///the stripe
+                     unsigned SubarrayID,///the subarray
+                     size_t ThreadID ///the scratch arena of a calling thread obtained from LockStripes()
+                    );
+    ///rebuild a stripe not yet reached by the rebuild in progress, if a read of some payload units needs to decode them.
+    ///The stripe must be locked by the caller
+    void RepairStripe(unsigned long long StripeID,///the stripe
+                      unsigned StripeUnitID,///the first payload stripe unit being read
+                      unsigned SubarrayID,///the subarray
+                      unsigned NumOfUnits,///the number of units being read
+                      size_t ThreadID ///the scratch arena of a calling thread obtained from LockStripes()
+                     );
+    ///record the hashes of the units written to a subarray of a payload stripe, and update the hash tree.
+    ///The stripe must be locked by the caller
+    void UpdateHashes(unsigned long long StripeID,///the stripe
+                      unsigned SubarrayID,///the subarray
+                      unsigned FirstUnit,///the first unit within the subarray
+                      unsigned NumOfUnits,///the number of units
+                      const unsigned char* pData ///the data written, or 0 if the units were filled with zeroes
+                     );
+    ///copy the hashes of the units of a subarray of a payload stripe to another stripe, and update the hash tree.
+    ///Both stripes must be locked by the caller
+    void CopyHashes(unsigned long long SrcStripeID,///the stripe the units were copied from
+                    unsigned long long DestStripeID,///the stripe the units were copied to
+                    unsigned SubarrayID ///the subarray
+                   );
+    ///update the hash tree after the unit hashes of a payload stripe were modified, and mark them for saving
+    void CommitHashes(unsigned long long StripeID,///the stripe
+                      unsigned long long FirstHash,///the first modified unit hash
+                      unsigned NumOfUnits ///the number of modified unit hashes
+                     );
+    ///recompute the leaf of the hash tree corresponding to a payload stripe. Must be called with m_HashLock held
+    void UpdateLeaf(unsigned long long StripeID ///the stripe
+                   );
+    ///load the hashes from the array, or recompute them if it was not unmounted cleanly. The array must be mounted
+    ///@return true on success
+    bool LoadHashes();
+    ///write the modified hashes to the array, followed by the header. The array must be write-mounted
+    ///@return true on success
+    bool SaveHashes(bool Clean ///true if no writes are expected until the array is unmounted
+                   );
+    ///make sure that the data written to the disks is persistent
+    ///@return true on success
+    bool FlushDisks();
+    ///load the spare space allocation from the online disks
+    void LoadState();
+    ///write the spare space allocation to all online disks. The array must be write-mounted
+    ///@return true on success
+    bool SaveState();
+    ///rebuild stripes until there are no more of them
+    static THREADPROC RebuildThread(void* pParams ///must be a pointer to CDiskArray
+                                   );
+    ///switch to the rebuild mode. All stripes must be locked by the caller
+    void BeginRebuild(unsigned DiskID,///the disk to be rebuilt
+                      int Slot ///the spare slot the disk is relocated to, or -1 if it is reconstructed in place
+                     );
+    ///rebuild all stripes in parallel, and make the result permanent
+    ///@return true on success
+    bool CompleteRebuild();
+    ///set the array state according to the disks which are neither online nor relocated. The array must be locked by the caller
+    void UpdateArrayState();
 
 public:
     ///initialize the array. The array parameters 
@@ -93,9 +419,10 @@ public:
             ///than the length of the array code implemented by Processor
             ///All extra disks will be ignored
             DiskConf const* pDiskFiles, ///configuration of the emulated disks
-            size_t DiskCapacity, ///the capacity of a single disk
+            size_t DiskCapacity, ///the capacity of the disks without a capacity of their own
             CRAIDProcessor& Processor, ///provides encoding and decoding functionality
-             unsigned NumOfThreads ///the number of concurrent processing threads
+             unsigned NumOfThreads, ///the expected number of concurrent processing threads. More of them are allowed
+             const ArrayConf& Conf ///the optional features of the array
             );
     virtual ~CDiskArray();
     ///initialize the array. It must be unmounted
@@ -138,12 +465,105 @@ public:
     ///check if the array is consistend
     ///@return true on success
     bool Check();
+    ///@return true if the hash tree over the payload stripes is maintained
+    bool HasHashTree()const
+    {
+        return m_pHashes!=0;
+    };
+    ///@return the root hash of the payload stripes, or 0 if the hash tree is not maintained. The array must be mounted
+    unsigned long long GetRootHash(bool Verified ///true if the root of the last verified tree is needed
+                                  );
+    ///verify the codewords and the unit hashes of the payload stripes modified since they were last verified,
+    ///and make the verified ones a part of the verified tree. The array must be write-mounted, and remains accessible
+    ///@return true if no invalid stripes were found
+    bool Scrub(unsigned long long& Scrubbed,///output: the number of stripes verified
+               unsigned long long& Invalid ///output: the number of invalid stripes
+              );
+    ///find the payload stripes whose content differs from another array with the same geometry. Both arrays must be mounted
+    ///@return true on success
+    bool Compare(CDiskArray& Other,///the array to be compared with
+                 std::vector<unsigned long long>& Stripes ///output: the differing stripes in the ascending order
+                );
+    ///reconstruct the data of a failed disk into the distributed spare space.
+    ///The array must be write-mounted, and remains accessible during the rebuild
+    ///@return true on success
+    bool Rebuild(unsigned DiskID ///the disk to be relocated
+                );
+    ///take an online disk offline, as if it failed. The requests in progress are completed first,
+    ///and the subsequent ones use the remaining disks
+    ///@return true on success
+    bool FailDisk(unsigned DiskID ///the disk to be failed
+                 );
+    ///attach a new file in place of a failed disk, and reconstruct its content, including the symbols
+    ///relocated to the spare space. The array must be write-mounted, and remains accessible during the rebuild
+    ///@return true on success
+    bool ReplaceDisk(unsigned DiskID,///the disk to be replaced
+                     const char* pFileName ///the name of the file emulating the new disk. It is created if needed
+                    );
+    ///take a failed disk back online, and reconstruct its content, which may be stale.
+    ///The array must be write-mounted, and remains accessible during the rebuild
+    ///@return true on success
+    bool ReAddDisk(unsigned DiskID ///the disk to be re-added
+                  );
+    ///@return true if the symbols stored on a disk are accessible in a given view. The disk being reconstructed in place
+    ///is accessible only in the views used by the rebuild
+    bool IsDiskAvailable(unsigned DiskID,///the disk
+                         unsigned View ///the view of the array (see CRAIDProcessor)
+                        )const
+    {
+        if (m_pDisks[DiskID].GetDiskState()!=dsOnline)
+            return false;
+        return View||((int)DiskID!=m_RebuildDisk)||(m_RebuildSlot>=0);
+    };
+    ///@return the spare slot disk DiskID was relocated to, or -1. In non-zero views, this takes into account the rebuild in progress,
+    ///which may move the disk back from the spare space
+    int GetSpareSlot(unsigned DiskID,///the disk
+                     unsigned View ///the view of the array (see CRAIDProcessor)
+                    )const
+    {
+        if (View&&((int)DiskID==m_RebuildDisk))
+            return m_RebuildSlot;
+        return m_pSpareSlots[DiskID];
+    };
+    ///@return the request scheduler, which can be used to set the QoS policy and obtain the latency statistics
+    CIOScheduler& GetScheduler()
+    {
+        return m_Scheduler;
+    };
+    ///allow or forbid the reads of a healthy array to proceed without locking the stripes
+    void SetOptimisticReads(bool Enable ///true if the reads may proceed without locking the stripes
+                           )
+    {
+        m_OptimisticReads=Enable;
+    };
+    ///get the redundancy lag of the array with deferred update of the check symbols
+    ///@return the time the oldest stripe waiting to be re-encoded is stale for in seconds, or 0 if there are no such stripes
+    double GetRedundancyLag(unsigned long long& StaleStripes ///receives the number of stripes with stale check symbols
+                           )
+    {
+        StaleStripes=0;
+        return (m_pDeferredParity)?m_pDeferredParity->GetRedundancyLag(StaleStripes):0;
+    };
+    ///@return true if a rebuild is in progress
+    bool IsRebuilding()const
+    {
+        return m_RebuildDisk>=0;
+    };
+    ///@return true if the stripe was already processed by the rebuild in progress. The stripe must be locked by the caller
+    bool IsStripeRebuilt(unsigned long long StripeID,///the stripe
+                         unsigned SubarrayID ///the subarray
+                        )const
+    {
+        return m_pRebuilt&&(SubarrayID==m_RebuildSubarray)&&m_pRebuilt[StripeID];
+    };
 
     ///get the payload array capacity
 
     unsigned long long GetCapacity()const 
     {
-        return m_NumOfStripes * m_UnitsPerStripe*m_StripeUnitSize;
+        if (m_pCompression)
+            return m_pCompression->GetCapacity();
+        return m_HashStripe * m_UnitsPerStripe*m_StripeUnitSize;
     };
     ///@return stripe unit size
 
@@ -151,6 +571,17 @@ public:
     {
         return m_StripeUnitSize;
     };
+    ///@return payload stripe size
+
+    unsigned GetStripeSize()const
+    {
+        return m_StripeSize;
+    };
+    ///@return the number of stripes the large reads and writes lock at once, or 0 if the whole request is locked
+    unsigned GetLockWindow()const
+    {
+        return m_LockWindow;
+    };
     ///the virtual file handle
     typedef long long tHandle;
     ///open a "file" for read and write
@@ -198,7 +629,88 @@ public:
             long long Bytes2Write, ///the number of bytes to be read
             const unsigned char* pSrc ///source address, must be aligned
             );
+    ///release the whole stripes within a given range, updating the position. They read as zeroes afterwards,
+    ///while the rest of the range is not modified
+    ///@return the actual number of bytes processed, or -1 in case of error
+    long long discard(tHandle& fd, ///file description, i.e. current position
+            long long Bytes2Discard ///the number of bytes to be discarded
+            );
+    ///fill a given range with zeroes, updating the position. The whole stripes within the range are released as by discard()
+    ///@return the actual number of bytes processed, or -1 in case of error
+    long long write_zeroes(tHandle& fd, ///file description, i.e. current position
+            long long Bytes2Zero ///the number of bytes to be zeroed
+            );
+    ///copy a range of the array to another position within it, updating both positions. The ranges may overlap,
+    ///and the result is the same as if the source was read before the destination was written
+    ///@return the actual number of bytes copied, or -1 in case of error
+    long long copy_range(tHandle& src, ///the position of the source range
+            tHandle& dst, ///the position of the destination range
+            long long Bytes2Copy ///the number of bytes to be copied
+            );
 
+private:
+    ///read the data at a given position, updating it. This bypasses the scheduler
+    ///@return the actual number of bytes read, or -1 in case of error
+    long long ReadBytes(tHandle& fd, ///file description, i.e. current position
+            long long Bytes2Read, ///the number of bytes to be read
+            unsigned char* pDest ///destination address, must be aligned 
+            );
+    ///write the data in place at a given position, updating it. This bypasses the scheduler
+    ///@return the actual number of bytes written, or -1 in case of error
+    long long WriteBytes(tHandle& fd, ///file description, i.e. current position
+            long long Bytes2Write, ///the number of bytes to be written
+            const unsigned char* pSrc ///source address, must be aligned
+            );
+    ///read the data within a lock window, updating the position. The stripes accessed are locked for the duration of the call,
+    ///unless they can be read optimistically
+    ///@return true on success
+    bool ReadWindow(tHandle& fd, ///file description, i.e. current position
+            long long Bytes2Read, ///the number of bytes to be read. They must fit into the array
+            unsigned char* pDest ///destination address, must be aligned
+            );
+    ///read the data without locking the stripes, updating the position on success
+    ///@return true if consistent data was read, false if the stripes must be locked
+    bool ReadOptimistic(tHandle& fd, ///file description, i.e. current position
+            long long Bytes2Read, ///the number of bytes to be read. They must fit into the array
+            unsigned char* pDest ///destination address, must be aligned
+            );
+    ///read the data, updating the position. The stripes must be locked by the caller, or validated by EndReadUnits()
+    ///@return true on success
+    bool ReadRange(tHandle& fd, ///file description, i.e. current position
+            long long Bytes2Read, ///the number of bytes to be read. They must fit into the array
+            unsigned char* pDest, ///destination address, must be aligned
+            size_t ThreadID ///the scratch arena of a calling thread
+            );
+    ///write the data in place within a lock window, updating the position. The stripes accessed are locked for the duration of the call
+    ///@return true on success
+    bool WriteWindow(tHandle& fd, ///file description, i.e. current position
+            long long Bytes2Write, ///the number of bytes to be written. They must fit into the array
+            const unsigned char* pSrc ///source address, must be aligned
+            );
+    ///write a number of bytes via the journal
+    ///@return the actual number of bytes written, or -1 in case of error
+    long long JournalWrite(tHandle& fd, ///file description, i.e. current position
+            long long Bytes2Write, ///the number of bytes to be written
+            const unsigned char* pSrc ///source address, must be aligned
+            );
+    ///release the whole stripes within a given range, optionally writing zeroes to the rest of it. This bypasses the scheduler
+    ///@return the actual number of bytes processed, or -1 in case of error
+    long long Deallocate(tHandle& fd, ///file description, i.e. current position
+            long long Bytes, ///the number of bytes to be processed
+            bool Zero ///true if the incomplete stripes at the ends of the range must be zeroed
+            );
+    ///copy a range within the array. This bypasses the scheduler
+    ///@return the actual number of bytes copied, or -1 in case of error
+    long long CopyBytes(tHandle& src, ///the position of the source range
+            tHandle& dst, ///the position of the destination range
+            long long Bytes2Copy ///the number of bytes to be copied
+            );
+    ///copy a payload stripe to another one without passing the data through the client
+    ///@return true on success
+    bool CopyStripe(unsigned long long SrcStripeID,///the stripe to be copied
+                    unsigned long long DestStripeID,///the stripe to be overwritten
+                    unsigned char* pBuffer ///temporary buffer for a payload stripe
+                   );
 
 };
 
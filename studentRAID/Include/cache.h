@@ -0,0 +1,236 @@
+/*********************************************************
+ * cache.h  - header file for the cache device of the RAID emulator
+ *
+ * Copyright(C) 2012 Saint-Petersburg State Polytechnic University
+ *
+ * Developed in the framework of the "Forward error correction for next generation storage systems" project
+ *
+ * Author: P. Trifonov petert@dcn.ftk.spbstu.ru
+ * ********************************************************/
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "disk.h"
+#include "sync.h"
+
+class CDiskArray;
+struct CacheLineTag;
+
+///cache device configuration record
+struct CacheConf
+{
+    ///name of the file emulating the cache device, or 0 if the lines are mirrored on the array disks
+    const char* pFileName;
+    ///cache device capacity in bytes. For the mirrored tier, this is the space reserved on each array disk
+    size_t Capacity;
+    ///true if the writes are acknowledged once they reach the cache device, and written to the array in background.
+    ///Otherwise, the writes are made to both the cache device and the array
+    bool WriteBack;
+    ///the number of accesses to a segment, after which it is placed into the cache
+    unsigned PromotionThreshold;
+    ///the number of seconds after the last write, after which a dirty line is written back, or 0 if the lines
+    ///are written back only when the number of dirty lines reaches the high watermark
+    unsigned CoolingTime;
+};
+
+///Cache tier in front of a disk array.
+///The cache device is an emulated disk, which stores a superblock, the tags of the cache lines, and the cache lines.
+///Each line keeps a segment, i.e. the part of a payload stripe within a single subarray, so that the line is protected
+///by the stripe locks of the array. The segments are placed into the cache after they are accessed PromotionThreshold times,
+///and the clean lines are replaced according to the CLOCK policy.
+///In the write-back mode, the dirty lines are written to the array by a background thread in batches of consecutive stripes,
+///so that the check symbols are computed once per stripe, rather than once per write.
+///The tags of the dirty lines are persistent, so that they are written back after a crash. The tags of the clean lines
+///are saved only on unmount, and are dropped if the array was not unmounted cleanly.
+///If no cache device is given, the blocks of the cache are mirrored over the area reserved at the end of the array disks.
+///This is a hot tier in the spirit of AutoRAID: the recently written segments are kept as mirrored copies, so that
+///the small writes do not need the read-modify-write of the check symbols, and the segments are moved back to
+///the erasure-coded stripes by full-stripe writes once they cool down. The number of copies is one more than
+///the number of check symbols in a stripe
+class CCacheDevice
+{
+    ///the array the cache belongs to
+    CDiskArray& m_Array;
+    ///the cache device
+    CDisk m_Device;
+    ///true if the lines are mirrored on the array disks rather than stored on the cache device
+    bool m_Mirrored;
+    ///the number of copies of each block of the mirrored tier
+    unsigned m_NumOfCopies;
+    ///the first block of the mirrored tier area on each array disk
+    unsigned long long m_MirrorStart;
+    ///the number of chunks of each copy of the mirrored tier on a single disk. A chunk has the size of a line
+    unsigned long long m_RegionChunks;
+    ///current mount state of the cache
+    eMountState m_MountState;
+    ///true if the cache device was successfully opened and belongs to this array
+    bool m_Valid;
+    ///true if the writes are acknowledged before they reach the array
+    bool m_WriteBack;
+    ///the number of accesses to a segment, after which it is placed into the cache
+    unsigned m_PromotionThreshold;
+    ///size of a block. This is equal to the array stripe unit size
+    unsigned m_BlockSize;
+    ///the number of stripe units in a segment
+    unsigned m_LineUnits;
+    ///the number of segments in each stripe, i.e. the number of subarrays
+    unsigned m_SegmentsPerStripe;
+    ///the number of payload segments of the array
+    unsigned long long m_NumOfSegments;
+    ///the number of cache lines
+    unsigned m_NumOfLines;
+    ///the number of blocks keeping the tags
+    unsigned m_TagBlocks;
+    ///the first block of the first cache line
+    unsigned long long m_DataStart;
+    ///the tags of all lines, as they are written to the device
+    CacheLineTag* m_pTags;
+    ///the line keeping each segment plus one, or 0 if it is not cached
+    unsigned* m_pLines;
+    ///the number of accesses to each segment which is not cached, saturated at 255. The counters are halved periodically
+    unsigned char* m_pAccesses;
+    ///the number of accesses counted since the counters were last halved
+    unsigned long long m_AccessCount;
+    ///the number of threads using each line. The lines in use cannot be replaced
+    unsigned* m_pPins;
+    ///nonzero for the lines accessed since the CLOCK hand passed them
+    unsigned char* m_pReferenced;
+    ///the CLOCK hand
+    unsigned m_Hand;
+    ///the lines not keeping any segment
+    unsigned* m_pFreeLines;
+    ///the number of free lines
+    unsigned m_NumOfFree;
+    ///the number of dirty lines
+    unsigned m_NumOfDirty;
+    ///the time of the last write to each line
+    double* m_pWriteTimes;
+    ///the number of seconds after the last write, after which a dirty line is written back, or 0
+    unsigned m_CoolingTime;
+    ///the number of dirty lines, at which the background write-back starts
+    unsigned m_HighWatermark;
+    ///the number of dirty lines, at which the background write-back stops unless a drain was requested
+    unsigned m_LowWatermark;
+    ///true if the background write-back is in progress
+    bool m_WritingBack;
+    ///the number of threads waiting for all dirty lines to be written back
+    unsigned m_DrainRequests;
+    ///the position in the (subarray, stripe) order, where the next batch of dirty lines is looked for
+    unsigned long long m_FlushCursor;
+    ///buffer for a batch of lines written back
+    unsigned char* m_pFlushBuffer;
+    ///access statistics
+    unsigned long long m_Hits,m_Misses,m_Promotions,m_WrittenBack;
+    ///true if the dirty lines cannot be written back any more
+    bool m_Failed;
+    ///true if the dirty lines are written back by the background thread
+    bool m_Running;
+    ///true if the background thread should terminate
+    bool m_Stop;
+    ///the thread writing back the dirty lines
+    tThread m_Flusher;
+    ///protects all the above data except the content of the lines, which is protected by the stripe locks of the array
+    tCriticalSection m_Lock;
+    ///signalled when some lines become dirty, a drain is requested, or the background thread must terminate
+    tCondVariable m_FlushSig;
+    ///signalled when some dirty lines are written back
+    tCondVariable m_CleanSig;
+
+    ///@return the first block of a line on the device
+    unsigned long long GetLineBlock(unsigned Line)const
+    {
+        return m_DataStart+(unsigned long long)Line*m_LineUnits;
+    };
+    ///read a range of cache blocks. For the mirrored tier, each chunk is read from the first available copy
+    ///@return true on success
+    bool ReadBlocks(unsigned long long Block,///the first block
+                    unsigned NumOfBlocks,///the number of blocks
+                    void* pDest ///destination buffer
+                   );
+    ///write a range of cache blocks. For the mirrored tier, all copies on the online disks are written
+    ///@return true on success
+    bool WriteBlocks(unsigned long long Block,///the first block
+                     unsigned NumOfBlocks,///the number of blocks
+                     const void* pSrc,///the data to be written
+                     int DiskID=-1 ///the only array disk to be written, or -1 if all copies must be written
+                    );
+    ///make sure that the written blocks are persistent
+    ///@return true on success
+    bool FlushBlocks();
+    ///write the superblock and flush the device
+    ///@return true on success
+    bool WriteSuperblock(bool Clean ///true if the tags of all lines are valid
+                        );
+    ///write the block keeping the tag of a line. Must be called with m_Lock held
+    ///@return true on success
+    bool WriteTag(unsigned Line ///the line
+                 );
+    ///find a line for a segment being promoted. Must be called with m_Lock held
+    ///@return the line, or -1 if all lines are dirty or in use
+    int AllocateLine(unsigned long long Segment ///the segment to be cached
+                    );
+    ///release a line. Must be called with m_Lock held
+    void ReleaseLine(unsigned Line ///the line
+                    );
+    ///forget all lines
+    void Reset();
+    ///release the cache device
+    ///@return true on success
+    bool Unmount();
+    ///write a batch of dirty lines keeping consecutive stripes of a subarray to the array
+    ///@return true on success
+    bool WriteBack(unsigned SubarrayID,///the subarray
+                   unsigned long long FirstStripe,///the first stripe
+                   unsigned NumOfStripes ///the number of stripes
+                  );
+    ///write back the dirty lines in background
+    static THREADPROC FlushThread(void* pParams ///must be a pointer to CCacheDevice
+                                 );
+public:
+    ///open the cache device, or lay out the mirrored tier over the area reserved by the array
+    CCacheDevice(CDiskArray& Array,///the array to be served
+                 const CacheConf& Conf,///the cache configuration
+                 unsigned DeviceID ///identifier of the cache device. This must be different from the IDs of the array disks
+                );
+    ~CCacheDevice();
+    ///create an empty cache. It must not be started
+    ///@return true on success
+    bool Init();
+    ///load the tags of the cached lines. If write access is requested, the background thread is started.
+    ///The array disks must be mounted
+    ///@return true on success
+    bool Start(bool Write ///true if the array is mounted for writing
+              );
+    ///write back all dirty lines, save the tags and terminate the background thread
+    ///@return true on success
+    bool Stop();
+    ///wait for all dirty lines to be written back to the array. The caller should not hold any array locks
+    ///@return true on success
+    bool Drain();
+    ///make sure that the data written to the cache device is persistent
+    ///@return true on success
+    bool FlushDevice();
+    ///read or write a range of payload stripe units, serving the cached segments from the cache device.
+    ///The caller must hold the lock on the stripes being accessed
+    ///@return true on success
+    bool Transfer(unsigned long long FirstUnit,///the first payload stripe unit
+                  unsigned long long NumOfUnits,///the number of units
+                  unsigned char* pData,///the data buffer
+                  bool Write,///true if the data must be written
+                  size_t ThreadID ///the scratch arena of a calling thread obtained from CDiskArray::LockStripes()
+                 );
+    ///copy the lines of the mirrored tier to an array disk being reconstructed in place. The copies on this disk
+    ///are not read until the array rebuild completes. The caller should not hold any array locks
+    ///@return true on success
+    bool Resync(unsigned DiskID ///the disk being reconstructed
+               );
+    ///drop the lines keeping a range of stripes of a subarray, which were released by the array, without writing them back.
+    ///The caller must hold the lock on the stripes
+    ///@return true on success
+    bool Invalidate(unsigned long long FirstStripe,///the first stripe
+                    unsigned long long LastStripe,///the stripe following the last one
+                    unsigned SubarrayID ///the subarray
+                   );
+};
+
+#endif
@@ -0,0 +1,108 @@
+/*********************************************************
+ * coalescer.h  - header file for the write coalescing of the RAID emulator
+ *
+ * Copyright(C) 2012 Saint-Petersburg State Polytechnic University
+ *
+ * Developed in the framework of the "Forward error correction for next generation storage systems" project
+ *
+ * Author: P. Trifonov petert@dcn.ftk.spbstu.ru
+ * ********************************************************/
+#ifndef COALESCER_H
+#define COALESCER_H
+
+#include <map>
+#include "sync.h"
+
+class CDiskArray;
+
+///Coalescing of the small writes issued by concurrent threads.
+///The first write to a stripe opens a batch, and waits for the coalescing window to expire, or for the batch to cover
+///the whole stripe. The writes to the same stripe arriving meanwhile copy their data into the batch and wait for its completion.
+///The batch is then written by a single array write, so that the stripe is encoded once, and is not read at all if it is
+///covered completely. Each writer obtains the result of the batch. Longer windows merge more writes at the expense of their latency.
+///The batch is written before the window expires if all the expected concurrent threads are already waiting for the batches,
+///since no other writer can join it then
+class CWriteCoalescer
+{
+    ///the writes to a stripe collected within a window
+    struct Batch
+    {
+        ///the stripe
+        unsigned long long StripeID;
+        ///the payload of the stripe. Only the covered bytes are meaningful
+        unsigned char* pData;
+        ///nonzero for the bytes covered by the writes
+        unsigned char* pCovered;
+        ///the number of covered bytes in each stripe unit
+        unsigned* pUnitCoverage;
+        ///the number of covered bytes
+        unsigned CoveredBytes;
+        ///the first covered byte
+        unsigned First;
+        ///the byte following the last covered one
+        unsigned Last;
+        ///the number of writers which did not obtain the result yet
+        unsigned NumOfWriters;
+        ///the time the batch must be written at
+        double Deadline;
+        ///true if the batch was written
+        bool Done;
+        ///true if the batch was written successfully
+        bool Result;
+    };
+    ///the array the writes are issued to
+    CDiskArray& m_Array;
+    ///the coalescing window (sec)
+    double m_Window;
+    ///size of a stripe unit
+    unsigned m_UnitSize;
+    ///size of a payload stripe
+    unsigned m_StripeSize;
+    ///the expected number of concurrent writers
+    unsigned m_NumOfThreads;
+    ///the batches accepting the writes
+    std::map<unsigned long long,Batch*> m_Open;
+    ///the number of writers waiting for their batches to be written
+    unsigned m_NumOfWaiting;
+    ///the number of writes coalesced since the statistics were reset
+    unsigned long long m_Writes;
+    ///the number of batches written since the statistics were reset
+    unsigned long long m_Batches;
+    ///protects all the above data
+    tCriticalSection m_Lock;
+    ///signalled when a batch covers the whole stripe, or is written, or all expected writers are waiting
+    tCondVariable m_Signal;
+
+    ///copy the data of a write into a batch. Must be called with m_Lock held
+    void Add(Batch& B,///the batch
+             unsigned Offset,///offset of the data within the stripe
+             unsigned Length,///data size
+             const unsigned char* pSrc ///the data
+            );
+    ///write a batch to the array. It must not accept the writes any more
+    ///@return true on success
+    bool Flush(Batch& B ///the batch
+              );
+public:
+    CWriteCoalescer(CDiskArray& Array,///the array the writes are issued to
+                    double Window ///the coalescing window (sec)
+                   );
+    ~CWriteCoalescer();
+    ///@return true if a write should be coalesced
+    bool IsCoalesced(long long fd,///file description, i.e. current position
+                     long long Bytes2Write ///the number of bytes to be written
+                    )const
+    {
+        return (Bytes2Write>0)&&(Bytes2Write<m_StripeSize)&&(fd/m_StripeSize==(fd+Bytes2Write-1)/m_StripeSize);
+    };
+    ///write the data within a single stripe together with the concurrent writes to it
+    ///@return the actual number of bytes written, or -1 in case of error
+    long long Write(long long& fd,///file description, i.e. current position
+                    long long Bytes2Write,///the number of bytes to be written
+                    const unsigned char* pSrc ///source address
+                   );
+    ///report and reset the statistics. There may be no writes in progress
+    void Reset();
+};
+
+#endif
@@ -0,0 +1,186 @@
+/*********************************************************
+ * compression.h  - header file for the inline compression of the RAID emulator
+ *
+ * Copyright(C) 2012 Saint-Petersburg State Polytechnic University
+ *
+ * Developed in the framework of the "Forward error correction for next generation storage systems" project
+ *
+ * Author: P. Trifonov petert@dcn.ftk.spbstu.ru
+ * ********************************************************/
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <vector>
+#include "disk.h"
+#include "locker.h"
+#include "sync.h"
+
+class CDiskArray;
+
+///avoid padding of on-disk structures
+#pragma pack(push)
+#pragma pack(1)
+///the map record of a logical block
+struct CompressedBlock
+{
+    ///size of the compressed data. It is equal to the logical block size if the block is stored uncompressed,
+    ///and 0 if it is filled with zeroes
+    unsigned Size;
+    ///unused
+    unsigned Reserved;
+    ///the physical units keeping the data. Their number is determined by Size, and the record has space for the units of an uncompressed block
+    unsigned long long Units[1];
+};
+#pragma pack(pop)
+
+///Inline compression of the payload data.
+///The users address the logical blocks, each of them consisting of several stripe units. A written block is compressed,
+///and stored in the smallest number of physical units, i.e. the payload stripe units of the array, so that the encoding
+///and the disk transfers are proportional to the compressed size. The blocks which do not shrink by a unit are stored
+///uncompressed, and the blocks filled with zeroes are not stored at all. The blocks are written out of place, and the blocks
+///written together are packed into consecutive units, so that they fill whole stripes. The map of the blocks is kept
+///on a separate device, and its blocks are written after the data. The physical units released by the writes are not reused
+///until both the array and the device are flushed, so that the map found on the device after a crash never refers to the overwritten data.
+///The units of the largest write are kept in reserve, so that a block is never overwritten in place
+class CCompression
+{
+    ///the array the data belongs to
+    CDiskArray& m_Array;
+    ///the map device
+    CDisk m_Device;
+    ///true if the map device was successfully opened and belongs to this array
+    bool m_Valid;
+    ///size of a physical unit. This is equal to the array stripe unit size
+    unsigned m_UnitSize;
+    ///the number of physical units in a logical block
+    unsigned m_BlockUnits;
+    ///size of a logical block in bytes
+    unsigned m_BlockSize;
+    ///the number of physical units
+    unsigned long long m_NumOfUnits;
+    ///the number of logical blocks
+    unsigned long long m_NumOfBlocks;
+    ///size of a map record
+    unsigned m_RecordSize;
+    ///the number of device blocks keeping the map. They follow the superblock
+    unsigned long long m_MapBlocks;
+    ///the records of the logical blocks, padded to whole device blocks
+    unsigned char* m_pMap;
+    ///the state of each physical unit (see compression.cpp)
+    unsigned char* m_pFlags;
+    ///the physical units released since the device was last flushed. They cannot be reused until it is flushed again
+    std::vector<unsigned long long> m_Pending;
+    ///the number of physical units which can be allocated
+    unsigned long long m_NumOfFree;
+    ///the physical unit the search for free ones starts at
+    unsigned long long m_Cursor;
+    ///the number of writers which allocated the physical units, but did not release the old ones yet
+    unsigned m_NumOfWriters;
+    ///signalled when a writer releases the old physical units
+    tCondVariable m_Released;
+    ///true if the map cannot be written any more
+    bool m_Failed;
+    ///the number of bytes written since the array was mounted, except the blocks filled with zeroes
+    unsigned long long m_Written;
+    ///the number of bytes the written blocks are stored in
+    unsigned long long m_Stored;
+    ///the number of blocks which did not shrink
+    unsigned long long m_Incompressible;
+    ///the number of blocks filled with zeroes written since the array was mounted
+    unsigned long long m_Zeroes;
+    ///serializes the accesses to the logical blocks
+    CRangeLocker m_Locker;
+    ///protects all the above data
+    tCriticalSection m_Lock;
+
+    ///write the superblock
+    ///@return true on success
+    bool WriteSuperblock();
+    ///load the map, and find the physical units in use
+    ///@return true on success
+    bool Load();
+    ///flush the array and the device, and make the released physical units reusable. Must be called with m_Lock held
+    ///@return true on success
+    bool Checkpoint();
+    ///@return the map record of a logical block
+    CompressedBlock& GetRecord(unsigned long long BlockID ///the logical block
+                              )const
+    {
+        return *(CompressedBlock*)(m_pMap+(size_t)BlockID*m_RecordSize);
+    };
+    ///@return the number of physical units keeping the data of a given size
+    unsigned GetUnits(unsigned Size ///size of the compressed data
+                     )const
+    {
+        return (Size+m_UnitSize-1)/m_UnitSize;
+    };
+    ///allocate a free physical unit starting the search at the cursor. There must be some. Must be called with m_Lock held
+    ///@return the unit
+    unsigned long long Allocate();
+    ///free a physical unit at once or after the next checkpoint. Must be called with m_Lock held
+    void Release(unsigned long long UnitID,///the unit
+                 bool Pending ///true if the map stored on the device may refer to it
+                );
+    ///read or write a range of physical units via the array, locking their stripes
+    ///@return true on success
+    bool TransferPhysical(unsigned long long UnitID,///the first physical unit
+                          unsigned NumOfUnits,///the number of units
+                          unsigned char* pData,///the data buffer
+                          bool Write ///true if the data must be written
+                         );
+    ///read a number of logical blocks. They must be locked by the caller
+    ///@return true on success
+    bool ReadBlocks(unsigned long long BlockID,///the first logical block
+                    unsigned NumOfBlocks,///the number of blocks
+                    unsigned char* pDest ///destination buffer
+                   );
+    ///write a number of logical blocks. They must be locked by the caller
+    ///@return true on success
+    bool WriteBlocks(unsigned long long BlockID,///the first logical block
+                     unsigned NumOfBlocks,///the number of blocks
+                     const unsigned char* pSrc ///source buffer
+                    );
+public:
+    ///open the map device
+    CCompression(CDiskArray& Array,///the array to be served
+                 const char* pFileName,///the name of the file emulating the map device
+                 unsigned BlockSize,///size of a logical block. This must be a multiple of the stripe unit size
+                 unsigned NumOfThreads,///the expected number of concurrent threads
+                 unsigned DeviceID ///identifier of the map device. This must be different from the IDs of the array disks
+                );
+    ~CCompression();
+    ///@return true if the map device is ready for use
+    bool IsValid()const
+    {
+        return m_Valid;
+    };
+    ///@return the capacity of the logical blocks
+    unsigned long long GetCapacity()const
+    {
+        return m_NumOfBlocks*m_BlockSize;
+    };
+    ///create the map of the array filled with zeroes. It must not be started
+    ///@return true on success
+    bool Init();
+    ///load the map. The array disks must be mounted
+    ///@return true on success
+    bool Start(bool Write ///true if the array is mounted for writing
+              );
+    ///flush the array and the map, and close the device
+    ///@return true on success
+    bool Stop();
+    ///read the data at a given position of the logical blocks, updating it
+    ///@return the actual number of bytes read, or -1 in case of error
+    long long ReadBytes(long long& fd,///file description, i.e. current position
+                        long long Bytes2Read,///the number of bytes to be read
+                        unsigned char* pDest ///destination address
+                       );
+    ///write the data at a given position of the logical blocks, updating it
+    ///@return the actual number of bytes written, or -1 in case of error
+    long long WriteBytes(long long& fd,///file description, i.e. current position
+                         long long Bytes2Write,///the number of bytes to be written
+                         const unsigned char* pSrc ///source address
+                        );
+};
+
+#endif
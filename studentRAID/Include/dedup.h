@@ -0,0 +1,180 @@
+/*********************************************************
+ * dedup.h  - header file for the inline deduplication of the RAID emulator
+ *
+ * Copyright(C) 2012 Saint-Petersburg State Polytechnic University
+ *
+ * Developed in the framework of the "Forward error correction for next generation storage systems" project
+ *
+ * Author: P. Trifonov petert@dcn.ftk.spbstu.ru
+ * ********************************************************/
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <map>
+#include <vector>
+#include "disk.h"
+#include "locker.h"
+#include "sync.h"
+
+class CDiskArray;
+
+///the map entry of a logical unit filled with zeroes. Such units have no physical unit
+#define DEDUPZERO (~0ull)
+
+///the record of a physical stripe unit in the deduplication index
+struct DedupUnit
+{
+    ///the fingerprint of its content. This is meaningful only if the unit is referenced
+    unsigned long long Fingerprint;
+    ///the number of logical units mapped to it
+    unsigned long long References;
+};
+
+///Inline deduplication of the payload stripe units.
+///The users address the logical stripe units, which are mapped to the physical ones, i.e. the payload stripe units of the array.
+///A written unit is fingerprinted, and if a physical unit with the same fingerprint exists and has the same content,
+///the logical unit is mapped to it, so that the unit is neither encoded nor written. The units filled with zeroes are not stored at all.
+///The map, the fingerprints and the reference counts are kept on a separate device. The map blocks are written after the data,
+///so that the writes survive a crash, while the fingerprints and the reference counts are written in batches, and recomputed from the map
+///if the array was not unmounted cleanly. The physical units released by the writes are not reused until both the array
+///and the device are flushed, so that the map found on the device after a crash never refers to the overwritten data
+class CDedup
+{
+    ///the array the index belongs to
+    CDiskArray& m_Array;
+    ///the index device
+    CDisk m_Device;
+    ///true if the index device was successfully opened and belongs to this array
+    bool m_Valid;
+    ///size of a block. This is equal to the array stripe unit size
+    unsigned m_BlockSize;
+    ///the number of logical units, which is equal to the number of physical ones
+    unsigned long long m_NumOfUnits;
+    ///the number of blocks keeping the map. They follow the superblock
+    unsigned long long m_MapBlocks;
+    ///the number of blocks keeping the physical unit records. They follow the map
+    unsigned long long m_UnitBlocks;
+    ///the content of the index device except the superblock: the map followed by the physical unit records
+    unsigned char* m_pImage;
+    ///the physical unit each logical unit is mapped to, or DEDUPZERO
+    unsigned long long* m_pMap;
+    ///the records of the physical units
+    DedupUnit* m_pUnits;
+    ///the state of each physical unit (see dedup.cpp)
+    unsigned char* m_pFlags;
+    ///nonzero for the blocks of m_pImage modified since they were written to the device
+    unsigned char* m_pDirty;
+    ///the number of nonzero entries of m_pDirty
+    unsigned long long m_NumOfDirty;
+    ///a physical unit with each fingerprint
+    std::map<unsigned long long,unsigned long long> m_Index;
+    ///the physical units released since the index was last written. They cannot be reused until it is written again
+    std::vector<unsigned long long> m_Pending;
+    ///the physical units shared by several logical ones since the index was last written
+    std::vector<unsigned long long> m_Shared;
+    ///the number of unreferenced physical units, which can be reused
+    unsigned long long m_NumOfFree;
+    ///the physical unit the search for a free one starts at
+    unsigned long long m_FreeHint;
+    ///the fingerprint of a unit filled with zeroes
+    unsigned long long m_ZeroFingerprint;
+    ///true if the index cannot be written any more
+    bool m_Failed;
+    ///the number of nonzero logical units written since the array was mounted
+    unsigned long long m_Written;
+    ///the number of them mapped to the existing physical units
+    unsigned long long m_Duplicates;
+    ///the number of logical units filled with zeroes written since the array was mounted
+    unsigned long long m_Zeroes;
+    ///the number of units with the same fingerprint as some physical unit, but different content
+    unsigned long long m_Collisions;
+    ///serializes the accesses to the logical units
+    CRangeLocker m_Locker;
+    ///protects all the above data
+    tCriticalSection m_Lock;
+
+    ///write the superblock
+    ///@return true on success
+    bool WriteSuperblock(bool Dirty ///true if the index may be modified after it is written
+                        );
+    ///load the index. If it was not written cleanly, the reference counts are recomputed from the map
+    ///@return true on success
+    bool Load(bool Write ///true if the array is mounted for writing
+             );
+    ///write the modified blocks of the physical unit records after flushing the array, and make the released physical units reusable.
+    ///Must be called with m_Lock held
+    ///@return true on success
+    bool Checkpoint();
+    ///mark the block of m_pImage containing an address as modified. Must be called with m_Lock held
+    void MarkDirty(const void* pEntry ///the modified entry
+                  );
+    ///add a reference to a physical unit. Must be called with m_Lock held
+    void AddReference(unsigned long long UnitID ///the physical unit
+                     );
+    ///remove a reference to a physical unit. Must be called with m_Lock held
+    void Release(unsigned long long UnitID ///the physical unit
+                );
+    ///@return true if a physical unit can be allocated. Must be called with m_Lock held
+    bool IsFree(unsigned long long UnitID ///the physical unit
+               )const;
+    ///allocate a physical unit. If all unreferenced units were released recently, the index is written first. Must be called with m_Lock held
+    ///@return the unit, or DEDUPZERO if there are no free units
+    unsigned long long Allocate(unsigned long long Preferred ///the unit to be allocated if it is free
+                               );
+    ///read or write a range of physical units via the array, locking their stripes
+    ///@return true on success
+    bool TransferPhysical(unsigned long long UnitID,///the first physical unit
+                          unsigned NumOfUnits,///the number of units
+                          unsigned char* pData,///the data buffer
+                          bool Write ///true if the data must be written
+                         );
+    ///read a number of logical units. They must be locked by the caller
+    ///@return true on success
+    bool ReadUnits(unsigned long long UnitID,///the first logical unit
+                   unsigned NumOfUnits,///the number of units
+                   unsigned char* pDest ///destination buffer
+                  );
+    ///write a number of logical units. They must be locked by the caller
+    ///@return true on success
+    bool WriteUnits(unsigned long long UnitID,///the first logical unit
+                    unsigned NumOfUnits,///the number of units
+                    const unsigned char* pSrc ///source buffer
+                   );
+public:
+    ///open the index device
+    CDedup(CDiskArray& Array,///the array to be served
+           const char* pFileName,///the name of the file emulating the index device
+           unsigned NumOfThreads,///the expected number of concurrent threads
+           unsigned DeviceID ///identifier of the index device. This must be different from the IDs of the array disks
+          );
+    ~CDedup();
+    ///@return true if the index device is ready for use
+    bool IsValid()const
+    {
+        return m_Valid;
+    };
+    ///create an index of the array filled with zeroes. It must not be started
+    ///@return true on success
+    bool Init();
+    ///load the index. The array disks must be mounted
+    ///@return true on success
+    bool Start(bool Write ///true if the array is mounted for writing
+              );
+    ///write the index and close the device
+    ///@return true on success
+    bool Stop();
+    ///read the data at a given position of the logical units, updating it
+    ///@return the actual number of bytes read, or -1 in case of error
+    long long ReadBytes(long long& fd,///file description, i.e. current position
+                        long long Bytes2Read,///the number of bytes to be read
+                        unsigned char* pDest ///destination address
+                       );
+    ///write the data at a given position of the logical units, updating it
+    ///@return the actual number of bytes written, or -1 in case of error
+    long long WriteBytes(long long& fd,///file description, i.e. current position
+                         long long Bytes2Write,///the number of bytes to be written
+                         const unsigned char* pSrc ///source address
+                        );
+};
+
+#endif
@@ -0,0 +1,181 @@
+/*********************************************************
+ * deferredparity.h  - header file for the deferred check symbol update of the RAID emulator
+ *
+ * Copyright(C) 2012 Saint-Petersburg State Polytechnic University
+ *
+ * Developed in the framework of the "Forward error correction for next generation storage systems" project
+ *
+ * Author: P. Trifonov petert@dcn.ftk.spbstu.ru
+ * ********************************************************/
+#ifndef DEFERREDPARITY_H
+#define DEFERREDPARITY_H
+
+#include <deque>
+#include <vector>
+#include <map>
+#include "disk.h"
+#include "sync.h"
+
+class CDiskArray;
+
+///the number of threads re-encoding the stale stripes
+#define DEFERREDPARITYTHREADS 2
+
+///a stripe waiting for its check symbols to be re-encoded
+struct StaleSegment
+{
+    ///the stripe of the subarray
+    unsigned long long Segment;
+    ///the time it became stale, as given by GetClock()
+    double Since;
+};
+
+///Deferred update of the check symbols (AFRAID).
+///A small write updates the payload symbols only, and marks the stripe as having stale check symbols in a bitmap
+///stored on a separate device. Background threads re-encode the stale stripes, so that the redundancy is restored
+///within the given time. The check symbols of a stale stripe cannot be used to recover its payload symbols, so the degraded reads
+///and the rebuild re-encode the stripe first, which fails if some of its payload symbols are erased.
+///The bit of a stripe reaches the device before its payload symbols are written, and is cleared only after the re-encoded
+///check symbols are flushed, so that the stripes left stale by a crash are re-encoded on the next mount
+class CDeferredParity
+{
+    ///the array the bitmap belongs to
+    CDiskArray& m_Array;
+    ///the bitmap device
+    CDisk m_Device;
+    ///true if the bitmap device was successfully opened and belongs to this array
+    bool m_Valid;
+    ///size of a block. This is equal to the array stripe unit size
+    unsigned m_BlockSize;
+    ///the number of subarrays. Stripe S of subarray j is identified as segment S*m_NumOfSubarrays+j
+    unsigned m_NumOfSubarrays;
+    ///the number of segments
+    unsigned long long m_NumOfSegments;
+    ///the number of blocks keeping the bitmap. They follow the superblock
+    unsigned long long m_BitmapBlocks;
+    ///the maximal time a stripe may remain stale in seconds, or 0 if it is not limited
+    double m_MaxStaleness;
+    ///the time each stale segment became stale. The segments with up to date check symbols are not present.
+    ///Each entry is modified by the threads holding both m_Lock and the lock of the corresponding stripe
+    std::map<unsigned long long,double> m_StaleSince;
+    ///the number of segments in m_StaleSince
+    unsigned long long m_NumOfStale;
+    ///the bitmap as stored on the device. Bit s is set if segment s may be stale
+    unsigned char* m_pBitmap;
+    ///the stale segments in the order they became stale. The entries of the segments re-encoded since then are skipped
+    std::deque<StaleSegment> m_Queue;
+    ///the segments re-encoded since their bits were last written
+    std::vector<unsigned long long> m_Cleared;
+    ///the number of segments being re-encoded by the background threads
+    unsigned m_Updating;
+    ///the number of threads waiting for all stale segments to be re-encoded
+    unsigned m_Drainers;
+    ///true if the bitmap cannot be written any more, so that the check symbols are updated in place
+    bool m_Failed;
+    ///true if the stale segments are re-encoded by the background threads
+    bool m_Running;
+    ///true if the background threads should terminate
+    bool m_Stop;
+    ///the number of writes, which updated the payload symbols only, since the array was mounted
+    unsigned long long m_Deferred;
+    ///the number of writes, which updated the check symbols in place since some stripe stayed stale for too long
+    unsigned long long m_Bypassed;
+    ///the number of stripes re-encoded by the background threads
+    unsigned long long m_Reencoded;
+    ///the number of stale stripes, which could not be re-encoded since some of their payload symbols were erased
+    unsigned long long m_Unrecoverable;
+    ///the maximal time a stripe remained stale
+    double m_MaxLag;
+    ///the threads re-encoding the stale stripes
+    tThread m_Updaters[DEFERREDPARITYTHREADS];
+    ///the number of running background threads
+    unsigned m_NumOfUpdaters;
+    ///protects all the above data
+    tCriticalSection m_Lock;
+    ///signalled when a stripe becomes stale, some thread waits for the stale stripes to be re-encoded, or the background threads must terminate
+    tCondVariable m_UpdateSig;
+    ///signalled when all stale stripes are re-encoded
+    tCondVariable m_IdleSig;
+
+    ///write the superblock and the whole bitmap
+    ///@return true on success
+    bool WriteBitmap();
+    ///write the bitmap block containing the bit of a segment. Must be called with m_Lock held
+    ///@return true on success
+    bool WriteBitmapBlock(unsigned long long Segment ///the segment
+                         );
+    ///load the bitmap and queue the stale segments
+    ///@return true on success
+    bool Load(bool Write ///true if the array is mounted for writing. Otherwise, the stale stripes are only reported
+             );
+    ///@return the time a segment became stale, or 0 if its check symbols are up to date. Must be called with m_Lock held
+    double StaleSince(unsigned long long Segment ///the segment
+                     )const
+    {
+        std::map<unsigned long long,double>::const_iterator S=m_StaleSince.find(Segment);
+        return (S!=m_StaleSince.end())?S->second:0;
+    };
+    ///remove the entries of the segments re-encoded since they were queued. Must be called with m_Lock held
+    void PruneQueue();
+    ///clear the bits of the re-encoded segments after their check symbols are flushed.
+    ///Must be called with m_Lock held, which is released while the array is being flushed
+    ///@return true on success
+    bool ClearBits();
+    ///mark a segment as up to date. Must be called with m_Lock held
+    void Clear(unsigned long long Segment ///the segment
+              );
+    ///re-encode the stale stripes in the order they became stale
+    static THREADPROC UpdateThread(void* pParams ///must be a pointer to CDeferredParity
+                                  );
+public:
+    ///open the bitmap device
+    CDeferredParity(CDiskArray& Array,///the array to be served
+                    const char* pFileName,///the name of the file emulating the bitmap device
+                    double MaxStaleness,///the maximal time a stripe may remain stale in seconds, or 0 if it is not limited
+                    unsigned DeviceID ///identifier of the bitmap device. This must be different from the IDs of the array disks
+                   );
+    ~CDeferredParity();
+    ///@return true if the bitmap device is ready for use
+    bool IsValid()const
+    {
+        return m_Valid;
+    };
+    ///create an empty bitmap. It must not be started
+    ///@return true on success
+    bool Init();
+    ///load the bitmap and start the background threads. The array disks must be mounted
+    ///@return true on success
+    bool Start(bool Write ///true if the array is mounted for writing
+              );
+    ///re-encode all stale stripes and terminate the background threads
+    ///@return true on success
+    bool Stop();
+    ///mark a stripe as stale, so that its payload symbols may be written without updating the check symbols.
+    ///The caller must hold the stripe lock
+    ///@return true on success, false if the check symbols must be updated in place
+    bool MarkStale(unsigned long long StripeID,///the stripe being updated
+                   unsigned SubarrayID ///identifies the subarray
+                  );
+    ///re-encode the check symbols of a stale stripe from its payload symbols. The caller must hold the stripe lock
+    ///@return true if the check symbols are up to date
+    bool Apply(unsigned long long StripeID,///the stripe
+               unsigned SubarrayID,///identifies the subarray
+               size_t ThreadID ///the scratch arena of a calling thread obtained from CDiskArray::LockStripes()
+              );
+    ///mark a stripe as up to date, since its check symbols were re-encoded. The caller must hold the stripe lock
+    void Drop(unsigned long long StripeID,///the stripe
+              unsigned SubarrayID ///identifies the subarray
+             );
+    ///wait for all stale stripes to be re-encoded
+    ///@return true on success
+    bool Drain();
+    ///flush the bitmap device
+    ///@return true on success
+    bool FlushDevice();
+    ///get the redundancy lag
+    ///@return the time the oldest stale stripe is stale for in seconds, or 0 if there are no stale stripes
+    double GetRedundancyLag(unsigned long long& StaleStripes ///receives the number of stale stripes
+                           );
+};
+
+#endif
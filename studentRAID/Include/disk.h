@@ -61,6 +61,8 @@ class CDisk {
 #else
     ///the descriptor of the underlying file
     int m_File;
+    ///the size of the mapping, which differs from the configured one if the file was created for another array
+    size_t m_MapSize;
 #endif    
 
 #else    
@@ -159,6 +161,11 @@ public:
         pData = m_pArrayData;
         return m_ArrayDataSize;
     };
+    ///close the backend file, and switch to another one, which will be created by ResetDisk().
+    ///The disk must not be online. The name must remain valid while the disk is in use
+    ///@return true on success
+    bool Attach(const char* pFilename ///the name of the new backend file
+               );
     ///Initialize the disk. The disk must be in dsOffline or dsInvalid state.
     ///The payload data is filled with zeroes. On success, the disk status is changed to online
     ///@return true on success
@@ -183,6 +190,15 @@ public:
             unsigned NumOfBlocks, ///the number of blocks to be written
             const void* pData ///the data to be written
             );
+    ///release the storage occupied by a number of payload data blocks. The disk must be read-write mounted.
+    ///The blocks read back as zeroes if the underlying file system supports hole punching, and remain intact otherwise
+    ///@return true on success
+    bool Discard(unsigned long long BlockID, ///the first block to be released
+            unsigned NumOfBlocks ///the number of blocks to be released
+            );
+    ///make sure that all written data reached the underlying file. The disk must be read-write mounted
+    ///@return true on success
+    bool Flush();
 
 };
 
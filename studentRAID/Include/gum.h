@@ -25,19 +25,24 @@ RAID5Params(unsigned Dimension,unsigned stripeUnitSize):RAIDParams(rtRAID5,Dimen
 
 class CgumProcessor :public CRAIDProcessor
 {
-	///the buffer used for parity computation
-	unsigned char* m_pXORBuffer;
+	///offset of the buffers used for parity computation within the scratch arena
+	size_t m_XORBuffer;
 protected:
 	///Check if it is possible to correct a given combination of erasures
 	///If yes, the method should initialize the internal data structures
 	///and be ready to do the actual erasure correction. This combination of erasures
 	/// is uniquely identified by ErasureID
 	///@return true if the specified combination of erasures is correctable
-	virtual bool IsCorrectable(unsigned ErasureSetID///identifies the erasure combination. This will not exceed m_Length-1
+	virtual bool IsCorrectable(unsigned ErasureSetID///identifies the erasure combination. This will not exceed GetNumOfErasureSets()-1
 		)
 	{
 		return GetNumOfErasures(ErasureSetID) <= 1;
 	};
+	///a single erasure is always correctable
+	virtual unsigned GetCorrectingCapability()const
+	{
+		return 1;
+	};
 	///reset the erasure correction engine
 	/// this will be called if the set of failed disks changes
 	virtual void ResetErasures()
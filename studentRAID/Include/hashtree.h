@@ -0,0 +1,79 @@
+/*********************************************************
+ * hashtree.h  - header file for a hash tree over the stripes of a disk array
+ *
+ * Copyright(C) 2012 Saint-Petersburg State Polytechnic University
+ *
+ * Developed in the framework of the "Forward error correction for next generation storage systems" project
+ *
+ * Author: P. Trifonov petert@dcn.ftk.spbstu.ru
+ * ********************************************************/
+#ifndef HASHTREE_H
+#define HASHTREE_H
+
+#include <stddef.h>
+#include <vector>
+
+///Binary hash (Merkle) tree over a sequence of leaf hashes.
+///The zero hash denotes an empty subtree, i.e. the leaves filled with zeroes, so that a tree
+///over an initialized array is all-zero, and needs not be written to the disks.
+///The inner nodes are recomputed lazily, so that updating a leaf costs O(1), and
+///obtaining the root afterwards costs O(log n) per modified leaf.
+///The class is not thread-safe
+class CHashTree
+{
+    ///the number of leaves
+    unsigned long long m_NumOfLeaves;
+    ///the number of leaves rounded up to a power of 2
+    unsigned long long m_Width;
+    ///the nodes in the heap order: node i has children 2i and 2i+1, and the leaves start at m_Width. Node 0 is not used
+    unsigned long long* m_pNodes;
+    ///nonzero for the inner nodes whose hashes must be recomputed from their children. The ancestors of a stale node are stale as well
+    unsigned char* m_pStale;
+
+    ///recompute a stale subtree
+    ///@return the hash of its root
+    unsigned long long Update(unsigned long long Node ///the root of the subtree
+                             );
+public:
+    CHashTree(unsigned long long NumOfLeaves ///the number of leaves
+             );
+    ~CHashTree();
+    ///@return the number of leaves
+    unsigned long long GetNumOfLeaves()const
+    {
+        return m_NumOfLeaves;
+    };
+    ///@return the hash of a leaf
+    unsigned long long GetLeaf(unsigned long long LeafID ///the leaf
+                              )const
+    {
+        return m_pNodes[m_Width+LeafID];
+    };
+    ///set the hash of a leaf
+    void SetLeaf(unsigned long long LeafID,///the leaf
+                 unsigned long long Hash ///its new hash
+                );
+    ///set the hashes of all leaves
+    void Load(const unsigned long long* pLeaves ///the leaf hashes
+             );
+    ///@return the root hash
+    unsigned long long GetRoot();
+    ///find the leaves which differ in two trees with the same number of leaves, descending only into
+    ///the subtrees with different hashes
+    static void Compare(CHashTree& A,///the first tree
+                        CHashTree& B,///the second tree
+                        std::vector<unsigned long long>& Leaves ///output: the differing leaves in the ascending order
+                       );
+    ///@return the hash of a pair of nodes, which is zero for a pair of empty ones
+    static unsigned long long Combine(unsigned long long Left,///the left node
+                                      unsigned long long Right ///the right node
+                                     );
+    ///compute a 64-bit non-cryptographic hash of a data block, processing 32 bytes per step with SSE2
+    ///@return the hash value
+    static unsigned long long Hash(const void* pData,///the data
+                                   size_t Size,///data size in bytes
+                                   unsigned long long Seed ///the initial value
+                                  );
+};
+
+#endif
@@ -0,0 +1,185 @@
+/*********************************************************
+ * journal.h  - header file for the write journal of the RAID emulator
+ *
+ * Copyright(C) 2012 Saint-Petersburg State Polytechnic University
+ *
+ * Developed in the framework of the "Forward error correction for next generation storage systems" project
+ *
+ * Author: P. Trifonov petert@dcn.ftk.spbstu.ru
+ * ********************************************************/
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "disk.h"
+#include "sync.h"
+
+class CDiskArray;
+
+///a write request stored in the journal
+struct JournalRecord
+{
+    ///sequence number of the record
+    unsigned long long Sequence;
+    ///the first payload stripe unit of the array to be updated
+    unsigned long long FirstUnit;
+    ///the number of stripe units to be updated
+    unsigned NumOfUnits;
+    ///the block of the journal device containing the record header
+    unsigned long long Position;
+    ///the number of journal blocks occupied by the record, including the unused blocks skipped at the end of the device
+    unsigned long long Footprint;
+    ///the record header block followed by the payload data
+    unsigned char* pBlocks;
+    ///the next record in the order of sequence numbers
+    JournalRecord* pNext;
+};
+
+///Write-ahead journal of a disk array.
+///The journal device is an emulated disk, which stores a superblock followed by a circular log of write requests.
+///The writes are appended to the log, made persistent by a single flush for all concurrently committed
+///records (group commit), and acknowledged. A background thread applies them to the array later.
+///Since all stripe units of a request reach the journal before any of them is written in place,
+///an interrupted update can be repeated on the next mount
+class CJournal
+{
+    ///the array the journal belongs to
+    CDiskArray& m_Array;
+    ///the journal device
+    CDisk m_Device;
+    ///true if the journal device was successfully opened and belongs to this array
+    bool m_Valid;
+    ///the number of blocks on the journal device
+    unsigned long long m_NumOfBlocks;
+    ///size of a block. This is equal to the array stripe unit size
+    unsigned m_BlockSize;
+    ///the maximal number of stripe units in a single record
+    unsigned m_MaxRecordUnits;
+    ///the number of records not yet applied for each stripe of the array
+    unsigned* m_pPendingRecords;
+    ///the oldest record not yet applied
+    JournalRecord* m_pFirst;
+    ///the latest record
+    JournalRecord* m_pLast;
+    ///the block where the next record will be written
+    unsigned long long m_Head;
+    ///sequence number of the next record
+    unsigned long long m_NextSequence;
+    ///all records with smaller sequence numbers are persistent
+    unsigned long long m_CommittedSequence;
+    ///all records with smaller sequence numbers are applied to the array, and this is recorded in the superblock
+    unsigned long long m_CheckpointSequence;
+    ///the number of blocks occupied by the records, which cannot be reused yet, or reserved by the writers
+    unsigned long long m_UsedBlocks;
+    ///true if some thread is flushing the journal device
+    bool m_Flushing;
+    ///true if the records cannot be applied any more
+    bool m_Failed;
+    ///true if the records are being applied by the background thread
+    bool m_Running;
+    ///true if the background thread should terminate
+    bool m_Stop;
+    ///the thread applying the records to the array
+    tThread m_Applier;
+    ///protects all the above data
+    tCriticalSection m_Lock;
+    ///signalled when some journal space is released
+    tCondVariable m_SpaceSig;
+    ///signalled when a flush completes
+    tCondVariable m_CommitSig;
+    ///signalled when new records are committed or the background thread must terminate
+    tCondVariable m_ApplySig;
+    ///signalled when a checkpoint is made
+    tCondVariable m_CheckpointSig;
+
+    ///write the superblock pointing to the given record and flush the journal device
+    ///@return true on success
+    bool WriteCheckpoint(unsigned long long Sequence,///sequence number of the oldest record to be replayed
+                         unsigned long long Position ///its location
+                        );
+    ///load a record with a given sequence number
+    ///@return the record, or 0 if there is no valid record with the given sequence number at this location
+    JournalRecord* LoadRecord(unsigned long long Sequence,///expected sequence number
+                              unsigned long long Position ///the location to be inspected
+                             );
+    ///load all records following the checkpoint
+    ///@return true on success
+    bool LoadRecords();
+    ///update the array according to the record, re-encoding all affected stripes
+    ///@return true on success
+    bool ReplayRecord(const JournalRecord* pRecord,///the record
+                      size_t ThreadID ///the scratch arena of a calling thread obtained from CDiskArray::LockStripes()
+                     );
+    ///add the record to the end of the list of records to be applied
+    void Link(JournalRecord* pRecord);
+    ///remove the first record from the list of records to be applied
+    void Unlink();
+    ///deallocate a record
+    static void DeleteRecord(JournalRecord* pRecord);
+    ///apply the committed records to the array and make checkpoints
+    static THREADPROC ApplyThread(void* pParams ///must be a pointer to CJournal
+                                 );
+public:
+    ///open the journal device
+    CJournal(CDiskArray& Array,///the array to be served
+             const char* pFileName,///the name of the file emulating the journal device
+             size_t Capacity,///journal capacity in bytes
+             unsigned DeviceID ///identifier of the journal device. This must be different from the IDs of the array disks
+            );
+    ~CJournal();
+    ///@return true if the journal device is ready for use
+    bool IsValid()const
+    {
+        return m_Valid;
+    };
+    ///@return the maximal number of stripe units in a single record
+    unsigned GetMaxRecordUnits()const
+    {
+        return m_MaxRecordUnits;
+    };
+    ///@return the buffer for the payload data of a record
+    unsigned char* GetPayload(JournalRecord* pRecord)const
+    {
+        return pRecord->pBlocks+m_BlockSize;
+    };
+    ///create an empty journal. It must not be started
+    ///@return true on success
+    bool Init();
+    ///replay the records left since the last checkpoint. If write access is requested,
+    ///the records are applied to the array, and the background thread is started.
+    ///Otherwise, the records are kept in memory, so that the reads return the latest data.
+    ///The array disks must be mounted
+    ///@return true on success
+    bool Start(bool Write ///true if the array is mounted for writing
+              );
+    ///apply all records to the array and terminate the background thread
+    ///@return true on success
+    bool Stop();
+    ///reserve space for a record, waiting for some records to be applied if needed.
+    ///The caller should not hold any array locks, since the background thread may need them
+    ///@return the record, or 0 in case of failure
+    JournalRecord* CreateRecord(unsigned long long FirstUnit,///the first payload stripe unit of the array to be updated
+                                unsigned NumOfUnits ///the number of units to be updated. This may not exceed GetMaxRecordUnits()
+                               );
+    ///release a record, which was not appended to the journal
+    void DiscardRecord(JournalRecord* pRecord);
+    ///write the record to the journal. The caller must hold the lock on the stripes being updated,
+    ///so that the order of records matches the order of updates
+    ///@return sequence number of the record, or 0 in case of failure
+    unsigned long long Append(JournalRecord* pRecord ///the record with the payload data filled in
+                             );
+    ///wait for the record to become persistent
+    ///@return true on success
+    bool Commit(unsigned long long Sequence ///sequence number of the record
+               );
+    ///wait for all appended records to be applied to the array
+    ///@return true on success
+    bool Drain();
+    ///replace the data read from the array with the one from the records not yet applied.
+    ///The caller must hold the lock on the stripes being read
+    void Overlay(unsigned long long FirstUnit,///the first payload stripe unit of the array
+                 unsigned long long NumOfUnits,///the number of units
+                 unsigned char* pDest ///the data read from the array
+                );
+};
+
+#endif
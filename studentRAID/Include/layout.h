@@ -0,0 +1,245 @@
+/*********************************************************
+ * layout.h  - header file for the mapping of codeword symbols onto disks
+ *
+ * Copyright(C) 2012 Saint-Petersburg State Polytechnic University
+ *
+ * Developed in the framework of the "Forward error correction for next generation storage systems" project
+ *
+ * Author: P. Trifonov petert@dcn.ftk.spbstu.ru
+ * ********************************************************/
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+struct RAIDParams;
+
+///the largest number of disks in a subarray with the weighted layout
+#define MAXWEIGHTEDDISKS 64
+
+///supported data layouts
+enum eLayoutTypes
+{
+    ltCyclic, ///right-symmetric: each stripe occupies all disks of a subarray, the symbols are cyclically shifted by one disk every RotationPeriod stripes
+    ltDeclustered, ///stripes are spread over a larger pool of disks with distributed spare space
+    ltLeftSymmetric, ///left-symmetric: as ltCyclic, but the symbols are shifted in the opposite direction
+    ltDedicated, ///each symbol is always stored on the same disk, i.e. there are dedicated check disks
+    ltWeighted, ///stripes are spread over a pool of disks of different speed or size in proportion to their weights
+    ltEnd
+};
+
+///layout names used in the configuration file
+extern const char* ppLayoutNames[];
+
+///translate the layout name into eLayoutTypes value
+///@return layout type. An exception is thrown if the name is unknown
+int GetLayoutType(const char* pName);
+
+///translate a comma-separated list of disk weights into an array of MAXWEIGHTEDDISKS entries.
+///An exception is thrown if the list is invalid
+void ParseWeights(const char* pList,///the list, or 0 if no weights are given
+                  unsigned char* pWeights ///output: the weights, followed by zeroes
+                 );
+
+///Maps codeword symbols of each stripe of a subarray onto (disk, row) pairs,
+///where a row is a group of stripe units storing one codeword symbol.
+///The stripes are classified into GetNumOfPatterns() patterns, so that the symbols of all stripes
+///with the same pattern are stored on the same disks, and the same erasure configuration applies to them.
+///Some layouts reserve spare units, which can be used to relocate the symbols from a failed disk.
+class CLayout
+{
+protected:
+    ///the number of symbols in a stripe (code length)
+    unsigned m_Length;
+    ///the number of disks in a subarray
+    unsigned m_NumOfDisks;
+    ///the number of distinct symbol to disk mappings
+    unsigned m_NumOfPatterns;
+    ///the number of disks worth of spare space
+    unsigned m_NumOfSpares;
+public:
+    CLayout(unsigned Length,///code length
+            unsigned NumOfDisks,///the number of disks in a subarray
+            unsigned NumOfPatterns,///the number of distinct symbol to disk mappings
+            unsigned NumOfSpares ///the number of spare slots
+           ):m_Length(Length),m_NumOfDisks(NumOfDisks),m_NumOfPatterns(NumOfPatterns),m_NumOfSpares(NumOfSpares)
+    {
+    };
+    virtual ~CLayout()
+    {
+    };
+    ///@return the number of disks in a subarray
+    unsigned GetNumOfDisks()const
+    {
+        return m_NumOfDisks;
+    };
+    ///@return the number of distinct symbol to disk mappings
+    unsigned GetNumOfPatterns()const
+    {
+        return m_NumOfPatterns;
+    };
+    ///@return the symbol to disk mapping used by the stripe
+    virtual unsigned GetPattern(unsigned long long StripeID)const
+    {
+        return (unsigned)(StripeID%m_NumOfPatterns);
+    };
+    ///@return some stripe using the given symbol to disk mapping
+    virtual unsigned long long GetPatternStripe(unsigned PatternID)const
+    {
+        return PatternID;
+    };
+    ///@return the number of spare slots, i.e. the number of failed disks which can be relocated to the spare space
+    unsigned GetNumOfSpares()const
+    {
+        return m_NumOfSpares;
+    };
+    ///@return the number of stripes which fit into the given number of rows on each disk
+    virtual unsigned long long GetNumOfStripes(unsigned long long DiskRows)const=0;
+    ///@return the number of stripes which fit into the disks of different size. The rows beyond the smallest disk are not used by default
+    virtual unsigned long long GetNumOfStripesOnDisks(const unsigned long long* pDiskRows ///the number of rows on each disk of the subarray
+                                                     )const;
+    ///find the location of a codeword symbol
+    virtual void GetLocation(unsigned long long StripeID,///the stripe
+                             unsigned SymbolID,///the symbol within the stripe
+                             unsigned& DiskID,///output: the disk within the subarray
+                             unsigned long long& Row ///output: the row on this disk
+                            )const=0;
+    ///find the spare unit which the symbol is relocated to if its disk fails.
+    ///The spare unit is never located on a disk used by the same stripe or by its other spare units
+    virtual void GetSpareLocation(unsigned long long StripeID,///the stripe
+                                  unsigned SymbolID,///the symbol within the stripe
+                                  unsigned SpareID,///the spare slot (<GetNumOfSpares())
+                                  unsigned& DiskID,///output: the disk within the subarray
+                                  unsigned long long& Row ///output: the row on this disk
+                                 )const;
+};
+
+///Symbol i of stripe s is stored in row s of disk (i+r)%Length (right-symmetric) or (i-r)%Length (left-symmetric),
+///where r=s/RotationPeriod. With RotationPeriod=1 and RAID-5, the parity symbol moves to the next (previous) disk
+///in each stripe, and the data symbols follow it. Larger rotation periods keep RotationPeriod consecutive units of
+///the same symbol on the same disk, so that sequential access results in long contiguous runs on each disk.
+///RotationPeriod=0 gives a layout without rotation, i.e. with dedicated check disks
+class CCyclicLayout:public CLayout
+{
+    ///true for the left-symmetric layout
+    bool m_LeftSymmetric;
+    ///the number of consecutive stripes sharing the same mapping
+    unsigned m_RotationPeriod;
+public:
+    CCyclicLayout(unsigned Length,///code length
+                  bool LeftSymmetric,///true for the left-symmetric layout
+                  unsigned RotationPeriod ///the number of consecutive stripes sharing the same mapping. 0 disables rotation
+                 ):CLayout(Length,Length,(RotationPeriod)?Length:1,0),m_LeftSymmetric(LeftSymmetric),m_RotationPeriod(RotationPeriod)
+    {
+    };
+    virtual unsigned GetPattern(unsigned long long StripeID)const
+    {
+        return (m_RotationPeriod)?(unsigned)((StripeID/m_RotationPeriod)%m_Length):0;
+    };
+    virtual unsigned long long GetPatternStripe(unsigned PatternID)const
+    {
+        return (unsigned long long)PatternID*m_RotationPeriod;
+    };
+    virtual unsigned long long GetNumOfStripes(unsigned long long DiskRows)const
+    {
+        return DiskRows;
+    };
+    virtual void GetLocation(unsigned long long StripeID,unsigned SymbolID,unsigned& DiskID,unsigned long long& Row)const
+    {
+        unsigned Shift=GetPattern(StripeID);
+        if (m_LeftSymmetric)
+            DiskID=(SymbolID+m_Length-Shift)%m_Length;
+        else
+            DiskID=(SymbolID+Shift)%m_Length;
+        Row=StripeID;
+    };
+};
+
+///Parity-declustered layout over a pool of NumOfDisks disks.
+///The stripes are arranged into groups of NumOfDisks stripes, each occupying Length+NumOfSpares rows.
+///Symbol i of stripe j within a group is stored on disk (j+i*m)%NumOfDisks, row i, where multiplier m is coprime
+///with NumOfDisks and changes from one group to another. For prime NumOfDisks this is an affine block design,
+///i.e. each pair of disks shares the same number of stripes, so that the rebuild load is evenly spread over the pool.
+///Row Length+k of each disk in a group is reserved for the k-th spare slot; symbol i of stripe j is relocated to
+///disk (j+(Length+k)*m)%NumOfDisks, so the spare space is distributed over all disks
+class CDeclusteredLayout:public CLayout
+{
+    ///multipliers used in consecutive stripe groups
+    unsigned* m_pMultipliers;
+    ///the number of multipliers
+    unsigned m_NumOfMultipliers;
+public:
+    CDeclusteredLayout(unsigned Length,///code length
+                       unsigned NumOfDisks,///pool size
+                       unsigned NumOfSpares ///the number of spare slots
+                      );
+    virtual ~CDeclusteredLayout();
+    virtual unsigned long long GetNumOfStripes(unsigned long long DiskRows)const
+    {
+        return (DiskRows/(m_Length+m_NumOfSpares))*m_NumOfDisks;
+    };
+    virtual void GetLocation(unsigned long long StripeID,unsigned SymbolID,unsigned& DiskID,unsigned long long& Row)const
+    {
+        unsigned long long GroupID=StripeID/m_NumOfDisks;
+        unsigned m=m_pMultipliers[GroupID%m_NumOfMultipliers];
+        DiskID=(unsigned)((StripeID%m_NumOfDisks+(unsigned long long)SymbolID*m)%m_NumOfDisks);
+        Row=GroupID*(m_Length+m_NumOfSpares)+SymbolID;
+    };
+    virtual void GetSpareLocation(unsigned long long StripeID,unsigned /*SymbolID*/,unsigned SpareID,unsigned& DiskID,unsigned long long& Row)const
+    {
+        unsigned long long GroupID=StripeID/m_NumOfDisks;
+        unsigned m=m_pMultipliers[GroupID%m_NumOfMultipliers];
+        DiskID=(unsigned)((StripeID%m_NumOfDisks+(unsigned long long)(m_Length+SpareID)*m)%m_NumOfDisks);
+        Row=GroupID*(m_Length+m_NumOfSpares)+m_Length+SpareID;
+    };
+};
+
+///Weighted layout over a pool of NumOfDisks disks of different speed or size. Disk d stores Length*w_d symbols
+///within each period of W patterns, where w_d is its weight and W is the sum of the weights, so that the faster
+///or the larger disks carry more stripes. No disk may have more than W/Length of the weight, since a stripe uses each disk at most once.
+///The disks of each pattern are those with the largest number of symbols still to be placed within the period,
+///so that all of them are placed. The check symbols of each pattern are assigned to its disks which are the most behind
+///their share of the check symbols, so that the load of the small writes is proportional to the weights as well.
+///Each pattern is used by RotationPeriod consecutive stripes, which are stored in consecutive rows of each disk
+class CWeightedLayout:public CLayout
+{
+    ///the number of consecutive stripes sharing the same mapping
+    unsigned m_RotationPeriod;
+    ///the number of symbols stored on each disk by the patterns of a period
+    unsigned* m_pSymbols;
+    ///the disk storing each symbol of each pattern
+    unsigned* m_pDisks;
+    ///the position of each symbol of each pattern among the symbols of the period stored on its disk
+    unsigned* m_pRows;
+public:
+    CWeightedLayout(unsigned Length,///code length
+                    unsigned Dimension,///the number of payload symbols
+                    unsigned NumOfDisks,///pool size
+                    const unsigned char* pWeights,///the weights of the disks. Zero entries stand for 1
+                    unsigned RotationPeriod ///the number of consecutive stripes sharing the same mapping
+                   );
+    virtual ~CWeightedLayout();
+    virtual unsigned GetPattern(unsigned long long StripeID)const
+    {
+        return (unsigned)((StripeID/m_RotationPeriod)%m_NumOfPatterns);
+    };
+    virtual unsigned long long GetPatternStripe(unsigned PatternID)const
+    {
+        return (unsigned long long)PatternID*m_RotationPeriod;
+    };
+    virtual unsigned long long GetNumOfStripes(unsigned long long DiskRows)const;
+    virtual unsigned long long GetNumOfStripesOnDisks(const unsigned long long* pDiskRows)const;
+    virtual void GetLocation(unsigned long long StripeID,unsigned SymbolID,unsigned& DiskID,unsigned long long& Row)const
+    {
+        unsigned long long Period=StripeID/((unsigned long long)m_RotationPeriod*m_NumOfPatterns);
+        unsigned Symbol=GetPattern(StripeID)*m_Length+SymbolID;
+        DiskID=m_pDisks[Symbol];
+        Row=(Period*m_pSymbols[DiskID]+m_pRows[Symbol])*m_RotationPeriod+StripeID%m_RotationPeriod;
+    };
+};
+
+///construct the layout specified by the array configuration
+///@return the layout object. An exception is thrown if the configuration is invalid
+CLayout* CreateLayout(const RAIDParams& Params,///array configuration
+                      unsigned Length ///code length
+                     );
+
+#endif
@@ -12,20 +12,25 @@
 #define LOCKER_H
 
 #include <algorithm>
+#include <vector>
 #include "sync.h"
 
-
+///the number of version counters of a range locker. The entries are mapped onto them modulo this number
+#define NUMOFLOCKVERSIONS 1024
 
 
 ///this class provides thread locking for critical sections given by an 
-///integer interval. 
+///integer interval. The lock entries are allocated on demand, so that the number
+///of threads holding locks simultaneously is limited only by range conflicts.
+///The overlapping ranges are granted in the order of requests, so that a large range
+///is not starved by a stream of small ones. The entries also have version counters,
+///which allow a range to be read optimistically without locking it (seqlock)
 
 class CRangeLocker {
-    ///maximal number of threads which can be executed concurrently
-    unsigned m_MaxThreads;
     ///possible lock states
     enum eLockStates {
         lsInvalid, ///the lock is invalid
+        lsWaiting, ///the thread is waiting for the overlapping ranges requested earlier
         lsLocked, ///the lock has been given and a thread is running,
         lsUnlocked ///the lock has been released, and the entry is waiting for all relevant threads to process this event
     };
@@ -36,6 +41,10 @@ class CRangeLocker {
         unsigned long long Low;
         ///all entries x with Low<=x<High will be locked
         unsigned long long High;
+        ///the second range locked along with the first one. It is empty unless requested by the two-range Lock()
+        unsigned long long Low2;
+        ///the second range locked along with the first one. It is empty unless requested by the two-range Lock()
+        unsigned long long High2;
         ///the variable used to signal that the lock state has changed
         tCondVariable Condition;
         ///current lock state
@@ -46,40 +55,81 @@ class CRangeLocker {
         LockedRange* pNext;
         ///pointer to the previous entry in the active node list
         LockedRange* pPrev;
+        ///index of the entry in m_LockPool
+        size_t ID;
+        ///the order of the request
+        unsigned long long Ticket;
     };
-    ///a pool of locks
-    LockedRange* m_pLockPool;
+    ///all lock entries allocated so far
+    std::vector<LockedRange*> m_LockPool;
     ///a stack of unused locks
-    LockedRange** m_ppFreeLocks;
-    ///index of the first free element in the buffer
-    ///the value is equal to the current number of active locks
-    unsigned m_FreeStackTop;
-    ///pointer to a double-linked list of granted locks
+    std::vector<LockedRange*> m_FreeLocks;
+    ///pointer to a double-linked list of granted and requested locks
     LockedRange* m_pActiveLocks;
+    ///the ticket to be assigned to the next request
+    unsigned long long m_NextTicket;
 
-    ///used to signal about m_FreeStackTop changes
-    tCondVariable m_FreePoolSig;
     ///the global mutex used to protect the internal data structures
     tCriticalSection m_GlobalMutex;
+    ///the number of locks granted for the entries mapped onto each counter. It is updated with m_GlobalMutex held
+    volatile unsigned long long m_Granted[NUMOFLOCKVERSIONS];
+    ///the number of locks released for the entries mapped onto each counter. It is updated with m_GlobalMutex held
+    volatile unsigned long long m_Released[NUMOFLOCKVERSIONS];
 
     ///wait for the locked range to become unlocked
     void Wait(LockedRange* pLock ///a lock entry in the list
             );
     ///remove an entry from the active lock list
     void Release(LockedRange* pLock);
+    ///allocate a new lock entry and put it into the free stack. Must be called with m_GlobalMutex held
+    void AddEntry();
+    ///@return true if a range intersects any range of a lock entry
+    static bool Overlaps(const LockedRange& Lock,///the lock entry
+                         unsigned long long RangeLow,///lower bound
+                         unsigned long long RangeHigh ///upper bound
+                        );
+    ///increment the counters of a range. Must be called with m_GlobalMutex held
+    static void Advance(volatile unsigned long long* pCounters,///the counters
+                        unsigned long long RangeLow,///lower bound
+                        unsigned long long RangeHigh ///upper bound
+                       );
+    ///@return the sum of the counters of a range
+    static unsigned long long Sum(const volatile unsigned long long* pCounters,///the counters
+                                  unsigned long long RangeLow,///lower bound
+                                  unsigned long long RangeHigh ///upper bound
+                                 );
 public:
-    CRangeLocker(unsigned MaxThreads  ///maximal number of threads to obtain locks simultaneously
+    CRangeLocker(unsigned NumOfEntries  ///the number of lock entries to be preallocated
             );
     ~CRangeLocker();
     ///lock the specified range [RangeLow,RangeHigh). The function will wait if
     /// a part of this range is locked by another thread
-    ///@return the unique ID of the lock (<m_MaxQueueSize)
+    ///@return the unique ID of the lock
     size_t Lock(const unsigned long long RangeLow, ///lower bound
             const unsigned long long RangeHigh ///upper bound 
             );
+    ///lock two ranges [RangeLow,RangeHigh) and [RangeLow2,RangeHigh2) with a single request. Both of them
+    ///are granted at once, so that a thread never holds one of them while waiting for the other
+    ///@return the unique ID of the lock
+    size_t Lock(const unsigned long long RangeLow, ///lower bound of the first range
+            const unsigned long long RangeHigh, ///upper bound of the first range
+            const unsigned long long RangeLow2, ///lower bound of the second range
+            const unsigned long long RangeHigh2 ///upper bound of the second range
+            );
     ///unlock the range
     void Unlock(size_t LockID ///the ID value returned by Lock
             );
+    ///start reading the range [RangeLow,RangeHigh) without locking it. The data read must be validated by EndRead()
+    ///@return false if a part of the range is locked
+    bool BeginRead(const unsigned long long RangeLow, ///lower bound
+            const unsigned long long RangeHigh, ///upper bound
+            unsigned long long& Version ///output: the version of the range
+            )const;
+    ///@return true if no part of the range was locked since BeginRead() returned a given version, i.e. the data read is consistent
+    bool EndRead(const unsigned long long RangeLow, ///lower bound
+            const unsigned long long RangeHigh, ///upper bound
+            unsigned long long Version ///the version returned by BeginRead()
+            )const;
 };
 
 
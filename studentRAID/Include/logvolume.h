@@ -0,0 +1,258 @@
+/*********************************************************
+ * logvolume.h  - header file for a log-structured volume on top of a disk array
+ *
+ * Copyright(C) 2012 Saint-Petersburg State Polytechnic University
+ *
+ * Developed in the framework of the "Forward error correction for next generation storage systems" project
+ *
+ * Author: P. Trifonov petert@dcn.ftk.spbstu.ru
+ * ********************************************************/
+#ifndef LOGVOLUME_H
+#define LOGVOLUME_H
+
+#include "array.h"
+#include "sync.h"
+
+///avoid padding of on-array structures
+#pragma pack(push)
+#pragma pack(1)
+///checkpoint record stored in the first or the second stripe of the array
+struct LogVolumeHeader
+{
+    ///must be equal to LOGVOLUMEMAGIC
+    unsigned MagicNumber;
+    ///version of the on-array format
+    unsigned Version;
+    ///size of a logical block. This is equal to the array stripe unit size
+    unsigned BlockSize;
+    ///payload stripe size the volume was formatted with
+    unsigned StripeSize;
+    ///the number of stripes in a segment
+    unsigned SegmentStripes;
+    ///the number of segments
+    unsigned NumOfSegments;
+    ///the number of logical blocks exposed by the volume
+    unsigned long long NumOfBlocks;
+    ///the number of stripes occupied by one copy of the mapping table
+    unsigned long long MapStripes;
+    ///all segments with smaller sequence numbers are reflected in the mapping table
+    unsigned long long Sequence;
+    ///the copy of the mapping table written by this checkpoint (0 or 1)
+    unsigned MapCopy;
+    ///CRC32 of the mapping table
+    unsigned MapChecksum;
+    ///CRC32 of all preceding fields
+    unsigned Checksum;
+};
+
+///the first blocks of each segment describe the data blocks stored in it
+struct LogSegmentSummary
+{
+    ///must be equal to LOGSEGMENTMAGIC
+    unsigned MagicNumber;
+    ///the number of data blocks written to the segment
+    unsigned NumOfBlocks;
+    ///sequence number of the segment
+    unsigned long long Sequence;
+    ///CRC32 of the data blocks
+    unsigned DataChecksum;
+    ///CRC32 of the summary, including the list of logical block numbers following it, computed with this field set to 0
+    unsigned Checksum;
+};
+#pragma pack(pop)
+
+///Log-structured volume on top of a disk array.
+///The logical blocks are not updated in place. Instead, they are appended to a segment buffer,
+///which is written to the array as a sequence of full stripes as soon as it is filled, so that
+///the array never needs read-modify-write parity updates. A mapping table gives the current
+///location of each logical block. It is written to the array at checkpoints, and the segments
+///written after the last checkpoint are rolled forward on open using their summaries.
+///A background cleaner relocates the live blocks of mostly obsolete segments, so that their space can be reused.
+///The writes become persistent when the segment containing them is written, or when Sync() is called.
+///All public methods may be called concurrently
+class CLogVolume
+{
+    ///segment states
+    enum eSegmentStates
+    {
+        ///the segment may be reused
+        lsFree,
+        ///data is being appended to the segment buffer
+        lsOpen,
+        ///the segment has been written and may contain live blocks
+        lsUsed,
+        ///all live blocks of the segment have been relocated. It becomes free at the next checkpoint
+        lsCleaned
+    };
+    ///the underlying array
+    CDiskArray& m_Array;
+    ///logical block size
+    unsigned m_BlockSize;
+    ///size of one payload stripe
+    unsigned m_StripeSize;
+    ///the latest checkpoint record
+    LogVolumeHeader m_Header;
+    ///true if the volume has been successfully opened or formatted
+    bool m_Loaded;
+    ///true if the volume may be updated
+    bool m_Writable;
+    ///the number of blocks in a segment
+    unsigned m_SegmentBlocks;
+    ///the number of blocks at the beginning of each segment occupied by the summary
+    unsigned m_SummaryBlocks;
+    ///the first stripe of the segment area
+    unsigned long long m_SegmentStart;
+    ///physical location of each logical block, counted in blocks from the start of the segment area,
+    ///or LOGUNMAPPED. The buffer is padded to MapStripes stripes, so that it can be written as is
+    unsigned* m_pMap;
+    ///the number of live blocks in each segment
+    unsigned* m_pLiveBlocks;
+    ///the number of readers accessing each segment. A segment cannot be reused while it is being read
+    unsigned* m_pReaders;
+    ///eSegmentStates value for each segment
+    unsigned char* m_pSegmentState;
+    ///the number of free segments
+    unsigned m_NumOfFreeSegments;
+    ///the number of cleaned segments waiting for a checkpoint
+    unsigned m_NumOfCleanedSegments;
+    ///the next segment to be inspected by the allocator
+    unsigned m_NextSegment;
+    ///the segment being filled, or LOGUNMAPPED
+    unsigned m_OpenSegment;
+    ///the number of data blocks appended to the open segment
+    unsigned m_OpenBlocks;
+    ///buffer of the open segment: the summary followed by the data blocks
+    unsigned char* m_pSegmentBuffer;
+    ///sequence number to be assigned to the next segment
+    unsigned long long m_NextSequence;
+    ///the number of segments written since the last checkpoint
+    unsigned m_SegmentsSinceCheckpoint;
+    ///statistics: the number of segments written, cleaned, and blocks relocated by the cleaner
+    unsigned long long m_SegmentsWritten,m_SegmentsCleaned,m_BlocksRelocated;
+    ///true if an array write has failed, so that the volume cannot be updated any more
+    bool m_Failed;
+    ///true if the cleaner should terminate
+    bool m_Stop;
+    ///true if the cleaner thread is running
+    bool m_Running;
+    ///the background cleaner
+    tThread m_Cleaner;
+    ///protects all the above data
+    tCriticalSection m_Lock;
+    ///signalled when the number of free segments drops below the threshold or the cleaner must terminate
+    tCondVariable m_CleanSig;
+    ///signalled when some space is released by the cleaner
+    tCondVariable m_SpaceSig;
+
+    ///allocate the in-memory structures for the geometry given by m_Header
+    void AllocateTables();
+    ///release the in-memory structures
+    void ReleaseTables();
+    ///@return offset of a physical block within the array
+    unsigned long long GetBlockOffset(unsigned PhysicalBlock)const
+    {
+        unsigned Segment=PhysicalBlock/m_SegmentBlocks;
+        return (m_SegmentStart+(unsigned long long)Segment*m_Header.SegmentStripes)*m_StripeSize+
+                (unsigned long long)(PhysicalBlock%m_SegmentBlocks)*m_BlockSize;
+    };
+    ///@return the list of logical block numbers stored in the summary of a segment buffer
+    unsigned* GetSummaryEntries(unsigned char* pSegment)const
+    {
+        return (unsigned*)(pSegment+sizeof(LogSegmentSummary));
+    };
+    ///read one logical block. Must be called with m_Lock held
+    ///@return true on success
+    bool ReadBlock(unsigned long long LogicalBlock,///the block to be read
+                   unsigned char* pDest ///destination buffer
+                  );
+    ///append a logical block to the open segment, writing it to the array and opening a new one if needed.
+    ///Must be called with m_Lock held
+    ///@return true on success
+    bool AppendBlock(unsigned long long LogicalBlock,///the block being written
+                     const unsigned char* pData,///its content
+                     bool Cleaner ///true if called by the cleaner, which may use the reserved segments
+                    );
+    ///find a free segment and make it open. Must be called with m_Lock held
+    ///@return true on success
+    bool OpenSegment(bool Cleaner ///true if called by the cleaner, which may use the reserved segments
+                    );
+    ///write the open segment to the array. Must be called with m_Lock held
+    ///@return true on success
+    bool SealSegment();
+    ///write the mapping table and the checkpoint record. The open segment must be sealed. Must be called with m_Lock held
+    ///@return true on success
+    bool WriteCheckpoint();
+    ///relocate the live blocks of the segment with the smallest number of them. Must be called with m_Lock held
+    ///@return true if some segment was cleaned
+    bool CleanSegment(unsigned char* pBuffer ///buffer for the segment data
+                     );
+    ///read the segments written after the checkpoint and apply their summaries to the mapping table
+    ///@return true on success
+    bool RollForward();
+    ///load the checkpoint record from a given stripe
+    ///@return true if a valid record was found
+    bool LoadHeader(unsigned Slot,///the stripe to be inspected
+                    LogVolumeHeader& H ///output record
+                   );
+    ///load the mapping table written by a checkpoint
+    ///@return true on success
+    bool LoadMap(const LogVolumeHeader& H ///checkpoint record
+                );
+    ///start the cleaner thread
+    void StartCleaner();
+    ///terminate the cleaner thread
+    void StopCleaner();
+    ///compact the segments in background
+    static THREADPROC CleanerThread(void* pParams ///must be a pointer to CLogVolume
+                                   );
+public:
+    ///attach to the array. The array must be mounted before Format() or Open() is called
+    CLogVolume(CDiskArray& A);
+    ///the volume is closed if needed
+    ~CLogVolume();
+    ///create an empty volume. The array must be write-mounted
+    ///@return true on success
+    bool Format(unsigned SegmentStripes,///the number of stripes in a segment
+                unsigned Utilization ///the percentage of the segment space exposed as logical blocks
+               );
+    ///load the latest checkpoint and roll forward the segments written after it.
+    ///If write access is requested, a new checkpoint is made, and the cleaner is started
+    ///@return true on success
+    bool Open(bool Write ///true if the volume is going to be updated. The array must be write-mounted
+             );
+    ///write the open segment and a checkpoint, and stop the cleaner
+    ///@return true on success
+    bool Close();
+    ///make all completed writes persistent
+    ///@return true on success
+    bool Sync();
+    ///@return volume capacity in bytes
+    unsigned long long GetCapacity()const
+    {
+        return m_Header.NumOfBlocks*m_BlockSize;
+    };
+    ///@return logical block size
+    unsigned GetBlockSize()const
+    {
+        return m_BlockSize;
+    };
+    ///read data from the volume
+    ///@return the number of bytes read, or -1 in case of error
+    long long read(unsigned long long Offset,///volume offset
+                   long long Size,///the number of bytes to be read
+                   unsigned char* pDest ///destination buffer
+                  );
+    ///write data to the volume
+    ///@return the number of bytes written, or -1 in case of error
+    long long write(unsigned long long Offset,///volume offset
+                    long long Size,///the number of bytes to be written
+                    const unsigned char* pSrc ///source buffer
+                   );
+    ///obtain the cleaner statistics
+    void GetStatistics(unsigned long long& SegmentsWritten,///the number of segments written to the array
+                       unsigned long long& SegmentsCleaned,///the number of segments compacted by the cleaner
+                       unsigned long long& BlocksRelocated ///the number of live blocks moved by the cleaner
+                      );
+};
+
+#endif
@@ -0,0 +1,33 @@
+/*********************************************************
+ * lz.h  - header file for a fast LZ77 compressor
+ *
+ * Copyright(C) 2012 Saint-Petersburg State Polytechnic University
+ *
+ * Developed in the framework of the "Forward error correction for next generation storage systems" project
+ *
+ * Author: P. Trifonov petert@dcn.ftk.spbstu.ru
+ * ********************************************************/
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+
+///compress a data block. The compressed data is a sequence of records, each of them consisting of a token with the 4-bit
+///literal run and match lengths, the literals, a 16-bit match offset and the length extensions. The last record has no match.
+///The matches are found via a hash table of 4-byte prefixes, so the compression is fast, but the ratio is moderate
+///@return the size of the compressed data, or 0 if it does not fit into the destination buffer
+size_t LZCompress(const void* pSrc,///the data to be compressed
+                  size_t SrcSize,///data size in bytes
+                  void* pDest,///destination buffer
+                  size_t DestCapacity ///size of the destination buffer
+                 );
+///decompress a data block produced by LZCompress(). The compressed data is validated, so the corrupted data cannot cause
+///accesses beyond the buffers
+///@return the size of the decompressed data, or (size_t)-1 if the compressed data is invalid or does not fit into the destination buffer
+size_t LZDecompress(const void* pSrc,///the compressed data
+                    size_t SrcSize,///size of the compressed data in bytes
+                    void* pDest,///destination buffer
+                    size_t DestCapacity ///size of the destination buffer
+                   );
+
+#endif
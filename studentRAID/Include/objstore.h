@@ -0,0 +1,182 @@
+/*********************************************************
+ * objstore.h  - header file for an extent-based object store
+ *
+ * Copyright(C) 2012 Saint-Petersburg State Polytechnic University
+ *
+ * Developed in the framework of the "Forward error correction for next generation storage systems" project
+ *
+ * Author: P. Trifonov petert@dcn.ftk.spbstu.ru
+ * ********************************************************/
+#ifndef OBJSTORE_H
+#define OBJSTORE_H
+
+#include <map>
+#include <string>
+#include "array.h"
+#include "sync.h"
+
+///maximal length of an object key (including the terminating zero)
+#define OBJECTKEYSIZE 64
+///maximal number of extents an object may consist of
+#define MAXOBJECTEXTENTS 3
+
+///avoid padding of on-array structures
+#pragma pack(push)
+#pragma pack(1)
+///a contiguous range of stripes
+struct ObjectExtent
+{
+    ///the first stripe of the extent
+    unsigned long long Start;
+    ///the number of stripes in the extent
+    unsigned long long Length;
+};
+
+///an entry of the on-array object index
+struct ObjectRecord
+{
+    ///zero-terminated object name. Empty key denotes a free entry
+    char Key[OBJECTKEYSIZE];
+    ///object size in bytes
+    unsigned long long Size;
+    ///CRC32 of the object payload
+    unsigned CRC32;
+    ///the number of valid entries in Extents
+    unsigned NumOfExtents;
+    ///stripe ranges occupied by the object
+    ObjectExtent Extents[MAXOBJECTEXTENTS];
+    ///sequence number of the record. If several records have the same key, the latest one is valid
+    unsigned Generation;
+    ///reserved for future use, must be zero
+    unsigned char Reserved[4];
+    ///CRC32 of all preceding fields
+    unsigned Checksum;
+};
+
+///the first stripe of the array identifies the object store layout
+struct ObjectStoreHeader
+{
+    ///must be equal to OBJSTOREMAGIC
+    unsigned MagicNumber;
+    ///version of the on-array format
+    unsigned Version;
+    ///payload stripe size the store was formatted with
+    unsigned StripeSize;
+    ///the number of entries in the object index
+    unsigned MaxObjects;
+    ///the first stripe of the object index
+    unsigned long long IndexStart;
+    ///the number of stripes occupied by the object index
+    unsigned long long IndexStripes;
+    ///the total number of stripes managed by the store
+    unsigned long long NumOfStripes;
+    ///CRC32 of all preceding fields
+    unsigned Checksum;
+};
+#pragma pack(pop)
+
+///callback used to enumerate stored objects
+typedef void (*tObjectCallback)(const char* pKey,///object name
+                                unsigned long long Size,///object size in bytes
+                                void* pContext ///user data passed to Enumerate()
+                               );
+
+///Stores many named objects in a disk array.
+///Each object occupies up to MAXOBJECTEXTENTS stripe-aligned extents, so that
+///the bulk of the object data is always written as full stripes.
+///The object index is kept in a fixed-size table at the beginning of the array.
+///All public methods may be called concurrently
+class CObjectStore
+{
+    ///the underlying array
+    CDiskArray& m_Array;
+    ///size of one payload stripe
+    unsigned m_StripeSize;
+    ///the on-array header
+    ObjectStoreHeader m_Header;
+    ///true if the store has been successfully loaded or formatted
+    bool m_Loaded;
+    ///in-memory copy of the object index
+    ObjectRecord* m_pIndex;
+    ///the number of threads accessing each index entry
+    unsigned* m_pReaders;
+    ///true for the index entries whose extents must be released as soon as the last reader leaves
+    bool* m_pRetired;
+    ///maps object names onto index entries
+    std::map<std::string,unsigned> m_Names;
+    ///free stripe ranges (start -> length)
+    std::map<unsigned long long,unsigned long long> m_FreeExtents;
+    ///unused index entries
+    unsigned* m_pFreeEntries;
+    ///the number of unused index entries
+    unsigned m_NumOfFreeEntries;
+    ///sequence number to be assigned to the next record
+    unsigned m_NextGeneration;
+    ///protects all in-memory structures
+    tCriticalSection m_Lock;
+
+    ///allocate the in-memory structures for a given index size
+    void AllocateIndex(unsigned MaxObjects);
+    ///release the in-memory structures
+    void ReleaseIndex();
+    ///return a stripe range to the free pool, merging it with the adjacent ones
+    void FreeExtent(unsigned long long Start,unsigned long long Length);
+    ///remove a stripe range from the free pool
+    void ReserveExtent(unsigned long long Start,unsigned long long Length);
+    ///allocate space for a given number of stripes. Must be called with m_Lock held
+    ///@return the number of extents allocated, 0 if there is no space
+    unsigned AllocateExtents(unsigned long long Stripes2Allocate,///the requested size in stripes
+                             ObjectExtent* pExtents ///output array of MAXOBJECTEXTENTS entries
+                            );
+    ///release the extents of an index entry. Must be called with m_Lock held
+    void ReleaseExtents(const ObjectRecord& R);
+    ///release a reference to an index entry obtained while m_Lock was held.
+    ///If the entry was retired and this was the last reference, its space is released. Must be called with m_Lock held
+    void Unpin(unsigned EntryID);
+    ///write an index entry to the array
+    ///@return true on success
+    bool WriteRecord(unsigned EntryID,///position of the entry within the index
+                     const ObjectRecord& R ///the record to be written
+                    );
+    ///transfer object data between the array and memory
+    ///@return true on success
+    bool TransferData(const ObjectRecord& R,///object descriptor
+                      unsigned char* pData,///data buffer
+                      unsigned long long Size,///the number of bytes to transfer
+                      bool Write ///true if the data should be written to the array
+                     );
+public:
+    ///attach to the array. The array must be mounted before Format() or Load() is called
+    CObjectStore(CDiskArray& A);
+    ~CObjectStore();
+    ///create an empty object store. The array must be write-mounted
+    ///@return true on success
+    bool Format(unsigned MaxObjects ///the number of index entries
+               );
+    ///load the object index from the array
+    ///@return true on success
+    bool Load();
+    ///store an object, replacing the existing one with the same name
+    ///@return true on success
+    bool Put(const char* pKey,///object name
+             const unsigned char* pData,///object data
+             unsigned long long Size ///object size
+            );
+    ///@return the size of an object, or -1 if it does not exist
+    long long GetSize(const char* pKey);
+    ///read an object
+    ///@return the object size, or -1 if the object does not exist, does not fit into the buffer or cannot be read
+    long long Get(const char* pKey,///object name
+                  unsigned char* pDest,///destination buffer
+                  unsigned long long BufferSize ///size of the destination buffer
+                 );
+    ///delete an object
+    ///@return true if the object existed
+    bool Delete(const char* pKey);
+    ///call the specified function for each stored object
+    void Enumerate(tObjectCallback pCallback,void* pContext);
+    ///@return the number of free stripes
+    unsigned long long GetFreeStripes();
+};
+
+#endif
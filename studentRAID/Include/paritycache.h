@@ -0,0 +1,91 @@
+/*********************************************************
+ * paritycache.h  - header file for the check symbol cache of the RAID emulator
+ *
+ * Copyright(C) 2012 Saint-Petersburg State Polytechnic University
+ *
+ * Developed in the framework of the "Forward error correction for next generation storage systems" project
+ *
+ * Author: P. Trifonov petert@dcn.ftk.spbstu.ru
+ * ********************************************************/
+#ifndef PARITYCACHE_H
+#define PARITYCACHE_H
+
+#include <map>
+#include "sync.h"
+
+///In-memory cache of the check symbols of the recently updated stripes.
+///The read-modify-write of the check symbols by the small writes fetches them from the cache, so that the back-to-back
+///updates of a hot stripe do not read them from the disks. The cache is write-through: the check symbols are written
+///to the disks as before, and the cached copies are replaced by the written data, so that no update is lost on a crash.
+///Each entry is accessed only by the threads holding the lock of the corresponding stripe, or m_MapLock of the array
+///for the hash and map stripes
+class CParityCache
+{
+    ///size of a check symbol in bytes
+    unsigned m_SymbolSize;
+    ///the number of check symbols in a stripe
+    unsigned m_CheckSymbols;
+    ///the number of subarrays. Stripe S of subarray j is identified as segment S*m_NumOfSubarrays+j
+    unsigned m_NumOfSubarrays;
+    ///the number of segments
+    unsigned long long m_NumOfSegments;
+    ///the number of cache lines. Each of them keeps the check symbols of a segment
+    size_t m_NumOfLines;
+    ///the line keeping each cached segment. Only the cached segments are present, so that its size is limited by the capacity
+    std::map<unsigned long long,size_t> m_Lines;
+    ///the segment kept in each line plus one, or 0 if the line is free
+    unsigned long long* m_pSegments;
+    ///nonzero for the check symbols of each line, which are equal to the ones stored on the disks
+    unsigned char* m_pValid;
+    ///nonzero for the lines accessed since the CLOCK hand passed them
+    unsigned char* m_pReferenced;
+    ///the line to be inspected next by the CLOCK replacement
+    size_t m_Hand;
+    ///the cached check symbols
+    unsigned char* m_pData;
+    ///the number of check symbols found in the cache
+    unsigned long long m_Hits;
+    ///the number of check symbols read from the disks
+    unsigned long long m_Misses;
+    ///protects all the above data
+    tCriticalSection m_Lock;
+
+    ///find a line for a segment being inserted, evicting the one not referenced recently. Must be called with m_Lock held
+    ///@return the line
+    size_t AllocateLine(unsigned long long Segment ///the segment to be cached
+                         );
+public:
+    ///allocate the cache lines
+    CParityCache(unsigned long long NumOfStripes,///the number of stripes in each subarray
+                 unsigned NumOfSubarrays,///the number of subarrays
+                 unsigned CheckSymbols,///the number of check symbols in a stripe
+                 unsigned SymbolSize,///size of a check symbol in bytes
+                 size_t Capacity ///cache capacity in bytes
+                );
+    ~CParityCache();
+    ///get a check symbol of a stripe
+    ///@return true if it was found in the cache
+    bool Read(unsigned long long StripeID,///the stripe
+              unsigned SubarrayID,///identifies the subarray
+              unsigned CheckID,///the check symbol, starting from 0
+              void* pDest ///destination buffer of m_SymbolSize bytes
+             );
+    ///replace the cached copy of a check symbol with the data read from or written to the disk
+    void Store(unsigned long long StripeID,///the stripe
+               unsigned SubarrayID,///identifies the subarray
+               unsigned CheckID,///the check symbol, starting from 0
+               const void* pSrc,///the current value of the symbol
+               bool Insert ///true if the stripe must be cached. Otherwise, only the existing line is updated
+              );
+    ///forget the cached copies of the check symbols of a stripe, since they are not known to be equal to the ones on the disks
+    void Invalidate(unsigned long long StripeID,///the stripe
+                    unsigned SubarrayID,///identifies the subarray
+                    int CheckID=-1 ///the check symbol, or -1 if all of them are stale
+                   );
+    ///forget all lines
+    void Reset();
+    ///print the hit statistics collected since the last call, if any
+    void ReportStatistics();
+};
+
+#endif
@@ -0,0 +1,149 @@
+/*********************************************************
+ * paritylog.h  - header file for the parity log of the RAID emulator
+ *
+ * Copyright(C) 2012 Saint-Petersburg State Polytechnic University
+ *
+ * Developed in the framework of the "Forward error correction for next generation storage systems" project
+ *
+ * Author: P. Trifonov petert@dcn.ftk.spbstu.ru
+ * ********************************************************/
+#ifndef PARITYLOG_H
+#define PARITYLOG_H
+
+#include <vector>
+#include <map>
+#include "disk.h"
+#include "sync.h"
+
+class CDiskArray;
+
+///Parity log of a disk array.
+///A small write updates the payload symbols in place, but instead of the read-modify-write of the check symbols,
+///the difference between their new and old values is appended to a sequential log, and accumulated in memory.
+///A background thread applies the accumulated differences to the check symbols in large batches, once a quarter of the log is used.
+///The log must hold the records of the small writes arriving while a batch is applied and flushed, since the writes
+///update the check symbols in place while the log is full. The writers finding the log full during the flush of a batch
+///wait for its checkpoint instead, since no stripe locks are needed by the flush
+///The log device is an emulated disk, which stores a superblock followed by a circular array of records.
+///The record of an update reaches the log before the payload symbols are written, so that the check symbols of the
+///stripes referenced by the records following the last checkpoint can be re-encoded on the next mount
+class CParityLog
+{
+    ///the array the log belongs to
+    CDiskArray& m_Array;
+    ///the log device
+    CDisk m_Device;
+    ///true if the log device was successfully opened and belongs to this array
+    bool m_Valid;
+    ///size of a block. This is equal to the array stripe unit size
+    unsigned m_BlockSize;
+    ///the number of stripe units in the check symbols of a stripe
+    unsigned m_CheckUnits;
+    ///the number of record slots following the superblock. The record with sequence number s is stored in slot s%m_NumOfSlots
+    unsigned long long m_NumOfSlots;
+    ///the number of subarrays. Stripe S of subarray j is identified as segment S*m_NumOfSubarrays+j
+    unsigned m_NumOfSubarrays;
+    ///the sum of the check symbol differences not yet applied for each segment having them. The map is changed under m_Lock,
+    ///and each sum is accessed only by the threads holding the lock of the corresponding stripe
+    std::map<unsigned long long,unsigned char*> m_Deltas;
+    ///the segments, for which the accumulated differences were allocated since the last batch was started
+    std::vector<unsigned long long> m_Pending;
+    ///the record being written. It is used under m_Lock
+    unsigned char* m_pRecord;
+    ///sequence number of the next record
+    unsigned long long m_NextSequence;
+    ///all records with smaller sequence numbers are applied to the check symbols, and this is recorded in the superblock
+    unsigned long long m_CheckpointSequence;
+    ///the number of threads waiting for all records to be applied
+    unsigned m_Drainers;
+    ///true if the log cannot be written or applied any more, so that the check symbols are updated in place
+    bool m_Failed;
+    ///true if the records are being applied by the background thread
+    bool m_Running;
+    ///true if the background thread should terminate
+    bool m_Stop;
+    ///true if the background thread has applied a batch, and is flushing the array and making the checkpoint
+    bool m_Flushing;
+    ///the number of records appended since the log was started
+    unsigned long long m_Appended;
+    ///the number of small writes, which updated the check symbols in place, since the log was full
+    unsigned long long m_Bypassed;
+    ///the number of small writes, which waited for a checkpoint, since the log was full
+    unsigned long long m_Waited;
+    ///the number of batches applied since the log was started
+    unsigned long long m_Batches;
+    ///the number of segments updated by these batches
+    unsigned long long m_AppliedSegments;
+    ///the thread applying the records to the array
+    tThread m_Applier;
+    ///protects all the above data except the sums in m_Deltas
+    tCriticalSection m_Lock;
+    ///signalled when a quarter of the log is used, some thread waits for the records to be applied, or the background thread must terminate
+    tCondVariable m_ApplySig;
+    ///signalled when a checkpoint is made
+    tCondVariable m_CheckpointSig;
+
+    ///write the superblock and flush the log device
+    ///@return true on success
+    bool WriteCheckpoint(unsigned long long Sequence ///sequence number of the oldest record to be replayed
+                        );
+    ///re-encode the stripes referenced by the records following the checkpoint
+    ///@return true on success
+    bool Replay(bool Write ///true if the array is mounted for writing. Otherwise, the stale stripes are only reported
+               );
+    ///apply the accumulated differences of all segments to the array and make a checkpoint
+    static THREADPROC ApplyThread(void* pParams ///must be a pointer to CParityLog
+                                 );
+    ///@return the accumulated differences of a segment, or 0 if there are none. The caller must hold the stripe lock
+    unsigned char* FindDeltas(unsigned long long Segment ///the segment
+                             );
+public:
+    ///open the log device
+    CParityLog(CDiskArray& Array,///the array to be served
+               const char* pFileName,///the name of the file emulating the log device
+               size_t Capacity,///log capacity in bytes
+               unsigned DeviceID ///identifier of the log device. This must be different from the IDs of the array disks
+              );
+    ~CParityLog();
+    ///@return true if the log device is ready for use
+    bool IsValid()const
+    {
+        return m_Valid;
+    };
+    ///create an empty log. It must not be started
+    ///@return true on success
+    bool Init();
+    ///re-encode the stripes updated since the last checkpoint and start the background thread.
+    ///The array disks must be mounted
+    ///@return true on success
+    bool Start(bool Write ///true if the array is mounted for writing
+              );
+    ///apply all records to the array and terminate the background thread
+    ///@return true on success
+    bool Stop();
+    ///write a record and add the check symbol differences to the ones accumulated for the stripe.
+    ///The caller must hold the stripe lock, and no other locks needed to flush the array
+    ///@return true on success, false if the check symbols must be updated in place
+    bool Append(unsigned long long StripeID,///the stripe being updated
+                unsigned SubarrayID,///identifies the subarray
+                const unsigned char* pDelta ///the differences between the new and old values of the check symbols
+               );
+    ///add the accumulated differences to the check symbols of a stripe. The caller must hold the stripe lock
+    ///@return true on success
+    bool Apply(unsigned long long StripeID,///the stripe
+               unsigned SubarrayID,///identifies the subarray
+               size_t ThreadID ///the scratch arena of a calling thread obtained from CDiskArray::LockStripes()
+              );
+    ///discard the accumulated differences of a stripe, since its check symbols are re-encoded. The caller must hold the stripe lock
+    void Drop(unsigned long long StripeID,///the stripe
+              unsigned SubarrayID ///identifies the subarray
+             );
+    ///wait for all appended records to be applied to the array
+    ///@return true on success
+    bool Drain();
+    ///flush the log device
+    ///@return true on success
+    bool FlushDevice();
+};
+
+#endif
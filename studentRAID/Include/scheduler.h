@@ -0,0 +1,126 @@
+/*********************************************************
+ * scheduler.h  - header file for the I/O request scheduler of a disk array
+ *
+ * Copyright(C) 2012 Saint-Petersburg State Polytechnic University
+ *
+ * Developed in the framework of the "Forward error correction for next generation storage systems" project
+ *
+ * Author: P. Trifonov petert@dcn.ftk.spbstu.ru
+ * ********************************************************/
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <set>
+#include <utility>
+#include "sync.h"
+
+///I/O request classes
+enum eIOClasses
+{
+    ///latency-sensitive client reads
+    iocRead,
+    ///client writes
+    iocWrite,
+    ///maintenance work, such as rebuild or cleaning
+    iocBackground,
+    iocEnd
+};
+
+///the number of buckets in the latency histograms. Bucket i contains latencies below 2^((i+1)/4) microseconds
+#define QOSHISTOGRAMSIZE 128
+///the background request rate is reconsidered with this period (sec)
+#define QOSADJUSTPERIOD 0.05
+///the smallest background request rate (requests/sec), so that the maintenance work makes progress under any load
+#define QOSMINBACKGROUNDRATE 20.0
+
+///QoS configuration of a disk array
+struct QoSParams
+{
+    ///the maximal number of requests dispatched to the disks concurrently, or 0 if not limited
+    unsigned Depth;
+    ///the waiting requests are dispatched in the order of their deadlines, obtained by adding these values (sec) to their arrival times
+    double Deadlines[iocEnd];
+    ///99th percentile of client request latency (sec) which should not be exceeded, or 0 if background requests should not be throttled
+    double LatencyTarget;
+    ///the maximal number of background requests per second, or 0 if not limited
+    double BackgroundRate;
+    QoSParams():Depth(0),LatencyTarget(0),BackgroundRate(0)
+    {
+        Deadlines[iocRead]=0.01;
+        Deadlines[iocWrite]=0.05;
+        Deadlines[iocBackground]=1;
+    };
+};
+
+///Admission control for the requests issued to a disk array.
+///If the number of dispatched requests is limited, the waiting ones are served earliest deadline first,
+///so that the client reads overtake the writes and the background work.
+///The background requests are paced by a token rate, which is halved whenever the 99th percentile
+///of client latency observed within the last QOSADJUSTPERIOD exceeds the target, and is gradually
+///increased while it does not.
+///All public methods may be called concurrently
+class CIOScheduler
+{
+    ///the configuration
+    QoSParams m_Params;
+    ///current background request rate, or 0 if they are not paced
+    double m_BackgroundRate;
+    ///the earliest time the next background request may be dispatched
+    double m_NextBackground;
+    ///the number of dispatched requests
+    unsigned m_InFlight;
+    ///waiting requests ordered by their deadlines. The second element makes the entries unique
+    std::set<std::pair<double,unsigned long long> > m_Queue;
+    ///ticket to be assigned to the next waiting request
+    unsigned long long m_NextTicket;
+    ///latency histograms of each class since the last Configure() call
+    unsigned long long m_Histogram[iocEnd][QOSHISTOGRAMSIZE];
+    ///latency histogram of the client requests completed within the current adjustment period
+    unsigned m_WindowHistogram[QOSHISTOGRAMSIZE];
+    ///the number of client requests completed within the current adjustment period
+    unsigned m_WindowRequests;
+    ///the number of background requests completed within the current adjustment period
+    unsigned m_WindowBackground;
+    ///start of the current adjustment period
+    double m_WindowStart;
+    ///the number of times the background requests were throttled
+    unsigned long long m_Throttled;
+    ///protects all the above data
+    tCriticalSection m_Lock;
+    ///signalled when a request completes or the background rate changes
+    tCondVariable m_DispatchSig;
+
+    ///@return histogram bucket for a given latency
+    static unsigned GetBucket(double Latency ///latency (sec)
+                             );
+    ///@return the upper bound of the latencies counted in a bucket (sec)
+    static double GetBucketBound(unsigned Bucket);
+    ///@return 99th percentile of the latencies in a histogram (sec)
+    template<class T> static double GetPercentile(const T* pHistogram ///the histogram
+                                                 );
+    ///reconsider the background rate if the adjustment period has expired. Must be called with m_Lock held
+    void Adjust(double Now ///current time
+               );
+public:
+    CIOScheduler();
+    ~CIOScheduler();
+    ///set the scheduling policy and reset the statistics. There may be no requests in progress
+    void Configure(const QoSParams& Params ///the new configuration
+                  );
+    ///wait until a request can be dispatched
+    ///@return the arrival time of the request, which must be passed to End()
+    double Begin(eIOClasses Class ///the request class
+                );
+    ///report request completion
+    void End(eIOClasses Class,///the request class
+             double ArrivalTime ///the value returned by Begin()
+            );
+    ///obtain the statistics of a request class since the last Configure() call
+    void GetStatistics(eIOClasses Class,///the request class
+                       unsigned long long& Requests,///the number of completed requests
+                       double& Latency99,///99th percentile of request latency (sec)
+                       unsigned long long& Throttled ///the number of times the background requests were throttled
+                      );
+};
+
+#endif
@@ -0,0 +1,73 @@
+/*********************************************************
+ * scratch.h  - header file for a pool of scratch memory arenas
+ *
+ * Copyright(C) 2012 Saint-Petersburg State Polytechnic University
+ *
+ * Developed in the framework of the "Forward error correction for next generation storage systems" project
+ *
+ * Author: P. Trifonov petert@dcn.ftk.spbstu.ru
+ * ********************************************************/
+#ifndef SCRATCH_H
+#define SCRATCH_H
+
+#include <stddef.h>
+#include <vector>
+#include "sync.h"
+
+///the arenas are aligned and padded to this boundary, so that the threads using adjacent arenas do not share cache lines
+#define CACHELINESIZE 64
+
+///Pool of equally sized scratch memory arenas.
+///A thread acquires an arena for the duration of a request and identifies it by an integer ID.
+///The pool grows on demand, so the number of concurrent requests is not limited.
+///The arenas are never moved or deallocated before the pool is reset, and their memory
+///is zeroed on allocation
+class CScratchPool
+{
+    ///size of each arena, rounded up to CACHELINESIZE
+    size_t m_ArenaSize;
+    ///arena addresses indexed by ID. The table is replaced by a larger copy when the pool grows,
+    ///so that it can be read without locking
+    unsigned char** volatile m_ppArenas;
+    ///the number of entries in m_ppArenas
+    size_t m_Capacity;
+    ///the number of allocated arenas
+    size_t m_NumOfArenas;
+    ///a stack of unused arena IDs
+    size_t* m_pFreeArenas;
+    ///the number of unused arenas
+    size_t m_NumOfFreeArenas;
+    ///memory blocks containing the arenas
+    std::vector<unsigned char*> m_Blocks;
+    ///the replaced address tables. They may be still accessed by the threads, which have read m_ppArenas earlier
+    std::vector<unsigned char**> m_RetiredTables;
+    ///protects all the above data
+    tCriticalSection m_Lock;
+
+    ///allocate new arenas. Must be called with m_Lock held
+    void Grow(size_t NumOfArenas ///the number of arenas to be added
+             );
+    ///deallocate all arenas
+    void Clear();
+public:
+    CScratchPool();
+    ~CScratchPool();
+    ///deallocate the existing arenas and allocate new ones. This may not be called concurrently with other methods
+    void Reset(size_t ArenaSize,///the number of bytes needed by a request
+               size_t NumOfArenas ///the number of arenas to be preallocated
+              );
+    ///obtain an unused arena, allocating more of them if needed
+    ///@return arena ID
+    size_t Acquire();
+    ///return the arena to the pool
+    void Release(size_t ArenaID ///the value returned by Acquire()
+                );
+    ///@return the address of an arena
+    unsigned char* Get(size_t ArenaID ///the value returned by Acquire()
+                      )const
+    {
+        return m_ppArenas[ArenaID];
+    };
+};
+
+#endif
@@ -15,9 +15,14 @@
 
 //requires at least Windows Vista or Windows Server 2008
 #include <Windows.h>
+#include <process.h>
 
 typedef CRITICAL_SECTION tCriticalSection;
 typedef CONDITION_VARIABLE  tCondVariable;
+typedef HANDLE tThread;
+///the thread function declaration, e.g. THREADPROC MyThread(void* pParams)
+#define THREADPROC unsigned __stdcall
+typedef unsigned (__stdcall *tThreadFunction)(void*);
 
 ///initialize a critical section object
 inline bool InitCS(tCriticalSection& CS)
@@ -64,6 +69,23 @@ inline bool CondWait(tCondVariable& C, tCriticalSection &M)
 	SleepConditionVariableCS(&C, &M, INFINITE);
 	return true;
 }
+///atomically release the critical section, wait for the condition to be signalled or the timeout to expire,
+///and take back the CS
+inline bool CondTimedWait(tCondVariable& C, tCriticalSection &M, unsigned Milliseconds)
+{
+	return SleepConditionVariableCS(&C, &M, Milliseconds)!=0;
+}
+///atomically release the critical section, wait for the condition to be signalled or the timeout given in microseconds to expire,
+///and reacquire the critical section. The waits shorter than a millisecond only yield the processor, so the caller must check the time
+inline bool CondTimedWaitMicroseconds(tCondVariable& C, tCriticalSection &M, unsigned Microseconds)
+{
+	if (Microseconds>=1000)
+		return SleepConditionVariableCS(&C, &M, Microseconds/1000)!=0;
+	LeaveCriticalSection(&M);
+	SwitchToThread();
+	EnterCriticalSection(&M);
+	return false;
+}
 ///atomically wake everyone waiting for the condition
 inline bool CondWakeAll(tCondVariable& C)
 {
@@ -77,11 +99,51 @@ inline bool CondWake(tCondVariable& C)
 	return true;
 };
 
+///spawn a thread
+inline bool StartThread(tThread& T, tThreadFunction pFunction, void* pParams)
+{
+	T=(HANDLE) _beginthreadex(NULL,0,pFunction,pParams,0,0);
+	return T!=0;
+};
+///wait for the thread to terminate
+inline bool JoinThread(tThread& T)
+{
+	WaitForSingleObject(T,INFINITE);
+	return CloseHandle(T)!=0;
+};
+///make sure that all memory operations issued before this call complete before any subsequent ones
+inline void FullBarrier()
+{
+	MemoryBarrier();
+};
+///atomically add a value to a variable. This is a full memory barrier
+///@return the new value of the variable
+inline long AtomicAdd(volatile long& x, long Delta)
+{
+	return InterlockedExchangeAdd(&x,Delta)+Delta;
+};
+///@return monotonic time in seconds
+inline double GetClock()
+{
+	static LARGE_INTEGER Frequency={0};
+	if (!Frequency.QuadPart)
+		QueryPerformanceFrequency(&Frequency);
+	LARGE_INTEGER Counter;
+	QueryPerformanceCounter(&Counter);
+	return double(Counter.QuadPart)/Frequency.QuadPart;
+};
+
 
 #else 
 #include <pthread.h>
+#include <sched.h>
+#include <time.h>
 typedef pthread_cond_t tCondVariable;
 typedef pthread_mutex_t tCriticalSection;
+typedef pthread_t tThread;
+///the thread function declaration, e.g. THREADPROC MyThread(void* pParams)
+#define THREADPROC void*
+typedef void* (*tThreadFunction)(void*);
 
 ///initialize a critical section object
 inline bool InitCS(tCriticalSection& CS)
@@ -122,6 +184,37 @@ inline bool CondWait(tCondVariable& C, tCriticalSection &M)
 	return pthread_cond_wait(&C, &M)==0;
 }
 
+///atomically release the critical section, wait for the condition to be signalled or the timeout to expire,
+///and take back the CS
+inline bool CondTimedWait(tCondVariable& C, tCriticalSection &M, unsigned Milliseconds)
+{
+	timespec T;
+	clock_gettime(CLOCK_REALTIME, &T);
+	T.tv_sec+=Milliseconds/1000;
+	T.tv_nsec+=(Milliseconds%1000)*1000000L;
+	if (T.tv_nsec>=1000000000L)
+	{
+		T.tv_sec++;
+		T.tv_nsec-=1000000000L;
+	};
+	return pthread_cond_timedwait(&C, &M, &T)==0;
+}
+///atomically release the critical section, wait for the condition to be signalled or the timeout given in microseconds to expire,
+///and reacquire the critical section
+inline bool CondTimedWaitMicroseconds(tCondVariable& C, tCriticalSection &M, unsigned Microseconds)
+{
+	timespec T;
+	clock_gettime(CLOCK_REALTIME, &T);
+	T.tv_sec+=Microseconds/1000000;
+	T.tv_nsec+=(Microseconds%1000000)*1000L;
+	if (T.tv_nsec>=1000000000L)
+	{
+		T.tv_sec++;
+		T.tv_nsec-=1000000000L;
+	};
+	return pthread_cond_timedwait(&C, &M, &T)==0;
+}
+
 
 //release a critical section
 inline bool UnlockCS(tCriticalSection& CS)
@@ -140,7 +233,37 @@ inline bool CondWakeAll(tCondVariable& C)
 ///wake a thread waiting for the condition
 inline bool CondWake(tCondVariable& C)
 {
-	pthread_cond_signal(&C)==0;
+	return pthread_cond_signal(&C)==0;
+};
+
+///spawn a thread
+inline bool StartThread(tThread& T, tThreadFunction pFunction, void* pParams)
+{
+	return pthread_create(&T, NULL, pFunction, pParams)==0;
+};
+///wait for the thread to terminate
+inline bool JoinThread(tThread& T)
+{
+	void* Status;
+	return pthread_join(T, &Status)==0;
+};
+///make sure that all memory operations issued before this call complete before any subsequent ones
+inline void FullBarrier()
+{
+	__sync_synchronize();
+};
+///atomically add a value to a variable. This is a full memory barrier
+///@return the new value of the variable
+inline long AtomicAdd(volatile long& x, long Delta)
+{
+	return __sync_add_and_fetch(&x,Delta);
+};
+///@return monotonic time in seconds
+inline double GetClock()
+{
+	timespec T;
+	clock_gettime(CLOCK_MONOTONIC, &T);
+	return T.tv_sec+T.tv_nsec*1E-9;
 };
 
 
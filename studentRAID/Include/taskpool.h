@@ -0,0 +1,73 @@
+/*********************************************************
+ * taskpool.h  - header file for a pool of worker threads
+ *
+ * Copyright(C) 2012 Saint-Petersburg State Polytechnic University
+ *
+ * Developed in the framework of the "Forward error correction for next generation storage systems" project
+ *
+ * Author: P. Trifonov petert@dcn.ftk.spbstu.ru
+ * ********************************************************/
+#ifndef TASKPOOL_H
+#define TASKPOOL_H
+
+#include <stddef.h>
+#include <deque>
+#include "sync.h"
+
+///Pool of threads executing the independent parts of a request concurrently.
+///The calling thread executes a part of the work itself, as well as the tasks
+///not yet taken by the pool threads, so a batch is completed even if all pool threads are busy,
+///and the tasks may submit nested batches
+class CTaskPool
+{
+public:
+    ///the function executing a task
+    typedef void (*tTaskFunction)(void* pParams);
+private:
+    ///a queued task
+    struct Task
+    {
+        ///the function to be called
+        tTaskFunction pFunction;
+        ///its argument
+        void* pParams;
+        ///the number of incomplete tasks of the batch this one belongs to
+        unsigned* pPending;
+    };
+    ///the tasks not yet taken by the pool threads
+    std::deque<Task> m_Queue;
+    ///the pool threads
+    tThread* m_pThreads;
+    ///the number of pool threads
+    unsigned m_NumOfThreads;
+    ///true if the pool threads must terminate
+    bool m_Stop;
+    ///protects all the above data
+    tCriticalSection m_Lock;
+    ///signalled when a task is queued or the pool is stopped
+    tCondVariable m_TaskSig;
+    ///signalled when a task is completed
+    tCondVariable m_DoneSig;
+
+    ///execute the queued tasks until the pool is stopped
+    static THREADPROC WorkerThread(void* pParams ///must be a pointer to CTaskPool
+                                  );
+public:
+    CTaskPool();
+    ~CTaskPool();
+    ///spawn the pool threads. The pool must not be running
+    ///@return the number of threads actually spawned
+    unsigned Start(unsigned NumOfThreads ///the number of threads to be spawned
+                  );
+    ///terminate the pool threads. There may be no batches in progress
+    void Stop();
+    ///execute a batch of tasks concurrently, and wait for all of them to complete. If the pool is not running,
+    ///the tasks are executed sequentially by the calling thread
+    void Run(tTaskFunction pFunction,///the function executing the tasks
+             void* pParams,///the array of task arguments
+             size_t ParamSize,///size of each element of the array
+             unsigned NumOfTasks ///the number of tasks
+            );
+};
+
+#endif
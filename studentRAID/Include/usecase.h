@@ -40,6 +40,39 @@ int ReadFile(CDiskArray& A,///the array to be used
 int Check(CDiskArray& A///the array to be checked
     );
 
+///relocate the data of a failed disk to the distributed spare space
+///@return 0 on success
+int RebuildDisk(CDiskArray& A,///the array to be repaired
+                unsigned DiskID ///the disk to be rebuilt
+               );
+
+///release a range of the array, or fill it with zeroes
+///@return 0 on success
+int DiscardRange(CDiskArray& A,///the array to be used
+                 unsigned long long Offset,///start of the range
+                 unsigned long long Length,///length of the range
+                 bool Zero ///true if the range must be filled with zeroes, otherwise only the whole stripes are discarded
+                );
+
+///copy a range of the array to another position within it
+///@return 0 on success
+int CopyRange(CDiskArray& A,///the array to be used
+              unsigned long long Source,///start of the source range
+              unsigned long long Destination,///start of the destination range
+              unsigned long long Length ///length of the range
+             );
+
+///verify the stripes modified since the last scrub
+///@return 0 on success
+int ScrubArray(CDiskArray& A ///the array to be scrubbed
+              );
+
+///find the stripes which differ in two arrays
+///@return 0 if the arrays are identical
+int CompareArrays(CDiskArray& A,///the first array
+                  CDiskArray& B ///the second array
+                 );
+
 ///run performance benchmarks
 ///@return 0 on success
 int Benchmark(CDiskArray& A, ///the array to be benchmarked
@@ -48,8 +81,103 @@ int Benchmark(CDiskArray& A, ///the array to be benchmarked
                bool Aligned, ///true if the read-write requests should be aligned to BlockSize multiple
                double WriteRatio, ///the fraction of write requests
                unsigned ThreadCount, ///number of threads to spawn
-               unsigned MaxDuration ///maximal benchmark duration (sec)
+               unsigned MaxDuration, ///maximal benchmark duration (sec)
+               const char* pDiskEvents=0 ///comma-separated list of Time:Command disk management events (see DiskCommand()), or 0
+               );
+
+///fill the array, execute a sequence of disk management commands, then check the array and verify its content
+///@return 0 on success
+int DiskEventsVerify(CDiskArray& A, ///the array to be inspected
+                     const char* pCommands ///comma-separated list of disk management commands (see Benchmark())
+                    );
+///fill the array, fail a disk, and replace it while the threads keep reading and verifying the data, then check the array
+///@return 0 on success
+int RepairVerify(CDiskArray& A, ///the array to be inspected
+                 unsigned DiskID, ///the disk to be replaced
+                 const char* pFileName, ///the name of the file emulating the new disk
+                 unsigned ThreadCount ///the number of reading threads
+                );
+///let the threads write random stripe units concurrently, optionally fail a disk, then verify the array content and check it
+///before and after remounting
+///@return 0 on success
+int SmallWriteVerify(CDiskArray& A, ///the array to be inspected
+                     unsigned ThreadCount, ///the number of writing threads
+                     unsigned MaxDuration, ///duration of the writes (sec)
+                     int DiskID = -1 ///the disk to be failed once the writes complete, or -1
+                    );
+///fill the array with a few distinct stripe units, overwrite some of them, then verify the array content and check it
+///before and after remounting
+///@return 0 on success
+int DuplicateVerify(CDiskArray& A, ///the array to be inspected
+                    unsigned Distinct ///the number of distinct stripe units
+                   );
+///let the threads write and read the same range concurrently, and verify that each stripe, and each request
+///if the array does not lock the large requests in windows, is read as written by a single writer
+///@return 0 on success
+int AtomicityVerify(CDiskArray& A, ///the array to be inspected
+                    unsigned RequestStripes, ///the number of stripes in each request
+                    unsigned ThreadCount, ///the number of writers, and of readers, to spawn
+                    unsigned MaxDuration ///test duration (sec)
+                   );
+///measure the random read throughput with and without locking the stripes for increasing numbers of threads
+///@return 0 on success
+int ReadScaling(CDiskArray& A, ///the array to be benchmarked
+                unsigned BlockSize, ///size of the data blocks to be read
+                unsigned ThreadCount, ///the maximal number of threads to spawn
+                unsigned MaxDuration ///duration of each measurement (sec)
                );
+///create an empty object store on the array
+///@return 0 on success
+int FormatObjectStore(CDiskArray& A,///the array to be used
+                      unsigned MaxObjects ///the maximal number of objects
+                     );
+
+///store a file as a named object
+///@return 0 on success
+int PutObject(CDiskArray& A,///the array to be used
+              const char* pKey,///object name
+              const char* pFilename ///the name of the file to be stored
+             );
 
+///extract a named object to a file
+///@return 0 on success
+int GetObject(CDiskArray& A,///the array to be used
+              const char* pKey,///object name
+              const char* pFilename ///the name of the file to be created
+             );
+
+///delete a named object
+///@return 0 on success
+int DeleteObject(CDiskArray& A,///the array to be used
+                 const char* pKey ///object name
+                );
+
+///list the objects stored in the array
+///@return 0 on success
+int ListObjects(CDiskArray& A///the array to be used
+               );
+
+///concurrently put, get and delete objects, verifying their content
+///@return 0 on success
+int ObjectBenchmark(CDiskArray& A, ///the array to be benchmarked
+                    unsigned MaxObjectSize, ///maximal size of the objects
+                    unsigned ThreadCount, ///number of threads to spawn
+                    unsigned MaxDuration ///maximal benchmark duration (sec)
+                   );
+
+///create an empty log-structured volume on the array
+///@return 0 on success
+int FormatLogVolume(CDiskArray& A,///the array to be used
+                    unsigned SegmentStripes,///the number of stripes in a segment
+                    unsigned Utilization ///the percentage of the segment space exposed as logical blocks
+                   );
+
+///issue random writes to the log-structured volume, verifying its content
+///@return 0 on success
+int LogBenchmark(CDiskArray& A, ///the array to be benchmarked
+                 unsigned BlockSize, ///size of the data blocks to be written
+                 unsigned ThreadCount, ///number of threads to spawn
+                 unsigned MaxDuration ///maximal benchmark duration (sec)
+                );
 
 #endif
\ No newline at end of file
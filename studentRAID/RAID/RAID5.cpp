@@ -18,7 +18,7 @@ using namespace std;
 
 ///initialize coding-related parameters
 CRAID5Processor::CRAID5Processor(RAID5Params* P ///the configuration file
-                                ):CRAIDProcessor(P->CodeDimension+1, 1,P,sizeof(*P)),m_pXORBuffer(0)
+                                ):CRAIDProcessor(P->CodeDimension+1, 1,P,sizeof(*P)),m_XORBuffer(0)
 {
     if (m_StripeUnitSize%ARITHMETIC_ALIGNMENT)
         throw Exception("Stripe size must be a multiple of #ARITHMETIC_ALIGNMENT");
@@ -27,7 +27,6 @@ CRAID5Processor::CRAID5Processor(RAID5Params* P ///the configuration file
 
 CRAID5Processor::~CRAID5Processor()
 {
-    AlignedFree(m_pXORBuffer);;
 };
 
 
@@ -39,7 +38,7 @@ bool CRAID5Processor::Attach(CDiskArray* pArray,///the disk array
                             )
 {
 
-    m_pXORBuffer=AlignedMalloc(ConcurrentThreads*m_StripeUnitSize*2);
+    m_XORBuffer=ReserveScratch(2*m_StripeUnitSize);
     return CRAIDProcessor::Attach(pArray,ConcurrentThreads);
 };
 
@@ -71,7 +70,7 @@ bool CRAID5Processor::DecodeDataSymbols(unsigned long long StripeID,///the strip
         unsigned S=GetErasedPosition(ErasureSetID,0);
         unsigned i=(S==0)?1:0;
         unsigned char* pXORBuffer=pDest+(S-SymbolID)*m_StripeUnitSize;
-        unsigned char* pReadBuffer=m_pXORBuffer+(ThreadID*2+1)*m_StripeUnitSize;
+        unsigned char* pReadBuffer=GetScratch(ThreadID)+m_XORBuffer+m_StripeUnitSize;
         //the first symbol can be loaded directly to the buffer
         Result&=ReadStripeUnit(StripeID,ErasureSetID,i,0,1,pXORBuffer);
         if ((i>=SymbolID)&&(i<SymbolID+Symbols2Decode))
@@ -109,7 +108,7 @@ bool CRAID5Processor::EncodeStripe(unsigned long long StripeID,///the stripe to
                                   )
 {
 
-    unsigned char* pXORBuffer=m_pXORBuffer+ThreadID*2*m_StripeUnitSize;
+    unsigned char* pXORBuffer=GetScratch(ThreadID)+m_XORBuffer;
 
     bool Result=true;
     if (!IsErased(ErasureSetID,0))
@@ -160,8 +159,8 @@ bool CRAID5Processor::UpdateInformationSymbols(unsigned long long StripeID,///th
     } else
     {
         //the parity check symbol has to be updated
-        unsigned char* pXORBuffer=m_pXORBuffer+ThreadID*2*m_StripeUnitSize;
-        unsigned char* pReadBuffer=m_pXORBuffer+(ThreadID*2+1)*m_StripeUnitSize;
+        unsigned char* pXORBuffer=GetScratch(ThreadID)+m_XORBuffer;
+        unsigned char* pReadBuffer=GetScratch(ThreadID)+m_XORBuffer+m_StripeUnitSize;
         unsigned S=GetErasedPosition(ErasureSetID,0);
         if ((S>=StripeUnitID)&&(S<StripeUnitID+Units2Update))
         {
@@ -195,7 +194,7 @@ bool CRAID5Processor::UpdateInformationSymbols(unsigned long long StripeID,///th
         {
             //the updated parity check value is given by S'=S +\sum_{i\in U} A_i'
             //load the old parity check symbol
-            Result&=ReadStripeUnit(StripeID,ErasureSetID,m_Dimension,0,1,pXORBuffer);
+            Result&=ReadCheckSymbol(StripeID,ErasureSetID,m_Dimension,pXORBuffer);
             for (unsigned i=0;i<Units2Update;i++)
             {
                 XOR(pXORBuffer,pData+i*m_StripeUnitSize,m_StripeUnitSize);
@@ -210,6 +209,22 @@ bool CRAID5Processor::UpdateInformationSymbols(unsigned long long StripeID,///th
 
 };
 
+/** The difference of the parity symbol is the sum of the differences of the updated symbols
+ */
+bool CRAID5Processor::ComputeCheckDeltas(unsigned /*ErasureSetID*/,///identifies the load balancing offset
+        unsigned /*StripeUnitID*/,///the first stripe unit to be updated
+        unsigned Units2Update,///the number of units to be updated
+        const unsigned char* pDelta,///the differences between the new and old values of the units
+        unsigned char* pCheckDeltas,///output: the differences of all check symbols
+        size_t /*ThreadID*/ ///the ID of the calling thread
+                                        )
+{
+    memcpy(pCheckDeltas,pDelta,m_StripeUnitSize);
+    for (unsigned i=1;i<Units2Update;i++)
+        XOR(pCheckDeltas,pDelta+i*m_StripeUnitSize,m_StripeUnitSize);
+    return true;
+};
+
 /** Check if the sum of all codeword symbols is equal zero
 * @return true on success
 */
@@ -221,8 +236,8 @@ bool CRAID5Processor::CheckCodeword(unsigned long long StripeID,///identifies th
     if (GetNumOfErasures(ErasureSetID))
         //there is no way to check it for consistency
         return true;
-    unsigned char* pXORBuffer=m_pXORBuffer+ThreadID*2*m_StripeUnitSize;
-    unsigned char* pReadBuffer=m_pXORBuffer+(1+ThreadID*2)*m_StripeUnitSize;
+    unsigned char* pXORBuffer=GetScratch(ThreadID)+m_XORBuffer;
+    unsigned char* pReadBuffer=GetScratch(ThreadID)+m_XORBuffer+m_StripeUnitSize;
     bool Result=ReadStripeUnit(StripeID,ErasureSetID,0,0,1,pXORBuffer);
     for (unsigned i=1;i<m_Length;i++)
     {
@@ -64,9 +64,10 @@ setup check symbol locator polynomial*/
 CRSProcessor::CRSProcessor( RSParams* pParams):
                 CRAIDProcessor(pParams->CodeDimension+pParams->Redundancy,
 					1,pParams,sizeof(RSParams)),m_Redundancy(pParams->Redundancy),
+                    m_CyclotomicTemp(0),
+					m_Syndromes(0),m_ErasureEvaluator(0),m_pErasureLocators(0),
                     m_pErasureLocatorsPrime(0),
-					m_pSyndromes(0),m_pErasureEvaluator(0),m_pErasureLocators(0),
-                    m_pSymbols(0),m_ppSymbols(0),m_pCyclotomicTemp(0)
+                    m_Symbols(0),m_SymbolPointers(0)
 {
     if (m_Dimension>=m_Length)
         throw Exception("Dimension exceeds Reed-Solomon code length");
@@ -169,8 +170,8 @@ CRSProcessor::CRSProcessor( RSParams* pParams):
     for(unsigned i=0;i<m_Redundancy;i++)
         m_pCheckLocatorsPrime[i]=GetForneyMultiple(m_Redundancy,m_pCheckLocator,0,m_pCheckSymbols[i]);
 
-    m_pErasureLocators=new GFValue[(m_Redundancy+1)*m_Length*m_InterleavingOrder];
-    m_pErasureLocatorsPrime=new int[m_Redundancy*m_Length*m_InterleavingOrder];
+    m_pErasureLocators=new GFValue[(m_Redundancy+1)*GetNumOfErasureSets()];
+    m_pErasureLocatorsPrime=new int[m_Redundancy*GetNumOfErasureSets()];
 
 };
 
@@ -181,37 +182,32 @@ CRSProcessor::~CRSProcessor()
      delete[]m_pCheckSymbols;
 	 delete[]m_pCheckLocator;
 	 delete[]m_pErasureLocators;
-	 delete[]m_ppSymbols;
      delete[]m_pErasureLocatorsPrime;
      delete[]m_pCheckLocatorsPrime;
-	 AlignedFree(m_pErasureEvaluator);
-	 AlignedFree(m_pSyndromes);
-	 AlignedFree(m_pSymbols);
-     AlignedFree(m_pCyclotomicTemp);
 };
 
 
 /**
-Allocate memory for syndrome and erasure evaluator polynomials
+Reserve scratch memory for syndrome and erasure evaluator polynomials
 return true on success
 */
 bool CRSProcessor::Attach(CDiskArray* pArray,///the disk array
-                        unsigned ConcurrentThreads ///the number of concurrent processing threads that will make calls to the processor
+                        unsigned ConcurrentThreads ///the expected number of concurrent calls
                        )
 {
-	m_pSyndromes=AlignedMalloc(m_Redundancy*m_StripeUnitSize*ConcurrentThreads);
-	m_pErasureEvaluator=AlignedMalloc(m_Redundancy*m_StripeUnitSize*ConcurrentThreads);
-	m_pSymbols=AlignedMalloc(m_Length*m_StripeUnitSize*ConcurrentThreads);
+	m_Syndromes=ReserveScratch(m_Redundancy*m_StripeUnitSize);
+	m_ErasureEvaluator=ReserveScratch(m_Redundancy*m_StripeUnitSize);
+	m_Symbols=ReserveScratch(m_Length*m_StripeUnitSize);
     if (m_CyclotomicProcessing)
     {
 #ifndef STUDENTBUILD
-        m_pCyclotomicTemp=AlignedMalloc(sizeof(GFValue)*m_StripeUnitSize*ConcurrentThreads*CYCLOTOMIC_TEMP_SIZE);
+        m_CyclotomicTemp=ReserveScratch(sizeof(GFValue)*m_StripeUnitSize*CYCLOTOMIC_TEMP_SIZE);
 #endif
     };
 
 
-	m_ppSymbols=new const GFValue*[RSLength*ConcurrentThreads];
-	memset(m_ppSymbols,0,RSLength*ConcurrentThreads*sizeof(GFValue*));
+	//the scratch arenas are zeroed on allocation, so the pointers for the unused positions are null
+	m_SymbolPointers=ReserveScratch(RSLength*sizeof(GFValue*));
 	return CRAIDProcessor::Attach(pArray,ConcurrentThreads);
 };
 ///reset the erasure correction engine
@@ -228,7 +224,7 @@ void CRSProcessor::ResetErasures()
 of erasures
 @return true if the specified combination of erasures is correctable
 */
-bool CRSProcessor::IsCorrectable(unsigned ErasureSetID///identifies the erasure combination. This will not exceed m_Length-1
+bool CRSProcessor::IsCorrectable(unsigned ErasureSetID///identifies the erasure combination. This will not exceed GetNumOfErasureSets()-1
                               )
 {
     if (GetNumOfErasures(ErasureSetID)==0) return true;
@@ -374,7 +370,7 @@ bool CRSProcessor::DecodeDataSymbols(unsigned long long StripeID,///the stripe t
 {
 	bool NeedsDecoding=false;
 	//pointers to fetched data
-    const GFValue** ppData=m_ppSymbols+RSLength*ThreadID;
+    const GFValue** ppData=(const GFValue**)(GetScratch(ThreadID)+m_SymbolPointers);
 	for(unsigned i=0;i<Symbols2Decode;i++)
 	{
 		unsigned S=SymbolID+i;
@@ -393,7 +389,7 @@ bool CRSProcessor::DecodeDataSymbols(unsigned long long StripeID,///the stripe t
 	};
 	if (NeedsDecoding)
 	{
-		GFValue* pFetchBuffer=m_pSymbols+ThreadID*m_Length*m_StripeUnitSize;
+		GFValue* pFetchBuffer=GetScratch(ThreadID)+m_Symbols;
 		//fetch all surviving information symbols
 		for(unsigned i=0;i<SymbolID;i++)
 		{
@@ -438,13 +434,13 @@ bool CRSProcessor::DecodeDataSymbols(unsigned long long StripeID,///the stripe t
 					return false;
 			};
         };
-        GFValue* pSyndrome=m_pSyndromes+ThreadID*m_Redundancy*m_StripeUnitSize;
-        GFValue* pErasureEvaluator=m_pErasureEvaluator+ThreadID*m_Redundancy*m_StripeUnitSize;
+        GFValue* pSyndrome=GetScratch(ThreadID)+m_Syndromes;
+        GFValue* pErasureEvaluator=GetScratch(ThreadID)+m_ErasureEvaluator;
 #ifndef STUDENTBUILD
 		if (m_CyclotomicProcessing)
 		{
 		//   ComputeSyndrome(ppData,pSyndrome,m_FirstRoot,m_FirstRoot+m_Redundancy,m_StripeUnitSize);
-			ComputeSyndromeCyclotomic(ppData,pSyndrome,m_Redundancy,m_pCyclotomicTemp+ThreadID*CYCLOTOMIC_TEMP_SIZE*m_StripeUnitSize,pErasureEvaluator,m_StripeUnitSize);
+			ComputeSyndromeCyclotomic(ppData,pSyndrome,m_Redundancy,GetScratch(ThreadID)+m_CyclotomicTemp,pErasureEvaluator,m_StripeUnitSize);
 		}else 
 #endif
             ComputeSyndrome(ppData,pSyndrome,0,m_Redundancy,m_StripeUnitSize);
@@ -476,23 +472,24 @@ bool CRSProcessor::EncodeStripe(unsigned long long StripeID,///the stripe to be
                  )
 {
     //initialize the information symbol positions and compute check ones via erasure decoding
-	const GFValue** ppData=m_ppSymbols+RSLength*ThreadID;
+	const GFValue** ppData=(const GFValue**)(GetScratch(ThreadID)+m_SymbolPointers);
     for(unsigned i=0;i<m_Dimension;i++)
     {
         ppData[m_pInfSymbols[i]]=pData+i*m_StripeUnitSize;
         //send the data to disk
-        WriteStripeUnit(StripeID,ErasureSetID,i,0,1,pData+i*m_StripeUnitSize);
+        if (!IsErased(ErasureSetID,i))
+            WriteStripeUnit(StripeID,ErasureSetID,i,0,1,pData+i*m_StripeUnitSize);
     };
     for(unsigned i=0;i<m_Redundancy;i++)
         ppData[m_pCheckSymbols[i]]=0;
 
-    GFValue* pSyndrome=m_pSyndromes+ThreadID*m_Redundancy*m_StripeUnitSize;
-    GFValue* pErasureEvaluator=m_pErasureEvaluator+ThreadID*m_Redundancy*m_StripeUnitSize;
+    GFValue* pSyndrome=GetScratch(ThreadID)+m_Syndromes;
+    GFValue* pErasureEvaluator=GetScratch(ThreadID)+m_ErasureEvaluator;
 #ifndef STUDENTBUILD
     if (m_CyclotomicProcessing)
     {
 //        ComputeSyndrome(ppData,pSyndrome,m_FirstRoot,m_FirstRoot+m_Redundancy,m_StripeUnitSize);
-		ComputeSyndromeCyclotomic(ppData,pSyndrome,m_Redundancy,m_pCyclotomicTemp+ThreadID*CYCLOTOMIC_TEMP_SIZE*m_StripeUnitSize,pErasureEvaluator,m_StripeUnitSize);
+		ComputeSyndromeCyclotomic(ppData,pSyndrome,m_Redundancy,GetScratch(ThreadID)+m_CyclotomicTemp,pErasureEvaluator,m_StripeUnitSize);
     }else
 #endif
         ComputeSyndrome(ppData,pSyndrome,0,m_Redundancy,m_StripeUnitSize);
@@ -515,7 +512,8 @@ bool CRSProcessor::EncodeStripe(unsigned long long StripeID,///the stripe to be
             //X_i^{1-b}\Gamma(1/X_i)/\Lambda'(1/X_i)
             Multiply(m_pCheckLocatorsPrime[i],pSyndrome+i*m_StripeUnitSize,pSyndrome+i*m_StripeUnitSize,m_StripeUnitSize);
             //send check symbols to disk
-            WriteStripeUnit(StripeID,ErasureSetID,m_Dimension+i,0,1,pSyndrome+i*m_StripeUnitSize);
+            if (!IsErased(ErasureSetID,m_Dimension+i))
+                WriteStripeUnit(StripeID,ErasureSetID,m_Dimension+i,0,1,pSyndrome+i*m_StripeUnitSize);
         };
 
     }else
@@ -531,7 +529,8 @@ bool CRSProcessor::EncodeStripe(unsigned long long StripeID,///the stripe to be
             //X_i^{1-b}\Gamma(1/X_i)/\Lambda'(1/X_i)
             Multiply(m_pCheckLocatorsPrime[i],pSyndrome,pSyndrome,m_StripeUnitSize);
             //send check symbols to disk
-            WriteStripeUnit(StripeID,ErasureSetID,m_Dimension+i,0,1,pSyndrome);
+            if (!IsErased(ErasureSetID,m_Dimension+i))
+                WriteStripeUnit(StripeID,ErasureSetID,m_Dimension+i,0,1,pSyndrome);
         };
     };
 
@@ -574,8 +573,8 @@ bool CRSProcessor::UpdateInformationSymbols(unsigned long long StripeID,///the s
     )
 {
     //assume here that there are no erasures
-    GFValue* pFetchBuffer=m_pSymbols+ThreadID*m_Length*m_StripeUnitSize;
-    const GFValue** ppData=m_ppSymbols+RSLength*ThreadID;
+    GFValue* pFetchBuffer=GetScratch(ThreadID)+m_Symbols;
+    const GFValue** ppData=(const GFValue**)(GetScratch(ThreadID)+m_SymbolPointers);
     memset(ppData,0,RSLength*sizeof(ppData[0]));
     bool Result=true;
     for(unsigned i=0;i<Units2Update;i++)
@@ -588,13 +587,13 @@ bool CRSProcessor::UpdateInformationSymbols(unsigned long long StripeID,///the s
         //save the new value
         Result&=WriteStripeUnit(StripeID,ErasureSetID,StripeUnitID+i,0,1,pData+i*m_StripeUnitSize);
     };
-    GFValue* pSyndrome=m_pSyndromes+ThreadID*m_Redundancy*m_StripeUnitSize;
-    GFValue* pErasureEvaluator=m_pErasureEvaluator+ThreadID*m_Redundancy*m_StripeUnitSize;
+    GFValue* pSyndrome=GetScratch(ThreadID)+m_Syndromes;
+    GFValue* pErasureEvaluator=GetScratch(ThreadID)+m_ErasureEvaluator;
 #ifndef STUDENTBUILD
     if (m_CyclotomicProcessing)
     {
      //   ComputeSyndrome(ppData,pSyndrome,m_FirstRoot,m_FirstRoot+m_Redundancy,m_StripeUnitSize);
-		ComputeSyndromeCyclotomic(ppData,pSyndrome,m_Redundancy,m_pCyclotomicTemp+ThreadID*CYCLOTOMIC_TEMP_SIZE*m_StripeUnitSize,pErasureEvaluator,m_StripeUnitSize);
+		ComputeSyndromeCyclotomic(ppData,pSyndrome,m_Redundancy,GetScratch(ThreadID)+m_CyclotomicTemp,pErasureEvaluator,m_StripeUnitSize);
 
     }
     else
@@ -613,7 +612,7 @@ bool CRSProcessor::UpdateInformationSymbols(unsigned long long StripeID,///the s
         {
             int X=(m_pCheckSymbols[i])?FieldSize_1-m_pCheckSymbols[i]:0;
             //fetch old value 
-            Result&=ReadStripeUnit(StripeID,ErasureSetID,m_Dimension+i,0,1,pFetchBuffer);
+            Result&=ReadCheckSymbol(StripeID,ErasureSetID,m_Dimension+i,pFetchBuffer);
             //X_i^{1-b}\Gamma(1/X_i)/\Lambda'(1/X_i)
             MultiplyAdd(m_pCheckLocatorsPrime[i],pSyndrome+i*m_StripeUnitSize,pFetchBuffer,m_StripeUnitSize);
             //send check symbols to disk
@@ -635,7 +634,7 @@ bool CRSProcessor::UpdateInformationSymbols(unsigned long long StripeID,///the s
             //\Gamma(1/X_i)
             Evaluate(pErasureEvaluator,m_Redundancy-1,X,pSyndrome,m_StripeUnitSize);
             //fetch old value 
-            Result&=ReadStripeUnit(StripeID,ErasureSetID,m_Dimension+i,0,1,pFetchBuffer);
+            Result&=ReadCheckSymbol(StripeID,ErasureSetID,m_Dimension+i,pFetchBuffer);
             //add to it X_i^{1-b}\Gamma(1/X_i)/\Lambda'(1/X_i)
             MultiplyAdd(m_pCheckLocatorsPrime[i],pSyndrome,pFetchBuffer,m_StripeUnitSize);
             //write it back
@@ -645,6 +644,54 @@ bool CRSProcessor::UpdateInformationSymbols(unsigned long long StripeID,///the s
 
     return true;
 };
+/**Compute the syndrome of the differences of the updated symbols, and find the differences of the check symbols
+   in the same way as UpdateInformationSymbols() does
+   @return true on success
+*/
+bool CRSProcessor::ComputeCheckDeltas(unsigned /*ErasureSetID*/,///identifies the load balancing offset
+    unsigned StripeUnitID,///the first stripe unit to be updated
+    unsigned Units2Update,///the number of units to be updated
+    const unsigned char* pDelta,///the differences between the new and old values of the units
+    unsigned char* pCheckDeltas,///output: the differences of all check symbols
+    size_t ThreadID ///the ID of the calling thread
+    )
+{
+    const GFValue** ppData=(const GFValue**)(GetScratch(ThreadID)+m_SymbolPointers);
+    memset(ppData,0,RSLength*sizeof(ppData[0]));
+    for(unsigned i=0;i<Units2Update;i++)
+        ppData[m_pInfSymbols[StripeUnitID+i]]=pDelta+i*m_StripeUnitSize;
+    GFValue* pSyndrome=GetScratch(ThreadID)+m_Syndromes;
+    GFValue* pErasureEvaluator=GetScratch(ThreadID)+m_ErasureEvaluator;
+#ifndef STUDENTBUILD
+    if (m_CyclotomicProcessing)
+		ComputeSyndromeCyclotomic(ppData,pSyndrome,m_Redundancy,GetScratch(ThreadID)+m_CyclotomicTemp,pErasureEvaluator,m_StripeUnitSize);
+    else
+#endif
+        ComputeSyndrome(ppData,pSyndrome,0,m_Redundancy,m_StripeUnitSize);
+    GetErasureEvaluator(pSyndrome,m_pCheckLocator,pErasureEvaluator,m_Redundancy,m_StripeUnitSize);
+    memset(pCheckDeltas,0,m_Redundancy*m_StripeUnitSize);
+#ifndef STUDENTBUILD
+    if (m_OptimizedCheckLocators)
+    {
+        //\Gamma(1/X_i) for all check symbols
+        CheckLocators[m_Redundancy-1].Evaluator(pErasureEvaluator,pSyndrome,m_StripeUnitSize);
+        for(unsigned i=0;i<m_Redundancy;i++)
+            MultiplyAdd(m_pCheckLocatorsPrime[i],pSyndrome+i*m_StripeUnitSize,pCheckDeltas+i*m_StripeUnitSize,m_StripeUnitSize);
+    }else
+#endif
+    {
+        for(unsigned i=0;i<m_Redundancy;i++)
+        {
+            int X=(m_pCheckSymbols[i])?FieldSize_1-m_pCheckSymbols[i]:0;
+            //use pSyndrome as a temporary storage
+            //\Gamma(1/X_i)
+            Evaluate(pErasureEvaluator,m_Redundancy-1,X,pSyndrome,m_StripeUnitSize);
+            //X_i^{1-b}\Gamma(1/X_i)/\Lambda'(1/X_i)
+            MultiplyAdd(m_pCheckLocatorsPrime[i],pSyndrome,pCheckDeltas+i*m_StripeUnitSize,m_StripeUnitSize);
+        };
+    };
+    return true;
+};
 /**
    Fetch all codeword symbols, compute the syndrome and check if it is zero
 */
@@ -655,8 +702,8 @@ bool CRSProcessor::CheckCodeword(unsigned long long StripeID,///the stripe to be
 {
     if (GetNumOfErasures(ErasureSetID))
         return true;
-    GFValue* pFetchBuffer=m_pSymbols+ThreadID*m_Length*m_StripeUnitSize;
-	const GFValue** ppData=m_ppSymbols+RSLength*ThreadID;
+    GFValue* pFetchBuffer=GetScratch(ThreadID)+m_Symbols;
+	const GFValue** ppData=(const GFValue**)(GetScratch(ThreadID)+m_SymbolPointers);
     //fetch information symbols
     for(unsigned i=0;i<m_Dimension;i++)
     {
@@ -671,7 +718,7 @@ bool CRSProcessor::CheckCodeword(unsigned long long StripeID,///the stripe to be
         if (!ReadStripeUnit(StripeID,ErasureSetID,m_Dimension+i,0,1,pCurSymbol)) return false;
         ppData[m_pCheckSymbols[i]]=pCurSymbol;
     };
-    GFValue* pSyndrome=m_pSyndromes+ThreadID*m_Redundancy*m_StripeUnitSize;
+    GFValue* pSyndrome=GetScratch(ThreadID)+m_Syndromes;
     ComputeSyndrome(ppData,pSyndrome,0,m_Redundancy,m_StripeUnitSize);
     GFValue X=0;
     for (unsigned i=0;i<m_Redundancy*m_StripeUnitSize;i++)
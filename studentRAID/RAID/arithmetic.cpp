@@ -384,7 +384,7 @@ void Multiply(int x,///scale factor
                 //add them up
                 A0=_mm_xor_si128(A0,A1);
                 //write it back
-                _mm_store_si128(pmDest+i ,A0);
+                _mm_storeu_si128(pmDest+i ,A0);
             }
         else
             //destination is aligned
@@ -420,7 +420,7 @@ void Multiply(int x,///scale factor
                 //add them up
                 A0=_mm_xor_si128(A0,A1);
                 //write it back
-                _mm_store_si128(pmDest+i ,A0);
+                _mm_storeu_si128(pmDest+i ,A0);
             }
         else
             //everything is aligned
@@ -495,7 +495,7 @@ void MultiplyAdd(int x,///scale factor
                 //add them to the destination
                 B=_mm_xor_si128(B,A0);
                 //write it back
-                _mm_store_si128(pmDest+i ,B);
+                _mm_storeu_si128(pmDest+i ,B);
             }
         else
             //destination is aligned
@@ -537,7 +537,7 @@ void MultiplyAdd(int x,///scale factor
                 //add them to the destination
                 B=_mm_xor_si128(B,A0);
                 //write it back
-                _mm_store_si128(pmDest+i ,B);
+                _mm_storeu_si128(pmDest+i ,B);
             }
         else
             //everything is aligned
@@ -609,7 +609,7 @@ void AddMultiply(int x,///scale factor
                 //add them to the destination
                 B=_mm_xor_si128(B,A0);
                 //write it back
-                _mm_store_si128(pmSrc+i ,B);
+                _mm_storeu_si128(pmSrc+i ,B);
             }
         else
             //destination is aligned
@@ -18,7 +18,7 @@ using namespace std;
 
 ///initialize coding-related parameters
 CgumProcessor::CgumProcessor(gumParams* P ///the configuration file
-	) :CRAIDProcessor(P->CodeDimension + 1, 1, P, sizeof(*P)), m_pXORBuffer(0)
+	) :CRAIDProcessor(P->CodeDimension + 1, 1, P, sizeof(*P)), m_XORBuffer(0)
 {
 	if (m_StripeUnitSize%ARITHMETIC_ALIGNMENT)
 		throw Exception("Stripe size must be a multiple of #ARITHMETIC_ALIGNMENT");
@@ -27,7 +27,6 @@ CgumProcessor::CgumProcessor(gumParams* P ///the configuration file
 
 CgumProcessor::~CgumProcessor()
 {
-	AlignedFree(m_pXORBuffer);;
 };
 
 
@@ -39,7 +38,7 @@ bool CgumProcessor::Attach(CDiskArray* pArray,///the disk array
 	)
 {
 
-	m_pXORBuffer = AlignedMalloc(ConcurrentThreads*m_StripeUnitSize * 2);
+	m_XORBuffer = ReserveScratch(2 * m_StripeUnitSize);
 	return CRAIDProcessor::Attach(pArray, ConcurrentThreads);
 };
 
@@ -72,7 +71,7 @@ bool CgumProcessor::DecodeDataSymbols(unsigned long long StripeID,///the stripe
 		unsigned S = GetErasedPosition(ErasureSetID, 0);
 		unsigned i = (S == 0) ? 1 : 0;
 		unsigned char* pXORBuffer = pDest + (S - SymbolID)*m_StripeUnitSize;
-		unsigned char* pReadBuffer = m_pXORBuffer + (ThreadID * 2 + 1)*m_StripeUnitSize;
+		unsigned char* pReadBuffer = GetScratch(ThreadID) + m_XORBuffer + m_StripeUnitSize;
 		//the first symbol can be loaded directly to the buffer
 		Result &= ReadStripeUnit(StripeID, ErasureSetID, i, 0, 1, pXORBuffer);
 		if ((i >= SymbolID) && (i<SymbolID + Symbols2Decode))
@@ -111,7 +110,7 @@ bool CgumProcessor::EncodeStripe(unsigned long long StripeID,///the stripe to be
 	)
 {
 
-	unsigned char* pXORBuffer = m_pXORBuffer + ThreadID * 2 * m_StripeUnitSize;
+	unsigned char* pXORBuffer = GetScratch(ThreadID) + m_XORBuffer;
 
 	bool Result = true;
 	if (!IsErased(ErasureSetID, 0))
@@ -163,8 +162,8 @@ bool CgumProcessor::UpdateInformationSymbols(unsigned long long StripeID,///the
 	else
 	{
 		//the parity check symbol has to be updated
-		unsigned char* pXORBuffer = m_pXORBuffer + ThreadID * 2 * m_StripeUnitSize;
-		unsigned char* pReadBuffer = m_pXORBuffer + (ThreadID * 2 + 1)*m_StripeUnitSize;
+		unsigned char* pXORBuffer = GetScratch(ThreadID) + m_XORBuffer;
+		unsigned char* pReadBuffer = GetScratch(ThreadID) + m_XORBuffer + m_StripeUnitSize;
 		unsigned S = GetErasedPosition(ErasureSetID, 0);
 		if ((S >= StripeUnitID) && (S<StripeUnitID + Units2Update))
 		{
@@ -199,7 +198,7 @@ bool CgumProcessor::UpdateInformationSymbols(unsigned long long StripeID,///the
 		{
 			//the updated parity check value is given by S'=S +\sum_{i\in U} A_i'
 			//load the old parity check symbol
-			Result &= ReadStripeUnit(StripeID, ErasureSetID, m_Dimension, 0, 1, pXORBuffer);
+			Result &= ReadCheckSymbol(StripeID, ErasureSetID, m_Dimension, pXORBuffer);
 			for (unsigned i = 0; i<Units2Update; i++)
 			{
 				XOR(pXORBuffer, pData + i*m_StripeUnitSize, m_StripeUnitSize);
@@ -225,8 +224,8 @@ bool CgumProcessor::CheckCodeword(unsigned long long StripeID,///identifies the
 	if (GetNumOfErasures(ErasureSetID))
 		//there is no way to check it for consistency
 		return true;
-	unsigned char* pXORBuffer = m_pXORBuffer + ThreadID * 2 * m_StripeUnitSize;
-	unsigned char* pReadBuffer = m_pXORBuffer + (1 + ThreadID * 2)*m_StripeUnitSize;
+	unsigned char* pXORBuffer = GetScratch(ThreadID) + m_XORBuffer;
+	unsigned char* pReadBuffer = GetScratch(ThreadID) + m_XORBuffer + m_StripeUnitSize;
 	bool Result = ReadStripeUnit(StripeID, ErasureSetID, 0, 0, 1, pXORBuffer);
 	for (unsigned i = 1; i<m_Length; i++)
 	{
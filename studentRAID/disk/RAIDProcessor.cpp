@@ -11,6 +11,7 @@
 #include <string.h>
 #include <iostream>
 #include "misc.h"
+#include "arithmetic.h"
 #include "array.h"
 #include "RAIDconfig.h"
 #include "RAIDProcessor.h"
@@ -24,45 +25,69 @@ CRAIDProcessor::CRAIDProcessor ( unsigned Length,///the length of the array code
                                  RAIDParams* pParams, ///Configuration of the RAID array
                                  unsigned ConfigSize ///size of the configuration entry
                                ) : m_pParams ( pParams ),m_ConfigSize ( ConfigSize ), m_Length ( Length ),m_Dimension ( pParams->CodeDimension ),
-        m_StripeUnitSize ( pParams->StripeUnitSize ),m_StripeUnitsPerSymbol ( StripeUnitsPerSymbol ),m_pArray ( 0 ),
-        m_pNumOfOfflineDisks ( 0 ),m_ppOfflineDisks ( 0 ),m_pUpdateBuffer ( 0 ),m_InterleavingOrder(pParams->InterleavingOrder)
+        m_StripeUnitSize ( pParams->StripeUnitSize ),m_StripeUnitsPerSymbol ( StripeUnitsPerSymbol ),m_pArray ( 0 ),m_pLayout ( 0 ),
+        m_pNumOfOfflineDisks ( 0 ),m_pNumOfErasures ( 0 ),m_pErasedPositions ( 0 ),m_UpdateBuffer ( 0 ),m_CheckDeltaBuffer ( 0 ),m_ScratchSize ( 0 ),m_pPrepared ( 0 ),m_InterleavingOrder(pParams->InterleavingOrder)
 {
     if (!m_Dimension||!m_StripeUnitSize||!m_StripeUnitsPerSymbol||!m_InterleavingOrder)
         throw Exception("Invalid initialization for RAID processor:\n"
                         "Dimension=%d, StripeUnitSize=%d, StripeUnitsPersymbol=%d, InterleavingOrder=%d",
                         m_Dimension,m_StripeUnitSize,m_StripeUnitsPerSymbol,m_InterleavingOrder);
+    m_pLayout=CreateLayout(*pParams,m_Length);
+    m_DisksPerSubarray=m_pLayout->GetNumOfDisks();
+    m_NumOfPatterns=m_pLayout->GetNumOfPatterns();
+    m_NumOfErasureSets=m_NumOfPatterns*m_InterleavingOrder;
     m_pNumOfOfflineDisks=new unsigned [m_InterleavingOrder];
-    m_ppOfflineDisks=new unsigned*[m_InterleavingOrder];
-    memset(m_ppOfflineDisks,0,sizeof(unsigned*)*m_InterleavingOrder);
+    if (!InitCS(m_PrepareLock))
+        throw Exception("Failed to initialize RAID processor mutex");
 };
 
 CRAIDProcessor::~CRAIDProcessor()
 {
-    for(unsigned i=0;i<m_InterleavingOrder;i++)
-        delete[]m_ppOfflineDisks[i];
-    delete[]m_ppOfflineDisks;
     delete[]m_pNumOfOfflineDisks;
-    delete[]m_pUpdateBuffer;
+    delete[]m_pNumOfErasures;
+    delete[]m_pErasedPositions;
+    delete[]m_pPrepared;
+    delete m_pLayout;
+    DestroyCS(m_PrepareLock);
 	delete m_pParams;
 };
 
 
 /**Attach to the disk array,
- * allocate memory for data encoding,
+ * allocate the scratch arenas for data encoding,
  * inspect the disks and find those not being online
 */
 bool CRAIDProcessor::Attach ( CDiskArray* pArray,///the disk array
-                              unsigned ConcurrentThreads ///the number of concurrent processing threads that will make calls to the processor
+                              unsigned ConcurrentThreads ///the expected number of concurrent calls. More of them are allowed, but need additional allocations
                             )
 {
     m_pArray=pArray;
-    m_pUpdateBuffer=new unsigned char[ConcurrentThreads*m_Dimension*m_StripeUnitsPerSymbol*m_StripeUnitSize];
+    m_UpdateBuffer=ReserveScratch(m_Dimension*m_StripeUnitsPerSymbol*m_StripeUnitSize);
+    if (pArray->m_pParityLog)
+        m_CheckDeltaBuffer=ReserveScratch((m_Length-m_Dimension)*m_StripeUnitsPerSymbol*m_StripeUnitSize);
+    m_Scratch.Reset(m_ScratchSize,ConcurrentThreads);
+    m_pPrepared=new bool[GetNumOfErasureSets()];
+    m_pNumOfErasures=new unsigned[GetNumOfErasureSets()];
+    m_pErasedPositions=new unsigned short[GetNumOfErasureSets()*m_Length];
 
     ResetErasures();
     return true;
 };
 
-/** Mark the non-online disks as erased
+/**The buffers are aligned to the cache line boundary
+*/
+size_t CRAIDProcessor::ReserveScratch(size_t Size ///the number of bytes needed by each call
+                                     )
+{
+    size_t Offset=m_ScratchSize;
+    m_ScratchSize+=(Size+CACHELINESIZE-1)/CACHELINESIZE*CACHELINESIZE;
+    return Offset;
+};
+
+/** Mark the symbols stored on the disks not available in each view as erased.
+ * The erasure configurations of the views used by the rebuild are computed only while it is in progress.
+ * The disk reconstructed in place keeps its location in all views, so its symbols are written in view 2 as well.
+ * The parity cache is emptied, since the updates skip the check symbols of the failed disks
  */
 void CRAIDProcessor::ResetErasures()
 {
@@ -70,57 +95,133 @@ void CRAIDProcessor::ResetErasures()
     for(unsigned j=0;j<m_InterleavingOrder;j++)
     {
         m_pNumOfOfflineDisks[j]=0;
-        for ( unsigned i=0;i<m_Length;i++ )
+        for ( unsigned i=0;i<m_DisksPerSubarray;i++ )
         {
-            if ( m_pArray->m_pDisks[j*m_Length+i].GetDiskState() !=dsOnline )
+            unsigned DiskID=j*m_DisksPerSubarray+i;
+            if ( !m_pArray->IsDiskAvailable(DiskID,0)&&(m_pArray->GetSpareSlot(DiskID,0)<0) )
                 m_pNumOfOfflineDisks[j]++;
-
         };
-        //enumerate the offline disks
-        if (m_ppOfflineDisks[j]) delete[]m_ppOfflineDisks[j];
-        if (m_pNumOfOfflineDisks[j]) 
+    };
+    unsigned NumOfViews=(m_pArray->IsRebuilding())?3:1;
+    memset(m_pNumOfErasures,0,sizeof(unsigned)*GetNumOfErasureSets());
+    for(unsigned v=0;v<NumOfViews;v++)
+    {
+        for(unsigned e=0;e<m_NumOfErasureSets;e++)
         {
-            m_ppOfflineDisks[j]=new unsigned[m_pNumOfOfflineDisks[j]];
-            unsigned S=0;
-            for ( unsigned i=0;i<m_Length;i++ )
+            unsigned ErasureSetID=e+v*m_NumOfErasureSets;
+            unsigned SubarrayID=e/m_NumOfPatterns;
+            unsigned long long StripeID=m_pLayout->GetPatternStripe(e%m_NumOfPatterns);
+            unsigned short* pErased=m_pErasedPositions+ErasureSetID*m_Length;
+            for(unsigned i=0;i<m_Length;i++)
             {
-                if ( m_pArray->m_pDisks[j*m_Length+i].GetDiskState() !=dsOnline )
-                    m_ppOfflineDisks[j][S++]=i;
+                unsigned DiskID;
+                unsigned long long Row;
+                GetSymbolLocation(StripeID,SubarrayID,v,i,DiskID,Row);
+                bool Erased=!m_pArray->IsDiskAvailable(DiskID,v);
+                if (v==2)
+                {
+                    //only the symbols being relocated are written in this view
+                    unsigned OldDiskID;
+                    GetSymbolLocation(StripeID,SubarrayID,0,i,OldDiskID,Row);
+                    Erased|=(OldDiskID==DiskID)&&m_pArray->IsDiskAvailable(DiskID,0);
+                };
+                if (Erased)
+                    pErased[m_pNumOfErasures[ErasureSetID]++]=i;
             };
-        }else m_ppOfflineDisks[j]=0;
+        };
     };
-
+    //the check symbols of the erased positions are not written, so their cached copies may become stale
+    if (m_pArray->m_pParityCache)
+        m_pArray->m_pParityCache->Reset();
+    //the erasure configurations will be prepared on first access
+    for(unsigned i=0;i<GetNumOfErasureSets();i++)
+        m_pPrepared[i]=false;
 };
 
+/** Stripes with the same symbol to disk mapping share the erasure configuration.
+ * The stripes already processed by the rebuild in progress use the second view of the array
+ */
+unsigned CRAIDProcessor::GetErasureSetID(unsigned long long StripeID,///the stripe
+                                         unsigned SubarrayID ///the subarray
+                                        )const
+{
+    unsigned ErasureSetID=m_pLayout->GetPattern(StripeID)+SubarrayID*m_NumOfPatterns;
+    if (m_pArray->IsStripeRebuilt(StripeID,SubarrayID))
+        ErasureSetID+=m_NumOfErasureSets;
+    return ErasureSetID;
+};
 
-/** Check if the corresponding disk is not online.
- * */
-bool CRAIDProcessor::IsErased ( unsigned ErasureSetID,///the erasure combination (identifies the load balancing offset)
-                                unsigned i ) const
+/** Find the symbol location given by the layout. If the disk was relocated to the spare space,
+ * the symbol is stored in the corresponding spare unit. This unit may reside on a disk which was relocated
+ * later, so the lookup is repeated, at most once per spare slot
+ */
+void CRAIDProcessor::GetSymbolLocation(unsigned long long StripeID,///the stripe
+                                       unsigned SubarrayID,///the subarray
+                                       unsigned View,///the view of the array
+                                       unsigned SymbolID,///the symbol
+                                       unsigned& DiskID,///output: the disk within the array
+                                       unsigned long long& Row ///output: the symbol row on this disk
+                                      )const
 {
-    unsigned SubarrayID=ErasureSetID/m_Length;
-    i=(i+ErasureSetID)%m_Length;
-    return m_pArray->m_pDisks[i+SubarrayID*m_Length].GetDiskState() !=dsOnline;
-}
+    unsigned FirstDisk=SubarrayID*m_DisksPerSubarray;
+    m_pLayout->GetLocation(StripeID,SymbolID,DiskID,Row);
+    DiskID+=FirstDisk;
+    for(unsigned k=0;k<m_pLayout->GetNumOfSpares();k++)
+    {
+        int SpareID=m_pArray->GetSpareSlot(DiskID,View);
+        if (SpareID<0)
+            break;
+        m_pLayout->GetSpareLocation(StripeID,SymbolID,SpareID,DiskID,Row);
+        DiskID+=FirstDisk;
+    };
+};
 
 
-/** Check if all possible erasure patterns are correctable
- *
- *
+/** Check if all possible erasure patterns are correctable.
+ * Each disk stores at most one symbol of any stripe, so if the number of failed disks in a subarray
+ * does not exceed the correcting capability of the code, this is true for all stripes, and the decoder
+ * initialization can be postponed until the first access
  * */
 bool CRAIDProcessor::IsMountable()
 {
-    //make sure that all cyclic shifts of the erasure pattern are correctable
+    unsigned Capability=GetCorrectingCapability();
     bool Result=true;
-    for ( unsigned i=0;i<m_pArray->m_NumOfDisks;i++ )
-        //prepare to correct all erasure patterns
-        Result&=IsCorrectable ( i );
+    for(unsigned j=0;j<m_InterleavingOrder;j++)
+    {
+        if (m_pNumOfOfflineDisks[j]<=Capability)
+            continue;
+        //make sure that the erasure patterns of all stripes are correctable
+        for ( unsigned i=0;i<m_NumOfPatterns;i++ )
+            Result&=PrepareErasureSet ( i+j*m_NumOfPatterns );
+    };
     return Result;
 };
 
+/** Initialize the decoder for a given erasure configuration.
+ * The flag is set only after IsCorrectable() has completed, so that
+ * PrepareErasureSet() does not need to take the lock on the fast path
+ */
+bool CRAIDProcessor::PrepareErasureSetSlow(unsigned ErasureSetID ///identifies the erasure combination
+                                          )
+{
+    LockCS(m_PrepareLock);
+    bool Result=true;
+    if (!m_pPrepared[ErasureSetID])
+    {
+        Result=IsCorrectable(ErasureSetID);
+        if (Result)
+        {
+            FullBarrier();
+            m_pPrepared[ErasureSetID]=true;
+        };
+    };
+    UnlockCS(m_PrepareLock);
+    return Result;
+};
 
-/**Read a number of stripe units from the disk. Implements cyclic mapping of codeword symbols onto the disks.
- * The offset is given by ErasureSetID
+
+/**Read a number of stripe units from the disk. The symbol location is given by the layout
+ * and the view identified by ErasureSetID
  *
  * */
 bool CRAIDProcessor::ReadStripeUnit ( unsigned long long StripeID,///identifies the codeword (stripe)
@@ -131,12 +232,14 @@ bool CRAIDProcessor::ReadStripeUnit ( unsigned long long StripeID,///identifies
                                       void* pDest ///the destination buffer. Must have size  Units2Read*m_StripeUnitSize
                                     )
 {
-    unsigned SubarrayID=ErasureSetID/m_Length;
-    SymbolID=(SymbolID+ErasureSetID)%m_Length;
-    return m_pArray->m_pDisks[SymbolID+SubarrayID*m_Length].ReadData ( StripeID*m_StripeUnitsPerSymbol+StripeUnitID,Units2Read,pDest );
+    unsigned DiskID;
+    unsigned long long Row;
+    GetSymbolLocation(StripeID,(ErasureSetID%m_NumOfErasureSets)/m_NumOfPatterns,ErasureSetID/m_NumOfErasureSets,SymbolID,DiskID,Row);
+    return m_pArray->m_pDisks[DiskID].ReadData ( Row*m_StripeUnitsPerSymbol+StripeUnitID,Units2Read,pDest );
 };
-/**Write a number of stripe units to the disk. Implements cyclic mapping of codeword symbols onto the disks.
- * The offset is given by ErasureSetID
+/**Write a number of stripe units to the disk. The symbol location is given by the layout
+ * and the view identified by ErasureSetID. The cached copy of a check symbol is replaced if it is written entirely,
+ * and discarded otherwise, so that the parity cache never differs from the disks
  *
  * */
 bool CRAIDProcessor::WriteStripeUnit ( unsigned long long StripeID,///identifies the codeword (stripe)
@@ -147,9 +250,41 @@ bool CRAIDProcessor::WriteStripeUnit ( unsigned long long StripeID,///identifies
                                        const void* pSrc ///the data to be written (Units2Read*m_StripeUnitSize bytes)
                                      )
 {
-    unsigned SubarrayID=ErasureSetID/m_Length;
-    SymbolID=(SymbolID+ErasureSetID)%m_Length;
-    return m_pArray->m_pDisks[SymbolID+SubarrayID*m_Length].WriteData ( StripeID*m_StripeUnitsPerSymbol+StripeUnitID,Units2Write,pSrc );
+    unsigned DiskID;
+    unsigned long long Row;
+    GetSymbolLocation(StripeID,(ErasureSetID%m_NumOfErasureSets)/m_NumOfPatterns,ErasureSetID/m_NumOfErasureSets,SymbolID,DiskID,Row);
+    bool Result=m_pArray->m_pDisks[DiskID].WriteData ( Row*m_StripeUnitsPerSymbol+StripeUnitID,Units2Write,pSrc );
+    CParityCache* pCache=m_pArray->m_pParityCache;
+    if (pCache&&(SymbolID>=m_Dimension))
+    {
+        unsigned SubarrayID=(ErasureSetID%m_NumOfErasureSets)/m_NumOfPatterns;
+        if (Result&&!StripeUnitID&&(Units2Write==m_StripeUnitsPerSymbol))
+            pCache->Store(StripeID,SubarrayID,SymbolID-m_Dimension,pSrc,false);
+        else
+            pCache->Invalidate(StripeID,SubarrayID,SymbolID-m_Dimension);
+    };
+    return Result;
+};
+
+/**The check symbols are cached per stripe, so that the erased ones, which are never read, do not occupy the cache
+ *
+ * */
+bool CRAIDProcessor::ReadCheckSymbol ( unsigned long long StripeID,///identifies the codeword (stripe)
+                                       unsigned ErasureSetID,///identifies the load balancing offset
+                                       unsigned SymbolID,///identifies the check symbol. This must be not less than m_Dimension
+                                       void* pDest ///the destination buffer. Must have size m_StripeUnitsPerSymbol*m_StripeUnitSize
+                                     )
+{
+    CParityCache* pCache=m_pArray->m_pParityCache;
+    if (!pCache)
+        return ReadStripeUnit(StripeID,ErasureSetID,SymbolID,0,m_StripeUnitsPerSymbol,pDest);
+    unsigned SubarrayID=(ErasureSetID%m_NumOfErasureSets)/m_NumOfPatterns;
+    if (pCache->Read(StripeID,SubarrayID,SymbolID-m_Dimension,pDest))
+        return true;
+    if (!ReadStripeUnit(StripeID,ErasureSetID,SymbolID,0,m_StripeUnitsPerSymbol,pDest))
+        return false;
+    pCache->Store(StripeID,SubarrayID,SymbolID-m_Dimension,pDest,true);
+    return true;
 };
 
 
@@ -168,7 +303,15 @@ bool CRAIDProcessor::ReadData ( unsigned long long StripeID,///the stripe to be
 {
     unsigned FirstSymbolID=StripeUnitID/m_StripeUnitsPerSymbol;
     unsigned FirstSymbolOffset=StripeUnitID%m_StripeUnitsPerSymbol;
-    unsigned ErasureSetID=(StripeID%m_Length)+SubarrayID*m_Length;
+    unsigned ErasureSetID=GetErasureSetID(StripeID,SubarrayID);
+    if (!PrepareErasureSet(ErasureSetID))
+        return false;
+    //the decoding needs the check symbols to be up to date
+    if (m_pArray->m_pParityLog&&GetNumOfErasures(ErasureSetID)&&!m_pArray->m_pParityLog->Apply(StripeID,SubarrayID,ThreadID))
+        return false;
+    if (m_pArray->m_pDeferredParity&&IsDegraded(StripeID,StripeUnitID,SubarrayID,NumOfUnits)&&
+            !m_pArray->m_pDeferredParity->Apply(StripeID,SubarrayID,ThreadID))
+        return false;
     bool Result=true;
     if ( FirstSymbolOffset )
     {
@@ -209,7 +352,10 @@ bool CRAIDProcessor::ReadData ( unsigned long long StripeID,///the stripe to be
 
 /**Translate write call into a number of Encode calls
  * The encoding strategy is determined by the GetEncodingStrategy function. If needed,
- * this method will get all non-affected the data from the disk and re-encode it
+ * this method will get all non-affected the data from the disk and re-encode it.
+ * If the parity log is used, the differences of the check symbols accumulated for the re-encoded stripe are discarded,
+ * and the updates of the selected symbols are logged. If the check symbols are updated in background,
+ * only the selected payload symbols of a healthy stripe are written
  * */
 bool CRAIDProcessor::WriteData ( unsigned long long StripeID,///the stripe to be written
                                  unsigned StripeUnitID,///the first payload stripe unit to write
@@ -219,15 +365,30 @@ bool CRAIDProcessor::WriteData ( unsigned long long StripeID,///the stripe to be
                                  size_t ThreadID ///calling thread ID
                                )
 {
-    unsigned ErasureSetID=(StripeID%m_Length)+SubarrayID*m_Length;
+    unsigned ErasureSetID=GetErasureSetID(StripeID,SubarrayID);
+    if (!PrepareErasureSet(ErasureSetID))
+        return false;
     bool Result=true;
+    CParityLog* pLog=m_pArray->m_pParityLog;
+    CDeferredParity* pDeferred=m_pArray->m_pDeferredParity;
     if ( GetEncodingStrategy (ErasureSetID,StripeUnitID,NumOfUnits ) )
     {
+        if (pLog)
+        {
+            //the check symbols are overwritten, unless the remaining data must be decoded first
+            if ((NumOfUnits<m_Dimension*m_StripeUnitsPerSymbol)&&GetNumOfErasures(ErasureSetID))
+                Result&=pLog->Apply(StripeID,SubarrayID,ThreadID);
+            else
+                pLog->Drop(StripeID,SubarrayID);
+        };
+        //the remaining payload symbols cannot be decoded from the stale check symbols
+        if (pDeferred&&(NumOfUnits<m_Dimension*m_StripeUnitsPerSymbol)&&GetNumOfErasures(ErasureSetID))
+            Result&=pDeferred->Apply(StripeID,SubarrayID,ThreadID);
 		if ( NumOfUnits==m_Dimension*m_StripeUnitsPerSymbol )
             Result&=EncodeStripe ( StripeID,ErasureSetID,pSrc,ThreadID );
         else
         {
-            unsigned char* pBuffer=m_pUpdateBuffer+ThreadID*m_Dimension*m_StripeUnitsPerSymbol*m_StripeUnitSize;
+            unsigned char* pBuffer=GetScratch(ThreadID)+m_UpdateBuffer;
             if ( StripeUnitID )
             {
                 //fetch the data residing before the new data
@@ -242,15 +403,272 @@ bool CRAIDProcessor::WriteData ( unsigned long long StripeID,///the stripe to be
             };
             Result&=EncodeStripe ( StripeID,ErasureSetID,pBuffer,ThreadID );
         };
+        if (pDeferred&&Result)
+            pDeferred->Drop(StripeID,SubarrayID);
         return Result;
     }
     else
     {
         //update selected symbols
+        if (pLog)
+            return LogInformationSymbols(StripeID,SubarrayID,ErasureSetID,StripeUnitID,NumOfUnits,pSrc,ThreadID);
+        if (pDeferred)
+        {
+            //the hash and map stripes are updated without range locking, so they cannot be re-encoded in background
+            if (!GetNumOfErasures(ErasureSetID)&&(StripeID<m_pArray->m_HashStripe)&&pDeferred->MarkStale(StripeID,SubarrayID))
+            {
+                for (unsigned i=0;i<NumOfUnits;i++)
+                {
+                    unsigned UnitID=StripeUnitID+i;
+                    Result&=WriteStripeUnit(StripeID,ErasureSetID,UnitID/m_StripeUnitsPerSymbol,UnitID%m_StripeUnitsPerSymbol,1,pSrc+i*m_StripeUnitSize);
+                };
+                return Result;
+            };
+            //the update of the stale check symbols keeps them stale, unless some symbols are erased and must be decoded
+            if (GetNumOfErasures(ErasureSetID)&&!pDeferred->Apply(StripeID,SubarrayID,ThreadID))
+                return false;
+        };
         bool Res=UpdateInformationSymbols ( StripeID,ErasureSetID,StripeUnitID,NumOfUnits,pSrc,ThreadID );
 	return Res;
 
     };
 }
 
+/** The old values of the units are read to compute the differences of the check symbols, which are appended
+ * to the parity log before the units are written. If the update is interrupted, the stripe is re-encoded on the next mount.
+ * The stripes with erased symbols are updated in place, since the decoding needs the up to date check symbols.
+ * This is also the case if the log is full, and for the hash and map stripes, which are updated without range locking
+ */
+bool CRAIDProcessor::LogInformationSymbols(unsigned long long StripeID,///the stripe to be updated
+                                           unsigned SubarrayID,///identifies the subarray
+                                           unsigned ErasureSetID,///identifies the load balancing offset
+                                           unsigned StripeUnitID,///the first stripe unit to be updated
+                                           unsigned Units2Update,///the number of units to be updated
+                                           const unsigned char* pData,///new payload data symbols
+                                           size_t ThreadID ///the ID of the calling thread
+                                          )
+{
+    CParityLog& Log=*m_pArray->m_pParityLog;
+    if (!GetNumOfErasures(ErasureSetID)&&(StripeID<m_pArray->m_HashStripe))
+    {
+        unsigned char* pDelta=GetScratch(ThreadID)+m_UpdateBuffer;
+        unsigned char* pCheckDeltas=GetScratch(ThreadID)+m_CheckDeltaBuffer;
+        bool Result=true;
+        for (unsigned i=0;i<Units2Update;i++)
+        {
+            unsigned UnitID=StripeUnitID+i;
+            Result&=ReadStripeUnit(StripeID,ErasureSetID,UnitID/m_StripeUnitsPerSymbol,UnitID%m_StripeUnitsPerSymbol,1,pDelta+i*m_StripeUnitSize);
+            XOR(pDelta+i*m_StripeUnitSize,pData+i*m_StripeUnitSize,m_StripeUnitSize);
+        };
+        if (Result&&ComputeCheckDeltas(ErasureSetID,StripeUnitID,Units2Update,pDelta,pCheckDeltas,ThreadID)&&
+                Log.Append(StripeID,SubarrayID,pCheckDeltas))
+        {
+            for (unsigned i=0;i<Units2Update;i++)
+            {
+                unsigned UnitID=StripeUnitID+i;
+                Result&=WriteStripeUnit(StripeID,ErasureSetID,UnitID/m_StripeUnitsPerSymbol,UnitID%m_StripeUnitsPerSymbol,1,pData+i*m_StripeUnitSize);
+            };
+            return Result;
+        };
+    };
+    //the check symbols must be up to date before they are updated in place
+    return Log.Apply(StripeID,SubarrayID,ThreadID)&&UpdateInformationSymbols(StripeID,ErasureSetID,StripeUnitID,Units2Update,pData,ThreadID);
+};
+
+/** The check symbols follow the payload ones in each codeword. The erased ones are reconstructed
+ * from the payload symbols by the rebuild, so they need not be updated
+ */
+bool CRAIDProcessor::ApplyCheckDeltas(unsigned long long StripeID,///the stripe to be updated
+                                      unsigned SubarrayID,///identifies the subarray
+                                      const unsigned char* pCheckDeltas,///the differences of all check symbols
+                                      size_t ThreadID ///calling thread ID
+                                     )
+{
+    unsigned ErasureSetID=GetErasureSetID(StripeID,SubarrayID);
+    if (!PrepareErasureSet(ErasureSetID))
+        return false;
+    unsigned char* pBuffer=GetScratch(ThreadID)+m_UpdateBuffer;
+    unsigned SymbolSize=m_StripeUnitsPerSymbol*m_StripeUnitSize;
+    bool Result=true;
+    for (unsigned i=m_Dimension;i<m_Length;i++)
+    {
+        if (IsErased(ErasureSetID,i))
+            continue;
+        Result&=ReadCheckSymbol(StripeID,ErasureSetID,i,pBuffer);
+        XOR(pBuffer,pCheckDeltas+(i-m_Dimension)*SymbolSize,SymbolSize);
+        Result&=WriteStripeUnit(StripeID,ErasureSetID,i,0,m_StripeUnitsPerSymbol,pBuffer);
+    };
+    return Result;
+};
 
+/** The payload symbols are read directly, since they cannot be decoded if the check symbols are stale
+ */
+bool CRAIDProcessor::ReencodeStripe(unsigned long long StripeID,///the stripe to be re-encoded
+                                    unsigned SubarrayID,///identifies the subarray
+                                    size_t ThreadID ///calling thread ID
+                                   )
+{
+    unsigned ErasureSetID=GetErasureSetID(StripeID,SubarrayID);
+    if (!PrepareErasureSet(ErasureSetID))
+        return false;
+    if (IsDegraded(StripeID,0,SubarrayID,m_Dimension*m_StripeUnitsPerSymbol))
+        return false;
+    unsigned char* pBuffer=GetScratch(ThreadID)+m_UpdateBuffer;
+    unsigned SymbolSize=m_StripeUnitsPerSymbol*m_StripeUnitSize;
+    bool Result=true;
+    for (unsigned i=0;Result&&(i<m_Dimension);i++)
+        Result=ReadStripeUnit(StripeID,ErasureSetID,i,0,m_StripeUnitsPerSymbol,pBuffer+i*SymbolSize);
+    return Result&&EncodeStripe(StripeID,ErasureSetID,pBuffer,ThreadID);
+};
+
+/** The differences of the check symbols accumulated in the parity log are applied first, and the stale stripe is re-encoded
+ */
+bool CRAIDProcessor::VerifyStripe(unsigned long long StripeID,///identifies the codeword to be validated
+                                  unsigned SubarrayID,///identifies the subarray to be used
+                                  size_t ThreadID ///calling thread ID
+                                 )
+{
+    if (m_pArray->m_pParityLog&&!m_pArray->m_pParityLog->Apply(StripeID,SubarrayID,ThreadID))
+        return false;
+    if (m_pArray->m_pDeferredParity&&!m_pArray->m_pDeferredParity->Apply(StripeID,SubarrayID,ThreadID))
+        return false;
+    return CheckCodeword(StripeID,GetErasureSetID(StripeID,SubarrayID),ThreadID);
+};
+
+/** The stripes sharing the erasure configuration store each symbol on the same disk, so the copy moves
+ * the units within each disk. The healthy stripes only are copied, since the erased symbols cannot be read
+ */
+bool CRAIDProcessor::CanCopyStripe(unsigned long long SrcStripeID,///the stripe to be copied
+                                   unsigned long long DestStripeID,///the stripe to be overwritten
+                                   unsigned SubarrayID ///identifies the subarray
+                                  )const
+{
+    unsigned ErasureSetID=GetErasureSetID(SrcStripeID,SubarrayID);
+    return (ErasureSetID==GetErasureSetID(DestStripeID,SubarrayID))&&!GetNumOfErasures(ErasureSetID);
+};
+
+/** The pending differences of the check symbols of the source stripe are applied first, and the stale ones are re-encoded,
+ * so that the copied check symbols are up to date. The differences accumulated for the destination stripe are discarded,
+ * as if it was encoded from scratch
+ */
+bool CRAIDProcessor::CopyStripe(unsigned long long SrcStripeID,///the stripe to be copied
+                                unsigned long long DestStripeID,///the stripe to be overwritten
+                                unsigned SubarrayID,///identifies the subarray
+                                size_t ThreadID ///calling thread ID
+                               )
+{
+    CParityLog* pLog=m_pArray->m_pParityLog;
+    CDeferredParity* pDeferred=m_pArray->m_pDeferredParity;
+    if (pLog&&!pLog->Apply(SrcStripeID,SubarrayID,ThreadID))
+        return false;
+    if (pDeferred&&!pDeferred->Apply(SrcStripeID,SubarrayID,ThreadID))
+        return false;
+    if (pLog)
+        pLog->Drop(DestStripeID,SubarrayID);
+    unsigned ErasureSetID=GetErasureSetID(SrcStripeID,SubarrayID);
+    unsigned char* pBuffer=GetScratch(ThreadID)+m_UpdateBuffer;
+    bool Result=true;
+    for (unsigned i=0;Result&&(i<m_Length);i++)
+    {
+        Result=(i<m_Dimension)?ReadStripeUnit(SrcStripeID,ErasureSetID,i,0,m_StripeUnitsPerSymbol,pBuffer):
+                               ReadCheckSymbol(SrcStripeID,ErasureSetID,i,pBuffer);
+        Result=Result&&WriteStripeUnit(DestStripeID,ErasureSetID,i,0,m_StripeUnitsPerSymbol,pBuffer);
+    };
+    if (pDeferred&&Result)
+        pDeferred->Drop(DestStripeID,SubarrayID);
+    return Result;
+};
+
+/** The erased positions of the payload symbols are looked up in the current view of the stripe
+ */
+bool CRAIDProcessor::IsDegraded(unsigned long long StripeID,///the stripe
+                                unsigned StripeUnitID,///the first payload stripe unit
+                                unsigned SubarrayID,///identifies the subarray
+                                unsigned NumOfUnits ///the number of units
+                               )const
+{
+    unsigned ErasureSetID=GetErasureSetID(StripeID,SubarrayID);
+    if (!NumOfUnits||!GetNumOfErasures(ErasureSetID))
+        return false;
+    for(unsigned i=StripeUnitID/m_StripeUnitsPerSymbol;i<=(StripeUnitID+NumOfUnits-1)/m_StripeUnitsPerSymbol;i++)
+        if (IsErased(ErasureSetID,i))
+            return true;
+    return false;
+};
+
+/** Decode the payload data using the normal view of the array, and re-encode it
+ * in the view which reports all symbols except the relocated ones as erased,
+ * so that only the spare units are written. The check symbols written in this way are up to date,
+ * so the differences accumulated in the parity log must be applied to the remaining ones first,
+ * and the stale stripe must be re-encoded
+ */
+bool CRAIDProcessor::RebuildStripe(unsigned long long StripeID,///the stripe to be rebuilt
+                                   unsigned SubarrayID,///identifies the subarray
+                                   size_t ThreadID ///calling thread ID
+                                  )
+{
+    unsigned ErasureSetID=m_pLayout->GetPattern(StripeID)+SubarrayID*m_NumOfPatterns+2*m_NumOfErasureSets;
+    if (GetNumOfErasures(ErasureSetID)==m_Length)
+        //no symbols of this stripe are relocated
+        return true;
+    if (m_pArray->m_pParityLog&&!m_pArray->m_pParityLog->Apply(StripeID,SubarrayID,ThreadID))
+        return false;
+    //the payload symbols of the stale stripe cannot be decoded
+    if (m_pArray->m_pDeferredParity&&!m_pArray->m_pDeferredParity->Apply(StripeID,SubarrayID,ThreadID))
+        return false;
+    unsigned char* pBuffer=GetScratch(ThreadID)+m_UpdateBuffer;
+    if (!ReadData(StripeID,0,SubarrayID,m_Dimension*m_StripeUnitsPerSymbol,pBuffer,ThreadID))
+        return false;
+    return EncodeStripe(StripeID,ErasureSetID,pBuffer,ThreadID);
+};
+
+/** The symbols are located in the current view of each stripe, so that the spare units
+ * written by the rebuild are released as well. The symbols of the offline disks are skipped.
+ * The stripe units are typically smaller than the file system blocks, so the adjacent symbols stored on each disk
+ * are merged into a single extent before being released
+ */
+bool CRAIDProcessor::DiscardStripes(unsigned long long FirstStripe,///the first stripe to be discarded
+                                    unsigned long long LastStripe,///the stripe following the last one
+                                    unsigned SubarrayID ///identifies the subarray
+                                   )
+{
+    unsigned NumOfDisks=GetNumOfDisks();
+    //the first row and the number of rows of the pending extent on each disk
+    unsigned long long* pExtentStart=new unsigned long long[NumOfDisks];
+    unsigned* pExtentRows=new unsigned[NumOfDisks];
+    memset(pExtentRows,0,sizeof(unsigned)*NumOfDisks);
+    bool Result=true;
+    for(unsigned long long S=FirstStripe;S<LastStripe;S++)
+    {
+        if (m_pArray->m_pParityLog)
+            m_pArray->m_pParityLog->Drop(S,SubarrayID);
+        if (m_pArray->m_pParityCache)
+            m_pArray->m_pParityCache->Invalidate(S,SubarrayID);
+        if (m_pArray->m_pDeferredParity)
+            m_pArray->m_pDeferredParity->Drop(S,SubarrayID);
+        unsigned View=GetErasureSetID(S,SubarrayID)/m_NumOfErasureSets;
+        for(unsigned i=0;i<m_Length;i++)
+        {
+            unsigned DiskID;
+            unsigned long long Row;
+            GetSymbolLocation(S,SubarrayID,View,i,DiskID,Row);
+            if (m_pArray->m_pDisks[DiskID].GetMountState()!=msReadWrite)
+                continue;
+            if (pExtentRows[DiskID]&&(pExtentStart[DiskID]+pExtentRows[DiskID]==Row))
+            {
+                pExtentRows[DiskID]++;
+                continue;
+            };
+            if (pExtentRows[DiskID])
+                Result&=m_pArray->m_pDisks[DiskID].Discard(pExtentStart[DiskID]*m_StripeUnitsPerSymbol,pExtentRows[DiskID]*m_StripeUnitsPerSymbol);
+            pExtentStart[DiskID]=Row;
+            pExtentRows[DiskID]=1;
+        };
+    };
+    for(unsigned d=0;d<NumOfDisks;d++)
+        if (pExtentRows[d])
+            Result&=m_pArray->m_pDisks[d].Discard(pExtentStart[d]*m_StripeUnitsPerSymbol,pExtentRows[d]*m_StripeUnitsPerSymbol);
+    delete[]pExtentStart;
+    delete[]pExtentRows;
+    return Result;
+};
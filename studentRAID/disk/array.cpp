@@ -14,9 +14,136 @@
 #include "misc.h"
 #include "array.h"
 #include "arithmetic.h"
+#include "sync.h"
 
 using namespace std;
 
+///the maximal number of threads used to open the disks
+#define MAXATTACHTHREADS 32
+///the number of stripes locked at once by a rebuild thread
+#define REBUILDCHUNK 16
+///the number of stripes locked at once by discard()
+#define DISCARDCHUNK 256
+///the number of attempts to read the stripes without locking them, after which they are locked
+#define OPTIMISTICREADATTEMPTS 2
+///array state record signature
+#define ARRAYSTATEMAGIC 0x5BA4E5E7
+///hash tree header signature
+#define HASHTREEMAGIC 0x4A5B7EE3
+
+///the header of the array state record, which is stored at the end of each disk if the layout has spare space.
+///It is followed by the spare slot of each disk (one signed char per disk, -1 if the disk was not relocated)
+struct ArrayStateHeader
+{
+    ///must be ARRAYSTATEMAGIC
+    unsigned MagicNumber;
+    ///the number of disks in the array
+    unsigned NumOfDisks;
+    ///incremented on each update
+    unsigned long long Generation;
+    ///CRC of the record, computed with this field set to 0
+    unsigned CRC;
+};
+
+///the header of the hash stripes. An all-zero header denotes the hashes of an initialized array, which are all zero
+struct HashTreeHeader
+{
+    ///must be HASHTREEMAGIC, or 0
+    unsigned MagicNumber;
+    ///nonzero if the array may have been modified after the hashes were written
+    unsigned Dirty;
+};
+
+///a portion of disks to be opened by a single thread
+struct DiskAttachTask
+{
+    ///the disks to be initialized
+    CDisk* pDisks;
+    ///disk configuration records
+    DiskConf const* pDiskFiles;
+    ///the first disk to be processed by this thread
+    unsigned FirstDisk;
+    ///the number of disks in the array
+    unsigned NumOfDisks;
+    ///distance between the disks processed by this thread
+    unsigned Step;
+    ///size of a disk block
+    unsigned BlockSize;
+    ///the number of blocks on each disk
+    const size_t* pNumOfBlocks;
+    ///array configuration record expected on each disk
+    void const* pCodeConfig;
+    ///size of the array configuration record
+    unsigned CodeConfigSize;
+};
+
+///a part of a read or write request belonging to a single subarray
+struct SubarrayRequest
+{
+    ///the array
+    CDiskArray* pArray;
+    ///the first stripe unit of the whole request
+    unsigned long long StripeUnitID;
+    ///the number of stripe units in the whole request
+    unsigned long long NumOfUnits;
+    ///the data buffer of the whole request
+    unsigned char* pData;
+    ///true if the data must be written
+    bool Write;
+    ///the subarray to be processed
+    unsigned SubarrayID;
+    ///the scratch arena to be used, or (size_t)-1 if the task must obtain its own one
+    size_t ThreadID;
+    ///output: true on success
+    bool Result;
+};
+
+/**Open the disks, map them into memory and validate their headers.
+ * Disks with mismatching array configuration are marked as invalid
+ */
+static THREADPROC AttachDisks(void* pParams ///must be a pointer to DiskAttachTask
+                             )
+{
+    DiskAttachTask& T=*(DiskAttachTask*)pParams;
+    for (unsigned i = T.FirstDisk; i < T.NumOfDisks; i+=T.Step)
+    {
+        if (T.pDisks[i].Initialize(T.pDiskFiles[i].pFileName, i, T.BlockSize, T.pNumOfBlocks[i], T.CodeConfigSize))
+        {
+            //check if the array configuration stored on disk is the same as the one of the processor
+            void const* pCodeConfig2;
+            unsigned CodeConfigSize2 = T.pDisks[i].GetArrayData(pCodeConfig2);
+            if ((CodeConfigSize2 != T.CodeConfigSize) || memcmp(T.pCodeConfig, pCodeConfig2, T.CodeConfigSize))
+            {
+                //cerr << "Array configuration mismatch for disk " << i << endl;
+                T.pDisks[i].SetDiskState(dsInvalid);
+            };
+        };
+    };
+    return 0;
+};
+
+/**Check that the optional features of the array can be used together. This is done before anything is allocated,
+ * since the destructor is not called if the constructor throws an exception
+ */
+static void ValidateConf(const ArrayConf& Conf ///the optional features of the array
+                        )
+{
+    //both of them take over the update of the check symbols by the small writes
+    if (Conf.pParityLogFile&&Conf.pDeferredParityFile)
+        throw Exception("The parity log cannot be used with the deferred update of the check symbols");
+    //the journal records address the payload units directly
+    if (Conf.pJournalFile&&Conf.pDedupFile)
+        throw Exception("The journal cannot be used with deduplication");
+    //both of them map the logical addresses to the payload units
+    if (Conf.pJournalFile&&Conf.pCompressionFile)
+        throw Exception("The journal cannot be used with compression");
+    if (Conf.pDedupFile&&Conf.pCompressionFile)
+        throw Exception("Deduplication cannot be used with compression");
+    //the merged writes are issued to the payload units in place
+    if ((Conf.CoalescingWindow>0)&&(Conf.pJournalFile||Conf.pDedupFile||Conf.pCompressionFile))
+        throw Exception("Write coalescing cannot be used with the journal, deduplication or compression");
+};
+
 ///initialize the array. The array parameters
 ///will be extracted from the processor object
 
@@ -24,50 +151,156 @@ CDiskArray::CDiskArray(unsigned NumberOfDisks, ///the number of disks to be emul
                        ///than the length of the array code implemented by Processor
                        ///All extra disks will be ignored
                        DiskConf const* pDiskFiles, ///configuration of the emulated disks
-                       size_t DiskCapacity, ///the capacity of a single disk
+                       size_t DiskCapacity, ///the capacity of the disks without a capacity of their own
                        CRAIDProcessor& Processor, ///provides encoding and decoding functionality
-                       unsigned NumOfThreads ///the number of concurrent processing threads
+                       unsigned NumOfThreads, ///the expected number of concurrent processing threads. More of them are allowed
+                       const ArrayConf& Conf ///the optional features of the array
                        ) : m_NumOfThreads(NumOfThreads), m_Engine(Processor),
 m_MountState(msUnmounted), m_NumOfDisks(NumberOfDisks),
 m_StripeUnitSize(Processor.GetStripeUnitSize()),
 m_UnitsPerStripePrim(Processor.GetStripeUnitsPerSymbol()*Processor.GetDimension()),
 m_UnitsPerStripe(m_UnitsPerStripePrim*Processor.GetInterleavingOrder()),
-m_NumOfStripes(DiskCapacity / (Processor.GetStripeUnitSize() *
-               Processor.GetStripeUnitsPerSymbol())),
-m_StripeSize(m_UnitsPerStripe*m_StripeUnitSize),m_Locker( NumOfThreads)
+m_StripeSize(m_UnitsPerStripe*m_StripeUnitSize),m_ppLockers(0),m_LockWindow(Conf.LockWindow),
+m_OptimisticReads(Conf.OptimisticReads),m_ReadVersions(0),m_OptimisticReaders(0),m_ReadsSuspended(0),
+m_MirrorBlock(0),m_MirrorBlocks(0),m_StateGeneration(0),m_pSpareSlots(0),m_pReplacementFiles(0),m_RebuildDisk(-1),m_RebuildSlot(0),m_RebuildSubarray(0),m_pRebuilt(0),m_pJournal(0),m_pCache(0),m_pParityLog(0),m_pParityCache(0),m_pDeferredParity(0),m_pDedup(0),m_pCompression(0),m_pCoalescer(0),
+m_pAllocated(0),m_pZeroes(0),m_pHashes(0),m_pUnitHashes(0),m_pVerifiedLeaves(0),m_pHashesDirty(0),
+m_pHashTree(0),m_pVerifiedTree(0),m_ZeroUnitHash(0)
 {
-    if (Processor.GetCodeLength()*Processor.GetInterleavingOrder()> m_NumOfDisks)
-        throw Exception("Not enough disks for a given code (minimum %d is required)", Processor.GetCodeLength()*Processor.GetInterleavingOrder());
-    else m_NumOfDisks= Processor.GetCodeLength()*Processor.GetInterleavingOrder();
+    ValidateConf(Conf);
+    if (Processor.GetNumOfDisks()> m_NumOfDisks)
+        throw Exception("Not enough disks for a given code (minimum %d is required)", Processor.GetNumOfDisks());
+    else m_NumOfDisks= Processor.GetNumOfDisks();
+    //the last rows of each disk are reserved for the array state record if there is some spare space.
+    //The disks may be of different size, and the layout decides how many of their rows are used
+    unsigned SymbolSize=m_StripeUnitSize*Processor.GetStripeUnitsPerSymbol();
+    vector<unsigned long long> Rows(m_NumOfDisks);
+    unsigned long long DiskRows=~0ull;
+    bool Heterogeneous=false;
+    for(unsigned i=0;i<m_NumOfDisks;i++)
+    {
+        Rows[i]=((pDiskFiles[i].Capacity)?pDiskFiles[i].Capacity:DiskCapacity)/SymbolSize;
+        Heterogeneous|=(Rows[i]!=Rows[0]);
+        DiskRows=min(DiskRows,Rows[i]);
+    };
+    unsigned StateRows=0;
+    if (Processor.GetLayout().GetNumOfSpares())
+        StateRows=(unsigned)((sizeof(ArrayStateHeader)+m_NumOfDisks+SymbolSize-1)/SymbolSize);
+    //the rows preceding them keep the mirrored tier
+    unsigned long long MirrorRows=0;
+    if (Conf.pCache&&!Conf.pCache->pFileName)
+        MirrorRows=(Conf.pCache->Capacity+SymbolSize-1)/SymbolSize;
+    //they are located at the same rows of all disks
+    if (Heterogeneous&&(StateRows||MirrorRows))
+        throw Exception("The disks of different size cannot keep the array state record or the mirrored tier");
+    if (DiskRows<=StateRows+MirrorRows)
+        throw Exception("Disk capacity is too small");
+    //the disks are attached with their full size
+    vector<size_t> NumOfBlocks(m_NumOfDisks);
+    for(unsigned i=0;i<m_NumOfDisks;i++)
+    {
+        NumOfBlocks[i]=(size_t)Rows[i]*Processor.GetStripeUnitsPerSymbol();
+        Rows[i]-=StateRows+MirrorRows;
+    };
+    m_NumOfStripes=Processor.GetNumOfStripes(&Rows[0]);
+    //the last stripes keep the allocation map, one bit per subarray of each stripe
+    unsigned NumOfSubarrays=Processor.GetInterleavingOrder();
+    unsigned long long MapStripes=(m_NumOfStripes*NumOfSubarrays+8ull*m_StripeSize-1)/(8ull*m_StripeSize);
+    if (m_NumOfStripes<=MapStripes)
+        throw Exception("Disk capacity is too small");
+    m_MapStripe=m_NumOfStripes-MapStripes;
+    m_pAllocated=AlignedMalloc((size_t)MapStripes*m_StripeSize);
+    memset(m_pAllocated,0,(size_t)MapStripes*m_StripeSize);
+    m_pZeroes=AlignedMalloc(m_StripeSize);
+    memset(m_pZeroes,0,m_StripeSize);
+    m_HashStripe=m_MapStripe;
+    if (Conf.HashTree)
+    {
+        //the hash stripes precede the map ones. They keep the header, the hash of each payload stripe unit,
+        //and the verified leaf of each payload stripe
+        unsigned long long HashStripes=0,HashUnits,UnitHashUnits;
+        do
+        {
+            HashStripes++;
+            if (m_MapStripe<=HashStripes)
+                throw Exception("Disk capacity is too small");
+            unsigned long long PayloadStripes=m_MapStripe-HashStripes;
+            UnitHashUnits=(PayloadStripes*m_UnitsPerStripe*sizeof(unsigned long long)+m_StripeUnitSize-1)/m_StripeUnitSize;
+            HashUnits=1+UnitHashUnits+(PayloadStripes*sizeof(unsigned long long)+m_StripeUnitSize-1)/m_StripeUnitSize;
+        }
+        while (HashStripes*m_UnitsPerStripe<HashUnits);
+        m_HashStripe=m_MapStripe-HashStripes;
+        m_pHashes=AlignedMalloc((size_t)HashStripes*m_StripeSize);
+        memset(m_pHashes,0,(size_t)HashStripes*m_StripeSize);
+        m_pUnitHashes=(unsigned long long*)(m_pHashes+m_StripeUnitSize);
+        m_pVerifiedLeaves=(unsigned long long*)(m_pHashes+(1+UnitHashUnits)*m_StripeUnitSize);
+        m_pHashesDirty=new unsigned char[HashStripes*m_UnitsPerStripe];
+        memset(m_pHashesDirty,0,HashStripes*m_UnitsPerStripe);
+        m_pHashTree=new CHashTree(m_HashStripe);
+        m_pVerifiedTree=new CHashTree(m_HashStripe);
+        m_ZeroUnitHash=CHashTree::Hash(m_pZeroes,m_StripeUnitSize,0);
+    };
+    m_MirrorBlock=(DiskRows-StateRows-MirrorRows)*Processor.GetStripeUnitsPerSymbol();
+    m_MirrorBlocks=MirrorRows*Processor.GetStripeUnitsPerSymbol();
+    m_StateBlock=(DiskRows-StateRows)*Processor.GetStripeUnitsPerSymbol();
+    m_StateBlocks=StateRows*Processor.GetStripeUnitsPerSymbol();
+    m_pSpareSlots=new int[m_NumOfDisks];
+    for (unsigned i = 0; i < m_NumOfDisks; i++)
+        m_pSpareSlots[i]=-1;
+    m_pReplacementFiles=new string[m_NumOfDisks];
+    if (!InitCS(m_RebuildLock))
+        throw Exception("Failed to initialize rebuild mutex");
+    if (!InitCS(m_MapLock))
+        throw Exception("Failed to initialize allocation map mutex");
+    if (!InitCS(m_HashLock))
+        throw Exception("Failed to initialize hash tree mutex");
+    if (!InitCS(m_ReadersLock)||!InitCond(m_ReadersIdle))
+        throw Exception("Failed to initialize optimistic read mutex");
+    m_ppLockers=new CRangeLocker*[NumOfSubarrays];
+    for(unsigned j=0;j<NumOfSubarrays;j++)
+        m_ppLockers[j]=new CRangeLocker(NumOfThreads);
 
     void const* pCodeConfig;
     unsigned CodeConfigSize = Processor.GetConfiguration(pCodeConfig);
-    //attach the disks
+    //attach the disks. Opening and mapping the files may take a while, so this is done in parallel
     m_pDisks = new CDisk[m_NumOfDisks];
+    unsigned NumOfAttachThreads = min(m_NumOfDisks, (unsigned)MAXATTACHTHREADS);
+    DiskAttachTask* pTasks = new DiskAttachTask[NumOfAttachThreads];
+    tThread* pThreads = new tThread[NumOfAttachThreads];
+    for (unsigned t = 0; t < NumOfAttachThreads; t++)
+    {
+        DiskAttachTask& T = pTasks[t];
+        T.pDisks = m_pDisks;
+        T.pDiskFiles = pDiskFiles;
+        T.FirstDisk = t;
+        T.NumOfDisks = m_NumOfDisks;
+        T.Step = NumOfAttachThreads;
+        T.BlockSize = m_StripeUnitSize;
+        T.pNumOfBlocks = &NumOfBlocks[0];
+        T.pCodeConfig = pCodeConfig;
+        T.CodeConfigSize = CodeConfigSize;
+    };
+    unsigned NumOfSpawnedThreads = 1;
+    while ((NumOfSpawnedThreads < NumOfAttachThreads) &&
+            StartThread(pThreads[NumOfSpawnedThreads], AttachDisks, pTasks + NumOfSpawnedThreads))
+        NumOfSpawnedThreads++;
+    //the calling thread processes its share, as well as the share of the threads which could not be spawned
+    AttachDisks(pTasks);
+    for (unsigned t = NumOfSpawnedThreads; t < NumOfAttachThreads; t++)
+        AttachDisks(pTasks + t);
+    for (unsigned t = 1; t < NumOfSpawnedThreads; t++)
+        JoinThread(pThreads[t]);
+    delete[]pThreads;
+    delete[]pTasks;
+
     time_t LastArrayMount = 0;
     for (unsigned i = 0; i < m_NumOfDisks; i++)
     {
-        if (m_pDisks[i].Initialize(pDiskFiles[i].pFileName, i, m_StripeUnitSize, 
-                                  m_NumOfStripes * Processor.GetStripeUnitsPerSymbol(), 
-                                   CodeConfigSize))
+        if (m_pDisks[i].GetDiskState() == dsOffline)
         {
-            //check if the array configuration stored on disk is the same as the one of the processor
-            void const* pCodeConfig2;
-            unsigned CodeConfigSize2 = m_pDisks[i].GetArrayData(pCodeConfig2);
-            if ((CodeConfigSize2 != CodeConfigSize) || memcmp(pCodeConfig, pCodeConfig2, CodeConfigSize))
-            {
-                //cerr << "Array configuration mismatch for disk " << i << endl;
-                m_pDisks[i].SetDiskState(dsInvalid);
-            };
-
-
-            if (m_pDisks[i].GetDiskState() == dsOffline)
-            {
-                //identify the latest mounted disks
-                time_t LastMount = m_pDisks[i].GetLastUnmountTime();
-                if (LastMount > LastArrayMount)
-                    LastArrayMount = LastMount;
-            };
+            //identify the latest mounted disks
+            time_t LastMount = m_pDisks[i].GetLastUnmountTime();
+            if (LastMount > LastArrayMount)
+                LastArrayMount = LastMount;
         };
     };
     unsigned NumOfInitializedDisks = 0;
@@ -88,8 +321,34 @@ m_StripeSize(m_UnitsPerStripe*m_StripeUnitSize),m_Locker( NumOfThreads)
                 m_pDisks[i].SetDiskState(dsInvalid);
         };
     };
+    if (NumOfOnlineDisks)
+        LoadState();
+    if (Conf.pJournalFile)
+        m_pJournal=new CJournal(*this,Conf.pJournalFile,Conf.JournalCapacity,m_NumOfDisks);
+    if (Conf.pCache)
+        m_pCache=new CCacheDevice(*this,*Conf.pCache,m_NumOfDisks+1);
+    if (Conf.pParityLogFile)
+        m_pParityLog=new CParityLog(*this,Conf.pParityLogFile,Conf.ParityLogCapacity,m_NumOfDisks+2);
+    if (Conf.pDeferredParityFile)
+        m_pDeferredParity=new CDeferredParity(*this,Conf.pDeferredParityFile,Conf.MaxStaleness,m_NumOfDisks+3);
+    if (Conf.pDedupFile)
+        m_pDedup=new CDedup(*this,Conf.pDedupFile,NumOfThreads,m_NumOfDisks+4);
+    if (Conf.pCompressionFile)
+        m_pCompression=new CCompression(*this,Conf.pCompressionFile,Conf.CompressionBlock,NumOfThreads,m_NumOfDisks+5);
+    if (Conf.CoalescingWindow>0)
+        m_pCoalescer=new CWriteCoalescer(*this,Conf.CoalescingWindow);
+    if (Conf.ParityCacheCapacity)
+        m_pParityCache=new CParityCache(m_NumOfStripes,NumOfSubarrays,Processor.GetCodeLength()-Processor.GetDimension(),
+                                        Processor.GetStripeUnitsPerSymbol()*m_StripeUnitSize,Conf.ParityCacheCapacity);
     //make final initialization of the coding engine
+    m_PartialRWBuffer = m_Engine.ReserveScratch(m_StripeUnitSize);
+    m_LockIDs = m_Engine.ReserveScratch(sizeof(size_t)*NumOfSubarrays);
+    m_SubarrayRequests = m_Engine.ReserveScratch(sizeof(SubarrayRequest)*NumOfSubarrays);
+    m_ReadVersions = m_Engine.ReserveScratch(sizeof(unsigned long long)*NumOfSubarrays);
     m_Engine.Attach(this, NumOfThreads);
+    //each concurrent request may need a worker for each of its subarrays except the first one
+    if (NumOfSubarrays>1)
+        m_Workers.Start((NumOfSubarrays-1)*max(NumOfThreads,1u));
     if (NumOfInitializedDisks == 0)
         m_ArrayState = asUninitialized;
     else
@@ -105,14 +364,39 @@ m_StripeSize(m_UnitsPerStripe*m_StripeUnitSize),m_Locker( NumOfThreads)
                 m_ArrayState = asFailed;
         };
     };
-    m_pPartialRWBuffer = AlignedMalloc(m_StripeUnitSize * m_NumOfThreads);
 };
 
 CDiskArray::~CDiskArray()
 {
     Unmount();
+    m_Workers.Stop();
+    delete m_pJournal;
+    delete m_pCache;
+    delete m_pParityLog;
+    delete m_pParityCache;
+    delete m_pDeferredParity;
+    delete m_pDedup;
+    delete m_pCompression;
+    delete m_pCoalescer;
+    //the processor may have been already destroyed
+    for(unsigned j=0;j<m_UnitsPerStripe/m_UnitsPerStripePrim;j++)
+        delete m_ppLockers[j];
+    delete[]m_ppLockers;
     delete[]m_pDisks;
-    AlignedFree(m_pPartialRWBuffer);
+    delete[]m_pReplacementFiles;
+    delete[]m_pSpareSlots;
+    AlignedFree(m_pAllocated);
+    AlignedFree(m_pZeroes);
+    delete m_pVerifiedTree;
+    delete m_pHashTree;
+    delete[]m_pHashesDirty;
+    if (m_pHashes)
+        AlignedFree(m_pHashes);
+    DestroyCS(m_HashLock);
+    DestroyCS(m_MapLock);
+    DestroyCS(m_RebuildLock);
+    DestroyCond(m_ReadersIdle);
+    DestroyCS(m_ReadersLock);
 };
 
 ///enable data access
@@ -135,6 +419,53 @@ bool CDiskArray::Mount ( bool Write ///true if write access is needed
     else
         //this should not happen
         throw Exception ( "Unexpected mount failure" );
+    //the journal replay needs the allocation map
+    if ( !LoadMap() )
+    {
+        cerr<<"Failed to load the allocation map\n";
+        Unmount();
+        return false;
+    };
+    //the replayed writes update the hashes
+    if ( m_pHashes&&!LoadHashes() )
+    {
+        cerr<<"Failed to load the hash tree\n";
+        Unmount();
+        return false;
+    };
+    //the stripes updated by the interrupted writes are re-encoded before any of them is decoded
+    if ( m_pParityLog&&!m_pParityLog->Start ( Write ) )
+    {
+        Unmount();
+        return false;
+    };
+    if ( m_pDeferredParity&&!m_pDeferredParity->Start ( Write ) )
+    {
+        Unmount();
+        return false;
+    };
+    //the journal replay may update the cached lines
+    if ( m_pCache&&!m_pCache->Start ( Write ) )
+    {
+        Unmount();
+        return false;
+    };
+    //repeat the writes interrupted by a crash
+    if ( m_pJournal&&!m_pJournal->Start ( Write ) )
+    {
+        Unmount();
+        return false;
+    };
+    if ( m_pDedup&&!m_pDedup->Start ( Write ) )
+    {
+        Unmount();
+        return false;
+    };
+    if ( m_pCompression&&!m_pCompression->Start ( Write ) )
+    {
+        Unmount();
+        return false;
+    };
     return Result;
 };
 
@@ -145,12 +476,42 @@ bool CDiskArray::Unmount()
 {
     if ( m_MountState==msUnmounted )
         return false;
+    bool Result=true;
+    //write the deduplication index and the compression map after the data they refer to
+    if ( m_pDedup )
+        Result&=m_pDedup->Stop();
+    if ( m_pCompression )
+        Result&=m_pCompression->Stop();
+    if ( m_pCoalescer )
+        m_pCoalescer->Reset();
+    //complete the pending writes
+    if ( m_pJournal )
+        Result&=m_pJournal->Stop();
+    //write back the cached data, which updates the hashes
+    if ( m_pCache )
+        Result&=m_pCache->Stop();
+    //apply the check symbol differences. The hashes are saved by the in-place updates
+    if ( m_pParityLog )
+        Result&=m_pParityLog->Stop();
+    //re-encode the stale stripes
+    if ( m_pDeferredParity )
+        Result&=m_pDeferredParity->Stop();
+    if ( m_MountState==msReadWrite )
+        Result&=SaveHashes ( true );
+    //the reads which do not lock the stripes may still access the disks
+    SuspendOptimisticReads();
     m_MountState=msUnmounted;
+    //the disks may be modified while the array is unmounted
+    if ( m_pParityCache )
+    {
+        m_pParityCache->ReportStatistics();
+        m_pParityCache->Reset();
+    };
     //unmount all the disks and put the timestamp if necessary
-	bool Result=true;
     time_t Timestamp=time ( NULL );
     for ( unsigned i=0;i<m_NumOfDisks;i++ )
         Result&=m_pDisks[i].Unmount ( Timestamp );
+    ResumeOptimisticReads();
 
 	return Result;
 };
@@ -173,6 +534,33 @@ bool CDiskArray::Init()
       m_pDisks[i].SetArrayData(pArrayData,DataSize);
         Result&=m_pDisks[i].ResetDisk();
     };
+    //no disks are relocated to the spare space
+    for ( unsigned i=0;i<m_NumOfDisks;i++ )
+        m_pSpareSlots[i]=-1;
+    m_StateGeneration=0;
+    //the disks are filled with zeroes, so no stripes are allocated
+    memset ( m_pAllocated,0, ( size_t ) ( m_NumOfStripes-m_MapStripe ) *m_StripeSize );
+    //the hashes of the units filled with zeroes are zero as well
+    if ( m_pHashes )
+    {
+        memset ( m_pHashes,0, ( size_t ) ( m_MapStripe-m_HashStripe ) *m_StripeSize );
+        m_pHashTree->Load ( m_pVerifiedLeaves );
+        m_pVerifiedTree->Load ( m_pVerifiedLeaves );
+    };
+    if ( m_pJournal )
+        Result&=m_pJournal->Init();
+    if ( m_pCache )
+        Result&=m_pCache->Init();
+    if ( m_pParityLog )
+        Result&=m_pParityLog->Init();
+    if ( m_pDeferredParity )
+        Result&=m_pDeferredParity->Init();
+    if ( m_pDedup )
+        Result&=m_pDedup->Init();
+    if ( m_pCompression )
+        Result&=m_pCompression->Init();
+    if ( m_pParityCache )
+        m_pParityCache->Reset();
     if ( Result )
     {
         //reset the erasure configuration
@@ -191,55 +579,142 @@ bool CDiskArray::Init()
 
 
 
+/** The stripe range of each lock domain is locked separately. The domains are always taken in the ascending order,
+ * so that the requests spanning several subarrays cannot deadlock
+ */
+size_t CDiskArray::LockStripes(unsigned long long FirstStripe,///the first stripe to be locked
+                               unsigned long long LastStripe,///the stripe following the last one to be locked
+                               int SubarrayID ///the subarray to be locked, or -1 for all of them
+                              )
+{
+    size_t ThreadID=m_Engine.AcquireScratch();
+    size_t* pLockIDs=(size_t*)(m_Engine.GetScratch(ThreadID)+m_LockIDs);
+    for(unsigned j=0;j<GetNumOfSubarrays();j++)
+        pLockIDs[j]=((SubarrayID<0)||(j==(unsigned)SubarrayID))?m_ppLockers[j]->Lock(FirstStripe,LastStripe):(size_t)-1;
+    return ThreadID;
+};
+
+/** The stripes are granted at once in each domain, so that the thread never holds one of them while waiting
+ * for the other one behind a request overlapping both of them
+ */
+size_t CDiskArray::LockStripePair(unsigned long long FirstStripe,///the first stripe to be locked
+                                  unsigned long long SecondStripe ///the second stripe to be locked
+                                 )
+{
+    size_t ThreadID=m_Engine.AcquireScratch();
+    size_t* pLockIDs=(size_t*)(m_Engine.GetScratch(ThreadID)+m_LockIDs);
+    for(unsigned j=0;j<GetNumOfSubarrays();j++)
+        pLockIDs[j]=m_ppLockers[j]->Lock(FirstStripe,FirstStripe+1,SecondStripe,SecondStripe+1);
+    return ThreadID;
+};
+
+/** Only the domains of the subarrays actually accessed by the request are locked, so that
+ * the small requests to different subarrays of the same stripes proceed concurrently
+ */
+size_t CDiskArray::LockUnits(unsigned long long FirstUnit,///the first stripe unit to be locked
+                             unsigned long long LastUnit ///the unit following the last one to be locked
+                            )
+{
+    size_t ThreadID=m_Engine.AcquireScratch();
+    size_t* pLockIDs=(size_t*)(m_Engine.GetScratch(ThreadID)+m_LockIDs);
+    for(unsigned j=0;j<GetNumOfSubarrays();j++)
+    {
+        unsigned long long FirstStripe,LastStripe;
+        GetSubarrayStripes(FirstUnit,LastUnit,j,FirstStripe,LastStripe);
+        pLockIDs[j]=(FirstStripe<LastStripe)?m_ppLockers[j]->Lock(FirstStripe,LastStripe):(size_t)-1;
+    };
+    return ThreadID;
+};
+
+///release the stripes and the scratch arena obtained by LockStripes() or LockUnits()
+void CDiskArray::UnlockStripes(size_t ThreadID ///the scratch arena
+                              )
+{
+    size_t* pLockIDs=(size_t*)(m_Engine.GetScratch(ThreadID)+m_LockIDs);
+    for(unsigned j=0;j<GetNumOfSubarrays();j++)
+        if (pLockIDs[j]!=(size_t)-1)
+            m_ppLockers[j]->Unlock(pLockIDs[j]);
+    m_Engine.ReleaseScratch(ThreadID);
+};
+
+/** The counters are updated atomically, so either the last read sees the suspension and signals, or this thread sees no reads
+ */
+void CDiskArray::SuspendOptimisticReads()
+{
+    AtomicAdd(m_ReadsSuspended,1);
+    LockCS(m_ReadersLock);
+    while (m_OptimisticReaders)
+        CondWait(m_ReadersIdle,m_ReadersLock);
+    UnlockCS(m_ReadersLock);
+};
+
+void CDiskArray::ResumeOptimisticReads()
+{
+    AtomicAdd(m_ReadsSuspended,-1);
+};
+
+/** The reads which do not lock the stripes access the erasure configuration and the rebuild state,
+ * so they are drained before these can be changed. The new reads meanwhile lock the stripes
+ */
+size_t CDiskArray::LockArray()
+{
+    size_t ThreadID=LockStripes(0,m_NumOfStripes);
+    SuspendOptimisticReads();
+    return ThreadID;
+};
+
+void CDiskArray::UnlockArray(size_t ThreadID ///the scratch arena
+                            )
+{
+    ResumeOptimisticReads();
+    UnlockStripes(ThreadID);
+};
+
+bool CDiskArray::BeginReadUnits(unsigned long long FirstUnit,///the first stripe unit to be read
+                                unsigned long long LastUnit,///the unit following the last one to be read
+                                unsigned long long* pVersions ///output: the version of the stripes in each lock domain
+                               )const
+{
+    for(unsigned j=0;j<GetNumOfSubarrays();j++)
+    {
+        unsigned long long FirstStripe,LastStripe;
+        GetSubarrayStripes(FirstUnit,LastUnit,j,FirstStripe,LastStripe);
+        if ((FirstStripe<LastStripe)&&!m_ppLockers[j]->BeginRead(FirstStripe,LastStripe,pVersions[j]))
+            return false;
+    };
+    return true;
+};
+
+bool CDiskArray::EndReadUnits(unsigned long long FirstUnit,///the first stripe unit read
+                              unsigned long long LastUnit,///the unit following the last one read
+                              const unsigned long long* pVersions ///the versions obtained by BeginReadUnits()
+                             )const
+{
+    for(unsigned j=0;j<GetNumOfSubarrays();j++)
+    {
+        unsigned long long FirstStripe,LastStripe;
+        GetSubarrayStripes(FirstUnit,LastUnit,j,FirstStripe,LastStripe);
+        if ((FirstStripe<LastStripe)&&!m_ppLockers[j]->EndRead(FirstStripe,LastStripe,pVersions[j]))
+            return false;
+    };
+    return true;
+};
+
 ///read a number of stripe units. The array must be mounted
 ///@return true on success
 bool CDiskArray::Read(unsigned long long StripeUnitID,///the first stripe unit
               unsigned  long long Units2Read,///the number of stripe units to be read
               unsigned char* pDest, ///destination buffer. Must have size for Units2Read*m_StripeUnitSize bytes
-            size_t ThreadID ///the ID of a calling thread obtained from m_Locker  
+            size_t ThreadID ///the scratch arena of a calling thread obtained from LockStripes()
          )
 {
     if (m_MountState==msUnmounted)
       return false;
-    unsigned long long StripeID=StripeUnitID/m_UnitsPerStripe;
-    unsigned UnitID=StripeUnitID%m_UnitsPerStripe;
-    bool Result=true;
-/*    if (UnitID)
-    {
-        //partial read
-        unsigned CurUnits2Read=(unsigned)min((unsigned long long)(m_UnitsPerStripe-UnitID),Units2Read);
-        Result&=m_Engine.ReadData(StripeID,UnitID,CurUnits2Read,pDest,ThreadID);
-        pDest+=CurUnits2Read*m_StripeUnitSize;
-        StripeID++;
-        Units2Read-=CurUnits2Read;
-        UnitID=0;
-    };
-    while(Result&&(Units2Read>=m_UnitsPerStripe))
-    {
-        Result&=m_Engine.ReadData(StripeID++,0,m_UnitsPerStripe,pDest,ThreadID);
-        pDest+=m_StripeSize;
-        Units2Read-=m_UnitsPerStripe;
-    };
-    if(Result&&(Units2Read>0))
-    {
-        Result&=m_Engine.ReadData(StripeID++,0,(unsigned)Units2Read,pDest,ThreadID);
-    };*/
-    unsigned InterleavedID=UnitID/m_UnitsPerStripePrim;
-    unsigned CurUnit=UnitID%m_UnitsPerStripePrim;
-    while(Result&&Units2Read)
-    {
-        unsigned CurUnits2Read=(unsigned)min((unsigned long long)(m_UnitsPerStripePrim-CurUnit),Units2Read);
-        Result&=m_Engine.ReadData(StripeID,CurUnit,InterleavedID,CurUnits2Read,pDest,ThreadID);
-        pDest+=CurUnits2Read*m_StripeUnitSize;
-        Units2Read-=CurUnits2Read;
-        CurUnit=0;
-        InterleavedID++;
-        if (InterleavedID==m_Engine.GetInterleavingOrder())
-        {
-            InterleavedID=0;
-            StripeID++;
-        };
-    };
+    bool Result=(m_pCache)?m_pCache->Transfer(StripeUnitID,Units2Read,pDest,false,ThreadID):
+                           Transfer(StripeUnitID,Units2Read,pDest,false,ThreadID);
+    if (m_pJournal)
+        //take the data not yet written in place from the journal
+        m_pJournal->Overlay(StripeUnitID,Units2Read,pDest);
     return Result;
 };
 
@@ -248,174 +723,1091 @@ bool CDiskArray::Read(unsigned long long StripeUnitID,///the first stripe unit
 bool CDiskArray::Write(unsigned long long StripeUnitID,///the first stripe unit
               unsigned  long long Units2Write,///the number of stripe units to be written
               const unsigned char* pSrc,///source buffer. Must have size for Units2Write*m_StripeUnitSize bytes
-            size_t ThreadID ///the ID of a calling thread obtained from m_Locker  
+            size_t ThreadID ///the scratch arena of a calling thread obtained from LockStripes()
         )
 {
     if (m_MountState!=msReadWrite)
       return false;
-    unsigned long long StripeID=StripeUnitID/m_UnitsPerStripe;
-    unsigned UnitID=StripeUnitID%m_UnitsPerStripe;
+    //the buffer is not modified by the write
+    if (m_pCache)
+        return m_pCache->Transfer(StripeUnitID,Units2Write,(unsigned char*)pSrc,true,ThreadID);
+    return Transfer(StripeUnitID,Units2Write,(unsigned char*)pSrc,true,ThreadID);
+};
+
+/** The request is split into the parts belonging to each subarray. If there are several of them,
+ * they are submitted to the worker threads, and the calling thread processes the first one in its own
+ * scratch arena. The remaining parts obtain the arenas of their own
+ */
+bool CDiskArray::Transfer(unsigned long long StripeUnitID, ///the first stripe unit
+                          unsigned long long NumOfUnits, ///the number of stripe units
+                          unsigned char* pData, ///the data buffer. Must have size for NumOfUnits*m_StripeUnitSize bytes
+                          bool Write, ///true if the data must be written
+                          size_t ThreadID ///the scratch arena of a calling thread obtained from LockStripes()
+                         )
+{
+    SubarrayRequest* pRequests=(SubarrayRequest*)(m_Engine.GetScratch(ThreadID)+m_SubarrayRequests);
+    unsigned NumOfRequests=0;
+    for(unsigned j=0;j<GetNumOfSubarrays();j++)
+    {
+        unsigned long long FirstStripe,LastStripe;
+        GetSubarrayStripes(StripeUnitID,StripeUnitID+NumOfUnits,j,FirstStripe,LastStripe);
+        if (FirstStripe==LastStripe)
+            continue;
+        SubarrayRequest& R=pRequests[NumOfRequests];
+        R.pArray=this;
+        R.StripeUnitID=StripeUnitID;
+        R.NumOfUnits=NumOfUnits;
+        R.pData=pData;
+        R.Write=Write;
+        R.SubarrayID=j;
+        R.ThreadID=(NumOfRequests)?(size_t)-1:ThreadID;
+        R.Result=false;
+        NumOfRequests++;
+    };
+    if (NumOfRequests==1)
+        return TransferSubarray(StripeUnitID,NumOfUnits,pData,Write,pRequests[0].SubarrayID,ThreadID);
+    m_Workers.Run(TransferTask,pRequests,sizeof(SubarrayRequest),NumOfRequests);
+    bool Result=true;
+    for(unsigned i=0;i<NumOfRequests;i++)
+        Result&=pRequests[i].Result;
+    return Result;
+};
+
+///execute a part of a request via TransferSubarray()
+void CDiskArray::TransferTask(void* pParams ///must be a pointer to SubarrayRequest
+                             )
+{
+    SubarrayRequest& R=*(SubarrayRequest*)pParams;
+    CDiskArray& A=*R.pArray;
+    size_t ThreadID=(R.ThreadID==(size_t)-1)?A.m_Engine.AcquireScratch():R.ThreadID;
+    R.Result=A.TransferSubarray(R.StripeUnitID,R.NumOfUnits,R.pData,R.Write,R.SubarrayID,ThreadID);
+    if (R.ThreadID==(size_t)-1)
+        A.m_Engine.ReleaseScratch(ThreadID);
+};
+
+/** The parts of the stripes written for the first time which are not completely covered by the request
+ * are cleared, so that the units not covered by it are zero, and the partial update does not rely
+ * on the stale content of the disks. The map is updated after the data, so that a stripe is never
+ * reported as allocated before its content is valid
+ */
+bool CDiskArray::TransferSubarray(unsigned long long StripeUnitID, ///the first stripe unit of the range
+                                  unsigned long long NumOfUnits, ///the number of stripe units in the range
+                                  unsigned char* pData, ///the data buffer for the whole range
+                                  bool Write, ///true if the data must be written
+                                  unsigned SubarrayID, ///the subarray
+                                  size_t ThreadID ///the scratch arena of a calling thread obtained from LockStripes()
+                                 )
+{
+    unsigned long long LastUnit=StripeUnitID+NumOfUnits;
+    unsigned long long FirstStripe,LastStripe;
+    GetSubarrayStripes(StripeUnitID,LastUnit,SubarrayID,FirstStripe,LastStripe);
     bool Result=true;
-   /* if (UnitID)
-    {
-        //partial write
-        unsigned CurUnits2Write=(unsigned)min((unsigned long long)(m_UnitsPerStripe-UnitID),Units2Write);
-        Result&=m_Engine.WriteData(StripeID,UnitID,CurUnits2Write,pSrc,ThreadID);
-        pSrc+=CurUnits2Write*m_StripeUnitSize;
-        StripeID++;
-        Units2Write-=CurUnits2Write;
-        UnitID=0;
-    };
-    while(Result&&(Units2Write>=m_UnitsPerStripe))
-    {
-        Result&=m_Engine.WriteData(StripeID++,0,m_UnitsPerStripe,pSrc,ThreadID);
-        pSrc+=m_StripeSize;
-        Units2Write-=m_UnitsPerStripe;
-    };
-    if(Result&&(Units2Write>0))
-    {
-        Result&=m_Engine.WriteData(StripeID++,0,(unsigned)Units2Write,pSrc,ThreadID);
-    };*/
-    unsigned InterleavedID=UnitID/m_UnitsPerStripePrim;
-    unsigned CurUnit=UnitID%m_UnitsPerStripePrim;
-    while(Result&&Units2Write)
-    {
-        unsigned CurUnits2Write=(unsigned)min((unsigned long long)(m_UnitsPerStripePrim-CurUnit),Units2Write);
-        Result&=m_Engine.WriteData(StripeID,CurUnit,InterleavedID,CurUnits2Write,pSrc,ThreadID);
-        pSrc+=CurUnits2Write*m_StripeUnitSize;
-        Units2Write-=CurUnits2Write;
-        CurUnit=0;
-        InterleavedID++;
-        if (InterleavedID==m_Engine.GetInterleavingOrder())
+    for(unsigned long long S=FirstStripe;Result&&(S<LastStripe);S++)
+    {
+        //the units of the subarray within the stripe
+        unsigned long long Start=S*m_UnitsPerStripe+SubarrayID*m_UnitsPerStripePrim;
+        unsigned long long From=max(Start,StripeUnitID);
+        unsigned Units=(unsigned)(min(Start+m_UnitsPerStripePrim,LastUnit)-From);
+        unsigned char* pCur=pData+(From-StripeUnitID)*m_StripeUnitSize;
+        if (Write)
         {
-            InterleavedID=0;
-            StripeID++;
-        };
+            if ((Units<m_UnitsPerStripePrim)&&!IsAllocated(S,SubarrayID))
+                Result&=ClearStripe(S,SubarrayID,ThreadID);
+            Result&=m_Engine.WriteData(S,(unsigned)(From-Start),SubarrayID,Units,pCur,ThreadID);
+            if (m_pHashes&&(S<m_HashStripe))
+                UpdateHashes(S,SubarrayID,(unsigned)(From-Start),Units,pCur);
+        }
+        else
+        if (IsAllocated(S,SubarrayID))
+        {
+            RepairStripe(S,(unsigned)(From-Start),SubarrayID,Units,ThreadID);
+            Result&=m_Engine.ReadData(S,(unsigned)(From-Start),SubarrayID,Units,pCur,ThreadID);
+        }
+        else
+            //the stripe was not written since it was initialized or discarded
+            memset(pCur,0,Units*m_StripeUnitSize);
     };
-
+    if (Write&&Result&&(FirstStripe<m_HashStripe))
+        Result&=UpdateMap(FirstStripe,min(LastStripe,m_HashStripe),SubarrayID,true,ThreadID);
     return Result;
 };
 
-///check if the array is consistend
-///@return true on success
-bool CDiskArray::Check()
+/** The whole stripe is decoded once and its symbols are written to the disk being rebuilt, so that the hot stripes
+ * become healthy first, and the subsequent reads do not need decoding. The stripe is then skipped by the rebuild threads.
+ * The hash and map stripes are left to the rebuild threads, since they are updated under the map lock
+ */
+void CDiskArray::RepairStripe(unsigned long long StripeID,///the stripe
+                              unsigned StripeUnitID,///the first payload stripe unit being read
+                              unsigned SubarrayID,///the subarray
+                              unsigned NumOfUnits,///the number of units being read
+                              size_t ThreadID ///the scratch arena of a calling thread obtained from LockStripes()
+                             )
 {
-    eMountState OldState=m_MountState;
-    size_t LockID=m_Locker.Lock(0,m_NumOfStripes);
-    Unmount();
-    //mount disks read-only
-    for(unsigned i=0;i<m_NumOfDisks;i++)
-      m_pDisks[i].Mount(false);
-    
-    bool Result=true;
-    for(unsigned long long S=0;S<m_NumOfStripes;S++)
+    if (!m_pRebuilt||(SubarrayID!=m_RebuildSubarray)||m_pRebuilt[StripeID]||(StripeID>=m_HashStripe)||(m_MountState!=msReadWrite)||
+            !m_Engine.IsDegraded(StripeID,StripeUnitID,SubarrayID,NumOfUnits))
+        return;
+    //if the stripe cannot be rebuilt, the read decodes it, and the rebuild threads report the failure
+    if (!m_Engine.RebuildStripe(StripeID,SubarrayID,ThreadID))
+        return;
+    m_pRebuilt[StripeID]=1;
+    LockCS(m_RebuildLock);
+    m_RepairedStripes++;
+    UnlockCS(m_RebuildLock);
+};
+
+/** The subarray is encoded from a buffer of zeroes, so that no data is read from the disks
+ */
+bool CDiskArray::ClearStripe(unsigned long long StripeID,///the stripe
+                             unsigned SubarrayID,///the subarray
+                             size_t ThreadID ///the scratch arena of a calling thread obtained from LockStripes()
+                            )
+{
+    return m_Engine.WriteData(StripeID,0,SubarrayID,m_UnitsPerStripePrim,m_pZeroes,ThreadID);
+};
+
+/** The map is written to the array in whole stripe units, so only the units containing the modified bits
+ * need to be updated. The map is not locked if no changes are needed, which is the case for most writes.
+ * The calling thread may be processing a part of a concurrent request, so the map units are written
+ * by it sequentially rather than via the worker threads
+ */
+bool CDiskArray::UpdateMap(unsigned long long FirstStripe,///the first stripe
+                           unsigned long long LastStripe,///the stripe following the last one
+                           unsigned SubarrayID,///the subarray
+                           bool Allocated,///the new state of the stripes
+                           size_t ThreadID ///the scratch arena of a calling thread obtained from LockStripes()
+                          )
+{
+    unsigned long long S=FirstStripe;
+    while ((S<LastStripe)&&(IsAllocated(S,SubarrayID)==Allocated))
+        S++;
+    if (S==LastStripe)
+        return true;
+    unsigned NumOfSubarrays=GetNumOfSubarrays();
+    LockCS(m_MapLock);
+    unsigned long long FirstUnit=(S*NumOfSubarrays+SubarrayID)/8/m_StripeUnitSize;
+    unsigned long long LastUnit=((LastStripe-1)*NumOfSubarrays+SubarrayID)/8/m_StripeUnitSize+1;
+    for(;S<LastStripe;S++)
     {
-         bool R=m_Engine.VerifyStripe(S,0);
-         if (!R)
-         {
-           cerr<<"Invalid stripe "<<S<<endl;
-           Result=false;
-         };
+        unsigned long long Bit=S*NumOfSubarrays+SubarrayID;
+        if (Allocated)
+            m_pAllocated[Bit/8]|=1<<(Bit%8);
+        else
+            m_pAllocated[Bit/8]&=~(1<<(Bit%8));
     };
-    if (OldState!=msUnmounted)
-      Mount(OldState==msReadWrite);
-    m_Locker.Unlock(LockID);
+    bool Result=true;
+    for(unsigned j=0;j<NumOfSubarrays;j++)
+        Result&=TransferSubarray(m_MapStripe*m_UnitsPerStripe+FirstUnit,LastUnit-FirstUnit,m_pAllocated+FirstUnit*m_StripeUnitSize,true,j,ThreadID);
+    UnlockCS(m_MapLock);
     return Result;
 };
 
+/** The map is read as ordinary data, so it survives the disk failures as well as the payload.
+ * It is never cached, so it is read directly from the disks.
+ * No stripe locks are needed, since the array has just been mounted
+ */
+bool CDiskArray::LoadMap()
+{
+    size_t ThreadID=m_Engine.AcquireScratch();
+    bool Result=Transfer(m_MapStripe*m_UnitsPerStripe,(m_NumOfStripes-m_MapStripe)*m_UnitsPerStripe,m_pAllocated,false,ThreadID);
+    m_Engine.ReleaseScratch(ThreadID);
+    return Result;
+};
 
-/** If the requested range does not fit into an integer number of stripe units,
- * read the incomplete ones and extract the required information from them.
- * The remaining data is read via a huge Read call
- * @return the actual number of bytes read, or -1 in case of error
+/** The unit hashes are stored without the hash lock, since the units are protected by the stripe locks.
+ * The leaf is recomputed under the lock, since the other subarrays of the stripe may be updated concurrently
  */
-long long CDiskArray::read(tHandle& fd,///file description, i.e. current position
-             long long Bytes2Read,///the number of bytes to be read
-             unsigned char* pDest ///destination address
-        )
+void CDiskArray::UpdateHashes(unsigned long long StripeID,///the stripe
+                              unsigned SubarrayID,///the subarray
+                              unsigned FirstUnit,///the first unit within the subarray
+                              unsigned NumOfUnits,///the number of units
+                              const unsigned char* pData ///the data written, or 0 if the units were filled with zeroes
+                             )
 {
-    long long NewPos=fd+Bytes2Read;
-    if ((unsigned long long)NewPos>GetCapacity())
-      NewPos=GetCapacity();
-    Bytes2Read=NewPos-fd;
-    if (Bytes2Read<0)
-      //this should never happen
-      return -1;
-    unsigned long long S=fd/m_StripeUnitSize;
-    unsigned Offset=fd%m_StripeUnitSize;
-    size_t ThreadID=m_Locker.Lock(fd/m_StripeSize,NewPos/m_StripeSize+((NewPos%m_StripeSize)?1:0));
-    if (Offset)
+    unsigned long long FirstHash=StripeID*m_UnitsPerStripe+SubarrayID*m_UnitsPerStripePrim+FirstUnit;
+    for(unsigned i=0;i<NumOfUnits;i++)
+        m_pUnitHashes[FirstHash+i]=(pData)?CHashTree::Hash(pData+i*m_StripeUnitSize,m_StripeUnitSize,0)^m_ZeroUnitHash:0;
+    CommitHashes(StripeID,FirstHash,NumOfUnits);
+};
+
+/** The copied units have the same content, so their hashes need not be recomputed
+ */
+void CDiskArray::CopyHashes(unsigned long long SrcStripeID,///the stripe the units were copied from
+                            unsigned long long DestStripeID,///the stripe the units were copied to
+                            unsigned SubarrayID ///the subarray
+                           )
+{
+    unsigned long long FirstHash=DestStripeID*m_UnitsPerStripe+SubarrayID*m_UnitsPerStripePrim;
+    memcpy(m_pUnitHashes+FirstHash,m_pUnitHashes+SrcStripeID*m_UnitsPerStripe+SubarrayID*m_UnitsPerStripePrim,
+           sizeof(unsigned long long)*m_UnitsPerStripePrim);
+    CommitHashes(DestStripeID,FirstHash,m_UnitsPerStripePrim);
+};
+
+///update the hash tree after the unit hashes of a payload stripe were modified, and mark them for saving
+void CDiskArray::CommitHashes(unsigned long long StripeID,///the stripe
+                              unsigned long long FirstHash,///the first modified unit hash
+                              unsigned NumOfUnits ///the number of modified unit hashes
+                             )
+{
+    //the stripe units of m_pHashes containing the modified hashes
+    size_t First=(size_t)(((unsigned char*)(m_pUnitHashes+FirstHash)-m_pHashes)/m_StripeUnitSize);
+    size_t Last=(size_t)(((unsigned char*)(m_pUnitHashes+FirstHash+NumOfUnits)-m_pHashes-1)/m_StripeUnitSize);
+    LockCS(m_HashLock);
+    UpdateLeaf(StripeID);
+    memset(m_pHashesDirty+First,1,Last-First+1);
+    UnlockCS(m_HashLock);
+};
+
+/** The leaf is the hash of the unit hashes of the stripe, or zero if all of them are zero
+ */
+void CDiskArray::UpdateLeaf(unsigned long long StripeID ///the stripe
+                           )
+{
+    const unsigned long long* pHashes=m_pUnitHashes+StripeID*m_UnitsPerStripe;
+    unsigned long long Leaf=0;
+    for(unsigned i=0;(i<m_UnitsPerStripe)&&!Leaf;i++)
+        Leaf=pHashes[i];
+    if (Leaf)
+        Leaf=CHashTree::Hash(pHashes,m_UnitsPerStripe*sizeof(unsigned long long),0);
+    m_pHashTree->SetLeaf(StripeID,Leaf);
+};
+
+/** The hashes are read as ordinary data, as well as the allocation map. If the array was not unmounted cleanly,
+ * the hashes of the allocated stripes are recomputed from their content, and no stripes are considered as verified.
+ * If the array is write-mounted, the header is marked dirty before any data are written
+ */
+bool CDiskArray::LoadHashes()
+{
+    size_t ThreadID=m_Engine.AcquireScratch();
+    unsigned long long HashUnits=(m_MapStripe-m_HashStripe)*m_UnitsPerStripe;
+    bool Result=Transfer(m_HashStripe*m_UnitsPerStripe,HashUnits,m_pHashes,false,ThreadID);
+    memset(m_pHashesDirty,0,(size_t)HashUnits);
+    const HashTreeHeader& H=*(const HashTreeHeader*)m_pHashes;
+    if (Result&&(((H.MagicNumber!=HASHTREEMAGIC)&&H.MagicNumber)||H.Dirty))
     {
-        //partial stripe unit read is necessary
-        unsigned char* pTemp=m_pPartialRWBuffer+ThreadID*m_StripeUnitSize;
-        if (!Read(S,1,pTemp,ThreadID))
+        cerr<<"The array was not unmounted cleanly, recomputing the hashes\n";
+        unsigned char* pStripe=AlignedMalloc(m_StripeSize);
+        for(unsigned long long S=0;Result&&(S<m_HashStripe);S++)
         {
-          m_Locker.Unlock(ThreadID);
-          return -1;
+            Result&=Transfer(S*m_UnitsPerStripe,m_UnitsPerStripe,pStripe,false,ThreadID);
+            for(unsigned j=0;j<GetNumOfSubarrays();j++)
+                UpdateHashes(S,j,0,m_UnitsPerStripePrim,(IsAllocated(S,j))?pStripe+j*m_UnitsPerStripePrim*m_StripeUnitSize:0);
+            m_pVerifiedLeaves[S]=~0ull;
         };
-        unsigned L=m_StripeUnitSize-Offset;
-        if (L>Bytes2Read)
-          L=(unsigned)Bytes2Read;
-        memcpy(pDest,pTemp+Offset,L);
-        fd+=L;
-        pDest+=L;
-        S++;
-    };
-    unsigned long long Stripes2Read=(NewPos-fd)/m_StripeUnitSize;
-    if (!Read(S,Stripes2Read,pDest,ThreadID))
+        AlignedFree(pStripe);
+        memset(m_pHashesDirty,1,(size_t)HashUnits);
+    }
+    else
     {
-        m_Locker.Unlock(ThreadID);
-      return -1;
+        LockCS(m_HashLock);
+        for(unsigned long long S=0;S<m_HashStripe;S++)
+            UpdateLeaf(S);
+        UnlockCS(m_HashLock);
     };
-    S+=Stripes2Read;
-    pDest+=Stripes2Read*m_StripeUnitSize;
-    fd+=Stripes2Read*m_StripeUnitSize;
-    if (fd<NewPos)
+    m_Engine.ReleaseScratch(ThreadID);
+    m_pVerifiedTree->Load(m_pVerifiedLeaves);
+    if (Result&&(m_MountState==msReadWrite))
+        Result=SaveHashes(false);
+    return Result;
+};
+
+/** The hashes are written in runs of consecutive modified stripe units. The header is written
+ * after the rest of the hashes is made persistent, and only if its state changes
+ */
+bool CDiskArray::SaveHashes(bool Clean ///true if no writes are expected until the array is unmounted
+                           )
+{
+    if (!m_pHashes)
+        return true;
+    LockCS(m_MapLock);
+    LockCS(m_HashLock);
+    size_t ThreadID=m_Engine.AcquireScratch();
+    unsigned long long HashUnits=(m_MapStripe-m_HashStripe)*m_UnitsPerStripe;
+    unsigned long long FirstHashUnit=m_HashStripe*m_UnitsPerStripe;
+    bool Result=true;
+    unsigned long long i=1;
+    while (i<HashUnits)
     {
-        //partial stripe read is necessary
-        unsigned char* pTemp=m_pPartialRWBuffer+ThreadID*m_StripeUnitSize;
-        if (!Read(S,1,pTemp,ThreadID))
+        if (!m_pHashesDirty[i])
         {
-            m_Locker.Unlock(ThreadID);
-          return -1;
+            i++;
+            continue;
         };
-        memcpy(pDest,pTemp,(NewPos-fd));
-        fd=NewPos;
+        unsigned long long First=i;
+        while ((i<HashUnits)&&m_pHashesDirty[i])
+            m_pHashesDirty[i++]=0;
+        Result&=Transfer(FirstHashUnit+First,i-First,m_pHashes+First*m_StripeUnitSize,true,ThreadID);
     };
-    m_Locker.Unlock(ThreadID);
-    return Bytes2Read;
-  
+    HashTreeHeader& H=*(HashTreeHeader*)m_pHashes;
+    unsigned Dirty=(Clean)?0:1;
+    if (Result&&((H.MagicNumber!=HASHTREEMAGIC)||(H.Dirty!=Dirty)))
+    {
+        H.MagicNumber=HASHTREEMAGIC;
+        H.Dirty=Dirty;
+        Result=FlushDisks()&&Transfer(FirstHashUnit,1,m_pHashes,true,ThreadID);
+    };
+    m_Engine.ReleaseScratch(ThreadID);
+    UnlockCS(m_HashLock);
+    UnlockCS(m_MapLock);
+    return Result;
 };
 
+///@return the root hash of the payload stripes, or 0 if the hash tree is not maintained. The array must be mounted
+unsigned long long CDiskArray::GetRootHash(bool Verified ///true if the root of the last verified tree is needed
+                                          )
+{
+    if (!m_pHashes)
+        return 0;
+    LockCS(m_HashLock);
+    unsigned long long Root=(Verified)?m_pVerifiedTree->GetRoot():m_pHashTree->GetRoot();
+    UnlockCS(m_HashLock);
+    return Root;
+};
 
-/** Write a number of bytes. If the requested write range does not fit into an 
- * integer number of stripe units, the incomplete ones will be read, partially
- * updated and written back
- @return the actual number of bytes read, or -1 in case of error
+/** The stripes to be verified are the leaves which differ in the current and the verified trees, so the cost
+ * is proportional to the number of stripes modified since the last scrub. Each stripe is locked while it is verified,
+ * and its verified leaf is set to the current one if both its codewords and its unit hashes are valid.
+ * The invalid stripes remain unverified, so they are reported again by the subsequent scrubs
  */
-long long CDiskArray::write(tHandle& fd,///file description, i.e. current position
-             long long Bytes2Write,///the number of bytes to be written
-             const unsigned char* pSrc ///source address, must be aligned
-        )
+bool CDiskArray::Scrub(unsigned long long& Scrubbed,///output: the number of stripes verified
+                       unsigned long long& Invalid ///output: the number of invalid stripes
+                      )
 {
-    long long NewPos=fd+Bytes2Write;
-    if ((unsigned long long)NewPos>GetCapacity())
-      NewPos=GetCapacity();
-    Bytes2Write=NewPos-fd;
-    if (Bytes2Write<0)
-      //this should never happen
-      return -1;
-    unsigned long long S=fd/m_StripeUnitSize;
-    unsigned Offset=fd%m_StripeUnitSize;
-    size_t ThreadID=m_Locker.Lock(fd/m_StripeSize,NewPos/m_StripeSize+((NewPos%m_StripeSize)?1:0));
-    if (Offset)
+    Scrubbed=Invalid=0;
+    if (!m_pHashes||(m_MountState!=msReadWrite))
+        return false;
+    //the hashes of the journalled writes are updated when they are applied
+    if (m_pJournal&&!m_pJournal->Drain())
+        return false;
+    if (m_pCache&&!m_pCache->Drain())
+        return false;
+    if (m_pParityLog&&!m_pParityLog->Drain())
+        return false;
+    if (m_pDeferredParity&&!m_pDeferredParity->Drain())
+        return false;
+    vector<unsigned long long> Stripes;
+    LockCS(m_HashLock);
+    CHashTree::Compare(*m_pHashTree,*m_pVerifiedTree,Stripes);
+    UnlockCS(m_HashLock);
+    unsigned char* pStripe=AlignedMalloc(m_StripeSize);
+    for(size_t k=0;k<Stripes.size();k++)
+    {
+        unsigned long long S=Stripes[k];
+        double Arrival=m_Scheduler.Begin(iocBackground);
+        size_t ThreadID=LockStripes(S,S+1);
+        //the data are read from the disks, bypassing the journal, as well as the hashes were computed
+        bool Valid=Transfer(S*m_UnitsPerStripe,m_UnitsPerStripe,pStripe,false,ThreadID);
+        for(unsigned j=0;j<GetNumOfSubarrays();j++)
+        {
+            if (IsAllocated(S,j)&&!m_Engine.VerifyStripe(S,j,ThreadID))
+            {
+                cerr<<"Invalid stripe "<<S;
+                if (GetNumOfSubarrays()>1)
+                    cerr<<" in subarray "<<j;
+                cerr<<endl;
+                Valid=false;
+            };
+        };
+        for(unsigned i=0;Valid&&(i<m_UnitsPerStripe);i++)
+        {
+            if ((CHashTree::Hash(pStripe+i*m_StripeUnitSize,m_StripeUnitSize,0)^m_ZeroUnitHash)!=m_pUnitHashes[S*m_UnitsPerStripe+i])
+            {
+                cerr<<"Hash mismatch in stripe "<<S<<endl;
+                Valid=false;
+            };
+        };
+        if (Valid)
+        {
+            LockCS(m_HashLock);
+            m_pVerifiedLeaves[S]=m_pHashTree->GetLeaf(S);
+            m_pVerifiedTree->SetLeaf(S,m_pVerifiedLeaves[S]);
+            m_pHashesDirty[((unsigned char*)(m_pVerifiedLeaves+S)-m_pHashes)/m_StripeUnitSize]=1;
+            UnlockCS(m_HashLock);
+        }
+        else
+            Invalid++;
+        UnlockStripes(ThreadID);
+        m_Scheduler.End(iocBackground,Arrival);
+    };
+    AlignedFree(pStripe);
+    Scrubbed=Stripes.size();
+    return SaveHashes(false)&&!Invalid;
+};
+
+/** Only the subtrees with different hashes are examined. The journalled writes are applied first,
+ * since the hashes are updated when the data are written in place
+ */
+bool CDiskArray::Compare(CDiskArray& Other,///the array to be compared with
+                         std::vector<unsigned long long>& Stripes ///output: the differing stripes in the ascending order
+                        )
+{
+    Stripes.clear();
+    if (!m_pHashes||!Other.m_pHashes)
+    {
+        cerr<<"The hash tree is not maintained\n";
+        return false;
+    };
+    if ((m_HashStripe!=Other.m_HashStripe)||(m_UnitsPerStripe!=Other.m_UnitsPerStripe)||(m_StripeUnitSize!=Other.m_StripeUnitSize))
+    {
+        cerr<<"The arrays have different geometry\n";
+        return false;
+    };
+    if ((m_MountState==msUnmounted)||(Other.m_MountState==msUnmounted))
+        return false;
+    if (m_pDedup||Other.m_pDedup||m_pCompression||Other.m_pCompression)
+    {
+        cerr<<"The deduplicated or compressed arrays cannot be compared stripe by stripe\n";
+        return false;
+    };
+    if ((m_pJournal&&!m_pJournal->Drain())||(Other.m_pJournal&&!Other.m_pJournal->Drain()))
+        return false;
+    if ((m_pCache&&!m_pCache->Drain())||(Other.m_pCache&&!Other.m_pCache->Drain()))
+        return false;
+    //the hash locks are taken in the order of the array addresses, so that A.Compare(B) and B.Compare(A)
+    //running concurrently cannot deadlock
+    CDiskArray *pFirst=(this<&Other)?this:&Other;
+    CDiskArray *pSecond=(this<&Other)?&Other:this;
+    LockCS(pFirst->m_HashLock);
+    if (pSecond!=pFirst)
+        LockCS(pSecond->m_HashLock);
+    CHashTree::Compare(*m_pHashTree,*Other.m_pHashTree,Stripes);
+    if (pSecond!=pFirst)
+        UnlockCS(pSecond->m_HashLock);
+    UnlockCS(pFirst->m_HashLock);
+    return true;
+};
+
+/** The mounted array is verified in place, since remounting it would replay the journal records, which needs
+ * the stripes locked here. The journal records and the dirty cache lines not yet written to the stripes
+ * do not affect their consistency, and the pending check symbol updates are applied by VerifyStripe().
+ * The disks of the unmounted array are mounted read-only for the check, and its allocation map is loaded,
+ * since the stripes are verified only if they are allocated
+ * @return true if the array is consistent
+ */
+bool CDiskArray::Check()
+{
+    bool Mounted=(m_MountState!=msUnmounted);
+    if (!Mounted)
+    {
+        for(unsigned i=0;i<m_NumOfDisks;i++)
+            if (m_pDisks[i].GetDiskState()==dsOnline)
+                m_pDisks[i].Mount(false);
+        if (!LoadMap())
+        {
+            cerr<<"Failed to load the allocation map\n";
+            for(unsigned i=0;i<m_NumOfDisks;i++)
+                m_pDisks[i].Unmount(0);
+            return false;
+        };
+    };
+    size_t ThreadID=LockArray();
+    bool Result=true;
+    for(unsigned long long S=0;S<m_NumOfStripes;S++)
+    {
+        for(unsigned j=0;j<GetNumOfSubarrays();j++)
+        {
+            //the content of the stripes which are not allocated is irrelevant
+            if (!IsAllocated(S,j))
+                continue;
+            bool R=m_Engine.VerifyStripe(S,j,ThreadID);
+            if (!R)
+            {
+                cerr<<"Invalid stripe "<<S;
+                if (GetNumOfSubarrays()>1)
+                    cerr<<" in subarray "<<j;
+                cerr<<endl;
+                Result=false;
+            };
+        };
+    };
+    UnlockArray(ThreadID);
+    if (!Mounted)
+        for(unsigned i=0;i<m_NumOfDisks;i++)
+            m_pDisks[i].Unmount(0);
+    return Result;
+};
+
+
+/** Flush the disks mounted for writing
+ */
+bool CDiskArray::FlushDisks()
+{
+    bool Result=true;
+    for (unsigned i=0;i<m_NumOfDisks;i++)
+        if (m_pDisks[i].GetMountState()==msReadWrite)
+            Result&=m_pDisks[i].Flush();
+    //the journal checkpoints may refer to the data kept in the cache
+    if (m_pCache)
+        Result&=m_pCache->FlushDevice();
+    //the payload data written in place may depend on the parity log records
+    if (m_pParityLog)
+        Result&=m_pParityLog->FlushDevice();
+    if (m_pDeferredParity)
+        Result&=m_pDeferredParity->FlushDevice();
+    return Result;
+};
+
+/** Look for a valid array state record on the online disks. All of them were written
+ * simultaneously, since the disks with older timestamps are not taken online
+ */
+void CDiskArray::LoadState()
+{
+    if (!m_StateBlocks)
+        return;
+    unsigned char* pRecord=new unsigned char[m_StateBlocks*m_StripeUnitSize];
+    ArrayStateHeader& H=*(ArrayStateHeader*)pRecord;
+    for (unsigned i=0;i<m_NumOfDisks;i++)
+    {
+        if (m_pDisks[i].GetDiskState()!=dsOnline)
+            continue;
+        m_pDisks[i].Mount(false);
+        bool Result=m_pDisks[i].ReadData(m_StateBlock,m_StateBlocks,pRecord);
+        m_pDisks[i].Unmount(0);
+        if (!Result||(H.MagicNumber!=ARRAYSTATEMAGIC)||(H.NumOfDisks!=m_NumOfDisks))
+            continue;
+        unsigned CRC=H.CRC;
+        H.CRC=0;
+        InitCRC32();
+        unsigned CRC2=0;
+        UpdateCRC32(CRC2,sizeof(ArrayStateHeader)+m_NumOfDisks,pRecord);
+        if (CRC!=CRC2)
+        {
+            cerr<<"Corrupted array state record on disk "<<i<<endl;
+            continue;
+        };
+        m_StateGeneration=H.Generation;
+        const signed char* pSlots=(const signed char*)(pRecord+sizeof(ArrayStateHeader));
+        for (unsigned j=0;j<m_NumOfDisks;j++)
+            m_pSpareSlots[j]=pSlots[j];
+        break;
+    };
+    delete[]pRecord;
+};
+
+/** Write the array state record with the next generation number
+ */
+bool CDiskArray::SaveState()
+{
+    if (!m_StateBlocks)
+        return true;
+    unsigned char* pRecord=new unsigned char[m_StateBlocks*m_StripeUnitSize];
+    memset(pRecord,0,m_StateBlocks*m_StripeUnitSize);
+    ArrayStateHeader& H=*(ArrayStateHeader*)pRecord;
+    H.MagicNumber=ARRAYSTATEMAGIC;
+    H.NumOfDisks=m_NumOfDisks;
+    H.Generation=++m_StateGeneration;
+    H.CRC=0;
+    signed char* pSlots=(signed char*)(pRecord+sizeof(ArrayStateHeader));
+    for (unsigned j=0;j<m_NumOfDisks;j++)
+        pSlots[j]=(signed char)m_pSpareSlots[j];
+    InitCRC32();
+    unsigned CRC=0;
+    UpdateCRC32(CRC,sizeof(ArrayStateHeader)+m_NumOfDisks,pRecord);
+    H.CRC=CRC;
+    bool Result=true;
+    for (unsigned i=0;i<m_NumOfDisks;i++)
+        if (m_pDisks[i].GetDiskState()==dsOnline)
+            Result&=m_pDisks[i].WriteData(m_StateBlock,m_StateBlocks,pRecord);
+    delete[]pRecord;
+    return Result;
+};
+
+/** Take chunks of consecutive stripes, lock them, and re-encode the stripes
+ * having symbols on the disk being rebuilt. The rebuilt stripes are switched immediately to the new view,
+ * so that concurrent writes keep the spare units up to date
+ */
+THREADPROC CDiskArray::RebuildThread(void* pParams ///must be a pointer to CDiskArray
+                                    )
+{
+    CDiskArray& A=*(CDiskArray*)pParams;
+    for(;;)
+    {
+        LockCS(A.m_RebuildLock);
+        unsigned long long FirstStripe=A.m_NextRebuildStripe;
+        A.m_NextRebuildStripe+=REBUILDCHUNK;
+        UnlockCS(A.m_RebuildLock);
+        if (FirstStripe>=A.m_NumOfStripes)
+            break;
+        unsigned long long LastStripe=min(FirstStripe+REBUILDCHUNK,A.m_NumOfStripes);
+        //the rebuild is paced, so that the client requests meet the latency target
+        double Arrival=A.m_Scheduler.Begin(iocBackground);
+        //only the subarray being rebuilt is locked, so that the client requests to the other ones are not delayed
+        size_t ThreadID=A.LockStripes(FirstStripe,LastStripe,A.m_RebuildSubarray);
+        unsigned long long Failures=0;
+        for(unsigned long long S=FirstStripe;S<LastStripe;S++)
+        {
+            //the stripe could have been repaired by a read
+            if (A.m_pRebuilt[S])
+                continue;
+            if (!A.IsAllocated(S,A.m_RebuildSubarray))
+            {
+                //there is nothing to reconstruct. The stripe will be encoded in the new view when it is first written
+                A.m_pRebuilt[S]=1;
+                continue;
+            };
+            //the hash and map stripes are updated under the map lock only
+            if (S>=A.m_HashStripe)
+                LockCS(A.m_MapLock);
+            if (A.m_Engine.RebuildStripe(S,A.m_RebuildSubarray,ThreadID))
+                A.m_pRebuilt[S]=1;
+            else
+                Failures++;
+            if (S>=A.m_HashStripe)
+                UnlockCS(A.m_MapLock);
+        };
+        A.UnlockStripes(ThreadID);
+        A.m_Scheduler.End(iocBackground,Arrival);
+        if (Failures)
+        {
+            LockCS(A.m_RebuildLock);
+            A.m_RebuildFailures+=Failures;
+            UnlockCS(A.m_RebuildLock);
+        };
+    };
+    return 0;
+};
+
+/** Assign a free spare slot to the disk, and rebuild the stripes in parallel.
+ * With the declustered layout, the stripes having symbols on the failed disk are spread over the whole pool,
+ * as well as their spare units, so each surviving disk serves only a fraction of the rebuild load.
+ * The spare slot assignment is made persistent after all stripes are rebuilt
+ */
+bool CDiskArray::Rebuild(unsigned DiskID ///the disk to be relocated
+                        )
+{
+    if (m_MountState!=msReadWrite)
+        return false;
+    if (DiskID>=m_NumOfDisks)
+    {
+        cerr<<"Invalid disk "<<DiskID<<endl;
+        return false;
+    };
+    size_t ThreadID=LockArray();
+    if (IsDiskOnline(DiskID)||(m_pSpareSlots[DiskID]>=0)||IsRebuilding())
+    {
+        UnlockArray(ThreadID);
+        cerr<<"Disk "<<DiskID<<" does not need to be rebuilt\n";
+        return false;
+    };
+    unsigned DisksPerSubarray=m_NumOfDisks/GetNumOfSubarrays();
+    unsigned SubarrayID=DiskID/DisksPerSubarray;
+    //find a free spare slot within the subarray
+    int Slot=-1;
+    for(unsigned k=0;(k<m_Engine.GetLayout().GetNumOfSpares())&&(Slot<0);k++)
+    {
+        Slot=k;
+        for(unsigned i=SubarrayID*DisksPerSubarray;i<(SubarrayID+1)*DisksPerSubarray;i++)
+            if (m_pSpareSlots[i]==(int)k)
+                Slot=-1;
+    };
+    if (Slot<0)
+    {
+        UnlockArray(ThreadID);
+        cerr<<"No spare space left in subarray "<<SubarrayID<<endl;
+        return false;
+    };
+    BeginRebuild(DiskID,Slot);
+    UnlockArray(ThreadID);
+    return CompleteRebuild();
+};
+
+///switch to the rebuild mode. All stripes must be locked by the caller
+void CDiskArray::BeginRebuild(unsigned DiskID,///the disk to be rebuilt
+                              int Slot ///the spare slot the disk is relocated to, or -1 if it is reconstructed in place
+                             )
+{
+    m_pRebuilt=new unsigned char[m_NumOfStripes];
+    memset(m_pRebuilt,0,m_NumOfStripes);
+    m_RebuildDisk=DiskID;
+    m_RebuildSlot=Slot;
+    m_RebuildSubarray=DiskID/(m_NumOfDisks/GetNumOfSubarrays());
+    m_NextRebuildStripe=0;
+    m_RebuildFailures=0;
+    m_RepairedStripes=0;
+    m_Engine.ResetErasures();
+};
+
+/** If the disk was reconstructed in place, it does not use the spare space any more.
+ * Otherwise, it is relocated to the spare slot. If some stripes could not be rebuilt,
+ * the disk reconstructed in place is taken offline again
+ */
+bool CDiskArray::CompleteRebuild()
+{
+    //the mirrored copies of the cached lines are restored first, so that the tier is not degraded longer than needed
+    bool Resynced=!m_pCache||(m_RebuildSlot>=0)||m_pCache->Resync(m_RebuildDisk);
+    unsigned NumOfRebuildThreads=max(m_NumOfThreads,1u);
+    tThread* pThreads=new tThread[NumOfRebuildThreads];
+    unsigned NumOfSpawnedThreads=0;
+    while ((NumOfSpawnedThreads<NumOfRebuildThreads)&&StartThread(pThreads[NumOfSpawnedThreads],RebuildThread,this))
+        NumOfSpawnedThreads++;
+    if (!NumOfSpawnedThreads)
+        RebuildThread(this);
+    for(unsigned t=0;t<NumOfSpawnedThreads;t++)
+        JoinThread(pThreads[t]);
+    delete[]pThreads;
+
+    //make the relocation permanent
+    size_t ThreadID=LockArray();
+    bool Result=(m_RebuildFailures==0)&&Resynced;
+    if (m_RepairedStripes)
+        cerr<<m_RepairedStripes<<" stripes were repaired by the reads\n";
+    if (Result)
+        m_pSpareSlots[m_RebuildDisk]=m_RebuildSlot;
+    else
+    {
+        if (m_RebuildFailures)
+            cerr<<m_RebuildFailures<<" stripes could not be rebuilt\n";
+        if (m_RebuildSlot<0)
+            m_pDisks[m_RebuildDisk].SetDiskState(dsOffline);
+    };
+    m_RebuildDisk=-1;
+    delete[]m_pRebuilt;
+    m_pRebuilt=0;
+    m_Engine.ResetErasures();
+    UpdateArrayState();
+    if (Result)
+        Result=SaveState();
+    UnlockArray(ThreadID);
+    return Result;
+};
+
+///set the array state according to the disks which are neither online nor relocated. The array must be locked by the caller
+void CDiskArray::UpdateArrayState()
+{
+    bool Complete=true;
+    for(unsigned i=0;i<m_NumOfDisks;i++)
+        Complete&=IsDiskOnline(i)||(m_pSpareSlots[i]>=0);
+    if (Complete)
+        m_ArrayState=asNormal;
+    else
+        m_ArrayState=(m_Engine.IsMountable())?asDegraded:asFailed;
+};
+
+/** The disk is dropped under the lock of all stripes, so that no request observes a partially updated
+ * erasure configuration. Its header is not updated, so it is not taken online after a restart
+ */
+bool CDiskArray::FailDisk(unsigned DiskID ///the disk to be failed
+                         )
+{
+    if (DiskID>=m_NumOfDisks)
+    {
+        cerr<<"Invalid disk "<<DiskID<<endl;
+        return false;
+    };
+    size_t ThreadID=LockArray();
+    bool Result=IsDiskOnline(DiskID)&&((int)DiskID!=m_RebuildDisk);
+    if (Result)
+    {
+        m_pDisks[DiskID].SetDiskState(dsOffline);
+        m_Engine.ResetErasures();
+        UpdateArrayState();
+        if (m_ArrayState==asFailed)
+            cerr<<"The array cannot tolerate the failure of disk "<<DiskID<<endl;
+    }
+    else
+        cerr<<"Disk "<<DiskID<<" is not online or is being rebuilt\n";
+    UnlockArray(ThreadID);
+    return Result;
+};
+
+/** The new file is filled with zeroes and taken online under the lock of all stripes.
+ * Its symbols are reported as erased until the stripes are rebuilt in place
+ */
+bool CDiskArray::ReplaceDisk(unsigned DiskID,///the disk to be replaced
+                             const char* pFileName ///the name of the file emulating the new disk. It is created if needed
+                            )
+{
+    if (m_MountState!=msReadWrite)
+        return false;
+    if (DiskID>=m_NumOfDisks)
+    {
+        cerr<<"Invalid disk "<<DiskID<<endl;
+        return false;
+    };
+    size_t ThreadID=LockArray();
+    if (IsDiskOnline(DiskID)||IsRebuilding())
+    {
+        UnlockArray(ThreadID);
+        cerr<<"Disk "<<DiskID<<" cannot be replaced while it is online or a rebuild is in progress\n";
+        return false;
+    };
+    m_pReplacementFiles[DiskID]=pFileName;
+    const void* pArrayData;
+    unsigned DataSize=m_Engine.GetConfiguration(pArrayData);
+    CDisk& D=m_pDisks[DiskID];
+    bool Result=D.Attach(m_pReplacementFiles[DiskID].c_str());
+    D.SetArrayData(pArrayData,DataSize);
+    Result=Result&&D.ResetDisk()&&D.Mount(true);
+    if (!Result)
+    {
+        D.SetDiskState(dsInvalid);
+        UnlockArray(ThreadID);
+        cerr<<"Failed to attach "<<pFileName<<" as disk "<<DiskID<<endl;
+        return false;
+    };
+    BeginRebuild(DiskID,-1);
+    UnlockArray(ThreadID);
+    return CompleteRebuild();
+};
+
+/** The disk content is not trusted, so all allocated stripes are rebuilt in place
+ */
+bool CDiskArray::ReAddDisk(unsigned DiskID ///the disk to be re-added
+                          )
+{
+    if (m_MountState!=msReadWrite)
+        return false;
+    if (DiskID>=m_NumOfDisks)
+    {
+        cerr<<"Invalid disk "<<DiskID<<endl;
+        return false;
+    };
+    size_t ThreadID=LockArray();
+    //the disks which were not properly initialized must be replaced
+    if ((m_pDisks[DiskID].GetDiskState()!=dsOffline)||IsRebuilding())
+    {
+        UnlockArray(ThreadID);
+        cerr<<"Disk "<<DiskID<<" cannot be re-added while it is not offline or a rebuild is in progress\n";
+        return false;
+    };
+    m_pDisks[DiskID].SetDiskState(dsOnline);
+    if (!m_pDisks[DiskID].Mount(true))
+    {
+        m_pDisks[DiskID].SetDiskState(dsOffline);
+        UnlockArray(ThreadID);
+        cerr<<"Failed to mount disk "<<DiskID<<endl;
+        return false;
+    };
+    BeginRebuild(DiskID,-1);
+    UnlockArray(ThreadID);
+    return CompleteRebuild();
+};
+
+
+/** The request is admitted by the scheduler as a latency-sensitive one
+ * @return the actual number of bytes read, or -1 in case of error
+ */
+long long CDiskArray::read(tHandle& fd,///file description, i.e. current position
+             long long Bytes2Read,///the number of bytes to be read
+             unsigned char* pDest ///destination address
+        )
+{
+    double Arrival=m_Scheduler.Begin(iocRead);
+    long long Result=ReadBytes(fd,Bytes2Read,pDest);
+    m_Scheduler.End(iocRead,Arrival);
+    return Result;
+};
+
+/** The request is split into the windows of m_LockWindow stripes, and each of them is locked only while it is read,
+ * so that the writers of the stripes already read need not wait for the whole request. Each stripe is still read atomically.
+ * The deduplicated array reads the logical units instead
+ * @return the actual number of bytes read, or -1 in case of error
+ */
+long long CDiskArray::ReadBytes(tHandle& fd,///file description, i.e. current position
+             long long Bytes2Read,///the number of bytes to be read
+             unsigned char* pDest ///destination address
+        )
+{
+    if (m_pDedup)
+        return m_pDedup->ReadBytes(fd,Bytes2Read,pDest);
+    if (m_pCompression)
+        return m_pCompression->ReadBytes(fd,Bytes2Read,pDest);
+    long long NewPos=fd+Bytes2Read;
+    if ((unsigned long long)NewPos>GetCapacity())
+      NewPos=GetCapacity();
+    Bytes2Read=NewPos-fd;
+    if (Bytes2Read<0)
+      //this should never happen
+      return -1;
+    while (fd<NewPos)
+    {
+        long long WindowEnd=NewPos;
+        if (m_LockWindow)
+            WindowEnd=min(WindowEnd,(long long)((fd/m_StripeSize+m_LockWindow)*m_StripeSize));
+        long long L=WindowEnd-fd;
+        if (!ReadWindow(fd,L,pDest))
+            return -1;
+        pDest+=L;
+    };
+    return Bytes2Read;
+};
+
+/** The stripes are read without locking them if the array is healthy, so that the readers do not contend for the locks
+ */
+bool CDiskArray::ReadWindow(tHandle& fd,///file description, i.e. current position
+             long long Bytes2Read,///the number of bytes to be read. They must fit into the array
+             unsigned char* pDest ///destination address
+        )
+{
+    if (m_OptimisticReads&&ReadOptimistic(fd,Bytes2Read,pDest))
+        return true;
+    size_t ThreadID=LockUnits(fd/m_StripeUnitSize,(fd+Bytes2Read+m_StripeUnitSize-1)/m_StripeUnitSize);
+    bool Result=ReadRange(fd,Bytes2Read,pDest,ThreadID);
+    UnlockStripes(ThreadID);
+    return Result;
+};
+
+/** The read is registered, so that the array configuration does not change until it completes. The versions of the stripes
+ * are obtained before the data is read, and the data is discarded if some of the stripes were locked meanwhile.
+ * The degraded and rebuilt stripes, as well as the cached ones, are always read under the locks, since reading them
+ * may update the disks. The read is attempted a few times, and is then made under the locks, so that it is not starved
+ * by the writers of the same stripes
+ */
+bool CDiskArray::ReadOptimistic(tHandle& fd,///file description, i.e. current position
+             long long Bytes2Read,///the number of bytes to be read. They must fit into the array
+             unsigned char* pDest ///destination address
+        )
+{
+    AtomicAdd(m_OptimisticReaders,1);
+    bool Result=false;
+    if (!m_ReadsSuspended&&(m_MountState!=msUnmounted)&&(m_ArrayState==asNormal)&&!m_pRebuilt&&!m_pCache)
+    {
+        unsigned long long FirstUnit=fd/m_StripeUnitSize;
+        unsigned long long LastUnit=(fd+Bytes2Read+m_StripeUnitSize-1)/m_StripeUnitSize;
+        size_t ThreadID=m_Engine.AcquireScratch();
+        unsigned long long* pVersions=(unsigned long long*)(m_Engine.GetScratch(ThreadID)+m_ReadVersions);
+        for(unsigned i=0;!Result&&(i<OPTIMISTICREADATTEMPTS);i++)
+        {
+            //wait for the writers in progress on the locks
+            if (!BeginReadUnits(FirstUnit,LastUnit,pVersions))
+                break;
+            tHandle Pos=fd;
+            //the failures are reported by the locked read
+            if (!ReadRange(Pos,Bytes2Read,pDest,ThreadID))
+                break;
+            Result=EndReadUnits(FirstUnit,LastUnit,pVersions);
+            if (Result)
+                fd=Pos;
+        };
+        m_Engine.ReleaseScratch(ThreadID);
+    };
+    if (!AtomicAdd(m_OptimisticReaders,-1)&&m_ReadsSuspended)
+    {
+        //LockArray() waits for it
+        LockCS(m_ReadersLock);
+        CondWakeAll(m_ReadersIdle);
+        UnlockCS(m_ReadersLock);
+    };
+    return Result;
+};
+
+/** If the requested range does not fit into an integer number of stripe units,
+ * read the incomplete ones and extract the required information from them.
+ * The remaining data is read via a huge Read call
+ */
+bool CDiskArray::ReadRange(tHandle& fd,///file description, i.e. current position
+             long long Bytes2Read,///the number of bytes to be read. They must fit into the array
+             unsigned char* pDest,///destination address
+             size_t ThreadID ///the scratch arena of a calling thread
+        )
+{
+    long long NewPos=fd+Bytes2Read;
+    unsigned long long S=fd/m_StripeUnitSize;
+    unsigned Offset=fd%m_StripeUnitSize;
+    if (Offset)
+    {
+        //partial stripe unit read is necessary
+        unsigned char* pTemp=m_Engine.GetScratch(ThreadID)+m_PartialRWBuffer;
+        if (!Read(S,1,pTemp,ThreadID))
+            return false;
+        unsigned L=m_StripeUnitSize-Offset;
+        if (L>Bytes2Read)
+          L=(unsigned)Bytes2Read;
+        memcpy(pDest,pTemp+Offset,L);
+        fd+=L;
+        pDest+=L;
+        S++;
+    };
+    unsigned long long Stripes2Read=(NewPos-fd)/m_StripeUnitSize;
+    if (!Read(S,Stripes2Read,pDest,ThreadID))
+        return false;
+    S+=Stripes2Read;
+    pDest+=Stripes2Read*m_StripeUnitSize;
+    fd+=Stripes2Read*m_StripeUnitSize;
+    if (fd<NewPos)
+    {
+        //partial stripe read is necessary
+        unsigned char* pTemp=m_Engine.GetScratch(ThreadID)+m_PartialRWBuffer;
+        if (!Read(S,1,pTemp,ThreadID))
+            return false;
+        memcpy(pDest,pTemp,(NewPos-fd));
+        fd=NewPos;
+    };
+    return true;
+};
+
+
+/** The request is admitted by the scheduler, and the data is written either via the journal, or in place.
+ * The small writes are merged with the concurrent writes to the same stripe, which are admitted together
+ @return the actual number of bytes written, or -1 in case of error
+ */
+long long CDiskArray::write(tHandle& fd,///file description, i.e. current position
+             long long Bytes2Write,///the number of bytes to be written
+             const unsigned char* pSrc ///source address, must be aligned
+        )
+{
+    if (m_pCoalescer&&m_pCoalescer->IsCoalesced(fd,Bytes2Write))
+        return m_pCoalescer->Write(fd,Bytes2Write,pSrc);
+    double Arrival=m_Scheduler.Begin(iocWrite);
+    long long Result=(m_pJournal)?JournalWrite(fd,Bytes2Write,pSrc):WriteBytes(fd,Bytes2Write,pSrc);
+    m_Scheduler.End(iocWrite,Arrival);
+    return Result;
+};
+
+/** The request is split into the windows of m_LockWindow stripes, and each of them is locked only while it is written,
+ * so that the readers of the stripes already written need not wait for the whole request. Each stripe is still written atomically.
+ * The deduplicated array writes the logical units instead
+ @return the actual number of bytes written, or -1 in case of error
+ */
+long long CDiskArray::WriteBytes(tHandle& fd,///file description, i.e. current position
+             long long Bytes2Write,///the number of bytes to be written
+             const unsigned char* pSrc ///source address, must be aligned
+        )
+{
+    if (m_pDedup)
+        return m_pDedup->WriteBytes(fd,Bytes2Write,pSrc);
+    if (m_pCompression)
+        return m_pCompression->WriteBytes(fd,Bytes2Write,pSrc);
+    long long NewPos=fd+Bytes2Write;
+    if ((unsigned long long)NewPos>GetCapacity())
+      NewPos=GetCapacity();
+    Bytes2Write=NewPos-fd;
+    if (Bytes2Write<0)
+      //this should never happen
+      return -1;
+    while (fd<NewPos)
+    {
+        long long WindowEnd=NewPos;
+        if (m_LockWindow)
+            WindowEnd=min(WindowEnd,(long long)((fd/m_StripeSize+m_LockWindow)*m_StripeSize));
+        long long L=WindowEnd-fd;
+        if (!WriteWindow(fd,L,pSrc))
+            return -1;
+        pSrc+=L;
+    };
+    return Bytes2Write;
+};
+
+/** Write a number of bytes. If the requested write range does not fit into an 
+ * integer number of stripe units, the incomplete ones will be read, partially
+ * updated and written back
+ */
+bool CDiskArray::WriteWindow(tHandle& fd,///file description, i.e. current position
+             long long Bytes2Write,///the number of bytes to be written. They must fit into the array
+             const unsigned char* pSrc ///source address, must be aligned
+        )
+{
+    long long NewPos=fd+Bytes2Write;
+    unsigned long long S=fd/m_StripeUnitSize;
+    unsigned Offset=fd%m_StripeUnitSize;
+    size_t ThreadID=LockUnits(S,(NewPos+m_StripeUnitSize-1)/m_StripeUnitSize);
+    if (Offset)
     {
         //partial stripe write is necessary
-        unsigned char* pTemp=m_pPartialRWBuffer+ThreadID*m_StripeUnitSize;
+        unsigned char* pTemp=m_Engine.GetScratch(ThreadID)+m_PartialRWBuffer;
         if (!Read(S,1,pTemp,ThreadID))
         {
-            m_Locker.Unlock(ThreadID);
-            return -1;
+            UnlockStripes(ThreadID);
+            return false;
         };
         unsigned L=m_StripeUnitSize-Offset;
         if (L>Bytes2Write)
@@ -423,8 +1815,8 @@ long long CDiskArray::write(tHandle& fd,///file description, i.e. current positi
         memcpy(pTemp+Offset,pSrc,L);
         if (!Write(S,1,pTemp,ThreadID))
         {
-           m_Locker.Unlock(ThreadID);
-           return -1;
+           UnlockStripes(ThreadID);
+           return false;
         };
         fd+=L;
         pSrc+=L;
@@ -433,8 +1825,8 @@ long long CDiskArray::write(tHandle& fd,///file description, i.e. current positi
     unsigned long long Stripes2Write=(NewPos-fd)/m_StripeUnitSize;
     if (!Write(S,Stripes2Write,pSrc,ThreadID))
         {
-           m_Locker.Unlock(ThreadID);
-           return -1;
+           UnlockStripes(ThreadID);
+           return false;
         };
     S+=Stripes2Write;
     pSrc+=Stripes2Write*m_StripeUnitSize;
@@ -442,21 +1834,288 @@ long long CDiskArray::write(tHandle& fd,///file description, i.e. current positi
     if (fd<NewPos)
     {
         //partial stripe write is necessary
-        unsigned char* pTemp=m_pPartialRWBuffer+ThreadID*m_StripeUnitSize;
+        unsigned char* pTemp=m_Engine.GetScratch(ThreadID)+m_PartialRWBuffer;
         if (!Read(S,1,pTemp,ThreadID))
         {
-           m_Locker.Unlock(ThreadID);
-           return -1;
+           UnlockStripes(ThreadID);
+           return false;
         };
         memcpy(pTemp,pSrc,NewPos-fd);
         if (!Write(S,1,pTemp,ThreadID))
         {
-           m_Locker.Unlock(ThreadID);
-           return -1;
+           UnlockStripes(ThreadID);
+           return false;
         };
         fd=NewPos;
     };
-    m_Locker.Unlock(ThreadID);
+    UnlockStripes(ThreadID);
+    return true;
+};
+
+/** Split the request into records of at most CJournal::GetMaxRecordUnits() stripe units.
+ * For each of them, reserve the journal space, lock the stripes, fill in the incomplete stripe units
+ * with the data read from the array, and append the record to the journal. The record is committed
+ * after the stripes are unlocked, so that the concurrent writers can share a single journal flush
+ @return the actual number of bytes written, or -1 in case of error
+ */
+long long CDiskArray::JournalWrite(tHandle& fd,///file description, i.e. current position
+             long long Bytes2Write,///the number of bytes to be written
+             const unsigned char* pSrc ///source address, must be aligned
+        )
+{
+    if (m_MountState!=msReadWrite)
+      return -1;
+    long long NewPos=fd+Bytes2Write;
+    if ((unsigned long long)NewPos>GetCapacity())
+      NewPos=GetCapacity();
+    Bytes2Write=NewPos-fd;
+    if (Bytes2Write<0)
+      //this should never happen
+      return -1;
+    while (fd<NewPos)
+    {
+        unsigned long long FirstUnit=fd/m_StripeUnitSize;
+        unsigned Offset=fd%m_StripeUnitSize;
+        unsigned long long LastUnit=min(FirstUnit+m_pJournal->GetMaxRecordUnits(),(unsigned long long)(NewPos+m_StripeUnitSize-1)/m_StripeUnitSize);
+        long long ChunkEnd=min((long long)(LastUnit*m_StripeUnitSize),NewPos);
+        unsigned Units=(unsigned)(LastUnit-FirstUnit);
+        JournalRecord* pRecord=m_pJournal->CreateRecord(FirstUnit,Units);
+        if (!pRecord)
+            return -1;
+        unsigned char* pData=m_pJournal->GetPayload(pRecord);
+        size_t ThreadID=LockUnits(FirstUnit,LastUnit);
+        bool Result=true;
+        if (Offset)
+            //partial stripe unit write is necessary
+            Result&=Read(FirstUnit,1,pData,ThreadID);
+        if ((ChunkEnd%m_StripeUnitSize)&&((Units>1)||!Offset))
+            Result&=Read(LastUnit-1,1,pData+(Units-1)*m_StripeUnitSize,ThreadID);
+        unsigned long long Sequence=0;
+        if (Result)
+        {
+            memcpy(pData+Offset,pSrc,(size_t)(ChunkEnd-fd));
+            Sequence=m_pJournal->Append(pRecord);
+        }
+        else
+            m_pJournal->DiscardRecord(pRecord);
+        UnlockStripes(ThreadID);
+        if (!Sequence||!m_pJournal->Commit(Sequence))
+            return -1;
+        pSrc+=ChunkEnd-fd;
+        fd=ChunkEnd;
+    };
     return Bytes2Write;
-  
+};
+
+/** The request is admitted by the scheduler as a write
+ * @return the actual number of bytes processed, or -1 in case of error
+ */
+long long CDiskArray::discard(tHandle& fd,///file description, i.e. current position
+             long long Bytes2Discard ///the number of bytes to be discarded
+        )
+{
+    double Arrival=m_Scheduler.Begin(iocWrite);
+    long long Result=Deallocate(fd,Bytes2Discard,false);
+    m_Scheduler.End(iocWrite,Arrival);
+    return Result;
+};
+
+/** The request is admitted by the scheduler as a write
+ * @return the actual number of bytes processed, or -1 in case of error
+ */
+long long CDiskArray::write_zeroes(tHandle& fd,///file description, i.e. current position
+             long long Bytes2Zero ///the number of bytes to be zeroed
+        )
+{
+    double Arrival=m_Scheduler.Begin(iocWrite);
+    long long Result=Deallocate(fd,Bytes2Zero,true);
+    m_Scheduler.End(iocWrite,Arrival);
+    return Result;
+};
+
+/** The request is admitted by the scheduler as a write
+ * @return the actual number of bytes copied, or -1 in case of error
+ */
+long long CDiskArray::copy_range(tHandle& src,///the position of the source range
+             tHandle& dst,///the position of the destination range
+             long long Bytes2Copy ///the number of bytes to be copied
+        )
+{
+    double Arrival=m_Scheduler.Begin(iocWrite);
+    long long Result=CopyBytes(src,dst,Bytes2Copy);
+    m_Scheduler.End(iocWrite,Arrival);
+    return Result;
+};
+
+/** The range is copied stripe by stripe. If both positions are aligned to the stripes, the whole stripes are copied
+ * by CopyStripe(), so that the data is not passed through the client. The remaining data is read and written
+ * via a stripe buffer. The journal is drained first, so that the stripes copied in this way are up to date.
+ * The data of the cached, deduplicated and compressed arrays is always copied via the buffer. If the destination
+ * follows the source and overlaps it, the stripes are copied backwards, so that the source is not overwritten before it is read
+ * @return the actual number of bytes copied, or -1 in case of error
+ */
+long long CDiskArray::CopyBytes(tHandle& src,///the position of the source range
+             tHandle& dst,///the position of the destination range
+             long long Bytes2Copy ///the number of bytes to be copied
+        )
+{
+    if ((m_MountState!=msReadWrite)||(src<0)||(dst<0))
+      return -1;
+    long long NewPos=max(src,dst)+Bytes2Copy;
+    if ((unsigned long long)NewPos>GetCapacity())
+      NewPos=GetCapacity();
+    Bytes2Copy=NewPos-max(src,dst);
+    if (Bytes2Copy<0)
+      return -1;
+    if (src==dst)
+    {
+        src+=Bytes2Copy;
+        dst+=Bytes2Copy;
+        return Bytes2Copy;
+    };
+    bool Direct=!(src%m_StripeSize)&&!(dst%m_StripeSize)&&!m_pCache&&!m_pDedup&&!m_pCompression;
+    if (Direct&&(Bytes2Copy>=m_StripeSize)&&m_pJournal&&!m_pJournal->Drain())
+        return -1;
+    unsigned char* pBuffer=AlignedMalloc(m_StripeSize);
+    bool Backward=(dst>src)&&(dst<src+Bytes2Copy);
+    long long NumOfChunks=(Bytes2Copy+m_StripeSize-1)/m_StripeSize;
+    bool Result=true;
+    for(long long i=0;Result&&(i<NumOfChunks);i++)
+    {
+        long long Offset=((Backward)?NumOfChunks-1-i:i)*m_StripeSize;
+        long long Length=min(Bytes2Copy-Offset,(long long)m_StripeSize);
+        tHandle From=src+Offset;
+        tHandle To=dst+Offset;
+        if (Direct&&(Length==m_StripeSize))
+            Result=CopyStripe(From/m_StripeSize,To/m_StripeSize,pBuffer);
+        else
+            Result=(ReadBytes(From,Length,pBuffer)==Length)&&
+                   (((m_pJournal)?JournalWrite(To,Length,pBuffer):WriteBytes(To,Length,pBuffer))==Length);
+    };
+    AlignedFree(pBuffer);
+    if (!Result)
+        return -1;
+    src+=Bytes2Copy;
+    dst+=Bytes2Copy;
+    return Bytes2Copy;
+};
+
+/** Both stripes are locked by a single request per lock domain, so that the copy cannot deadlock with the requests
+ * and the copies overlapping both of them. The symbols
+ * of each subarray are copied as they are if the stripes share the mapping of symbols to disks and are healthy,
+ * and the payload is decoded and re-encoded otherwise. The subarray which was not written reads as zeroes,
+ * so the destination one is released as by discard()
+ */
+bool CDiskArray::CopyStripe(unsigned long long SrcStripeID,///the stripe to be copied
+                            unsigned long long DestStripeID,///the stripe to be overwritten
+                            unsigned char* pBuffer ///temporary buffer for a payload stripe
+                           )
+{
+    size_t ThreadID=LockStripePair(SrcStripeID,DestStripeID);
+    bool Result=true;
+    for(unsigned j=0;Result&&(j<GetNumOfSubarrays());j++)
+    {
+        if (!IsAllocated(SrcStripeID,j))
+        {
+            Result=UpdateMap(DestStripeID,DestStripeID+1,j,false,ThreadID)&&m_Engine.DiscardStripes(DestStripeID,DestStripeID+1,j);
+            if (m_pHashes)
+                UpdateHashes(DestStripeID,j,0,m_UnitsPerStripePrim,0);
+        }
+        else
+        if (m_Engine.CanCopyStripe(SrcStripeID,DestStripeID,j))
+        {
+            Result=m_Engine.CopyStripe(SrcStripeID,DestStripeID,j,ThreadID)&&UpdateMap(DestStripeID,DestStripeID+1,j,true,ThreadID);
+            if (Result&&m_pHashes)
+                CopyHashes(SrcStripeID,DestStripeID,j);
+        }
+        else
+            Result=TransferSubarray(SrcStripeID*m_UnitsPerStripe,m_UnitsPerStripe,pBuffer,false,j,ThreadID)&&
+                   TransferSubarray(DestStripeID*m_UnitsPerStripe,m_UnitsPerStripe,pBuffer,true,j,ThreadID);
+    };
+    UnlockStripes(ThreadID);
+    return Result;
+};
+
+/** The incomplete stripes at the ends of the range are zeroed by ordinary writes.
+ * The journal is drained before the whole stripes are released, so that the records written earlier
+ * are not applied on top of them. The stripes are processed in chunks of DISCARDCHUNK. For each chunk,
+ * the allocation map is updated first, and the disk space is released afterwards, so that
+ * the stripes are never reported as allocated after their content is lost. The deduplicated and the compressed arrays map
+ * the logical units to be released or zeroed to no physical units, by writing zeroes to them
+ * @return the actual number of bytes processed, or -1 in case of error
+ */
+long long CDiskArray::Deallocate(tHandle& fd,///file description, i.e. current position
+             long long Bytes,///the number of bytes to be processed
+             bool Zero ///true if the incomplete stripes at the ends of the range must be zeroed
+        )
+{
+    if (m_MountState!=msReadWrite)
+      return -1;
+    long long NewPos=fd+Bytes;
+    if ((unsigned long long)NewPos>GetCapacity())
+      NewPos=GetCapacity();
+    Bytes=NewPos-fd;
+    if (Bytes<0)
+      //this should never happen
+      return -1;
+    unsigned long long FirstStripe=(fd+m_StripeSize-1)/m_StripeSize;
+    unsigned long long LastStripe=NewPos/m_StripeSize;
+    if (FirstStripe>LastStripe)
+        //the range is within a single stripe
+        FirstStripe=LastStripe;
+    if (m_pDedup||m_pCompression)
+    {
+        tHandle Pos=(Zero)?fd:(long long)(FirstStripe*m_StripeSize);
+        long long End=(Zero)?NewPos:(long long)(LastStripe*m_StripeSize);
+        while (Pos<End)
+        {
+            long long Length=min(End-Pos,(long long)m_StripeSize);
+            long long Written=(m_pDedup)?m_pDedup->WriteBytes(Pos,Length,m_pZeroes):m_pCompression->WriteBytes(Pos,Length,m_pZeroes);
+            if (Written!=Length)
+                return -1;
+        };
+        fd=NewPos;
+        return Bytes;
+    };
+    if (Zero)
+    {
+        //the parts of the range before and after the whole stripes
+        long long Parts[2][2]={{fd,max(fd,(long long)(FirstStripe*m_StripeSize))},{min(NewPos,(long long)(LastStripe*m_StripeSize)),NewPos}};
+        if (FirstStripe==LastStripe)
+            Parts[0][1]=Parts[1][0]=NewPos;
+        for(unsigned i=0;i<2;i++)
+        {
+            tHandle Pos=Parts[i][0];
+            while (Pos<Parts[i][1])
+            {
+                long long Length=min(Parts[i][1]-Pos,(long long)m_StripeSize);
+                long long Written=(m_pJournal)?JournalWrite(Pos,Length,m_pZeroes):WriteBytes(Pos,Length,m_pZeroes);
+                if (Written!=Length)
+                    return -1;
+            };
+        };
+    };
+    if ((FirstStripe<LastStripe)&&m_pJournal&&!m_pJournal->Drain())
+        return -1;
+    for(unsigned long long S=FirstStripe;S<LastStripe;S+=DISCARDCHUNK)
+    {
+        unsigned long long ChunkEnd=min(S+DISCARDCHUNK,LastStripe);
+        size_t ThreadID=LockStripes(S,ChunkEnd);
+        bool Result=true;
+        for(unsigned j=0;Result&&(j<GetNumOfSubarrays());j++)
+        {
+            Result&=UpdateMap(S,ChunkEnd,j,false,ThreadID)&&m_Engine.DiscardStripes(S,ChunkEnd,j);
+            //the cached data of the released stripes must not be written back
+            if (m_pCache)
+                Result&=m_pCache->Invalidate(S,ChunkEnd,j);
+            //the released stripes read as zeroes
+            for(unsigned long long D=S;m_pHashes&&(D<ChunkEnd);D++)
+                UpdateHashes(D,j,0,m_UnitsPerStripePrim,0);
+        };
+        UnlockStripes(ThreadID);
+        if (!Result)
+            return -1;
+    };
+    fd=NewPos;
+    return Bytes;
 };
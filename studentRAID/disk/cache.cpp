@@ -0,0 +1,946 @@
+/*********************************************************
+ * cache.cpp  - implementation of the cache device of the RAID emulator
+ *
+ * Copyright(C) 2012 Saint-Petersburg State Polytechnic University
+ *
+ * Developed in the framework of the "Forward error correction for next generation storage systems" project
+ *
+ * Author: P. Trifonov petert@dcn.ftk.spbstu.ru
+ * ********************************************************/
+#include <iostream>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include <algorithm>
+#include "misc.h"
+#include "arithmetic.h"
+#include "array.h"
+#include "cache.h"
+
+using namespace std;
+
+///cache superblock signature
+#define CACHEMAGIC 0xCAC4E5B1
+///the maximal number of lines written back in a single batch
+#define CACHEFLUSHBATCH 64
+///the access counters are halved after this number of accesses per cache line
+#define CACHEAGINGPERIOD 8
+
+///avoid padding of on-disk structures
+#pragma pack(push)
+#pragma pack(1)
+///the first block of the cache device
+struct CacheSuperblock
+{
+    ///must be CACHEMAGIC
+    unsigned MagicNumber;
+    ///size of a cache device block
+    unsigned BlockSize;
+    ///the number of blocks in a cache line
+    unsigned LineUnits;
+    ///the number of cache lines
+    unsigned NumOfLines;
+    ///nonzero if the tags of the clean lines are valid, i.e. the array was unmounted cleanly
+    unsigned Clean;
+    ///CRC32 of all preceding fields
+    unsigned CRC;
+};
+
+///the tag of a cache line
+struct CacheLineTag
+{
+    ///the segment kept in the line plus one, or 0 if the line is free
+    unsigned long long Segment;
+    ///nonzero if the line was modified since it was written to the array
+    unsigned Dirty;
+    ///must be 0
+    unsigned Reserved;
+};
+#pragma pack(pop)
+
+///compute CRC32 of a memory block
+static unsigned GetChecksum(const void* pData,size_t Size)
+{
+    unsigned CRC=0;
+    UpdateCRC32(CRC,Size,(const unsigned char*)pData);
+    return CRC;
+};
+
+/** Split the device into the superblock, the tag blocks and as many lines as possible,
+ * and check that it was created for the same array configuration.
+ * The mirrored tier is a virtual device made of line-sized chunks. Copy k of chunk c is stored on disk (c+k) mod N
+ * in the k-th region of the reserved area, so that the copies are on different disks, and the lines are aligned to the chunks
+ */
+CCacheDevice::CCacheDevice(CDiskArray& Array,///the array to be served
+                           const CacheConf& Conf,///the cache configuration
+                           unsigned DeviceID ///identifier of the cache device. This must be different from the IDs of the array disks
+                          ):m_Array(Array),m_Mirrored(!Conf.pFileName),m_NumOfCopies(0),m_MirrorStart(Array.m_MirrorBlock),
+    m_RegionChunks(0),m_MountState(msUnmounted),m_Valid(false),m_WriteBack(Conf.WriteBack),m_PromotionThreshold(Conf.PromotionThreshold),
+    m_BlockSize(Array.GetStripeUnitSize()),m_LineUnits(Array.m_UnitsPerStripePrim),m_SegmentsPerStripe(Array.GetNumOfSubarrays()),
+    m_NumOfSegments(Array.m_HashStripe*Array.GetNumOfSubarrays()),m_CoolingTime(Conf.CoolingTime),m_Failed(false),m_Running(false),m_Stop(false)
+{
+    unsigned long long NumOfBlocks=Conf.Capacity/m_BlockSize;
+    unsigned Alignment=1;
+    if (m_Mirrored)
+    {
+        //as many disk failures are tolerated as for an MDS code with the same redundancy
+        m_NumOfCopies=min(m_Array.m_Engine.GetCodeLength()-m_Array.m_Engine.GetDimension()+1,m_Array.m_NumOfDisks);
+        m_RegionChunks=m_Array.m_MirrorBlocks/((unsigned long long)m_NumOfCopies*m_LineUnits);
+        NumOfBlocks=m_RegionChunks*m_Array.m_NumOfDisks*m_LineUnits;
+        Alignment=m_LineUnits;
+    };
+    unsigned TagsPerBlock=m_BlockSize/sizeof(CacheLineTag);
+    unsigned long long NumOfLines=(NumOfBlocks>1)?(NumOfBlocks-1)/m_LineUnits:0;
+    while (NumOfLines&&(((1+(NumOfLines+TagsPerBlock-1)/TagsPerBlock+Alignment-1)/Alignment)*Alignment+NumOfLines*m_LineUnits>NumOfBlocks))
+        NumOfLines--;
+    if (!NumOfLines)
+        throw Exception("Cache capacity is too small");
+    //there is no point in caching more segments than the array has
+    m_NumOfLines=(unsigned)min(NumOfLines,m_NumOfSegments);
+    m_TagBlocks=(m_NumOfLines+TagsPerBlock-1)/TagsPerBlock;
+    m_DataStart=((1+m_TagBlocks+Alignment-1)/Alignment)*Alignment;
+    m_HighWatermark=max(m_NumOfLines/2,1u);
+    m_LowWatermark=m_NumOfLines/4;
+    if (!InitCS(m_Lock))
+        throw Exception("Failed to initialize cache mutex");
+    if (!InitCond(m_FlushSig)||!InitCond(m_CleanSig))
+        throw Exception("Cache condition initialization failed");
+    InitCRC32();
+    m_pTags=(CacheLineTag*)AlignedMalloc((size_t)m_TagBlocks*m_BlockSize);
+    m_pLines=new unsigned[m_NumOfSegments];
+    m_pAccesses=new unsigned char[m_NumOfSegments];
+    m_pPins=new unsigned[m_NumOfLines];
+    m_pReferenced=new unsigned char[m_NumOfLines];
+    m_pFreeLines=new unsigned[m_NumOfLines];
+    m_pWriteTimes=new double[m_NumOfLines];
+    m_pFlushBuffer=AlignedMalloc((size_t)CACHEFLUSHBATCH*m_LineUnits*m_BlockSize);
+    Reset();
+    if (m_Mirrored)
+    {
+        //the copies are kept on the array disks, which are validated by the array
+        m_Valid=true;
+        return;
+    };
+
+    const void* pCodeConfig;
+    unsigned CodeConfigSize=m_Array.m_Engine.GetConfiguration(pCodeConfig);
+    if (m_Device.Initialize(Conf.pFileName,DeviceID,m_BlockSize,NumOfBlocks,CodeConfigSize)&&(m_Device.GetDiskState()==dsOffline))
+    {
+        void const* pCodeConfig2;
+        unsigned CodeConfigSize2=m_Device.GetArrayData(pCodeConfig2);
+        m_Valid=(CodeConfigSize2==CodeConfigSize)&&!memcmp(pCodeConfig,pCodeConfig2,CodeConfigSize);
+    };
+    if (m_Valid)
+        m_Device.SetDiskState(dsOnline);
+};
+
+CCacheDevice::~CCacheDevice()
+{
+    Stop();
+    AlignedFree(m_pFlushBuffer);
+    delete[]m_pWriteTimes;
+    delete[]m_pFreeLines;
+    delete[]m_pReferenced;
+    delete[]m_pPins;
+    delete[]m_pAccesses;
+    delete[]m_pLines;
+    AlignedFree((unsigned char*)m_pTags);
+    DestroyCond(m_FlushSig);
+    DestroyCond(m_CleanSig);
+    DestroyCS(m_Lock);
+};
+
+/** All lines become free, and the access counters are cleared
+ */
+void CCacheDevice::Reset()
+{
+    memset(m_pTags,0,(size_t)m_TagBlocks*m_BlockSize);
+    memset(m_pLines,0,sizeof(unsigned)*m_NumOfSegments);
+    memset(m_pAccesses,0,m_NumOfSegments);
+    memset(m_pPins,0,sizeof(unsigned)*m_NumOfLines);
+    memset(m_pReferenced,0,m_NumOfLines);
+    memset(m_pWriteTimes,0,sizeof(double)*m_NumOfLines);
+    //the lines are allocated in the ascending order
+    for(unsigned i=0;i<m_NumOfLines;i++)
+        m_pFreeLines[i]=m_NumOfLines-1-i;
+    m_NumOfFree=m_NumOfLines;
+    m_NumOfDirty=0;
+    m_Hand=0;
+    m_AccessCount=0;
+    m_WritingBack=false;
+    m_DrainRequests=0;
+    m_FlushCursor=0;
+    m_Hits=m_Misses=m_Promotions=m_WrittenBack=0;
+    m_Failed=false;
+};
+
+/** Each chunk is read from the first copy located on a disk, which is online and is not being reconstructed
+ */
+bool CCacheDevice::ReadBlocks(unsigned long long Block,///the first block
+                              unsigned NumOfBlocks,///the number of blocks
+                              void* pDest ///destination buffer
+                             )
+{
+    if (!m_Mirrored)
+        return m_Device.ReadData(Block,NumOfBlocks,pDest);
+    unsigned char* p=(unsigned char*)pDest;
+    while (NumOfBlocks)
+    {
+        unsigned long long Chunk=Block/m_LineUnits;
+        unsigned Offset=(unsigned)(Block%m_LineUnits);
+        unsigned Blocks=min(NumOfBlocks,m_LineUnits-Offset);
+        bool Done=false;
+        for(unsigned k=0;!Done&&(k<m_NumOfCopies);k++)
+        {
+            unsigned DiskID=(unsigned)((Chunk+k)%m_Array.m_NumOfDisks);
+            if (!m_Array.IsDiskAvailable(DiskID,0))
+                continue;
+            unsigned long long DiskBlock=m_MirrorStart+(k*m_RegionChunks+Chunk/m_Array.m_NumOfDisks)*m_LineUnits+Offset;
+            Done=m_Array.m_pDisks[DiskID].ReadData(DiskBlock,Blocks,p);
+        };
+        if (!Done)
+            return false;
+        Block+=Blocks;
+        NumOfBlocks-=Blocks;
+        p+=(size_t)Blocks*m_BlockSize;
+    };
+    return true;
+};
+
+/** The copies located on the failed disks are skipped. The write fails if some copy could not be written,
+ * or no copy is available while all copies must be written
+ */
+bool CCacheDevice::WriteBlocks(unsigned long long Block,///the first block
+                               unsigned NumOfBlocks,///the number of blocks
+                               const void* pSrc,///the data to be written
+                               int DiskID ///the only array disk to be written, or -1 if all copies must be written
+                              )
+{
+    if (!m_Mirrored)
+        return m_Device.WriteData(Block,NumOfBlocks,pSrc);
+    const unsigned char* p=(const unsigned char*)pSrc;
+    while (NumOfBlocks)
+    {
+        unsigned long long Chunk=Block/m_LineUnits;
+        unsigned Offset=(unsigned)(Block%m_LineUnits);
+        unsigned Blocks=min(NumOfBlocks,m_LineUnits-Offset);
+        unsigned Written=0;
+        for(unsigned k=0;k<m_NumOfCopies;k++)
+        {
+            unsigned D=(unsigned)((Chunk+k)%m_Array.m_NumOfDisks);
+            if (((DiskID>=0)&&(D!=(unsigned)DiskID))||!m_Array.IsDiskOnline(D))
+                continue;
+            unsigned long long DiskBlock=m_MirrorStart+(k*m_RegionChunks+Chunk/m_Array.m_NumOfDisks)*m_LineUnits+Offset;
+            if (!m_Array.m_pDisks[D].WriteData(DiskBlock,Blocks,p))
+                return false;
+            Written++;
+        };
+        if (!Written&&(DiskID<0))
+            return false;
+        Block+=Blocks;
+        NumOfBlocks-=Blocks;
+        p+=(size_t)Blocks*m_BlockSize;
+    };
+    return true;
+};
+
+///make sure that the written blocks are persistent
+bool CCacheDevice::FlushBlocks()
+{
+    if (!m_Mirrored)
+        return m_Device.Flush();
+    bool Result=true;
+    for(unsigned i=0;i<m_Array.m_NumOfDisks;i++)
+        if (m_Array.m_pDisks[i].GetMountState()==msReadWrite)
+            Result&=m_Array.m_pDisks[i].Flush();
+    return Result;
+};
+
+/** Write the superblock and make sure that it reaches the device
+ */
+bool CCacheDevice::WriteSuperblock(bool Clean ///true if the tags of all lines are valid
+                                  )
+{
+    unsigned char* pBlock=AlignedMalloc(m_BlockSize);
+    memset(pBlock,0,m_BlockSize);
+    CacheSuperblock& S=*(CacheSuperblock*)pBlock;
+    S.MagicNumber=CACHEMAGIC;
+    S.BlockSize=m_BlockSize;
+    S.LineUnits=m_LineUnits;
+    S.NumOfLines=m_NumOfLines;
+    S.Clean=Clean;
+    S.CRC=GetChecksum(&S,sizeof(S)-sizeof(S.CRC));
+    bool Result=WriteBlocks(0,1,pBlock)&&FlushBlocks();
+    AlignedFree(pBlock);
+    return Result;
+};
+
+///write the block keeping the tag of a line. Must be called with m_Lock held
+bool CCacheDevice::WriteTag(unsigned Line ///the line
+                           )
+{
+    unsigned TagsPerBlock=m_BlockSize/sizeof(CacheLineTag);
+    unsigned Block=Line/TagsPerBlock;
+    return WriteBlocks(1+Block,1,m_pTags+Block*TagsPerBlock);
+};
+
+/** Take a free line, if any. Otherwise, move the CLOCK hand over the lines, skipping the dirty ones and the ones in use,
+ * and clearing the reference bits, until a clean line which was not recently accessed is found.
+ * If there is no such line, the background write-back is started
+ */
+int CCacheDevice::AllocateLine(unsigned long long Segment ///the segment to be cached
+                              )
+{
+    int Line=-1;
+    if (m_NumOfFree)
+        Line=m_pFreeLines[--m_NumOfFree];
+    else
+    {
+        for(unsigned i=0;(Line<0)&&(i<2*m_NumOfLines);i++)
+        {
+            unsigned L=m_Hand;
+            m_Hand=(m_Hand+1)%m_NumOfLines;
+            if (m_pPins[L]||m_pTags[L].Dirty)
+                continue;
+            if (m_pReferenced[L])
+                m_pReferenced[L]=0;
+            else
+            {
+                Line=L;
+                m_pLines[m_pTags[L].Segment-1]=0;
+            };
+        };
+    };
+    if (Line<0)
+    {
+        if (m_NumOfDirty&&!m_WritingBack)
+        {
+            m_WritingBack=true;
+            CondWake(m_FlushSig);
+        };
+        return -1;
+    };
+    m_pTags[Line].Segment=Segment+1;
+    m_pTags[Line].Dirty=0;
+    m_pLines[Segment]=Line+1;
+    m_pPins[Line]=1;
+    m_pReferenced[Line]=1;
+    m_pAccesses[Segment]=0;
+    return Line;
+};
+
+///release a line. Must be called with m_Lock held
+void CCacheDevice::ReleaseLine(unsigned Line ///the line
+                              )
+{
+    m_pLines[m_pTags[Line].Segment-1]=0;
+    if (m_pTags[Line].Dirty)
+        m_NumOfDirty--;
+    m_pTags[Line].Segment=0;
+    m_pTags[Line].Dirty=0;
+    m_pReferenced[Line]=0;
+    m_pFreeLines[m_NumOfFree++]=Line;
+};
+
+///release the cache device
+bool CCacheDevice::Unmount()
+{
+    m_MountState=msUnmounted;
+    return m_Mirrored||m_Device.Unmount(time(NULL));
+};
+
+/** Create an empty cache, whose tags are valid. The array disks are filled with zeroes on initialization,
+ * so the mirrored tier needs no initialization
+ */
+bool CCacheDevice::Init()
+{
+    if (m_MountState!=msUnmounted)
+        return false;
+    Reset();
+    if (m_Mirrored)
+        return true;
+    const void* pCodeConfig;
+    unsigned CodeConfigSize=m_Array.m_Engine.GetConfiguration(pCodeConfig);
+    if (m_Device.GetDiskState()==dsOnline)
+        m_Device.SetDiskState(dsOffline);
+    m_Device.SetArrayData(pCodeConfig,CodeConfigSize);
+    m_Valid=m_Device.ResetDisk()&&m_Device.Mount(true);
+    if (m_Valid)
+    {
+        m_Valid=m_Device.WriteData(1,m_TagBlocks,m_pTags)&&WriteSuperblock(true);
+        m_Valid&=m_Device.Unmount(time(NULL));
+    };
+    if (!m_Valid)
+        cerr<<"Failed to initialize the cache device\n";
+    return m_Valid;
+};
+
+/** Load the tags. If the array was not unmounted cleanly, the clean lines may be stale, so only the dirty ones are kept.
+ * In the write mode, the superblock is marked accordingly, and the background thread is started.
+ * An empty superblock of the mirrored tier denotes an empty tier of a freshly initialized array
+ */
+bool CCacheDevice::Start(bool Write ///true if the array is mounted for writing
+                        )
+{
+    if (!m_Valid)
+    {
+        cerr<<"Cache device is not available\n";
+        return false;
+    };
+    if ((m_MountState!=msUnmounted)||(!m_Mirrored&&!m_Device.Mount(Write)))
+        return false;
+    m_MountState=(Write)?msReadWrite:msRead;
+    Reset();
+    unsigned char* pBlock=AlignedMalloc(m_BlockSize);
+    bool Result=ReadBlocks(0,1,pBlock);
+    CacheSuperblock S=*(CacheSuperblock*)pBlock;
+    AlignedFree(pBlock);
+    if (Result&&m_Mirrored&&!S.MagicNumber&&!S.CRC)
+    {
+        S.MagicNumber=CACHEMAGIC;
+        S.BlockSize=m_BlockSize;
+        S.LineUnits=m_LineUnits;
+        S.NumOfLines=m_NumOfLines;
+        S.Clean=1;
+        S.CRC=GetChecksum(&S,sizeof(S)-sizeof(S.CRC));
+    };
+    if (!Result||(S.MagicNumber!=CACHEMAGIC)||(S.BlockSize!=m_BlockSize)||(S.LineUnits!=m_LineUnits)||(S.NumOfLines!=m_NumOfLines)||
+            (S.CRC!=GetChecksum(&S,sizeof(S)-sizeof(S.CRC)))||!ReadBlocks(1,m_TagBlocks,m_pTags))
+    {
+        cerr<<"Invalid cache superblock\n";
+        Unmount();
+        return false;
+    };
+    m_NumOfFree=0;
+    for(unsigned i=m_NumOfLines;i-->0;)
+    {
+        CacheLineTag& T=m_pTags[i];
+        if (!T.Segment||(T.Segment>m_NumOfSegments)||(!S.Clean&&!T.Dirty)||m_pLines[T.Segment-1])
+        {
+            T.Segment=0;
+            T.Dirty=0;
+            m_pFreeLines[m_NumOfFree++]=i;
+            continue;
+        };
+        m_pLines[T.Segment-1]=i+1;
+        if (T.Dirty)
+            m_NumOfDirty++;
+    };
+    if (!S.Clean)
+        cerr<<"The array was not unmounted cleanly, "<<m_NumOfDirty<<" dirty cache lines recovered\n";
+    if (!Write)
+        //the dirty lines are served to the readers
+        return true;
+    m_Stop=false;
+    //the tags of the clean lines are not saved until the cache is stopped
+    Result=WriteSuperblock(false);
+    if (Result)
+    {
+        m_Running=StartThread(m_Flusher,FlushThread,this);
+        if (!m_Running)
+        {
+            cerr<<"Failed to start the cache thread\n";
+            Result=false;
+        };
+    };
+    if (!Result)
+        Unmount();
+    return Result;
+};
+
+/** Write back all dirty lines and terminate the background thread. The tags of all lines are saved,
+ * so that the cache content is reused after the next mount
+ */
+bool CCacheDevice::Stop()
+{
+    if (m_MountState==msUnmounted)
+        return true;
+    bool Result=true;
+    if (m_Running)
+    {
+        Result=Drain();
+        LockCS(m_Lock);
+        m_Stop=true;
+        CondWakeAll(m_FlushSig);
+        UnlockCS(m_Lock);
+        JoinThread(m_Flusher);
+        m_Running=false;
+    };
+    if (m_MountState==msReadWrite)
+    {
+        //the lines, which could not be written back, remain dirty
+        Result&=WriteBlocks(1,m_TagBlocks,m_pTags)&&FlushBlocks()&&WriteSuperblock(true);
+        if (m_Hits+m_Misses)
+            cerr<<"Cache: "<<m_Hits<<" hits, "<<m_Misses<<" misses, "<<m_Promotions<<" promotions, "<<m_WrittenBack<<" lines written back\n";
+    };
+    Reset();
+    Result&=Unmount();
+    return Result;
+};
+
+/** While a drain is requested, the writers do not make new lines dirty, so that the number of dirty lines
+ * decreases monotonically
+ */
+bool CCacheDevice::Drain()
+{
+    if (!m_Running)
+        return !m_Failed;
+    LockCS(m_Lock);
+    m_DrainRequests++;
+    CondWake(m_FlushSig);
+    while (!m_Failed&&m_NumOfDirty)
+        CondWait(m_CleanSig,m_Lock);
+    m_DrainRequests--;
+    bool Result=!m_NumOfDirty;
+    UnlockCS(m_Lock);
+    return Result;
+};
+
+///make sure that the data written to the cache device is persistent. The mirrored tier is flushed with the array disks
+bool CCacheDevice::FlushDevice()
+{
+    if (m_Mirrored||(m_MountState!=msReadWrite))
+        return true;
+    return m_Device.Flush();
+};
+
+/** The segments are classified into the cached ones, the ones being promoted, and the remaining ones.
+ * The consecutive uncached segments are accessed by a single array request. The lines for the promoted segments
+ * are filled with their complete content, which is read from the array if needed. In the write-back mode,
+ * the written lines become dirty after their data reach the device, so that a persistent dirty tag always refers to valid data.
+ * If a line cannot be written, it is dropped, and the data are written to the array instead
+ */
+bool CCacheDevice::Transfer(unsigned long long FirstUnit,///the first payload stripe unit
+                            unsigned long long NumOfUnits,///the number of units
+                            unsigned char* pData,///the data buffer
+                            bool Write,///true if the data must be written
+                            size_t ThreadID ///the scratch arena of a calling thread obtained from CDiskArray::LockStripes()
+                           )
+{
+    if (!NumOfUnits)
+        return true;
+    unsigned long long LastUnit=FirstUnit+NumOfUnits;
+    unsigned long long FirstSegment=FirstUnit/m_LineUnits;
+    size_t NumOfSegments=(size_t)((LastUnit-1)/m_LineUnits+1-FirstSegment);
+    bool Promote=(m_MountState==msReadWrite);
+    //the line used for each segment, or -1
+    vector<int> Lines(NumOfSegments,-1);
+    //nonzero for the segments being promoted
+    vector<unsigned char> Promoted(NumOfSegments,0);
+    LockCS(m_Lock);
+    bool WriteBack=m_WriteBack&&!m_DrainRequests&&!m_Failed;
+    for(size_t k=0;k<NumOfSegments;k++)
+    {
+        unsigned long long Segment=FirstSegment+k;
+        unsigned Line=m_pLines[Segment];
+        if (Line)
+        {
+            Lines[k]=Line-1;
+            m_pPins[Line-1]++;
+            m_pReferenced[Line-1]=1;
+            m_Hits++;
+            continue;
+        };
+        m_Misses++;
+        //the segments which were never written read as zeroes without disk access
+        if (!Promote||(!Write&&!m_Array.IsAllocated(Segment/m_SegmentsPerStripe,(unsigned)(Segment%m_SegmentsPerStripe))))
+            continue;
+        //the mirrored tier keeps the recently written segments only, since reading the erasure-coded stripes is not more expensive
+        if (m_Mirrored&&!Write)
+            continue;
+        if (m_pAccesses[Segment]<255)
+            m_pAccesses[Segment]++;
+        if (++m_AccessCount>=(unsigned long long)CACHEAGINGPERIOD*m_NumOfLines)
+        {
+            //forget the old accesses
+            for(unsigned long long s=0;s<m_NumOfSegments;s++)
+                m_pAccesses[s]>>=1;
+            m_AccessCount=0;
+        };
+        if (m_pAccesses[Segment]<m_PromotionThreshold)
+            continue;
+        Lines[k]=AllocateLine(Segment);
+        if (Lines[k]>=0)
+        {
+            Promoted[k]=1;
+            m_Promotions++;
+        };
+    };
+    UnlockCS(m_Lock);
+
+    size_t LineSize=(size_t)m_LineUnits*m_BlockSize;
+    unsigned char* pLine=0;
+    bool Result=true;
+    //nonzero for the lines to be dropped, or made dirty
+    vector<unsigned char> Drop(NumOfSegments,0),MakeDirty(NumOfSegments,0);
+    if (Write&&!WriteBack)
+        Result=m_Array.Transfer(FirstUnit,NumOfUnits,pData,true,ThreadID);
+    for(size_t k=0;k<NumOfSegments;)
+    {
+        unsigned long long SegmentStart=(FirstSegment+k)*m_LineUnits;
+        unsigned long long From=max(FirstUnit,SegmentStart);
+        unsigned char* pSegment=pData+(From-FirstUnit)*m_BlockSize;
+        if (!Write&&((Lines[k]<0)||Promoted[k]))
+        {
+            //read the run of segments not served by the cache from the array
+            size_t End=k;
+            while ((End<NumOfSegments)&&((Lines[End]<0)||Promoted[End]))
+                End++;
+            unsigned long long To=min(LastUnit,(FirstSegment+End)*m_LineUnits);
+            bool Read=m_Array.Transfer(From,To-From,pSegment,false,ThreadID);
+            Result&=Read;
+            for(;k<End;k++)
+            {
+                if (!Promoted[k])
+                    continue;
+                SegmentStart=(FirstSegment+k)*m_LineUnits;
+                const unsigned char* pSrc=pData+((long long)SegmentStart-(long long)FirstUnit)*m_BlockSize;
+                if ((SegmentStart<FirstUnit)||(SegmentStart+m_LineUnits>LastUnit))
+                {
+                    //the segment is not completely covered by the request
+                    if (!pLine)
+                        pLine=AlignedMalloc(LineSize);
+                    Read=Read&&m_Array.Transfer(SegmentStart,m_LineUnits,pLine,false,ThreadID);
+                    pSrc=pLine;
+                };
+                Drop[k]=!(Read&&WriteBlocks(GetLineBlock(Lines[k]),m_LineUnits,pSrc));
+            };
+            continue;
+        };
+        unsigned long long To=min(LastUnit,SegmentStart+m_LineUnits);
+        unsigned Units=(unsigned)(To-From);
+        if (Lines[k]<0)
+        {
+            if (Write&&WriteBack)
+            {
+                //write the run of uncached segments to the array
+                size_t End=k+1;
+                while ((End<NumOfSegments)&&(Lines[End]<0))
+                    End++;
+                To=min(LastUnit,(FirstSegment+End)*m_LineUnits);
+                Result&=m_Array.Transfer(From,To-From,pSegment,true,ThreadID);
+                k=End;
+            }
+            else
+                k++;
+            continue;
+        };
+        unsigned long long Block=GetLineBlock(Lines[k])+(From-SegmentStart);
+        bool Done;
+        if (!Write)
+            Done=ReadBlocks(Block,Units,pSegment);
+        else
+        if (Promoted[k]&&(Units<m_LineUnits))
+        {
+            //complete the segment with the data from the array. In the write-through mode, they are already updated
+            if (!pLine)
+                pLine=AlignedMalloc(LineSize);
+            Done=m_Array.Transfer(SegmentStart,m_LineUnits,pLine,false,ThreadID);
+            if (WriteBack)
+                memcpy(pLine+(From-SegmentStart)*m_BlockSize,pSegment,(size_t)Units*m_BlockSize);
+            Done=Done&&WriteBlocks(GetLineBlock(Lines[k]),m_LineUnits,pLine);
+        }
+        else
+            Done=WriteBlocks(Block,Units,pSegment);
+        if (!Write)
+            Result&=Done;
+        else
+        if (!WriteBack)
+            //the line must not keep stale data
+            Drop[k]=!Done||!Result;
+        else
+        {
+            bool Dirty=m_pTags[Lines[k]].Dirty!=0;
+            if (!Done&&!Dirty)
+            {
+                //the line is still clean, so the data can be written in place
+                Drop[k]=1;
+                Result&=m_Array.Transfer(From,Units,pSegment,true,ThreadID);
+            }
+            else
+            {
+                Result&=Done;
+                MakeDirty[k]=!Dirty;
+            };
+        };
+        k++;
+    };
+    if (pLine)
+        AlignedFree(pLine);
+    //the data of the lines must be persistent before their tags refer to them
+    if ((find(MakeDirty.begin(),MakeDirty.end(),1)!=MakeDirty.end())&&!FlushBlocks())
+    {
+        cerr<<"Cache flush failed\n";
+        for(size_t k=0;k<NumOfSegments;k++)
+        {
+            if (!MakeDirty[k])
+                continue;
+            //the lines are dropped, so the data are written in place
+            unsigned long long From=max(FirstUnit,(FirstSegment+k)*m_LineUnits);
+            unsigned long long To=min(LastUnit,(FirstSegment+k+1)*m_LineUnits);
+            Result&=m_Array.Transfer(From,To-From,pData+(From-FirstUnit)*m_BlockSize,true,ThreadID);
+            MakeDirty[k]=0;
+            Drop[k]=1;
+        };
+    };
+    double Now=GetClock();
+    LockCS(m_Lock);
+    bool WasClean=!m_NumOfDirty;
+    for(size_t k=0;k<NumOfSegments;k++)
+    {
+        if (Lines[k]<0)
+            continue;
+        unsigned Line=Lines[k];
+        m_pPins[Line]--;
+        if (Drop[k])
+        {
+            ReleaseLine(Line);
+            continue;
+        };
+        if (Write)
+            m_pWriteTimes[Line]=Now;
+        if (MakeDirty[k])
+        {
+            m_pTags[Line].Dirty=1;
+            m_NumOfDirty++;
+            if (!WriteTag(Line))
+            {
+                //the line data are valid, but the tag may be lost
+                cerr<<"Cache tag write failed\n";
+                Result=false;
+            };
+        };
+    };
+    if ((m_NumOfDirty>=m_HighWatermark)&&!m_WritingBack)
+    {
+        m_WritingBack=true;
+        CondWake(m_FlushSig);
+    }
+    else
+    if (m_CoolingTime&&WasClean&&m_NumOfDirty)
+        //the background thread waits for the lines to cool down
+        CondWake(m_FlushSig);
+    UnlockCS(m_Lock);
+    return Result;
+};
+
+/** The dirty tags are overwritten, so that the released stripes are not updated after a crash
+ */
+bool CCacheDevice::Invalidate(unsigned long long FirstStripe,///the first stripe
+                              unsigned long long LastStripe,///the stripe following the last one
+                              unsigned SubarrayID ///the subarray
+                             )
+{
+    bool Result=true;
+    LockCS(m_Lock);
+    for(unsigned long long S=FirstStripe;S<LastStripe;S++)
+    {
+        unsigned long long Segment=S*m_SegmentsPerStripe+SubarrayID;
+        m_pAccesses[Segment]=0;
+        unsigned Line=m_pLines[Segment];
+        if (!Line)
+            continue;
+        bool Dirty=m_pTags[Line-1].Dirty!=0;
+        ReleaseLine(Line-1);
+        if (Dirty)
+            Result&=WriteTag(Line-1);
+    };
+    CondWakeAll(m_CleanSig);
+    UnlockCS(m_Lock);
+    return Result;
+};
+
+/** The tags and the superblock are rewritten. Each line having a copy on the disk is copied under the lock
+ * of its stripe, so that it is not modified concurrently. The concurrent writes update the copies on this disk as well.
+ * The copies on a disk relocated to the spare space are not restored, so the lines stay degraded until the disk is replaced
+ */
+bool CCacheDevice::Resync(unsigned DiskID ///the disk being reconstructed
+                         )
+{
+    if (!m_Mirrored||(m_MountState!=msReadWrite))
+        return true;
+    LockCS(m_Lock);
+    bool Result=WriteBlocks(1,m_TagBlocks,m_pTags,DiskID);
+    UnlockCS(m_Lock);
+    Result=Result&&WriteSuperblock(false);
+    unsigned char* pLine=AlignedMalloc((size_t)m_LineUnits*m_BlockSize);
+    for(unsigned L=0;Result&&(L<m_NumOfLines);L++)
+    {
+        unsigned long long Chunk=GetLineBlock(L)/m_LineUnits;
+        if ((DiskID+m_Array.m_NumOfDisks-Chunk%m_Array.m_NumOfDisks)%m_Array.m_NumOfDisks>=m_NumOfCopies)
+            continue;
+        LockCS(m_Lock);
+        unsigned long long Segment=m_pTags[L].Segment;
+        UnlockCS(m_Lock);
+        if (!Segment)
+            continue;
+        Segment--;
+        unsigned long long S=Segment/m_SegmentsPerStripe;
+        unsigned SubarrayID=(unsigned)(Segment%m_SegmentsPerStripe);
+        double Arrival=m_Array.m_Scheduler.Begin(iocBackground);
+        size_t ThreadID=m_Array.LockStripes(S,S+1,SubarrayID);
+        //the line could have been replaced before the stripe was locked
+        LockCS(m_Lock);
+        bool Valid=(m_pTags[L].Segment==Segment+1);
+        if (Valid)
+            m_pPins[L]++;
+        UnlockCS(m_Lock);
+        if (Valid)
+        {
+            Result=ReadBlocks(GetLineBlock(L),m_LineUnits,pLine)&&WriteBlocks(GetLineBlock(L),m_LineUnits,pLine,DiskID);
+            LockCS(m_Lock);
+            m_pPins[L]--;
+            UnlockCS(m_Lock);
+        };
+        m_Array.UnlockStripes(ThreadID);
+        m_Array.m_Scheduler.End(iocBackground,Arrival);
+    };
+    AlignedFree(pLine);
+    Result=Result&&FlushBlocks();
+    if (!Result)
+        cerr<<"Failed to copy the mirrored lines to disk "<<DiskID<<endl;
+    return Result;
+};
+
+/** The stripes are locked, so that the lines cannot be modified while they are written back.
+ * The lines of consecutive stripes are written by a single array request if there is a single subarray.
+ * The lines become clean only after the array disks are flushed
+ */
+bool CCacheDevice::WriteBack(unsigned SubarrayID,///the subarray
+                             unsigned long long FirstStripe,///the first stripe
+                             unsigned NumOfStripes ///the number of stripes
+                            )
+{
+    double Arrival=m_Array.m_Scheduler.Begin(iocBackground);
+    size_t ThreadID=m_Array.LockStripes(FirstStripe,FirstStripe+NumOfStripes,SubarrayID);
+    //the lines could have been invalidated before the stripes were locked
+    vector<int> Lines(NumOfStripes,-1);
+    LockCS(m_Lock);
+    for(unsigned i=0;i<NumOfStripes;i++)
+    {
+        unsigned Line=m_pLines[(FirstStripe+i)*m_SegmentsPerStripe+SubarrayID];
+        if (Line&&m_pTags[Line-1].Dirty)
+        {
+            Lines[i]=Line-1;
+            m_pPins[Line-1]++;
+        };
+    };
+    UnlockCS(m_Lock);
+    size_t LineSize=(size_t)m_LineUnits*m_BlockSize;
+    bool Result=true;
+    for(unsigned i=0;Result&&(i<NumOfStripes);)
+    {
+        if (Lines[i]<0)
+        {
+            i++;
+            continue;
+        };
+        unsigned End=i+1;
+        if (m_SegmentsPerStripe==1)
+            while ((End<NumOfStripes)&&(Lines[End]>=0))
+                End++;
+        for(unsigned k=i;Result&&(k<End);k++)
+            Result=ReadBlocks(GetLineBlock(Lines[k]),m_LineUnits,m_pFlushBuffer+k*LineSize);
+        unsigned long long FirstUnit=((FirstStripe+i)*m_SegmentsPerStripe+SubarrayID)*m_LineUnits;
+        Result=Result&&m_Array.Transfer(FirstUnit,(unsigned long long)(End-i)*m_LineUnits,m_pFlushBuffer+i*LineSize,true,ThreadID);
+        i=End;
+    };
+    Result=Result&&m_Array.FlushDisks();
+    LockCS(m_Lock);
+    unsigned TagsPerBlock=m_BlockSize/sizeof(CacheLineTag);
+    vector<unsigned> Written;
+    for(unsigned i=0;i<NumOfStripes;i++)
+    {
+        if (Lines[i]<0)
+            continue;
+        unsigned Line=Lines[i];
+        m_pPins[Line]--;
+        if (!Result)
+            continue;
+        m_pTags[Line].Dirty=0;
+        m_NumOfDirty--;
+        m_WrittenBack++;
+        Written.push_back(Line/TagsPerBlock);
+    };
+    //each tag block is written once
+    sort(Written.begin(),Written.end());
+    Written.erase(unique(Written.begin(),Written.end()),Written.end());
+    for(size_t b=0;Result&&(b<Written.size());b++)
+        Result=WriteTag(Written[b]*TagsPerBlock);
+    UnlockCS(m_Lock);
+    m_Array.UnlockStripes(ThreadID);
+    m_Array.m_Scheduler.End(iocBackground,Arrival);
+    return Result;
+};
+
+/** Once the number of dirty lines reaches the high watermark, or a drain is requested, the dirty lines are written back
+ * in the ascending order of (subarray, stripe) pairs, continuing from the last written batch, until their number drops
+ * to the low watermark, or to zero if a drain is requested. Each batch consists of the lines keeping consecutive stripes.
+ * Otherwise, only the lines which were not written for the cooling time are written back
+ */
+THREADPROC CCacheDevice::FlushThread(void* pParams ///must be a pointer to CCacheDevice
+                                    )
+{
+    CCacheDevice& C=*(CCacheDevice*)pParams;
+    unsigned long long NumOfStripes=C.m_NumOfSegments/C.m_SegmentsPerStripe;
+    vector<unsigned long long> Dirty;
+    LockCS(C.m_Lock);
+    while (!C.m_Stop)
+    {
+        if (C.m_NumOfDirty>=C.m_HighWatermark)
+            C.m_WritingBack=true;
+        bool All=C.m_WritingBack||C.m_DrainRequests;
+        if (C.m_Failed||!C.m_NumOfDirty||(!All&&!C.m_CoolingTime))
+        {
+            C.m_WritingBack=false;
+            CondWait(C.m_FlushSig,C.m_Lock);
+            continue;
+        };
+        //the position of each dirty line to be written in the (subarray, stripe) order
+        Dirty.clear();
+        double Now=GetClock();
+        //the time the next line cools down at
+        double NextCooling=0;
+        for(unsigned L=0;L<C.m_NumOfLines;L++)
+            if (C.m_pTags[L].Dirty)
+            {
+                double Cooling=C.m_pWriteTimes[L]+C.m_CoolingTime;
+                if (!All&&(Cooling>Now))
+                {
+                    if (!NextCooling||(Cooling<NextCooling))
+                        NextCooling=Cooling;
+                    continue;
+                };
+                unsigned long long Segment=C.m_pTags[L].Segment-1;
+                Dirty.push_back((Segment%C.m_SegmentsPerStripe)*NumOfStripes+Segment/C.m_SegmentsPerStripe);
+            };
+        if (Dirty.empty())
+        {
+            CondTimedWait(C.m_FlushSig,C.m_Lock,(unsigned)((NextCooling-Now)*1000)+1);
+            continue;
+        };
+        sort(Dirty.begin(),Dirty.end());
+        size_t First=lower_bound(Dirty.begin(),Dirty.end(),C.m_FlushCursor)-Dirty.begin();
+        if (First==Dirty.size())
+            First=0;
+        size_t Last=First+1;
+        while ((Last<Dirty.size())&&(Last-First<CACHEFLUSHBATCH)&&(Dirty[Last]==Dirty[Last-1]+1)&&(Dirty[Last]%NumOfStripes))
+            Last++;
+        C.m_FlushCursor=Dirty[Last-1]+1;
+        unsigned SubarrayID=(unsigned)(Dirty[First]/NumOfStripes);
+        unsigned long long FirstStripe=Dirty[First]%NumOfStripes;
+        UnlockCS(C.m_Lock);
+        bool Result=C.WriteBack(SubarrayID,FirstStripe,(unsigned)(Last-First));
+        LockCS(C.m_Lock);
+        if (!Result)
+        {
+            cerr<<"Failed to write back the cache lines\n";
+            C.m_Failed=true;
+        };
+        if (C.m_NumOfDirty<=C.m_LowWatermark)
+            C.m_WritingBack=false;
+        CondWakeAll(C.m_CleanSig);
+    };
+    UnlockCS(C.m_Lock);
+    return 0;
+};
@@ -0,0 +1,183 @@
+/*********************************************************
+ * coalescer.cpp  - implementation of the write coalescing of the RAID emulator
+ *
+ * Copyright(C) 2012 Saint-Petersburg State Polytechnic University
+ *
+ * Developed in the framework of the "Forward error correction for next generation storage systems" project
+ *
+ * Author: P. Trifonov petert@dcn.ftk.spbstu.ru
+ * ********************************************************/
+#include <iostream>
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+#include "misc.h"
+#include "arithmetic.h"
+#include "array.h"
+#include "coalescer.h"
+
+using namespace std;
+
+CWriteCoalescer::CWriteCoalescer(CDiskArray& Array,///the array the writes are issued to
+                                 double Window ///the coalescing window (sec)
+                                ):m_Array(Array),m_Window(Window),m_UnitSize(Array.GetStripeUnitSize()),m_StripeSize(Array.GetStripeSize()),
+    m_NumOfThreads(max(Array.m_NumOfThreads,1u)),m_NumOfWaiting(0),m_Writes(0),m_Batches(0)
+{
+    if (!InitCS(m_Lock)||!InitCond(m_Signal))
+        throw Exception("Failed to initialize write coalescing mutex");
+};
+
+CWriteCoalescer::~CWriteCoalescer()
+{
+    DestroyCond(m_Signal);
+    DestroyCS(m_Lock);
+};
+
+/** The later writes overwrite the bytes covered by the earlier ones, since they are concurrent
+ */
+void CWriteCoalescer::Add(Batch& B,///the batch
+                          unsigned Offset,///offset of the data within the stripe
+                          unsigned Length,///data size
+                          const unsigned char* pSrc ///the data
+                         )
+{
+    memcpy(B.pData+Offset,pSrc,Length);
+    for(unsigned i=Offset;i<Offset+Length;i++)
+        if (!B.pCovered[i])
+        {
+            B.pCovered[i]=1;
+            B.pUnitCoverage[i/m_UnitSize]++;
+            B.CoveredBytes++;
+        };
+    B.First=min(B.First,Offset);
+    B.Last=max(B.Last,Offset+Length);
+};
+
+/** The stripe units from the first covered byte to the last one are written at once. The bytes not covered by the writes
+ * are read from the array under the stripe locks, so that the concurrent writes to them are not lost
+ */
+bool CWriteCoalescer::Flush(Batch& B ///the batch
+                           )
+{
+    unsigned FirstUnit=B.First/m_UnitSize;
+    unsigned LastUnit=(B.Last+m_UnitSize-1)/m_UnitSize;
+    unsigned long long StripeUnitID=B.StripeID*(m_StripeSize/m_UnitSize)+FirstUnit;
+    double Arrival=m_Array.m_Scheduler.Begin(iocWrite);
+    size_t ThreadID=m_Array.LockUnits(StripeUnitID,StripeUnitID+LastUnit-FirstUnit);
+    unsigned char* pTemp=m_Array.m_Engine.GetScratch(ThreadID)+m_Array.m_PartialRWBuffer;
+    bool Result=true;
+    for(unsigned u=FirstUnit;Result&&(u<LastUnit);u++)
+    {
+        if (B.pUnitCoverage[u]==m_UnitSize)
+            continue;
+        //partial stripe unit write is necessary
+        Result=m_Array.Read(StripeUnitID+u-FirstUnit,1,pTemp,ThreadID);
+        for(unsigned i=u*m_UnitSize;i<(u+1)*m_UnitSize;i++)
+            if (!B.pCovered[i])
+                B.pData[i]=pTemp[i-u*m_UnitSize];
+    };
+    Result=Result&&m_Array.Write(StripeUnitID,LastUnit-FirstUnit,B.pData+(size_t)FirstUnit*m_UnitSize,ThreadID);
+    m_Array.UnlockStripes(ThreadID);
+    m_Array.m_Scheduler.End(iocWrite,Arrival);
+    return Result;
+};
+
+/** The writer opening a batch becomes its leader. It closes the batch once the window expires, or the stripe is covered,
+ * or all the expected writers are waiting for the batches, writes it, and wakes up the other writers.
+ * The batch is admitted by the scheduler as a single write
+ * @return the actual number of bytes written, or -1 in case of error
+ */
+long long CWriteCoalescer::Write(long long& fd,///file description, i.e. current position
+                                 long long Bytes2Write,///the number of bytes to be written
+                                 const unsigned char* pSrc ///source address
+                                )
+{
+    if (m_Array.m_MountState!=msReadWrite)
+        return -1;
+    long long NewPos=fd+Bytes2Write;
+    if ((unsigned long long)NewPos>m_Array.GetCapacity())
+        NewPos=m_Array.GetCapacity();
+    Bytes2Write=NewPos-fd;
+    if (Bytes2Write<=0)
+        return (Bytes2Write)?-1:0;
+    unsigned long long StripeID=fd/m_StripeSize;
+    LockCS(m_Lock);
+    map<unsigned long long,Batch*>::iterator it=m_Open.find(StripeID);
+    bool Leader=(it==m_Open.end());
+    Batch* pBatch;
+    if (Leader)
+    {
+        pBatch=new Batch;
+        pBatch->StripeID=StripeID;
+        pBatch->pData=AlignedMalloc(m_StripeSize);
+        pBatch->pCovered=new unsigned char[m_StripeSize];
+        memset(pBatch->pCovered,0,m_StripeSize);
+        pBatch->pUnitCoverage=new unsigned[m_StripeSize/m_UnitSize];
+        memset(pBatch->pUnitCoverage,0,sizeof(unsigned)*(m_StripeSize/m_UnitSize));
+        pBatch->CoveredBytes=0;
+        pBatch->First=m_StripeSize;
+        pBatch->Last=0;
+        pBatch->NumOfWriters=0;
+        pBatch->Deadline=GetClock()+m_Window;
+        pBatch->Done=pBatch->Result=false;
+        m_Open[StripeID]=pBatch;
+    }
+    else
+        pBatch=it->second;
+    Batch& B=*pBatch;
+    Add(B,(unsigned)(fd%m_StripeSize),(unsigned)Bytes2Write,pSrc);
+    B.NumOfWriters++;
+    m_Writes++;
+    if (++m_NumOfWaiting>=m_NumOfThreads)
+        //no other writer can join the open batches
+        CondWakeAll(m_Signal);
+    if (Leader)
+    {
+        while ((B.CoveredBytes<m_StripeSize)&&(m_NumOfWaiting<m_NumOfThreads))
+        {
+            double Now=GetClock();
+            if (Now>=B.Deadline)
+                break;
+            CondTimedWaitMicroseconds(m_Signal,m_Lock,(unsigned)ceil((B.Deadline-Now)*1E6));
+        };
+        m_Open.erase(StripeID);
+        m_Batches++;
+        UnlockCS(m_Lock);
+        bool Result=Flush(B);
+        LockCS(m_Lock);
+        B.Result=Result;
+        B.Done=true;
+        CondWakeAll(m_Signal);
+    }
+    else
+    {
+        if (B.CoveredBytes==m_StripeSize)
+            //the leader need not wait any more
+            CondWakeAll(m_Signal);
+        while (!B.Done)
+            CondWait(m_Signal,m_Lock);
+    };
+    bool Result=B.Result;
+    m_NumOfWaiting--;
+    if (!--B.NumOfWriters)
+    {
+        AlignedFree(B.pData);
+        delete[]B.pCovered;
+        delete[]B.pUnitCoverage;
+        delete pBatch;
+    };
+    UnlockCS(m_Lock);
+    if (!Result)
+        return -1;
+    fd=NewPos;
+    return Bytes2Write;
+};
+
+void CWriteCoalescer::Reset()
+{
+    LockCS(m_Lock);
+    if (m_Writes)
+        cerr<<"Write coalescing: "<<m_Writes<<" writes were merged into "<<m_Batches<<" stripe writes\n";
+    m_Writes=m_Batches=0;
+    UnlockCS(m_Lock);
+};
@@ -0,0 +1,559 @@
+/*********************************************************
+ * compression.cpp  - implementation of the inline compression of the RAID emulator
+ *
+ * Copyright(C) 2012 Saint-Petersburg State Polytechnic University
+ *
+ * Developed in the framework of the "Forward error correction for next generation storage systems" project
+ *
+ * Author: P. Trifonov petert@dcn.ftk.spbstu.ru
+ * ********************************************************/
+#include <iostream>
+#include <algorithm>
+#include <string.h>
+#include <time.h>
+#include "misc.h"
+#include "arithmetic.h"
+#include "array.h"
+#include "lz.h"
+#include "compression.h"
+
+using namespace std;
+
+///compression map superblock signature
+#define COMPRESSIONMAGIC 0x2C0A9E55
+///the released physical units are made reusable once this number of them is accumulated
+#define COMPRESSIONCHECKPOINT 1024
+///the maximal number of logical blocks processed at once
+#define COMPRESSIONCHUNK 64
+///the physical unit keeps the data of some logical block, or is being written
+#define UNITUSED 1
+///the physical unit was released since the device was last flushed, so that the map stored on the device may still refer to it
+#define UNITPENDING 2
+
+///avoid padding of on-disk structures
+#pragma pack(push)
+#pragma pack(1)
+///the first block of the map device
+struct CompressionSuperblock
+{
+    ///must be COMPRESSIONMAGIC
+    unsigned MagicNumber;
+    ///size of a physical unit
+    unsigned UnitSize;
+    ///size of a logical block
+    unsigned BlockSize;
+    ///the number of logical blocks
+    unsigned long long NumOfBlocks;
+    ///CRC32 of all preceding fields
+    unsigned CRC;
+};
+#pragma pack(pop)
+
+/** Open the map device and check that it was created for the same array configuration.
+ * The logical blocks cover the payload stripes except COMPRESSIONCHUNK blocks, so that the writes of the incompressible data
+ * to a full array find the free units once the units released by the other writes become reusable
+ */
+CCompression::CCompression(CDiskArray& Array,///the array to be served
+                           const char* pFileName,///the name of the file emulating the map device
+                           unsigned BlockSize,///size of a logical block. This must be a multiple of the stripe unit size
+                           unsigned NumOfThreads,///the expected number of concurrent threads
+                           unsigned DeviceID ///identifier of the map device. This must be different from the IDs of the array disks
+                          ):m_Array(Array),m_Valid(false),m_UnitSize(Array.GetStripeUnitSize()),m_BlockSize(BlockSize),m_NumOfFree(0),m_Cursor(0),
+    m_NumOfWriters(0),m_Failed(false),m_Written(0),m_Stored(0),m_Incompressible(0),m_Zeroes(0),m_Locker(max(NumOfThreads,1u))
+{
+    if (!BlockSize||(BlockSize%m_UnitSize))
+        throw Exception("The compression block size %u is not a multiple of the stripe unit size %u",BlockSize,m_UnitSize);
+    m_BlockUnits=BlockSize/m_UnitSize;
+    m_NumOfUnits=m_Array.m_HashStripe*m_Array.m_UnitsPerStripe;
+    if (m_NumOfUnits/m_BlockUnits<=COMPRESSIONCHUNK)
+        throw Exception("Disk capacity is too small for the compression block size %u",BlockSize);
+    m_NumOfBlocks=m_NumOfUnits/m_BlockUnits-COMPRESSIONCHUNK;
+    m_RecordSize=sizeof(CompressedBlock)+(m_BlockUnits-1)*sizeof(unsigned long long);
+    m_MapBlocks=(m_NumOfBlocks*m_RecordSize+m_UnitSize-1)/m_UnitSize;
+    if (!InitCS(m_Lock)||!InitCond(m_Released))
+        throw Exception("Failed to initialize compression mutex");
+    InitCRC32();
+    m_pMap=AlignedMalloc((size_t)m_MapBlocks*m_UnitSize);
+    memset(m_pMap,0,(size_t)m_MapBlocks*m_UnitSize);
+    m_pFlags=new unsigned char[(size_t)m_NumOfUnits];
+    memset(m_pFlags,0,(size_t)m_NumOfUnits);
+
+    const void* pCodeConfig;
+    unsigned CodeConfigSize=m_Array.m_Engine.GetConfiguration(pCodeConfig);
+    if (m_Device.Initialize(pFileName,DeviceID,m_UnitSize,1+m_MapBlocks,CodeConfigSize)&&(m_Device.GetDiskState()==dsOffline))
+    {
+        void const* pCodeConfig2;
+        unsigned CodeConfigSize2=m_Device.GetArrayData(pCodeConfig2);
+        m_Valid=(CodeConfigSize2==CodeConfigSize)&&!memcmp(pCodeConfig,pCodeConfig2,CodeConfigSize);
+    };
+    if (m_Valid)
+        m_Device.SetDiskState(dsOnline);
+};
+
+CCompression::~CCompression()
+{
+    Stop();
+    AlignedFree(m_pMap);
+    delete[]m_pFlags;
+    DestroyCond(m_Released);
+    DestroyCS(m_Lock);
+};
+
+///write the superblock
+///@return true on success
+bool CCompression::WriteSuperblock()
+{
+    unsigned char* pBlock=AlignedMalloc(m_UnitSize);
+    memset(pBlock,0,m_UnitSize);
+    CompressionSuperblock& S=*(CompressionSuperblock*)pBlock;
+    S.MagicNumber=COMPRESSIONMAGIC;
+    S.UnitSize=m_UnitSize;
+    S.BlockSize=m_BlockSize;
+    S.NumOfBlocks=m_NumOfBlocks;
+    unsigned CRC=0;
+    UpdateCRC32(CRC,sizeof(S)-sizeof(S.CRC),pBlock);
+    S.CRC=CRC;
+    bool Result=m_Device.WriteData(0,1,pBlock)&&m_Device.Flush();
+    AlignedFree(pBlock);
+    return Result;
+};
+
+/** All logical blocks of an initialized array are filled with zeroes, so no physical units are used
+ */
+bool CCompression::Init()
+{
+    if (m_Device.GetMountState()!=msUnmounted)
+        return false;
+    m_Failed=false;
+    const void* pCodeConfig;
+    unsigned CodeConfigSize=m_Array.m_Engine.GetConfiguration(pCodeConfig);
+    if (m_Device.GetDiskState()==dsOnline)
+        m_Device.SetDiskState(dsOffline);
+    m_Device.SetArrayData(pCodeConfig,CodeConfigSize);
+    m_Valid=m_Device.ResetDisk()&&m_Device.Mount(true);
+    if (m_Valid)
+    {
+        memset(m_pMap,0,(size_t)m_MapBlocks*m_UnitSize);
+        m_Valid=WriteSuperblock()&&m_Device.WriteData(1,(unsigned)m_MapBlocks,m_pMap)&&m_Device.Flush();
+        m_Valid&=m_Device.Unmount(time(NULL));
+    };
+    if (!m_Valid)
+        cerr<<"Failed to initialize the compression map device\n";
+    return m_Valid;
+};
+
+/** The physical units in use are found from the map, so nothing but the map needs to be written.
+ * Each physical unit must be used by a single logical block
+ */
+bool CCompression::Load()
+{
+    unsigned char* pBlock=AlignedMalloc(m_UnitSize);
+    bool Result=m_Device.ReadData(0,1,pBlock);
+    CompressionSuperblock S=*(CompressionSuperblock*)pBlock;
+    AlignedFree(pBlock);
+    unsigned CRC=0;
+    UpdateCRC32(CRC,sizeof(S)-sizeof(S.CRC),(const unsigned char*)&S);
+    Result=Result&&(S.MagicNumber==COMPRESSIONMAGIC)&&(S.UnitSize==m_UnitSize)&&(S.BlockSize==m_BlockSize)&&(S.NumOfBlocks==m_NumOfBlocks)&&
+           (S.CRC==CRC)&&m_Device.ReadData(1,(unsigned)m_MapBlocks,m_pMap);
+    memset(m_pFlags,0,(size_t)m_NumOfUnits);
+    m_Pending.clear();
+    m_NumOfFree=m_NumOfUnits;
+    for(unsigned long long i=0;Result&&(i<m_NumOfBlocks);i++)
+    {
+        const CompressedBlock& R=GetRecord(i);
+        Result=(R.Size<=m_BlockSize);
+        for(unsigned k=0;Result&&(k<GetUnits(R.Size));k++)
+        {
+            Result=(R.Units[k]<m_NumOfUnits)&&!m_pFlags[R.Units[k]];
+            if (!Result)
+                break;
+            m_pFlags[R.Units[k]]=UNITUSED;
+            m_NumOfFree--;
+        };
+    };
+    if (!Result)
+        cerr<<"Invalid compression map\n";
+    m_Cursor=0;
+    m_NumOfWriters=0;
+    return Result;
+};
+
+bool CCompression::Start(bool Write ///true if the array is mounted for writing
+                        )
+{
+    if (!m_Valid)
+    {
+        cerr<<"Compression map device is not available\n";
+        return false;
+    };
+    if ((m_Device.GetMountState()!=msUnmounted)||!m_Device.Mount(Write))
+        return false;
+    m_Failed=false;
+    m_Written=m_Stored=m_Incompressible=m_Zeroes=0;
+    if (!Load())
+    {
+        m_Device.Unmount(time(NULL));
+        return false;
+    };
+    return true;
+};
+
+bool CCompression::Stop()
+{
+    if (m_Device.GetMountState()==msUnmounted)
+        return true;
+    bool Result=true;
+    if (m_Device.GetMountState()==msReadWrite)
+    {
+        LockCS(m_Lock);
+        Result=Checkpoint();
+        if (m_Written||m_Zeroes)
+            cerr<<"Compression: "<<m_Written<<" bytes written were stored in "<<m_Stored<<" bytes, "<<m_Incompressible
+                <<" blocks stored uncompressed, "<<m_Zeroes<<" blocks filled with zeroes, "<<m_NumOfUnits-m_NumOfFree
+                <<" physical units in use\n";
+        UnlockCS(m_Lock);
+    };
+    m_Pending.clear();
+    Result&=m_Device.Unmount(time(NULL));
+    return Result;
+};
+
+/** The array is flushed first, followed by the device, so that the map records stored on the device refer to the persistent data,
+ * and the units released before that are not referenced by them any more, so they can be reused.
+ * The writers are blocked meanwhile, since the map must not change
+ */
+bool CCompression::Checkpoint()
+{
+    if (m_Failed)
+        return false;
+    if (!m_Array.FlushDisks()||!m_Device.Flush())
+    {
+        cerr<<"Failed to flush the compressed array\n";
+        m_Failed=true;
+        return false;
+    };
+    for(size_t k=0;k<m_Pending.size();k++)
+        m_pFlags[m_Pending[k]]=0;
+    m_NumOfFree+=m_Pending.size();
+    m_Pending.clear();
+    return true;
+};
+
+/** The cursor is moved past the unit, so that the units allocated one after another are consecutive
+ */
+unsigned long long CCompression::Allocate()
+{
+    while (m_pFlags[m_Cursor])
+        m_Cursor=(m_Cursor+1)%m_NumOfUnits;
+    unsigned long long UnitID=m_Cursor;
+    m_pFlags[UnitID]=UNITUSED;
+    m_NumOfFree--;
+    m_Cursor=(m_Cursor+1)%m_NumOfUnits;
+    return UnitID;
+};
+
+///free a physical unit at once or after the next checkpoint. Must be called with m_Lock held
+void CCompression::Release(unsigned long long UnitID,///the unit
+                           bool Pending ///true if the map stored on the device may refer to it
+                          )
+{
+    if (Pending)
+    {
+        m_pFlags[UnitID]=UNITPENDING;
+        m_Pending.push_back(UnitID);
+    }
+    else
+    {
+        m_pFlags[UnitID]=0;
+        m_NumOfFree++;
+    };
+};
+
+/** The physical units are accessed as ordinary payload data, so the cache and the hash tree see them as usual.
+ * The stripe locks are taken after the logical ones, so that the threads accessing the array directly cannot deadlock with this one
+ */
+bool CCompression::TransferPhysical(unsigned long long UnitID,///the first physical unit
+                                    unsigned NumOfUnits,///the number of units
+                                    unsigned char* pData,///the data buffer
+                                    bool Write ///true if the data must be written
+                                   )
+{
+    size_t ThreadID=m_Array.LockUnits(UnitID,UnitID+NumOfUnits);
+    bool Result=(Write)?m_Array.Write(UnitID,NumOfUnits,pData,ThreadID):m_Array.Read(UnitID,NumOfUnits,pData,ThreadID);
+    m_Array.UnlockStripes(ThreadID);
+    return Result;
+};
+
+/** The map records of the locked blocks are modified only by the threads holding their locks, so they are copied without m_Lock.
+ * The units of all blocks are read into a staging buffer, the consecutive ones at once, and decompressed afterwards
+ */
+bool CCompression::ReadBlocks(unsigned long long BlockID,///the first logical block
+                              unsigned NumOfBlocks,///the number of blocks
+                              unsigned char* pDest ///destination buffer
+                             )
+{
+    vector<unsigned> Sizes(NumOfBlocks);
+    vector<unsigned long long> Units;
+    for(unsigned i=0;i<NumOfBlocks;i++)
+    {
+        const CompressedBlock& R=GetRecord(BlockID+i);
+        Sizes[i]=R.Size;
+        Units.insert(Units.end(),R.Units,R.Units+GetUnits(R.Size));
+    };
+    unsigned char* pStage=(Units.empty())?0:AlignedMalloc(Units.size()*m_UnitSize);
+    bool Result=true;
+    size_t k=0;
+    while (Result&&(k<Units.size()))
+    {
+        size_t First=k;
+        while ((++k<Units.size())&&(Units[k]==Units[k-1]+1));
+        Result=TransferPhysical(Units[First],(unsigned)(k-First),pStage+First*m_UnitSize,false);
+    };
+    const unsigned char* pCur=pStage;
+    for(unsigned i=0;Result&&(i<NumOfBlocks);i++)
+    {
+        unsigned char* pBlock=pDest+(size_t)i*m_BlockSize;
+        if (!Sizes[i])
+            memset(pBlock,0,m_BlockSize);
+        else
+        if (Sizes[i]==m_BlockSize)
+            memcpy(pBlock,pCur,m_BlockSize);
+        else
+        if (LZDecompress(pCur,Sizes[i],pBlock,m_BlockSize)!=m_BlockSize)
+        {
+            cerr<<"Corrupted compressed block "<<BlockID+i<<endl;
+            Result=false;
+        };
+        pCur+=(size_t)GetUnits(Sizes[i])*m_UnitSize;
+    };
+    if (pStage)
+        AlignedFree(pStage);
+    return Result;
+};
+
+/** The blocks are compressed into a staging buffer one after another, each of them padded to whole units, and stored
+ * in the free units following the cursor, so that the blocks written together are written by a few full stripe writes.
+ * The logical blocks are mapped to the new units after the data is written, and the old units are released.
+ * If there are not enough free units, the request waits until the released ones become reusable, and the other writers complete.
+ * The old units are never overwritten, so that a failed or interrupted write leaves the blocks with their old content
+ */
+bool CCompression::WriteBlocks(unsigned long long BlockID,///the first logical block
+                               unsigned NumOfBlocks,///the number of blocks
+                               const unsigned char* pSrc ///source buffer
+                              )
+{
+    vector<unsigned> Sizes(NumOfBlocks);
+    unsigned char* pStage=AlignedMalloc((size_t)NumOfBlocks*m_BlockSize);
+    unsigned TotalUnits=0;
+    for(unsigned i=0;i<NumOfBlocks;i++)
+    {
+        const unsigned char* pBlock=pSrc+(size_t)i*m_BlockSize;
+        unsigned char* pCur=pStage+(size_t)TotalUnits*m_UnitSize;
+        unsigned u;
+        for(u=0;(u<m_BlockUnits)&&!memcmp(pBlock+(size_t)u*m_UnitSize,m_Array.m_pZeroes,m_UnitSize);u++);
+        if (u==m_BlockUnits)
+        {
+            Sizes[i]=0;
+            continue;
+        };
+        size_t Size=LZCompress(pBlock,m_BlockSize,pCur,(size_t)(m_BlockUnits-1)*m_UnitSize);
+        if (Size)
+        {
+            Sizes[i]=(unsigned)Size;
+            memset(pCur+Size,0,(size_t)GetUnits(Sizes[i])*m_UnitSize-Size);
+        }
+        else
+        {
+            Sizes[i]=m_BlockSize;
+            memcpy(pCur,pBlock,m_BlockSize);
+        };
+        TotalUnits+=GetUnits(Sizes[i]);
+    };
+    //the old and the new units of each block
+    vector<vector<unsigned long long> > Old(NumOfBlocks),New(NumOfBlocks);
+    bool Result=true;
+    LockCS(m_Lock);
+    for(unsigned i=0;i<NumOfBlocks;i++)
+    {
+        const CompressedBlock& R=GetRecord(BlockID+i);
+        Old[i].assign(R.Units,R.Units+GetUnits(R.Size));
+    };
+    for(;;)
+    {
+        if (m_Failed)
+        {
+            Result=false;
+            break;
+        };
+        if (TotalUnits<=m_NumOfFree)
+            break;
+        if (!m_Pending.empty())
+        {
+            Checkpoint();
+            continue;
+        };
+        if (!m_NumOfWriters)
+        {
+            //this should never happen, since the reserved units are enough for the largest write
+            cerr<<"No free physical units in the compressed array\n";
+            Result=false;
+            break;
+        };
+        CondWait(m_Released,m_Lock);
+    };
+    if (!Result)
+    {
+        UnlockCS(m_Lock);
+        AlignedFree(pStage);
+        return false;
+    };
+    vector<unsigned long long> Targets;
+    for(unsigned i=0;i<NumOfBlocks;i++)
+    {
+        for(unsigned k=0;k<GetUnits(Sizes[i]);k++)
+            New[i].push_back(Allocate());
+        Targets.insert(Targets.end(),New[i].begin(),New[i].end());
+    };
+    m_NumOfWriters++;
+    UnlockCS(m_Lock);
+    //the units are packed in the staging buffer in the same order
+    size_t k=0;
+    while (Result&&(k<Targets.size()))
+    {
+        size_t First=k;
+        while ((++k<Targets.size())&&(Targets[k]==Targets[k-1]+1));
+        Result=TransferPhysical(Targets[First],(unsigned)(k-First),pStage+First*m_UnitSize,true);
+    };
+    AlignedFree(pStage);
+    LockCS(m_Lock);
+    for(unsigned i=0;i<NumOfBlocks;i++)
+    {
+        if (!Result)
+        {
+            //the logical blocks keep their old units, and the units allocated by the request are freed
+            for(size_t j=0;j<New[i].size();j++)
+                Release(New[i][j],false);
+            continue;
+        };
+        if (Sizes[i])
+        {
+            m_Written+=m_BlockSize;
+            m_Stored+=(unsigned long long)New[i].size()*m_UnitSize;
+            if (Sizes[i]==m_BlockSize)
+                m_Incompressible++;
+        }
+        else
+            m_Zeroes++;
+        for(size_t j=0;j<Old[i].size();j++)
+            Release(Old[i][j],true);
+        CompressedBlock& R=GetRecord(BlockID+i);
+        R.Size=Sizes[i];
+        if (!New[i].empty())
+            memcpy(R.Units,&New[i][0],New[i].size()*sizeof(unsigned long long));
+    };
+    m_NumOfWriters--;
+    CondWakeAll(m_Released);
+    if (Result)
+    {
+        //the map blocks are written at once, so that the write is not lost on a crash
+        unsigned long long FirstBlock=BlockID*m_RecordSize/m_UnitSize;
+        unsigned long long LastBlock=((BlockID+NumOfBlocks)*m_RecordSize-1)/m_UnitSize;
+        Result=m_Device.WriteData(1+FirstBlock,(unsigned)(LastBlock-FirstBlock+1),m_pMap+(size_t)FirstBlock*m_UnitSize);
+        if (!Result)
+        {
+            cerr<<"Failed to write the compression map\n";
+            m_Failed=true;
+        };
+    };
+    if (Result&&(m_Pending.size()>=COMPRESSIONCHECKPOINT))
+        Result=Checkpoint();
+    UnlockCS(m_Lock);
+    return Result;
+};
+
+/** The logical blocks are locked for the whole request. The incomplete blocks at its ends are read into a temporary buffer
+ * @return the actual number of bytes read, or -1 in case of error
+ */
+long long CCompression::ReadBytes(long long& fd,///file description, i.e. current position
+                                  long long Bytes2Read,///the number of bytes to be read
+                                  unsigned char* pDest ///destination address
+                                 )
+{
+    long long NewPos=fd+Bytes2Read;
+    if ((unsigned long long)NewPos>GetCapacity())
+        NewPos=GetCapacity();
+    Bytes2Read=NewPos-fd;
+    if (Bytes2Read<=0)
+        return (Bytes2Read)?-1:0;
+    size_t LockID=m_Locker.Lock(fd/m_BlockSize,(NewPos+m_BlockSize-1)/m_BlockSize);
+    unsigned char* pTemp=((fd|NewPos)%m_BlockSize)?AlignedMalloc(m_BlockSize):0;
+    bool Result=true;
+    while (Result&&(fd<NewPos))
+    {
+        unsigned long long BlockID=fd/m_BlockSize;
+        unsigned Offset=fd%m_BlockSize;
+        long long Length;
+        if (Offset||(NewPos-fd<m_BlockSize))
+        {
+            Length=min((long long)(m_BlockSize-Offset),NewPos-fd);
+            Result=ReadBlocks(BlockID,1,pTemp);
+            memcpy(pDest,pTemp+Offset,(size_t)Length);
+        }
+        else
+        {
+            Length=min((NewPos-fd)/m_BlockSize,(long long)COMPRESSIONCHUNK)*m_BlockSize;
+            Result=ReadBlocks(BlockID,(unsigned)(Length/m_BlockSize),pDest);
+        };
+        fd+=Length;
+        pDest+=Length;
+    };
+    if (pTemp)
+        AlignedFree(pTemp);
+    m_Locker.Unlock(LockID);
+    return (Result)?Bytes2Read:-1;
+};
+
+/** The incomplete blocks at the ends of the request are read, partially updated and written back
+ * @return the actual number of bytes written, or -1 in case of error
+ */
+long long CCompression::WriteBytes(long long& fd,///file description, i.e. current position
+                                   long long Bytes2Write,///the number of bytes to be written
+                                   const unsigned char* pSrc ///source address
+                                  )
+{
+    if (m_Device.GetMountState()!=msReadWrite)
+        return -1;
+    long long NewPos=fd+Bytes2Write;
+    if ((unsigned long long)NewPos>GetCapacity())
+        NewPos=GetCapacity();
+    Bytes2Write=NewPos-fd;
+    if (Bytes2Write<=0)
+        return (Bytes2Write)?-1:0;
+    size_t LockID=m_Locker.Lock(fd/m_BlockSize,(NewPos+m_BlockSize-1)/m_BlockSize);
+    unsigned char* pTemp=((fd|NewPos)%m_BlockSize)?AlignedMalloc(m_BlockSize):0;
+    bool Result=true;
+    while (Result&&(fd<NewPos))
+    {
+        unsigned long long BlockID=fd/m_BlockSize;
+        unsigned Offset=fd%m_BlockSize;
+        long long Length;
+        if (Offset||(NewPos-fd<m_BlockSize))
+        {
+            Length=min((long long)(m_BlockSize-Offset),NewPos-fd);
+            Result=ReadBlocks(BlockID,1,pTemp);
+            memcpy(pTemp+Offset,pSrc,(size_t)Length);
+            Result=Result&&WriteBlocks(BlockID,1,pTemp);
+        }
+        else
+        {
+            Length=min((NewPos-fd)/m_BlockSize,(long long)COMPRESSIONCHUNK)*m_BlockSize;
+            Result=WriteBlocks(BlockID,(unsigned)(Length/m_BlockSize),pSrc);
+        };
+        fd+=Length;
+        pSrc+=Length;
+    };
+    if (pTemp)
+        AlignedFree(pTemp);
+    m_Locker.Unlock(LockID);
+    return (Result)?Bytes2Write:-1;
+};
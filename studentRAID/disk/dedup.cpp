@@ -0,0 +1,698 @@
+/*********************************************************
+ * dedup.cpp  - implementation of the inline deduplication of the RAID emulator
+ *
+ * Copyright(C) 2012 Saint-Petersburg State Polytechnic University
+ *
+ * Developed in the framework of the "Forward error correction for next generation storage systems" project
+ *
+ * Author: P. Trifonov petert@dcn.ftk.spbstu.ru
+ * ********************************************************/
+#include <iostream>
+#include <algorithm>
+#include <string.h>
+#include <time.h>
+#include "misc.h"
+#include "arithmetic.h"
+#include "array.h"
+#include "hashtree.h"
+#include "dedup.h"
+
+using namespace std;
+
+///deduplication index superblock signature
+#define DEDUPMAGIC 0x4DED0B1C
+///the modified blocks of the index are written once this number of them is accumulated
+#define DEDUPCHECKPOINT 256
+///the maximal number of logical units processed at once
+#define DEDUPCHUNK 1024
+///the physical unit was released since the index was last written, so that the map stored on the device may still refer to it
+#define UNITPENDING 1
+///the physical unit was shared by several logical units since the index was last written, so that the map stored on the device
+///may refer to it from a logical unit other than its current owner
+#define UNITSHARED 2
+
+///the states of the logical units being written
+enum eDedupStates
+{
+    dsZero, ///filled with zeroes
+    dsCandidate, ///a physical unit with the same fingerprint is being compared
+    dsUnverified, ///a physical unit with the same fingerprint could not be read
+    dsDuplicate, ///mapped to an existing physical unit with the same content
+    dsShared, ///mapped to the physical unit written by a preceding unit of the same request
+    dsWrite ///written to a physical unit
+};
+
+///avoid padding of on-disk structures
+#pragma pack(push)
+#pragma pack(1)
+///the first block of the index device
+struct DedupSuperblock
+{
+    ///must be DEDUPMAGIC
+    unsigned MagicNumber;
+    ///size of a block
+    unsigned BlockSize;
+    ///the number of logical units
+    unsigned long long NumOfUnits;
+    ///nonzero if the index may have been modified after it was written
+    unsigned Dirty;
+    ///CRC32 of all preceding fields
+    unsigned CRC;
+};
+#pragma pack(pop)
+
+/** Open the index device and check that it was created for the same array configuration.
+ * The logical units cover the payload stripes, so the deduplicated array has the same capacity
+ */
+CDedup::CDedup(CDiskArray& Array,///the array to be served
+               const char* pFileName,///the name of the file emulating the index device
+               unsigned NumOfThreads,///the expected number of concurrent threads
+               unsigned DeviceID ///identifier of the index device. This must be different from the IDs of the array disks
+              ):m_Array(Array),m_Valid(false),m_BlockSize(Array.GetStripeUnitSize()),m_NumOfDirty(0),m_NumOfFree(0),m_FreeHint(0),
+    m_Failed(false),m_Written(0),m_Duplicates(0),m_Zeroes(0),m_Collisions(0),m_Locker(max(NumOfThreads,1u))
+{
+    m_NumOfUnits=m_Array.m_HashStripe*m_Array.m_UnitsPerStripe;
+    m_MapBlocks=(m_NumOfUnits*sizeof(unsigned long long)+m_BlockSize-1)/m_BlockSize;
+    m_UnitBlocks=(m_NumOfUnits*sizeof(DedupUnit)+m_BlockSize-1)/m_BlockSize;
+    if (!InitCS(m_Lock))
+        throw Exception("Failed to initialize deduplication mutex");
+    InitCRC32();
+    size_t ImageSize=(size_t)(m_MapBlocks+m_UnitBlocks)*m_BlockSize;
+    m_pImage=AlignedMalloc(ImageSize);
+    memset(m_pImage,0,ImageSize);
+    m_pMap=(unsigned long long*)m_pImage;
+    m_pUnits=(DedupUnit*)(m_pImage+(size_t)m_MapBlocks*m_BlockSize);
+    m_pFlags=new unsigned char[(size_t)m_NumOfUnits];
+    memset(m_pFlags,0,(size_t)m_NumOfUnits);
+    m_pDirty=new unsigned char[(size_t)(m_MapBlocks+m_UnitBlocks)];
+    memset(m_pDirty,0,(size_t)(m_MapBlocks+m_UnitBlocks));
+    m_ZeroFingerprint=CHashTree::Hash(m_Array.m_pZeroes,m_BlockSize,0);
+
+    const void* pCodeConfig;
+    unsigned CodeConfigSize=m_Array.m_Engine.GetConfiguration(pCodeConfig);
+    if (m_Device.Initialize(pFileName,DeviceID,m_BlockSize,1+m_MapBlocks+m_UnitBlocks,CodeConfigSize)&&(m_Device.GetDiskState()==dsOffline))
+    {
+        void const* pCodeConfig2;
+        unsigned CodeConfigSize2=m_Device.GetArrayData(pCodeConfig2);
+        m_Valid=(CodeConfigSize2==CodeConfigSize)&&!memcmp(pCodeConfig,pCodeConfig2,CodeConfigSize);
+    };
+    if (m_Valid)
+        m_Device.SetDiskState(dsOnline);
+};
+
+CDedup::~CDedup()
+{
+    Stop();
+    AlignedFree(m_pImage);
+    delete[]m_pFlags;
+    delete[]m_pDirty;
+    DestroyCS(m_Lock);
+};
+
+///write the superblock
+///@return true on success
+bool CDedup::WriteSuperblock(bool Dirty ///true if the index may be modified after it is written
+                            )
+{
+    unsigned char* pBlock=AlignedMalloc(m_BlockSize);
+    memset(pBlock,0,m_BlockSize);
+    DedupSuperblock& S=*(DedupSuperblock*)pBlock;
+    S.MagicNumber=DEDUPMAGIC;
+    S.BlockSize=m_BlockSize;
+    S.NumOfUnits=m_NumOfUnits;
+    S.Dirty=(Dirty)?1:0;
+    unsigned CRC=0;
+    UpdateCRC32(CRC,sizeof(S)-sizeof(S.CRC),pBlock);
+    S.CRC=CRC;
+    bool Result=m_Device.WriteData(0,1,pBlock)&&m_Device.Flush();
+    AlignedFree(pBlock);
+    return Result;
+};
+
+/** All logical units of an initialized array are filled with zeroes, so no physical units are referenced
+ */
+bool CDedup::Init()
+{
+    if (m_Device.GetMountState()!=msUnmounted)
+        return false;
+    m_Failed=false;
+    const void* pCodeConfig;
+    unsigned CodeConfigSize=m_Array.m_Engine.GetConfiguration(pCodeConfig);
+    if (m_Device.GetDiskState()==dsOnline)
+        m_Device.SetDiskState(dsOffline);
+    m_Device.SetArrayData(pCodeConfig,CodeConfigSize);
+    m_Valid=m_Device.ResetDisk()&&m_Device.Mount(true);
+    if (m_Valid)
+    {
+        for(unsigned long long i=0;i<m_NumOfUnits;i++)
+            m_pMap[i]=DEDUPZERO;
+        memset(m_pUnits,0,(size_t)m_UnitBlocks*m_BlockSize);
+        m_Valid=WriteSuperblock(false)&&m_Device.WriteData(1,(unsigned)(m_MapBlocks+m_UnitBlocks),m_pImage)&&m_Device.Flush();
+        m_Valid&=m_Device.Unmount(time(NULL));
+    };
+    if (!m_Valid)
+        cerr<<"Failed to initialize the deduplication index device\n";
+    return m_Valid;
+};
+
+/** If the index was not written cleanly, the stored reference counts may disagree with the map, and count the units
+ * whose writes were interrupted, so they are recomputed. The stored fingerprints of the units overwritten in place
+ * may be stale, which only prevents some duplicates from being found, since the matching units are compared bytewise.
+ * The units shared by several logical ones cannot be overwritten in place until the index is written
+ */
+bool CDedup::Load(bool Write ///true if the array is mounted for writing
+                 )
+{
+    unsigned char* pBlock=AlignedMalloc(m_BlockSize);
+    bool Result=m_Device.ReadData(0,1,pBlock);
+    DedupSuperblock S=*(DedupSuperblock*)pBlock;
+    AlignedFree(pBlock);
+    unsigned CRC=0;
+    UpdateCRC32(CRC,sizeof(S)-sizeof(S.CRC),(const unsigned char*)&S);
+    if (!Result||(S.MagicNumber!=DEDUPMAGIC)||(S.BlockSize!=m_BlockSize)||(S.NumOfUnits!=m_NumOfUnits)||(S.CRC!=CRC)||
+            !m_Device.ReadData(1,(unsigned)(m_MapBlocks+m_UnitBlocks),m_pImage))
+    {
+        cerr<<"Invalid deduplication index\n";
+        return false;
+    };
+    memset(m_pFlags,0,(size_t)m_NumOfUnits);
+    memset(m_pDirty,0,(size_t)(m_MapBlocks+m_UnitBlocks));
+    m_NumOfDirty=0;
+    m_Index.clear();
+    m_Pending.clear();
+    m_Shared.clear();
+    if (S.Dirty)
+    {
+        for(unsigned long long u=0;u<m_NumOfUnits;u++)
+            m_pUnits[u].References=0;
+        for(unsigned long long i=0;i<m_NumOfUnits;i++)
+        {
+            if (m_pMap[i]==DEDUPZERO)
+                continue;
+            if (m_pMap[i]>=m_NumOfUnits)
+            {
+                cerr<<"Invalid deduplication index\n";
+                return false;
+            };
+            m_pUnits[m_pMap[i]].References++;
+        };
+        memset(m_pDirty+m_MapBlocks,1,(size_t)m_UnitBlocks);
+        m_NumOfDirty=m_UnitBlocks;
+        if (Write)
+            cerr<<"The array was not unmounted cleanly, recounting the references of the deduplicated units\n";
+    };
+    m_NumOfFree=0;
+    for(unsigned long long u=0;u<m_NumOfUnits;u++)
+    {
+        if (!m_pUnits[u].References)
+        {
+            m_NumOfFree++;
+            continue;
+        };
+        m_Index[m_pUnits[u].Fingerprint]=u;
+        if (m_pUnits[u].References>1)
+        {
+            m_pFlags[u]|=UNITSHARED;
+            m_Shared.push_back(u);
+        };
+    };
+    m_FreeHint=0;
+    return true;
+};
+
+/** The index is marked dirty before any logical unit is written
+ */
+bool CDedup::Start(bool Write ///true if the array is mounted for writing
+                  )
+{
+    if (!m_Valid)
+    {
+        cerr<<"Deduplication index device is not available\n";
+        return false;
+    };
+    if ((m_Device.GetMountState()!=msUnmounted)||!m_Device.Mount(Write))
+        return false;
+    m_Failed=false;
+    m_Written=m_Duplicates=m_Zeroes=m_Collisions=0;
+    if (!Load(Write)||(Write&&!WriteSuperblock(true)))
+    {
+        m_Device.Unmount(time(NULL));
+        return false;
+    };
+    return true;
+};
+
+/** The index is marked clean after all its modified blocks are written, so that the next mount
+ * does not need to recount the references
+ */
+bool CDedup::Stop()
+{
+    if (m_Device.GetMountState()==msUnmounted)
+        return true;
+    bool Result=true;
+    if (m_Device.GetMountState()==msReadWrite)
+    {
+        LockCS(m_Lock);
+        Result=Checkpoint()&&WriteSuperblock(false);
+        if (m_Written||m_Zeroes)
+            cerr<<"Deduplication: "<<m_Duplicates<<" of "<<m_Written<<" units written were duplicates, "<<m_Collisions
+                <<" fingerprint collisions, "<<m_Zeroes<<" units filled with zeroes, "<<m_NumOfUnits-m_NumOfFree-m_Pending.size()
+                <<" physical units in use\n";
+        UnlockCS(m_Lock);
+    };
+    m_Index.clear();
+    m_Pending.clear();
+    m_Shared.clear();
+    Result&=m_Device.Unmount(time(NULL));
+    return Result;
+};
+
+/** The array is flushed first, followed by the device, so that the map entries stored on the device refer to the persistent data,
+ * and the units released before that are not referenced by them any more, so they can be reused.
+ * The writers are blocked meanwhile, since the index must not change
+ */
+bool CDedup::Checkpoint()
+{
+    if (m_Failed)
+        return false;
+    if (!m_NumOfDirty&&m_Pending.empty())
+        return true;
+    bool Result=m_Array.FlushDisks();
+    unsigned long long Blocks=m_MapBlocks+m_UnitBlocks;
+    unsigned long long i=0;
+    while (Result&&(i<Blocks))
+    {
+        if (!m_pDirty[i])
+        {
+            i++;
+            continue;
+        };
+        unsigned long long First=i;
+        while ((i<Blocks)&&m_pDirty[i])
+            m_pDirty[i++]=0;
+        Result=m_Device.WriteData(1+First,(unsigned)(i-First),m_pImage+(size_t)First*m_BlockSize);
+    };
+    if (!Result||!m_Device.Flush())
+    {
+        cerr<<"Failed to write the deduplication index\n";
+        m_Failed=true;
+        return false;
+    };
+    m_NumOfDirty=0;
+    for(size_t k=0;k<m_Pending.size();k++)
+        m_pFlags[m_Pending[k]]&=~UNITPENDING;
+    m_NumOfFree+=m_Pending.size();
+    m_Pending.clear();
+    size_t NumOfShared=0;
+    for(size_t k=0;k<m_Shared.size();k++)
+    {
+        if (m_pUnits[m_Shared[k]].References>1)
+            m_Shared[NumOfShared++]=m_Shared[k];
+        else
+            m_pFlags[m_Shared[k]]&=~UNITSHARED;
+    };
+    m_Shared.resize(NumOfShared);
+    return true;
+};
+
+///mark the block of m_pImage containing an address as modified. Must be called with m_Lock held
+void CDedup::MarkDirty(const void* pEntry ///the modified entry
+                      )
+{
+    size_t Block=((const unsigned char*)pEntry-m_pImage)/m_BlockSize;
+    if (!m_pDirty[Block])
+    {
+        m_pDirty[Block]=1;
+        m_NumOfDirty++;
+    };
+};
+
+///add a reference to a physical unit. Must be called with m_Lock held
+void CDedup::AddReference(unsigned long long UnitID ///the physical unit
+                         )
+{
+    DedupUnit& U=m_pUnits[UnitID];
+    U.References++;
+    MarkDirty(&U);
+    if ((U.References>1)&&!(m_pFlags[UnitID]&UNITSHARED))
+    {
+        m_pFlags[UnitID]|=UNITSHARED;
+        m_Shared.push_back(UnitID);
+    };
+};
+
+/** An unreferenced unit is removed from the index at once, so that no duplicates are mapped to it
+ */
+void CDedup::Release(unsigned long long UnitID ///the physical unit
+                    )
+{
+    DedupUnit& U=m_pUnits[UnitID];
+    U.References--;
+    MarkDirty(&U);
+    if (U.References)
+        return;
+    m_pFlags[UnitID]|=UNITPENDING;
+    m_Pending.push_back(UnitID);
+    map<unsigned long long,unsigned long long>::iterator it=m_Index.find(U.Fingerprint);
+    if ((it!=m_Index.end())&&(it->second==UnitID))
+        m_Index.erase(it);
+};
+
+///@return true if a physical unit can be allocated. Must be called with m_Lock held
+bool CDedup::IsFree(unsigned long long UnitID ///the physical unit
+                   )const
+{
+    return !m_pUnits[UnitID].References&&!(m_pFlags[UnitID]&UNITPENDING);
+};
+
+/** The unit is reserved by setting its reference count, and is mapped to a logical unit after it is written.
+ * If the preferred unit is not free, the free units are searched in the ascending order, so that the units written
+ * together are likely to be allocated sequentially
+ */
+unsigned long long CDedup::Allocate(unsigned long long Preferred ///the unit to be allocated if it is free
+                                   )
+{
+    if ((Preferred>=m_NumOfUnits)||!IsFree(Preferred))
+    {
+        if (!m_NumOfFree&&!m_Pending.empty())
+            Checkpoint();
+        if (!m_NumOfFree)
+            return DEDUPZERO;
+        while (!IsFree(m_FreeHint))
+            m_FreeHint=(m_FreeHint+1)%m_NumOfUnits;
+        Preferred=m_FreeHint;
+    };
+    m_pUnits[Preferred].References=1;
+    MarkDirty(m_pUnits+Preferred);
+    m_NumOfFree--;
+    return Preferred;
+};
+
+/** The physical units are accessed as ordinary payload data, so the cache and the hash tree see them as usual.
+ * The stripe locks are taken after the logical ones, so that the threads accessing the array directly cannot deadlock with this one
+ */
+bool CDedup::TransferPhysical(unsigned long long UnitID,///the first physical unit
+                              unsigned NumOfUnits,///the number of units
+                              unsigned char* pData,///the data buffer
+                              bool Write ///true if the data must be written
+                             )
+{
+    size_t ThreadID=m_Array.LockUnits(UnitID,UnitID+NumOfUnits);
+    bool Result=(Write)?m_Array.Write(UnitID,NumOfUnits,pData,ThreadID):m_Array.Read(UnitID,NumOfUnits,pData,ThreadID);
+    m_Array.UnlockStripes(ThreadID);
+    return Result;
+};
+
+/** The consecutive logical units mapped to the consecutive physical ones are read at once. The map entries of the locked units
+ * are modified only by the threads holding their locks, so they are copied without m_Lock. The physical units cannot be released
+ * or overwritten meanwhile, since the logical units referring to them are locked
+ */
+bool CDedup::ReadUnits(unsigned long long UnitID,///the first logical unit
+                       unsigned NumOfUnits,///the number of units
+                       unsigned char* pDest ///destination buffer
+                      )
+{
+    vector<unsigned long long> Units(m_pMap+UnitID,m_pMap+UnitID+NumOfUnits);
+    bool Result=true;
+    unsigned i=0;
+    while (Result&&(i<NumOfUnits))
+    {
+        unsigned char* pCur=pDest+(size_t)i*m_BlockSize;
+        if (Units[i]==DEDUPZERO)
+        {
+            memset(pCur,0,m_BlockSize);
+            i++;
+            continue;
+        };
+        unsigned First=i;
+        while ((++i<NumOfUnits)&&(Units[i]==Units[i-1]+1));
+        Result=TransferPhysical(Units[First],i-First,pCur,false);
+    };
+    return Result;
+};
+
+/** The write proceeds in three steps. First, the physical units with the same fingerprints are referenced, so that
+ * they are neither released nor overwritten, and compared with the data bytewise. Second, the remaining units are assigned
+ * physical units: the unit mapped to the logical one is overwritten in place if no other logical unit may refer to it,
+ * and a free unit is allocated otherwise. The units of the request with the same content share a physical unit.
+ * Finally, the data is written, and the logical units are mapped to the new physical ones. Only the last step encodes
+ * the data, so the duplicates cost the fingerprint computation and the comparison only
+ */
+bool CDedup::WriteUnits(unsigned long long UnitID,///the first logical unit
+                        unsigned NumOfUnits,///the number of units
+                        const unsigned char* pSrc ///source buffer
+                       )
+{
+    vector<unsigned long long> Fingerprints(NumOfUnits),Old(NumOfUnits),Targets(NumOfUnits,DEDUPZERO);
+    vector<unsigned char> States(NumOfUnits);
+    for(unsigned i=0;i<NumOfUnits;i++)
+    {
+        const unsigned char* pCur=pSrc+(size_t)i*m_BlockSize;
+        Fingerprints[i]=CHashTree::Hash(pCur,m_BlockSize,0);
+        States[i]=((Fingerprints[i]==m_ZeroFingerprint)&&!memcmp(pCur,m_Array.m_pZeroes,m_BlockSize))?dsZero:dsWrite;
+    };
+    unsigned NumOfCandidates=0;
+    LockCS(m_Lock);
+    if (m_Failed)
+    {
+        UnlockCS(m_Lock);
+        return false;
+    };
+    for(unsigned i=0;i<NumOfUnits;i++)
+    {
+        Old[i]=m_pMap[UnitID+i];
+        if (States[i]!=dsWrite)
+            continue;
+        map<unsigned long long,unsigned long long>::const_iterator it=m_Index.find(Fingerprints[i]);
+        if (it==m_Index.end())
+            continue;
+        //the unit mapped to the logical one being written cannot be modified by the other threads
+        Targets[i]=it->second;
+        if (Targets[i]!=Old[i])
+            AddReference(Targets[i]);
+        States[i]=dsCandidate;
+        NumOfCandidates++;
+    };
+    UnlockCS(m_Lock);
+    if (NumOfCandidates)
+    {
+        unsigned char* pCandidates=AlignedMalloc((size_t)NumOfUnits*m_BlockSize);
+        unsigned i=0;
+        while (i<NumOfUnits)
+        {
+            if (States[i]!=dsCandidate)
+            {
+                i++;
+                continue;
+            };
+            unsigned First=i;
+            while ((++i<NumOfUnits)&&(States[i]==dsCandidate)&&(Targets[i]==Targets[i-1]+1));
+            bool Read=TransferPhysical(Targets[First],i-First,pCandidates+(size_t)First*m_BlockSize,false);
+            for(unsigned k=First;k<i;k++)
+                if (!Read)
+                    States[k]=dsUnverified;
+                else
+                if (!memcmp(pCandidates+(size_t)k*m_BlockSize,pSrc+(size_t)k*m_BlockSize,m_BlockSize))
+                    States[k]=dsDuplicate;
+        };
+        AlignedFree(pCandidates);
+    };
+    bool Result=true;
+    LockCS(m_Lock);
+    //the first unit of the request written with each fingerprint
+    map<unsigned long long,unsigned> Written;
+    unsigned long long Next=DEDUPZERO;
+    for(unsigned i=0;Result&&(i<NumOfUnits);i++)
+    {
+        if ((States[i]==dsCandidate)||(States[i]==dsUnverified))
+        {
+            if (States[i]==dsCandidate)
+                m_Collisions++;
+            if (Targets[i]!=Old[i])
+                Release(Targets[i]);
+            Targets[i]=DEDUPZERO;
+            States[i]=dsWrite;
+        };
+        if (States[i]!=dsWrite)
+            continue;
+        map<unsigned long long,unsigned>::const_iterator it=Written.find(Fingerprints[i]);
+        if ((it!=Written.end())&&!memcmp(pSrc+(size_t)i*m_BlockSize,pSrc+(size_t)it->second*m_BlockSize,m_BlockSize))
+        {
+            Targets[i]=Targets[it->second];
+            AddReference(Targets[i]);
+            States[i]=dsShared;
+            continue;
+        };
+        if ((Old[i]!=DEDUPZERO)&&(m_pUnits[Old[i]].References==1)&&!(m_pFlags[Old[i]]&UNITSHARED))
+        {
+            //no other logical unit refers to it, either in memory or on the device. It is not found by the other writers
+            //until the new content is written
+            Targets[i]=Old[i];
+            map<unsigned long long,unsigned long long>::iterator Entry=m_Index.find(m_pUnits[Old[i]].Fingerprint);
+            if ((Entry!=m_Index.end())&&(Entry->second==Old[i]))
+                m_Index.erase(Entry);
+        }
+        else
+        {
+            Targets[i]=Allocate((Next!=DEDUPZERO)?Next:UnitID+i);
+            if (Targets[i]==DEDUPZERO)
+            {
+                cerr<<"No free physical units in the deduplicated array\n";
+                Result=false;
+                break;
+            };
+        };
+        Next=Targets[i]+1;
+        if (it==Written.end())
+            Written[Fingerprints[i]]=i;
+    };
+    UnlockCS(m_Lock);
+    unsigned i=0;
+    while (Result&&(i<NumOfUnits))
+    {
+        if (States[i]!=dsWrite)
+        {
+            i++;
+            continue;
+        };
+        unsigned First=i;
+        while ((++i<NumOfUnits)&&(States[i]==dsWrite)&&(Targets[i]==Targets[i-1]+1));
+        Result=TransferPhysical(Targets[First],i-First,(unsigned char*)pSrc+(size_t)First*m_BlockSize,true);
+    };
+    LockCS(m_Lock);
+    bool Remapped=false;
+    for(unsigned i=0;i<NumOfUnits;i++)
+    {
+        if (!Result)
+        {
+            //the logical units keep their old physical units, and the references taken by the request are dropped
+            if ((Targets[i]!=DEDUPZERO)&&(Targets[i]!=Old[i]))
+                Release(Targets[i]);
+            continue;
+        };
+        if (States[i]==dsZero)
+            m_Zeroes++;
+        else
+        {
+            m_Written++;
+            if (States[i]!=dsWrite)
+                m_Duplicates++;
+        };
+        if (States[i]==dsWrite)
+        {
+            m_pUnits[Targets[i]].Fingerprint=Fingerprints[i];
+            MarkDirty(m_pUnits+Targets[i]);
+            m_Index[Fingerprints[i]]=Targets[i];
+        };
+        if (Targets[i]!=Old[i])
+        {
+            m_pMap[UnitID+i]=Targets[i];
+            Remapped=true;
+            if (Old[i]!=DEDUPZERO)
+                Release(Old[i]);
+        };
+    };
+    if (Result&&Remapped)
+    {
+        //the map blocks are written at once, so that the write is not lost on a crash
+        unsigned long long FirstBlock=UnitID*sizeof(unsigned long long)/m_BlockSize;
+        unsigned long long LastBlock=(UnitID+NumOfUnits-1)*sizeof(unsigned long long)/m_BlockSize;
+        Result=m_Device.WriteData(1+FirstBlock,(unsigned)(LastBlock-FirstBlock+1),m_pImage+(size_t)FirstBlock*m_BlockSize);
+        if (!Result)
+        {
+            cerr<<"Failed to write the deduplication map\n";
+            m_Failed=true;
+        };
+    };
+    if (Result&&(m_NumOfDirty>=DEDUPCHECKPOINT))
+        Result=Checkpoint();
+    UnlockCS(m_Lock);
+    return Result;
+};
+
+/** The logical units are locked for the whole request. The incomplete units at its ends are read into a temporary buffer
+ * @return the actual number of bytes read, or -1 in case of error
+ */
+long long CDedup::ReadBytes(long long& fd,///file description, i.e. current position
+                            long long Bytes2Read,///the number of bytes to be read
+                            unsigned char* pDest ///destination address
+                           )
+{
+    long long NewPos=fd+Bytes2Read;
+    if ((unsigned long long)NewPos>m_NumOfUnits*m_BlockSize)
+        NewPos=m_NumOfUnits*m_BlockSize;
+    Bytes2Read=NewPos-fd;
+    if (Bytes2Read<=0)
+        return (Bytes2Read)?-1:0;
+    size_t LockID=m_Locker.Lock(fd/m_BlockSize,(NewPos+m_BlockSize-1)/m_BlockSize);
+    unsigned char* pTemp=((fd|NewPos)%m_BlockSize)?AlignedMalloc(m_BlockSize):0;
+    bool Result=true;
+    while (Result&&(fd<NewPos))
+    {
+        unsigned long long UnitID=fd/m_BlockSize;
+        unsigned Offset=fd%m_BlockSize;
+        long long Length;
+        if (Offset||(NewPos-fd<m_BlockSize))
+        {
+            Length=min((long long)(m_BlockSize-Offset),NewPos-fd);
+            Result=ReadUnits(UnitID,1,pTemp);
+            memcpy(pDest,pTemp+Offset,(size_t)Length);
+        }
+        else
+        {
+            Length=min((NewPos-fd)/m_BlockSize,(long long)DEDUPCHUNK)*m_BlockSize;
+            Result=ReadUnits(UnitID,(unsigned)(Length/m_BlockSize),pDest);
+        };
+        fd+=Length;
+        pDest+=Length;
+    };
+    if (pTemp)
+        AlignedFree(pTemp);
+    m_Locker.Unlock(LockID);
+    return (Result)?Bytes2Read:-1;
+};
+
+/** The incomplete units at the ends of the request are read, partially updated and written back
+ * @return the actual number of bytes written, or -1 in case of error
+ */
+long long CDedup::WriteBytes(long long& fd,///file description, i.e. current position
+                             long long Bytes2Write,///the number of bytes to be written
+                             const unsigned char* pSrc ///source address
+                            )
+{
+    if (m_Device.GetMountState()!=msReadWrite)
+        return -1;
+    long long NewPos=fd+Bytes2Write;
+    if ((unsigned long long)NewPos>m_NumOfUnits*m_BlockSize)
+        NewPos=m_NumOfUnits*m_BlockSize;
+    Bytes2Write=NewPos-fd;
+    if (Bytes2Write<=0)
+        return (Bytes2Write)?-1:0;
+    size_t LockID=m_Locker.Lock(fd/m_BlockSize,(NewPos+m_BlockSize-1)/m_BlockSize);
+    unsigned char* pTemp=((fd|NewPos)%m_BlockSize)?AlignedMalloc(m_BlockSize):0;
+    bool Result=true;
+    while (Result&&(fd<NewPos))
+    {
+        unsigned long long UnitID=fd/m_BlockSize;
+        unsigned Offset=fd%m_BlockSize;
+        long long Length;
+        if (Offset||(NewPos-fd<m_BlockSize))
+        {
+            Length=min((long long)(m_BlockSize-Offset),NewPos-fd);
+            Result=ReadUnits(UnitID,1,pTemp);
+            memcpy(pTemp+Offset,pSrc,(size_t)Length);
+            Result=Result&&WriteUnits(UnitID,1,pTemp);
+        }
+        else
+        {
+            Length=min((NewPos-fd)/m_BlockSize,(long long)DEDUPCHUNK)*m_BlockSize;
+            Result=WriteUnits(UnitID,(unsigned)(Length/m_BlockSize),pSrc);
+        };
+        fd+=Length;
+        pSrc+=Length;
+    };
+    if (pTemp)
+        AlignedFree(pTemp);
+    m_Locker.Unlock(LockID);
+    return (Result)?Bytes2Write:-1;
+};
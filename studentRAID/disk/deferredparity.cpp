@@ -0,0 +1,488 @@
+/*********************************************************
+ * deferredparity.cpp  - implementation of the deferred check symbol update of the RAID emulator
+ *
+ * Copyright(C) 2012 Saint-Petersburg State Polytechnic University
+ *
+ * Developed in the framework of the "Forward error correction for next generation storage systems" project
+ *
+ * Author: P. Trifonov petert@dcn.ftk.spbstu.ru
+ * ********************************************************/
+#include <iostream>
+#include <algorithm>
+#include <string.h>
+#include <time.h>
+#include "misc.h"
+#include "arithmetic.h"
+#include "array.h"
+#include "deferredparity.h"
+
+using namespace std;
+
+///deferred parity bitmap superblock signature
+#define STALEMAPMAGIC 0x57A1E3A9
+///the bits of the re-encoded stripes are cleared after this number of stripes is re-encoded
+#define DEFERREDPARITYBATCH 64
+
+///avoid padding of on-disk structures
+#pragma pack(push)
+#pragma pack(1)
+///the first block of the bitmap device
+struct StaleMapSuperblock
+{
+    ///must be STALEMAPMAGIC
+    unsigned MagicNumber;
+    ///size of a block
+    unsigned BlockSize;
+    ///the number of bits in the bitmap
+    unsigned long long NumOfSegments;
+    ///CRC32 of all preceding fields
+    unsigned CRC;
+};
+#pragma pack(pop)
+
+/** Open the bitmap device and check that it was created for the same array configuration.
+ * The bitmap keeps a bit for each stripe of each subarray
+ */
+CDeferredParity::CDeferredParity(CDiskArray& Array,///the array to be served
+                                 const char* pFileName,///the name of the file emulating the bitmap device
+                                 double MaxStaleness,///the maximal time a stripe may remain stale in seconds, or 0 if it is not limited
+                                 unsigned DeviceID ///identifier of the bitmap device. This must be different from the IDs of the array disks
+                                ):m_Array(Array),m_Valid(false),m_BlockSize(Array.GetStripeUnitSize()),m_MaxStaleness(MaxStaleness),
+    m_NumOfStale(0),m_Updating(0),m_Drainers(0),m_Failed(false),m_Running(false),m_Stop(false),
+    m_Deferred(0),m_Bypassed(0),m_Reencoded(0),m_Unrecoverable(0),m_MaxLag(0),m_NumOfUpdaters(0)
+{
+    CRAIDProcessor& Engine=m_Array.m_Engine;
+    m_NumOfSubarrays=Engine.GetInterleavingOrder();
+    m_NumOfSegments=m_Array.m_NumOfStripes*m_NumOfSubarrays;
+    m_BitmapBlocks=(m_NumOfSegments+8ull*m_BlockSize-1)/(8ull*m_BlockSize);
+    if (m_MaxStaleness<0)
+        throw Exception("Invalid staleness bound %f",m_MaxStaleness);
+    if (!InitCS(m_Lock))
+        throw Exception("Failed to initialize deferred parity mutex");
+    if (!InitCond(m_UpdateSig)||!InitCond(m_IdleSig))
+        throw Exception("Deferred parity condition initialization failed");
+    InitCRC32();
+    m_pBitmap=AlignedMalloc((size_t)m_BitmapBlocks*m_BlockSize);
+    memset(m_pBitmap,0,(size_t)m_BitmapBlocks*m_BlockSize);
+
+    const void* pCodeConfig;
+    unsigned CodeConfigSize=Engine.GetConfiguration(pCodeConfig);
+    if (m_Device.Initialize(pFileName,DeviceID,m_BlockSize,1+m_BitmapBlocks,CodeConfigSize)&&(m_Device.GetDiskState()==dsOffline))
+    {
+        void const* pCodeConfig2;
+        unsigned CodeConfigSize2=m_Device.GetArrayData(pCodeConfig2);
+        m_Valid=(CodeConfigSize2==CodeConfigSize)&&!memcmp(pCodeConfig,pCodeConfig2,CodeConfigSize);
+    };
+    if (m_Valid)
+        m_Device.SetDiskState(dsOnline);
+};
+
+CDeferredParity::~CDeferredParity()
+{
+    Stop();
+    AlignedFree(m_pBitmap);
+    DestroyCond(m_UpdateSig);
+    DestroyCond(m_IdleSig);
+    DestroyCS(m_Lock);
+};
+
+///write the superblock and the whole bitmap
+///@return true on success
+bool CDeferredParity::WriteBitmap()
+{
+    unsigned char* pBlock=AlignedMalloc(m_BlockSize);
+    memset(pBlock,0,m_BlockSize);
+    StaleMapSuperblock& S=*(StaleMapSuperblock*)pBlock;
+    S.MagicNumber=STALEMAPMAGIC;
+    S.BlockSize=m_BlockSize;
+    S.NumOfSegments=m_NumOfSegments;
+    unsigned CRC=0;
+    UpdateCRC32(CRC,sizeof(S)-sizeof(S.CRC),pBlock);
+    S.CRC=CRC;
+    bool Result=m_Device.WriteData(0,1,pBlock)&&m_Device.WriteData(1,(unsigned)m_BitmapBlocks,m_pBitmap)&&m_Device.Flush();
+    AlignedFree(pBlock);
+    return Result;
+};
+
+///write the bitmap block containing the bit of a segment. Must be called with m_Lock held
+///@return true on success
+bool CDeferredParity::WriteBitmapBlock(unsigned long long Segment ///the segment
+                                      )
+{
+    unsigned long long Block=Segment/(8ull*m_BlockSize);
+    return m_Device.WriteData(1+Block,1,m_pBitmap+(size_t)Block*m_BlockSize);
+};
+
+/** Create an empty bitmap, since the array is filled with zeroes
+ */
+bool CDeferredParity::Init()
+{
+    if (m_Running)
+        return false;
+    m_Failed=false;
+    const void* pCodeConfig;
+    unsigned CodeConfigSize=m_Array.m_Engine.GetConfiguration(pCodeConfig);
+    if (m_Device.GetDiskState()==dsOnline)
+        m_Device.SetDiskState(dsOffline);
+    m_Device.SetArrayData(pCodeConfig,CodeConfigSize);
+    m_Valid=m_Device.ResetDisk()&&m_Device.Mount(true);
+    if (m_Valid)
+    {
+        memset(m_pBitmap,0,(size_t)m_BitmapBlocks*m_BlockSize);
+        m_Valid=WriteBitmap();
+        m_Valid&=m_Device.Unmount(time(NULL));
+    };
+    if (!m_Valid)
+        cerr<<"Failed to initialize the deferred parity bitmap device\n";
+    return m_Valid;
+};
+
+/** The stripes left stale by the previous mount are queued as if they became stale now,
+ * so that the array can be used while they are being re-encoded
+ */
+bool CDeferredParity::Load(bool Write ///true if the array is mounted for writing. Otherwise, the stale stripes are only reported
+                          )
+{
+    unsigned char* pBlock=AlignedMalloc(m_BlockSize);
+    bool Result=m_Device.ReadData(0,1,pBlock);
+    StaleMapSuperblock S=*(StaleMapSuperblock*)pBlock;
+    AlignedFree(pBlock);
+    unsigned CRC=0;
+    UpdateCRC32(CRC,sizeof(S)-sizeof(S.CRC),(const unsigned char*)&S);
+    if (!Result||(S.MagicNumber!=STALEMAPMAGIC)||(S.BlockSize!=m_BlockSize)||(S.NumOfSegments!=m_NumOfSegments)||(S.CRC!=CRC)||
+            !m_Device.ReadData(1,(unsigned)m_BitmapBlocks,m_pBitmap))
+    {
+        cerr<<"Invalid deferred parity bitmap\n";
+        return false;
+    };
+    double Now=GetClock();
+    for(unsigned long long s=0;s<m_NumOfSegments;s++)
+        if (m_pBitmap[s/8]&(1<<(s%8)))
+        {
+            m_StaleSince[s]=Now;
+            StaleSegment E={s,Now};
+            m_Queue.push_back(E);
+            m_NumOfStale++;
+        };
+    if (m_NumOfStale)
+    {
+        if (Write)
+            cerr<<"The array was not unmounted cleanly, the check symbols of "<<m_NumOfStale<<" stripes will be re-encoded\n";
+        else
+            cerr<<"The check symbols of "<<m_NumOfStale<<" stripes are stale, and cannot be re-encoded in the read-only mode\n";
+    };
+    return true;
+};
+
+/** Load the bitmap and start the background threads. In the read-only mode, no stripes are re-encoded,
+ * so the threads are not needed
+ */
+bool CDeferredParity::Start(bool Write ///true if the array is mounted for writing
+                           )
+{
+    if (!m_Valid)
+    {
+        cerr<<"Deferred parity bitmap device is not available\n";
+        return false;
+    };
+    if (m_Running||!m_Device.Mount(Write))
+        return false;
+    m_Failed=false;
+    m_Stop=false;
+    m_Deferred=m_Bypassed=m_Reencoded=m_Unrecoverable=0;
+    m_MaxLag=0;
+    if (!Load(Write))
+    {
+        m_Device.Unmount(time(NULL));
+        return false;
+    };
+    if (!Write)
+        return true;
+    m_NumOfUpdaters=0;
+    while ((m_NumOfUpdaters<DEFERREDPARITYTHREADS)&&StartThread(m_Updaters[m_NumOfUpdaters],UpdateThread,this))
+        m_NumOfUpdaters++;
+    m_Running=(m_NumOfUpdaters>0);
+    if (!m_Running)
+    {
+        cerr<<"Failed to start the deferred parity threads\n";
+        m_Device.Unmount(time(NULL));
+        return false;
+    };
+    return true;
+};
+
+/** Wait for the background threads to re-encode all stale stripes, and terminate them.
+ * The stripes, which could not be re-encoded, remain stale in the bitmap
+ */
+bool CDeferredParity::Stop()
+{
+    if (m_Device.GetMountState()==msUnmounted)
+        return true;
+    bool Result=true;
+    if (m_Running)
+    {
+        Result=Drain();
+        LockCS(m_Lock);
+        m_Stop=true;
+        CondWakeAll(m_UpdateSig);
+        UnlockCS(m_Lock);
+        for(unsigned t=0;t<m_NumOfUpdaters;t++)
+            JoinThread(m_Updaters[t]);
+        m_NumOfUpdaters=0;
+        m_Running=false;
+        if (m_Deferred||m_Bypassed)
+            cerr<<"Deferred parity: "<<m_Deferred<<" writes deferred, "<<m_Reencoded<<" stripes re-encoded, "<<m_Bypassed
+                <<" writes updated the check symbols in place, the redundancy lag reached "<<m_MaxLag<<" sec\n";
+        if (m_Unrecoverable)
+            cerr<<m_Unrecoverable<<" stale stripes could not be re-encoded\n";
+    };
+    m_Queue.clear();
+    m_Cleared.clear();
+    m_StaleSince.clear();
+    m_NumOfStale=0;
+    Result&=m_Device.Unmount(time(NULL));
+    return Result;
+};
+
+/** The bit of a stripe is written only when it becomes stale, so that the repeated updates of a hot stripe
+ * do not access the bitmap device. Once some stripe remains stale for longer than the bound,
+ * no new stripes are made stale until the background threads catch up. Neither are they made stale
+ * while some thread waits in Drain(), so that the concurrent writes cannot keep it waiting forever
+ */
+bool CDeferredParity::MarkStale(unsigned long long StripeID,///the stripe being updated
+                                unsigned SubarrayID ///identifies the subarray
+                               )
+{
+    unsigned long long Segment=StripeID*m_NumOfSubarrays+SubarrayID;
+    LockCS(m_Lock);
+    if (!m_Running)
+    {
+        UnlockCS(m_Lock);
+        return false;
+    };
+    if (StaleSince(Segment))
+    {
+        m_Deferred++;
+        UnlockCS(m_Lock);
+        return true;
+    };
+    PruneQueue();
+    double Now=GetClock();
+    if (m_Failed||m_Drainers||(m_MaxStaleness&&!m_Queue.empty()&&(Now-m_Queue.front().Since>=m_MaxStaleness)))
+    {
+        m_Bypassed++;
+        CondWake(m_UpdateSig);
+        UnlockCS(m_Lock);
+        return false;
+    };
+    unsigned char Bit=(unsigned char)(1<<(Segment%8));
+    //the bit may be still set if the stripe was re-encoded recently
+    if (!(m_pBitmap[Segment/8]&Bit))
+    {
+        m_pBitmap[Segment/8]|=Bit;
+        if (!WriteBitmapBlock(Segment))
+        {
+            cerr<<"Deferred parity bitmap write failed\n";
+            m_Failed=true;
+            CondWakeAll(m_IdleSig);
+            UnlockCS(m_Lock);
+            return false;
+        };
+    };
+    m_StaleSince[Segment]=Now;
+    m_NumOfStale++;
+    StaleSegment E={Segment,Now};
+    m_Queue.push_back(E);
+    m_Deferred++;
+    CondWake(m_UpdateSig);
+    UnlockCS(m_Lock);
+    return true;
+};
+
+/** The stale stripe is re-encoded from the payload symbols stored on the disks. This is not possible if some of them are erased,
+ * since the check symbols do not correspond to the payload ones
+ */
+bool CDeferredParity::Apply(unsigned long long StripeID,///the stripe
+                            unsigned SubarrayID,///identifies the subarray
+                            size_t ThreadID ///the scratch arena of a calling thread obtained from CDiskArray::LockStripes()
+                           )
+{
+    unsigned long long Segment=StripeID*m_NumOfSubarrays+SubarrayID;
+    //the entry cannot be modified by other threads, since the caller holds the stripe lock
+    LockCS(m_Lock);
+    bool Stale=(StaleSince(Segment)!=0);
+    UnlockCS(m_Lock);
+    if (!Stale)
+        return true;
+    if (!m_Array.m_Engine.ReencodeStripe(StripeID,SubarrayID,ThreadID))
+        return false;
+    LockCS(m_Lock);
+    Clear(Segment);
+    m_Reencoded++;
+    UnlockCS(m_Lock);
+    return true;
+};
+
+///mark a stripe as up to date, since its check symbols were re-encoded. The caller must hold the stripe lock
+void CDeferredParity::Drop(unsigned long long StripeID,///the stripe
+                           unsigned SubarrayID ///identifies the subarray
+                          )
+{
+    unsigned long long Segment=StripeID*m_NumOfSubarrays+SubarrayID;
+    LockCS(m_Lock);
+    if (StaleSince(Segment))
+        Clear(Segment);
+    UnlockCS(m_Lock);
+};
+
+/** The bit of the segment is cleared on the device later, after the check symbols are flushed
+ */
+void CDeferredParity::Clear(unsigned long long Segment ///the segment
+                           )
+{
+    map<unsigned long long,double>::iterator S=m_StaleSince.find(Segment);
+    double Lag=GetClock()-S->second;
+    if (Lag>m_MaxLag)
+        m_MaxLag=Lag;
+    m_StaleSince.erase(S);
+    m_NumOfStale--;
+    m_Cleared.push_back(Segment);
+};
+
+///remove the entries of the segments re-encoded since they were queued. Must be called with m_Lock held
+void CDeferredParity::PruneQueue()
+{
+    while (!m_Queue.empty()&&(StaleSince(m_Queue.front().Segment)!=m_Queue.front().Since))
+        m_Queue.pop_front();
+};
+
+/** The re-encoded check symbols must reach the disks before the bits are cleared on the device.
+ * The bits of the stripes, which became stale again in the meantime, are kept
+ */
+bool CDeferredParity::ClearBits()
+{
+    vector<unsigned long long> Cleared;
+    Cleared.swap(m_Cleared);
+    //the threads waiting for the bitmap to be cleared are not released prematurely
+    m_Updating++;
+    UnlockCS(m_Lock);
+    bool Result=m_Array.FlushDisks();
+    sort(Cleared.begin(),Cleared.end());
+    LockCS(m_Lock);
+    m_Updating--;
+    for(size_t i=0;i<Cleared.size();i++)
+        if (!StaleSince(Cleared[i]))
+            m_pBitmap[Cleared[i]/8]&=(unsigned char)~(1<<(Cleared[i]%8));
+    for(size_t i=0;Result&&(i<Cleared.size());i++)
+        if (!i||(Cleared[i]/(8ull*m_BlockSize)!=Cleared[i-1]/(8ull*m_BlockSize)))
+            Result=WriteBitmapBlock(Cleared[i]);
+    if (!Result)
+    {
+        cerr<<"Failed to clear the deferred parity bitmap\n";
+        m_Failed=true;
+        CondWakeAll(m_IdleSig);
+    };
+    return Result;
+};
+
+/** Wake up the background threads and wait until all stale stripes, which can be re-encoded, are re-encoded,
+ * and their bits are cleared. The writes issued meanwhile update the check symbols in place
+ */
+bool CDeferredParity::Drain()
+{
+    if (!m_Running)
+        return !m_Failed;
+    LockCS(m_Lock);
+    m_Drainers++;
+    CondWakeAll(m_UpdateSig);
+    for(;;)
+    {
+        PruneQueue();
+        if (m_Failed||(m_Queue.empty()&&!m_Updating&&m_Cleared.empty()))
+            break;
+        CondWait(m_IdleSig,m_Lock);
+    };
+    m_Drainers--;
+    bool Result=!m_Failed;
+    UnlockCS(m_Lock);
+    return Result;
+};
+
+/** The bits are written without flushing, so they become persistent together with the payload data
+ */
+bool CDeferredParity::FlushDevice()
+{
+    if (m_Device.GetMountState()!=msReadWrite)
+        return true;
+    return m_Device.Flush();
+};
+
+/** The stripes, which could not be re-encoded, are not included into the lag
+ */
+double CDeferredParity::GetRedundancyLag(unsigned long long& StaleStripes ///receives the number of stale stripes
+                                        )
+{
+    LockCS(m_Lock);
+    PruneQueue();
+    StaleStripes=m_NumOfStale;
+    double Lag=(m_Queue.empty())?0:GetClock()-m_Queue.front().Since;
+    UnlockCS(m_Lock);
+    return Lag;
+};
+
+/** A stripe is re-encoded once it has been stale for half of the staleness bound, so that the repeated updates
+ * of a hot stripe are combined, and the other half is left for the re-encoding to catch up with the writes.
+ * If there is no bound, the stripes are re-encoded immediately. Either way, the re-encoding is paced as a background activity,
+ * unless the stripe is overdue, or some thread waits for all stripes to be re-encoded
+ */
+THREADPROC CDeferredParity::UpdateThread(void* pParams ///must be a pointer to CDeferredParity
+                                        )
+{
+    CDeferredParity& D=*(CDeferredParity*)pParams;
+    CDiskArray& A=D.m_Array;
+    LockCS(D.m_Lock);
+    while (!D.m_Stop)
+    {
+        D.PruneQueue();
+        bool Idle=D.m_Failed||D.m_Queue.empty();
+        double Age=(Idle)?0:GetClock()-D.m_Queue.front().Since;
+        bool Urgent=D.m_Drainers||(D.m_MaxStaleness&&(Age>=D.m_MaxStaleness));
+        if (Idle||(!Urgent&&(2*Age<D.m_MaxStaleness)))
+        {
+            if (!D.m_Failed&&!D.m_Cleared.empty())
+            {
+                D.ClearBits();
+                continue;
+            };
+            if (Idle)
+            {
+                if (!D.m_Updating)
+                    CondWakeAll(D.m_IdleSig);
+                CondWait(D.m_UpdateSig,D.m_Lock);
+            }
+            else
+                CondTimedWait(D.m_UpdateSig,D.m_Lock,(unsigned)((D.m_MaxStaleness/2-Age)*1000)+1);
+            continue;
+        };
+        StaleSegment E=D.m_Queue.front();
+        D.m_Queue.pop_front();
+        D.m_Updating++;
+        UnlockCS(D.m_Lock);
+        unsigned long long StripeID=E.Segment/D.m_NumOfSubarrays;
+        unsigned SubarrayID=(unsigned)(E.Segment%D.m_NumOfSubarrays);
+        double Arrival=(Urgent)?0:A.m_Scheduler.Begin(iocBackground);
+        size_t ThreadID=A.LockStripes(StripeID,StripeID+1,SubarrayID);
+        bool Result=D.Apply(StripeID,SubarrayID,ThreadID);
+        A.UnlockStripes(ThreadID);
+        if (!Urgent)
+            A.m_Scheduler.End(iocBackground,Arrival);
+        LockCS(D.m_Lock);
+        D.m_Updating--;
+        if (!Result)
+            D.m_Unrecoverable++;
+        if (D.m_Cleared.size()>=DEFERREDPARITYBATCH)
+            D.ClearBits();
+    };
+    UnlockCS(D.m_Lock);
+    return 0;
+};
@@ -59,7 +59,7 @@ CDisk::CDisk() : m_MountState(msUnmounted), m_DiskState(dsInvalid), m_pArrayData
 #ifdef WIN32
         m_File(NULL)
 #else
-        m_File(-1)
+        m_File(-1),m_MapSize(0)
 #endif
 #else
         m_File(-1)
@@ -143,6 +143,13 @@ bool CDisk::Initialize(const char* pFilename, ///the name of the backend file
     off64_t FileSize = lseek64(m_File, 0, SEEK_END);
     lseek64(m_File, 0, SEEK_SET);
     m_pMap=(unsigned char*)mmap(NULL,FileSize,PROT_READ|PROT_WRITE,MAP_SHARED,m_File,0);
+    if (m_pMap==MAP_FAILED)
+    {
+        m_pMap=NULL;
+        cerr<<"Failed to map file "<<pFilename<<" to memory\n";
+        return false;
+    };
+    m_MapSize=FileSize;
 #endif
 #else
     //get file size
@@ -237,7 +244,8 @@ CDisk::~CDisk()
         CloseHandle(m_File);
     };
 #else
-    munmap(m_pMap,m_PayloadOffset+m_NumOfBlocks*m_BlockSize);
+    if (m_pMap)
+        munmap(m_pMap,m_MapSize);
 #endif
 #else
     if (m_File >= 0)
@@ -345,6 +353,43 @@ bool CDisk::Unmount(time_t Timestamp)
     };
 };
 
+/** Emulate the replacement of a physical disk. The new file is not opened until ResetDisk() is called,
+ * so the disk remains invalid
+ */
+bool CDisk::Attach(const char* pFilename ///the name of the new backend file
+                  )
+{
+    if (m_DiskState == dsOnline)
+        return false;
+    Lock();
+#ifdef USE_MMAP
+#ifdef WIN32
+    if (m_pMap)
+    {
+        UnmapViewOfFile(m_pMap);
+        CloseHandle(m_Mapping);
+        CloseHandle(m_File);
+    };
+#else
+    if (m_pMap)
+        munmap(m_pMap,m_MapSize);
+    if (m_File >= 0)
+        close(m_File);
+    m_File = -1;
+#endif
+    m_pMap = 0;
+#else
+    if (m_File >= 0)
+        close(m_File);
+    m_File = -1;
+#endif
+    m_pFileName = pFilename;
+    m_DiskState = dsInvalid;
+    m_MountState = msUnmounted;
+    Unlock();
+    return true;
+};
+
 ///Initialize the disk. The disk must be in dsOffline or dsInvalid state.
 ///The payload data is filled with zeroes. On success, the disk status is changed to online
 ///@return true on success
@@ -390,7 +435,7 @@ bool CDisk::ResetDisk()
 
 #else
     if (m_pMap)
-        munmap(m_pMap,m_PayloadOffset+m_NumOfBlocks*m_BlockSize);
+        munmap(m_pMap,m_MapSize);
     if (m_File < 0)
     {
         //try to create the files
@@ -412,11 +457,13 @@ bool CDisk::ResetDisk()
         return false;
     };
     m_pMap=(unsigned char*) mmap(NULL,TargetSize,PROT_READ|PROT_WRITE,MAP_SHARED,m_File,0);
-    if (!m_pMap)
+    if (m_pMap==MAP_FAILED)
     {
+        m_pMap=NULL;
         Unlock();
         return false;
     };
+    m_MapSize=TargetSize;
 #endif    
 #else
     //we are going to rebuild the file from scratch
@@ -551,3 +598,54 @@ bool CDisk::WriteData(unsigned long long BlockID, ///start of the destination ar
     };
 #endif
 };
+
+
+/** Punch a hole in the underlying file. This is done without the disk lock, since the file position
+ * is not affected. If hole punching is not supported, the request is silently ignored,
+ * so that the data remains intact
+ * @return true on success
+ */
+bool CDisk::Discard(unsigned long long BlockID, ///the first block to be released
+                    unsigned NumOfBlocks ///the number of blocks to be released
+                    )
+{
+    if (m_MountState != msReadWrite) //invalid disk access
+        return false;
+    if (BlockID + NumOfBlocks > m_NumOfBlocks) //invalid discard request
+        return false;
+#if !defined(WIN32) && defined(FALLOC_FL_PUNCH_HOLE)
+    off64_t Pos = m_PayloadOffset + BlockID*m_BlockSize;
+    if (fallocate64(m_File, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, Pos, (off64_t) NumOfBlocks * m_BlockSize) &&
+            (errno != EOPNOTSUPP))
+    {
+        cerr << "Discard error " << strerror(errno) << " on disk " << m_pFileName << endl;
+        return false;
+    };
+#endif
+    return true;
+};
+
+///make sure that all written data reached the underlying file. The disk must be read-write mounted
+///@return true on success
+
+bool CDisk::Flush()
+{
+    if (m_MountState != msReadWrite) //invalid disk access
+        return false;
+#ifdef USE_MMAP
+#ifdef WIN32
+    return FlushViewOfFile(m_pMap, 0) && FlushFileBuffers(m_File);
+#else
+    return msync(m_pMap, m_PayloadOffset + m_NumOfBlocks*m_BlockSize, MS_SYNC) == 0;
+#endif
+#else
+    Lock();
+#ifdef WIN32
+    bool Result = _commit(m_File) == 0;
+#else
+    bool Result = fsync(m_File) == 0;
+#endif
+    Unlock();
+    return Result;
+#endif
+};
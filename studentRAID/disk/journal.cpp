@@ -0,0 +1,638 @@
+/*********************************************************
+ * journal.cpp  - implementation of the write journal of the RAID emulator
+ *
+ * Copyright(C) 2012 Saint-Petersburg State Polytechnic University
+ *
+ * Developed in the framework of the "Forward error correction for next generation storage systems" project
+ *
+ * Author: P. Trifonov petert@dcn.ftk.spbstu.ru
+ * ********************************************************/
+#include <iostream>
+#include <string.h>
+#include <time.h>
+#include "misc.h"
+#include "arithmetic.h"
+#include "array.h"
+#include "journal.h"
+
+using namespace std;
+
+///journal superblock signature
+#define JOURNALMAGIC 0x70A2BA1F
+///journal record signature
+#define JOURNALRECORDMAGIC 0x70A2DA7A
+///the maximal number of stripe units in a single record
+#define MAXJOURNALRECORDUNITS 256
+
+///avoid padding of on-disk structures
+#pragma pack(push)
+#pragma pack(1)
+///the first block of the journal device. It identifies the oldest record which may be not yet applied to the array
+struct JournalSuperblock
+{
+    ///must be JOURNALMAGIC
+    unsigned MagicNumber;
+    ///size of a journal block
+    unsigned BlockSize;
+    ///sequence number of the first record to be replayed
+    unsigned long long Sequence;
+    ///the block where this record is expected. If it is not there, it is looked for at the beginning of the log
+    unsigned long long Position;
+    ///CRC32 of all preceding fields
+    unsigned CRC;
+};
+
+///the first block of each journal record. It is followed by the payload stripe units
+struct JournalRecordHeader
+{
+    ///must be JOURNALRECORDMAGIC
+    unsigned MagicNumber;
+    ///the number of payload stripe units
+    unsigned NumOfUnits;
+    ///sequence number of the record
+    unsigned long long Sequence;
+    ///the first payload stripe unit of the array to be updated
+    unsigned long long FirstUnit;
+    ///CRC32 of the payload data
+    unsigned DataCRC;
+    ///CRC32 of the header, computed with this field set to 0
+    unsigned CRC;
+};
+#pragma pack(pop)
+
+///compute CRC32 of a memory block
+static unsigned GetChecksum(const void* pData,size_t Size)
+{
+    unsigned CRC=0;
+    UpdateCRC32(CRC,Size,(const unsigned char*)pData);
+    return CRC;
+};
+
+/** Open the journal device and check that it was created for the same array configuration
+ */
+CJournal::CJournal(CDiskArray& Array,///the array to be served
+                   const char* pFileName,///the name of the file emulating the journal device
+                   size_t Capacity,///journal capacity in bytes
+                   unsigned DeviceID ///identifier of the journal device. This must be different from the IDs of the array disks
+                  ):m_Array(Array),m_Valid(false),m_BlockSize(Array.GetStripeUnitSize()),m_pPendingRecords(0),
+    m_pFirst(0),m_pLast(0),m_Head(1),m_NextSequence(1),m_CommittedSequence(1),m_CheckpointSequence(1),m_UsedBlocks(0),
+    m_Flushing(false),m_Failed(false),m_Running(false),m_Stop(false)
+{
+    m_NumOfBlocks=Capacity/m_BlockSize;
+    //a record must fit into the log even if the unused blocks at the end of the device are skipped
+    if (m_NumOfBlocks<5)
+        throw Exception("Journal capacity is too small");
+    m_MaxRecordUnits=(unsigned)min(m_NumOfBlocks/2-1,(unsigned long long)MAXJOURNALRECORDUNITS);
+    if (!InitCS(m_Lock))
+        throw Exception("Failed to initialize journal mutex");
+    if (!InitCond(m_SpaceSig)||!InitCond(m_CommitSig)||!InitCond(m_ApplySig)||!InitCond(m_CheckpointSig))
+        throw Exception("Journal condition initialization failed");
+    InitCRC32();
+    m_pPendingRecords=new unsigned[m_Array.m_NumOfStripes];
+    memset(m_pPendingRecords,0,sizeof(unsigned)*m_Array.m_NumOfStripes);
+
+    const void* pCodeConfig;
+    unsigned CodeConfigSize=m_Array.m_Engine.GetConfiguration(pCodeConfig);
+    if (m_Device.Initialize(pFileName,DeviceID,m_BlockSize,m_NumOfBlocks,CodeConfigSize)&&(m_Device.GetDiskState()==dsOffline))
+    {
+        void const* pCodeConfig2;
+        unsigned CodeConfigSize2=m_Device.GetArrayData(pCodeConfig2);
+        m_Valid=(CodeConfigSize2==CodeConfigSize)&&!memcmp(pCodeConfig,pCodeConfig2,CodeConfigSize);
+    };
+    if (m_Valid)
+        m_Device.SetDiskState(dsOnline);
+};
+
+CJournal::~CJournal()
+{
+    Stop();
+    delete[]m_pPendingRecords;
+    DestroyCond(m_SpaceSig);
+    DestroyCond(m_CommitSig);
+    DestroyCond(m_ApplySig);
+    DestroyCond(m_CheckpointSig);
+    DestroyCS(m_Lock);
+};
+
+///deallocate a record
+void CJournal::DeleteRecord(JournalRecord* pRecord)
+{
+    AlignedFree(pRecord->pBlocks);
+    delete pRecord;
+};
+
+/** Add the record to the end of the list, and mark the affected stripes
+ */
+void CJournal::Link(JournalRecord* pRecord)
+{
+    pRecord->pNext=0;
+    if (m_pLast)
+        m_pLast->pNext=pRecord;
+    else
+        m_pFirst=pRecord;
+    m_pLast=pRecord;
+    unsigned UnitsPerStripe=m_Array.m_UnitsPerStripe;
+    for(unsigned long long S=pRecord->FirstUnit/UnitsPerStripe;S<=(pRecord->FirstUnit+pRecord->NumOfUnits-1)/UnitsPerStripe;S++)
+        m_pPendingRecords[S]++;
+};
+
+/** Remove the first record from the list, and unmark the affected stripes
+ */
+void CJournal::Unlink()
+{
+    JournalRecord* pRecord=m_pFirst;
+    m_pFirst=pRecord->pNext;
+    if (!m_pFirst)
+        m_pLast=0;
+    unsigned UnitsPerStripe=m_Array.m_UnitsPerStripe;
+    for(unsigned long long S=pRecord->FirstUnit/UnitsPerStripe;S<=(pRecord->FirstUnit+pRecord->NumOfUnits-1)/UnitsPerStripe;S++)
+        m_pPendingRecords[S]--;
+};
+
+/** Write the superblock and make sure that it reaches the device
+ */
+bool CJournal::WriteCheckpoint(unsigned long long Sequence,///sequence number of the oldest record to be replayed
+                               unsigned long long Position ///its location
+                              )
+{
+    unsigned char* pBlock=AlignedMalloc(m_BlockSize);
+    memset(pBlock,0,m_BlockSize);
+    JournalSuperblock& S=*(JournalSuperblock*)pBlock;
+    S.MagicNumber=JOURNALMAGIC;
+    S.BlockSize=m_BlockSize;
+    S.Sequence=Sequence;
+    S.Position=Position;
+    S.CRC=GetChecksum(&S,sizeof(S)-sizeof(S.CRC));
+    bool Result=m_Device.WriteData(0,1,pBlock)&&m_Device.Flush();
+    AlignedFree(pBlock);
+    return Result;
+};
+
+/** Create an empty log with the checkpoint pointing to its beginning
+ */
+bool CJournal::Init()
+{
+    if (m_Running)
+        return false;
+    while (m_pFirst)
+    {
+        JournalRecord* pRecord=m_pFirst;
+        Unlink();
+        DeleteRecord(pRecord);
+    };
+    m_Head=1;
+    m_NextSequence=m_CommittedSequence=m_CheckpointSequence=1;
+    m_UsedBlocks=0;
+    m_Failed=false;
+    const void* pCodeConfig;
+    unsigned CodeConfigSize=m_Array.m_Engine.GetConfiguration(pCodeConfig);
+    if (m_Device.GetDiskState()==dsOnline)
+        m_Device.SetDiskState(dsOffline);
+    m_Device.SetArrayData(pCodeConfig,CodeConfigSize);
+    m_Valid=m_Device.ResetDisk()&&m_Device.Mount(true);
+    if (m_Valid)
+    {
+        m_Valid=WriteCheckpoint(1,1);
+        m_Valid&=m_Device.Unmount(time(NULL));
+    };
+    if (!m_Valid)
+        cerr<<"Failed to initialize the journal device\n";
+    return m_Valid;
+};
+
+/** Check the header and the payload checksums.
+ *  Stale records left from the previous passes over the log have smaller sequence numbers, so they are not accepted
+ */
+JournalRecord* CJournal::LoadRecord(unsigned long long Sequence,///expected sequence number
+                                    unsigned long long Position ///the location to be inspected
+                                   )
+{
+    if ((Position<1)||(Position>=m_NumOfBlocks))
+        return 0;
+    unsigned char* pHeader=AlignedMalloc(m_BlockSize);
+    if (!m_Device.ReadData(Position,1,pHeader))
+    {
+        AlignedFree(pHeader);
+        return 0;
+    };
+    JournalRecordHeader H=*(JournalRecordHeader*)pHeader;
+    AlignedFree(pHeader);
+    if ((H.MagicNumber!=JOURNALRECORDMAGIC)||(H.Sequence!=Sequence)||(H.CRC!=GetChecksum(&H,sizeof(H)-sizeof(H.CRC))))
+        return 0;
+    if (!H.NumOfUnits||(Position+1+H.NumOfUnits>m_NumOfBlocks)||
+            (H.FirstUnit+H.NumOfUnits>m_Array.m_NumOfStripes*m_Array.m_UnitsPerStripe))
+        return 0;
+    JournalRecord* pRecord=new JournalRecord;
+    pRecord->Sequence=Sequence;
+    pRecord->FirstUnit=H.FirstUnit;
+    pRecord->NumOfUnits=H.NumOfUnits;
+    pRecord->Position=Position;
+    pRecord->Footprint=1+H.NumOfUnits;
+    pRecord->pNext=0;
+    pRecord->pBlocks=AlignedMalloc((1+(size_t)H.NumOfUnits)*m_BlockSize);
+    if (!m_Device.ReadData(Position,1+H.NumOfUnits,pRecord->pBlocks)||
+            (GetChecksum(GetPayload(pRecord),(size_t)H.NumOfUnits*m_BlockSize)!=H.DataCRC))
+    {
+        //the record was not completely written
+        DeleteRecord(pRecord);
+        return 0;
+    };
+    return pRecord;
+};
+
+/** Follow the chain of records with consecutive sequence numbers, starting from the checkpoint.
+ * A record which does not fit into the remaining part of the device is written at the beginning of the log
+ */
+bool CJournal::LoadRecords()
+{
+    unsigned char* pBlock=AlignedMalloc(m_BlockSize);
+    bool Result=m_Device.ReadData(0,1,pBlock);
+    JournalSuperblock S=*(JournalSuperblock*)pBlock;
+    AlignedFree(pBlock);
+    if (!Result||(S.MagicNumber!=JOURNALMAGIC)||(S.BlockSize!=m_BlockSize)||(S.CRC!=GetChecksum(&S,sizeof(S)-sizeof(S.CRC))))
+    {
+        cerr<<"Invalid journal superblock\n";
+        return false;
+    };
+    unsigned long long Sequence=S.Sequence;
+    unsigned long long Position=S.Position;
+    m_UsedBlocks=0;
+    for(;;)
+    {
+        JournalRecord* pRecord=LoadRecord(Sequence,Position);
+        if (!pRecord&&(Position!=1))
+        {
+            pRecord=LoadRecord(Sequence,1);
+            if (pRecord)
+                //the blocks at the end of the device were skipped
+                pRecord->Footprint+=m_NumOfBlocks-Position;
+        };
+        if (!pRecord)
+            break;
+        Link(pRecord);
+        m_UsedBlocks+=pRecord->Footprint;
+        Position=pRecord->Position+1+pRecord->NumOfUnits;
+        Sequence++;
+    };
+    m_Head=Position;
+    m_NextSequence=m_CommittedSequence=Sequence;
+    m_CheckpointSequence=S.Sequence;
+    return true;
+};
+
+/** The record may be the last one written before a crash, so that the check symbols of the affected stripes
+ * may be inconsistent with the data. The whole stripes are therefore re-encoded, rather than updated.
+ * Notice that the data of erased symbols of such stripes cannot be recovered
+ */
+bool CJournal::ReplayRecord(const JournalRecord* pRecord,///the record
+                            size_t ThreadID ///the scratch arena of a calling thread obtained from CDiskArray::LockStripes()
+                           )
+{
+    unsigned UnitsPerStripe=m_Array.m_UnitsPerStripe;
+    const unsigned char* pPayload=pRecord->pBlocks+m_BlockSize;
+    unsigned long long LastUnit=pRecord->FirstUnit+pRecord->NumOfUnits;
+    unsigned char* pStripe=AlignedMalloc(m_Array.m_StripeSize);
+    bool Result=true;
+    for(unsigned long long S=pRecord->FirstUnit/UnitsPerStripe;Result&&(S*UnitsPerStripe<LastUnit);S++)
+    {
+        unsigned long long StripeStart=S*UnitsPerStripe;
+        Result=m_Array.Read(StripeStart,UnitsPerStripe,pStripe,ThreadID);
+        unsigned long long From=max(StripeStart,pRecord->FirstUnit);
+        unsigned long long To=min(StripeStart+UnitsPerStripe,LastUnit);
+        memcpy(pStripe+(From-StripeStart)*m_BlockSize,pPayload+(From-pRecord->FirstUnit)*m_BlockSize,(size_t)(To-From)*m_BlockSize);
+        Result&=m_Array.Write(StripeStart,UnitsPerStripe,pStripe,ThreadID);
+    };
+    AlignedFree(pStripe);
+    return Result;
+};
+
+/** Load the records following the last checkpoint. In the write mode, apply them to the array,
+ * make a new checkpoint and start the background thread
+ */
+bool CJournal::Start(bool Write ///true if the array is mounted for writing
+                    )
+{
+    if (!m_Valid)
+    {
+        cerr<<"Journal device is not available\n";
+        return false;
+    };
+    if (m_Running||!m_Device.Mount(Write))
+        return false;
+    m_Failed=false;
+    m_Stop=false;
+    if (!LoadRecords())
+    {
+        m_Device.Unmount(time(NULL));
+        return false;
+    };
+    if (!Write)
+        //keep the records, so that Overlay() returns the latest data
+        return true;
+    bool Result=true;
+    if (m_pFirst)
+    {
+        unsigned long long NumOfRecords=m_NextSequence-m_pFirst->Sequence;
+        size_t ThreadID=m_Array.LockStripes(0,m_Array.m_NumOfStripes);
+        while (m_pFirst)
+        {
+            JournalRecord* pRecord=m_pFirst;
+            Result=Result&&ReplayRecord(pRecord,ThreadID);
+            Unlink();
+            DeleteRecord(pRecord);
+        };
+        m_Array.UnlockStripes(ThreadID);
+        Result=Result&&m_Array.FlushDisks();
+        if (Result)
+            cerr<<NumOfRecords<<" journal records replayed\n";
+        else
+            cerr<<"Journal replay failed\n";
+    };
+    m_UsedBlocks=0;
+    if (Result)
+    {
+        Result=WriteCheckpoint(m_NextSequence,m_Head);
+        m_CheckpointSequence=m_NextSequence;
+    };
+    if (Result)
+    {
+        m_Running=StartThread(m_Applier,ApplyThread,this);
+        if (!m_Running)
+        {
+            cerr<<"Failed to start the journal thread\n";
+            Result=false;
+        };
+    };
+    if (!Result)
+        m_Device.Unmount(time(NULL));
+    return Result;
+};
+
+/** Wait for the background thread to apply all records, and terminate it
+ */
+bool CJournal::Stop()
+{
+    if (m_Device.GetMountState()==msUnmounted)
+        return true;
+    bool Result=true;
+    if (m_Running)
+    {
+        Result=Drain();
+        LockCS(m_Lock);
+        m_Stop=true;
+        CondWakeAll(m_ApplySig);
+        UnlockCS(m_Lock);
+        JoinThread(m_Applier);
+        m_Running=false;
+    };
+    //the records, which could not be applied, are still stored in the journal
+    while (m_pFirst)
+    {
+        JournalRecord* pRecord=m_pFirst;
+        Unlink();
+        DeleteRecord(pRecord);
+    };
+    m_UsedBlocks=0;
+    Result&=m_Device.Unmount(time(NULL));
+    return Result;
+};
+
+/** Reserve enough space for the record, even if it does not fit into the remaining part of the device,
+ * and allocate the buffer for it
+ */
+JournalRecord* CJournal::CreateRecord(unsigned long long FirstUnit,///the first payload stripe unit of the array to be updated
+                                      unsigned NumOfUnits ///the number of units to be updated. This may not exceed GetMaxRecordUnits()
+                                     )
+{
+    if (!NumOfUnits||(NumOfUnits>m_MaxRecordUnits))
+        return 0;
+    unsigned long long Reservation=2*(1+(unsigned long long)NumOfUnits)-1;
+    LockCS(m_Lock);
+    while (!m_Failed&&(m_UsedBlocks+Reservation>m_NumOfBlocks-1))
+        CondWait(m_SpaceSig,m_Lock);
+    if (m_Failed)
+    {
+        UnlockCS(m_Lock);
+        return 0;
+    };
+    m_UsedBlocks+=Reservation;
+    UnlockCS(m_Lock);
+    JournalRecord* pRecord=new JournalRecord;
+    pRecord->Sequence=0;
+    pRecord->FirstUnit=FirstUnit;
+    pRecord->NumOfUnits=NumOfUnits;
+    pRecord->Position=0;
+    pRecord->Footprint=Reservation;
+    pRecord->pNext=0;
+    pRecord->pBlocks=AlignedMalloc((1+(size_t)NumOfUnits)*m_BlockSize);
+    memset(pRecord->pBlocks,0,m_BlockSize);
+    return pRecord;
+};
+
+///release a record, which was not appended to the journal
+void CJournal::DiscardRecord(JournalRecord* pRecord)
+{
+    LockCS(m_Lock);
+    m_UsedBlocks-=pRecord->Footprint;
+    CondWakeAll(m_SpaceSig);
+    UnlockCS(m_Lock);
+    DeleteRecord(pRecord);
+};
+
+/** Place the record after the previous one, or at the beginning of the log if it does not fit into the
+ * remaining part of the device, and return the unused part of the reservation
+ */
+unsigned long long CJournal::Append(JournalRecord* pRecord ///the record with the payload data filled in
+                                   )
+{
+    unsigned long long Size=1+pRecord->NumOfUnits;
+    JournalRecordHeader& H=*(JournalRecordHeader*)pRecord->pBlocks;
+    H.MagicNumber=JOURNALRECORDMAGIC;
+    H.NumOfUnits=pRecord->NumOfUnits;
+    H.FirstUnit=pRecord->FirstUnit;
+    H.DataCRC=GetChecksum(GetPayload(pRecord),(size_t)pRecord->NumOfUnits*m_BlockSize);
+    LockCS(m_Lock);
+    if (m_Failed)
+    {
+        m_UsedBlocks-=pRecord->Footprint;
+        UnlockCS(m_Lock);
+        DeleteRecord(pRecord);
+        return 0;
+    };
+    unsigned long long Reservation=pRecord->Footprint;
+    pRecord->Position=m_Head;
+    pRecord->Footprint=Size;
+    if (m_Head+Size>m_NumOfBlocks)
+    {
+        pRecord->Footprint+=m_NumOfBlocks-m_Head;
+        pRecord->Position=1;
+    };
+    m_UsedBlocks-=Reservation-pRecord->Footprint;
+    CondWakeAll(m_SpaceSig);
+    unsigned long long Sequence=m_NextSequence;
+    pRecord->Sequence=Sequence;
+    H.Sequence=Sequence;
+    H.CRC=GetChecksum(&H,sizeof(H)-sizeof(H.CRC));
+    if (!m_Device.WriteData(pRecord->Position,(unsigned)Size,pRecord->pBlocks))
+    {
+        cerr<<"Journal write failed\n";
+        m_UsedBlocks-=pRecord->Footprint;
+        m_Failed=true;
+        CondWakeAll(m_SpaceSig);
+        CondWakeAll(m_CheckpointSig);
+        UnlockCS(m_Lock);
+        DeleteRecord(pRecord);
+        return 0;
+    };
+    m_Head=pRecord->Position+Size;
+    m_NextSequence++;
+    Link(pRecord);
+    UnlockCS(m_Lock);
+    return Sequence;
+};
+
+/** If no flush is in progress, flush the journal device, committing all records appended so far.
+ * Otherwise, wait for the flush to complete, since it may have covered the record
+ */
+bool CJournal::Commit(unsigned long long Sequence ///sequence number of the record
+                     )
+{
+    LockCS(m_Lock);
+    bool Result=true;
+    while (Result&&(m_CommittedSequence<=Sequence))
+    {
+        if (m_Failed)
+            Result=false;
+        else
+        if (m_Flushing)
+            CondWait(m_CommitSig,m_Lock);
+        else
+        {
+            m_Flushing=true;
+            unsigned long long Target=m_NextSequence;
+            UnlockCS(m_Lock);
+            bool Flushed=m_Device.Flush();
+            LockCS(m_Lock);
+            m_Flushing=false;
+            if (Flushed)
+                m_CommittedSequence=Target;
+            else
+            {
+                cerr<<"Journal flush failed\n";
+                m_Failed=true;
+                CondWakeAll(m_SpaceSig);
+                CondWakeAll(m_CheckpointSig);
+            };
+            CondWakeAll(m_CommitSig);
+            CondWake(m_ApplySig);
+        };
+    };
+    UnlockCS(m_Lock);
+    return Result;
+};
+
+/** Commit all appended records, and wait for a checkpoint beyond them
+ */
+bool CJournal::Drain()
+{
+    if (!m_Running)
+        return !m_Failed;
+    LockCS(m_Lock);
+    unsigned long long Target=m_NextSequence;
+    UnlockCS(m_Lock);
+    bool Result=Commit(Target-1);
+    LockCS(m_Lock);
+    while (!m_Failed&&(m_CheckpointSequence<Target))
+        CondWait(m_CheckpointSig,m_Lock);
+    Result&=!m_Failed;
+    UnlockCS(m_Lock);
+    return Result;
+};
+
+/** Copy the data of the pending records overlapping with the requested range,
+ * starting from the oldest one
+ */
+void CJournal::Overlay(unsigned long long FirstUnit,///the first payload stripe unit of the array
+                       unsigned long long NumOfUnits,///the number of units
+                       unsigned char* pDest ///the data read from the array
+                      )
+{
+    if (!NumOfUnits)
+        return;
+    unsigned UnitsPerStripe=m_Array.m_UnitsPerStripe;
+    unsigned long long LastUnit=FirstUnit+NumOfUnits;
+    LockCS(m_Lock);
+    bool Pending=false;
+    if (m_pFirst)
+        for(unsigned long long S=FirstUnit/UnitsPerStripe;!Pending&&(S<=(LastUnit-1)/UnitsPerStripe);S++)
+            Pending=(m_pPendingRecords[S]!=0);
+    if (Pending)
+    {
+        for(JournalRecord* pRecord=m_pFirst;pRecord;pRecord=pRecord->pNext)
+        {
+            unsigned long long From=max(FirstUnit,pRecord->FirstUnit);
+            unsigned long long To=min(LastUnit,pRecord->FirstUnit+pRecord->NumOfUnits);
+            if (From<To)
+                memcpy(pDest+(From-FirstUnit)*m_BlockSize,GetPayload(pRecord)+(From-pRecord->FirstUnit)*m_BlockSize,(size_t)(To-From)*m_BlockSize);
+        };
+    };
+    UnlockCS(m_Lock);
+};
+
+/** Take the committed records in the order of their sequence numbers, and write them to the array
+ * under the stripe locks. Each record is removed from the list before the stripes are unlocked, so that the readers
+ * see either the record or the updated stripes. After a batch of records is applied, the array disks are flushed,
+ * and the checkpoint is moved, so that the space occupied by the records can be reused
+ */
+THREADPROC CJournal::ApplyThread(void* pParams ///must be a pointer to CJournal
+                                )
+{
+    CJournal& J=*(CJournal*)pParams;
+    CDiskArray& A=J.m_Array;
+    LockCS(J.m_Lock);
+    while (!J.m_Stop)
+    {
+        if (J.m_Failed||!J.m_pFirst||(J.m_pFirst->Sequence>=J.m_CommittedSequence))
+        {
+            CondWait(J.m_ApplySig,J.m_Lock);
+            continue;
+        };
+        unsigned long long AppliedBlocks=0;
+        bool Result=true;
+        while (Result&&J.m_pFirst&&(J.m_pFirst->Sequence<J.m_CommittedSequence))
+        {
+            JournalRecord* pRecord=J.m_pFirst;
+            UnlockCS(J.m_Lock);
+            size_t ThreadID=A.LockUnits(pRecord->FirstUnit,pRecord->FirstUnit+pRecord->NumOfUnits);
+            Result=A.Write(pRecord->FirstUnit,pRecord->NumOfUnits,J.GetPayload(pRecord),ThreadID);
+            LockCS(J.m_Lock);
+            J.Unlink();
+            AppliedBlocks+=pRecord->Footprint;
+            UnlockCS(J.m_Lock);
+            A.UnlockStripes(ThreadID);
+            DeleteRecord(pRecord);
+            LockCS(J.m_Lock);
+        };
+        unsigned long long Sequence=(J.m_pFirst)?J.m_pFirst->Sequence:J.m_NextSequence;
+        unsigned long long Position=(J.m_pFirst)?J.m_pFirst->Position:J.m_Head;
+        UnlockCS(J.m_Lock);
+        //the superblock may point beyond the applied records only after they reach the disks
+        Result=Result&&A.FlushDisks()&&J.WriteCheckpoint(Sequence,Position);
+        LockCS(J.m_Lock);
+        if (Result)
+        {
+            J.m_CheckpointSequence=Sequence;
+            J.m_UsedBlocks-=AppliedBlocks;
+        }
+        else
+        {
+            cerr<<"Failed to apply the journal records\n";
+            J.m_Failed=true;
+            CondWakeAll(J.m_CommitSig);
+        };
+        CondWakeAll(J.m_SpaceSig);
+        CondWakeAll(J.m_CheckpointSig);
+    };
+    UnlockCS(J.m_Lock);
+    return 0;
+};
@@ -0,0 +1,280 @@
+/*********************************************************
+ * layout.cpp  - implementation of the mapping of codeword symbols onto disks
+ *
+ * Copyright(C) 2012 Saint-Petersburg State Polytechnic University
+ *
+ * Developed in the framework of the "Forward error correction for next generation storage systems" project
+ *
+ * Author: P. Trifonov petert@dcn.ftk.spbstu.ru
+ * ********************************************************/
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+#include "misc.h"
+#include "RAIDProcessor.h"
+#include "layout.h"
+
+using namespace std;
+
+const char* ppLayoutNames[]={"cyclic","declustered","left-symmetric","dedicated","weighted",NULL};
+
+///translate the layout name into eLayoutTypes value
+///@return layout type. An exception is thrown if the name is unknown
+int GetLayoutType(const char* pName)
+{
+    for(int i=0;ppLayoutNames[i];i++)
+        if (!strcmp(pName,ppLayoutNames[i]))
+            return i;
+    throw Exception("Unknown layout %s",pName);
+};
+
+///translate a comma-separated list of disk weights into an array of MAXWEIGHTEDDISKS entries.
+///An exception is thrown if the list is invalid
+void ParseWeights(const char* pList,///the list, or 0 if no weights are given
+                  unsigned char* pWeights ///output: the weights, followed by zeroes
+                 )
+{
+    memset(pWeights,0,MAXWEIGHTEDDISKS);
+    if (!pList)
+        return;
+    const char* p=pList;
+    for(unsigned i=0;*p;i++)
+    {
+        char* pEnd;
+        unsigned long W=strtoul(p,&pEnd,10);
+        if ((pEnd==p)||!W||(W>255)||(i>=MAXWEIGHTEDDISKS))
+            throw Exception("Invalid disk weights %s. At most %d weights from 1 to 255 are allowed",pList,MAXWEIGHTEDDISKS);
+        pWeights[i]=(unsigned char)W;
+        p=pEnd;
+        while ((*p==',')||(*p==' '))
+            p++;
+    };
+};
+
+/** Each disk stores the same number of rows, so the smallest disk determines the number of stripes
+ */
+unsigned long long CLayout::GetNumOfStripesOnDisks(const unsigned long long* pDiskRows ///the number of rows on each disk of the subarray
+                                                  )const
+{
+    unsigned long long DiskRows=pDiskRows[0];
+    for(unsigned i=1;i<m_NumOfDisks;i++)
+        if (pDiskRows[i]<DiskRows)
+            DiskRows=pDiskRows[i];
+    return GetNumOfStripes(DiskRows);
+};
+
+///this should never be called, since such layouts report zero spare slots
+void CLayout::GetSpareLocation(unsigned long long /*StripeID*/,unsigned /*SymbolID*/,unsigned /*SpareID*/,unsigned& /*DiskID*/,unsigned long long& /*Row*/)const
+{
+    throw Exception("The layout has no spare space");
+};
+
+///@return the greatest common divisor of a and b
+static unsigned GCD(unsigned a,unsigned b)
+{
+    while (b)
+    {
+        unsigned t=a%b;
+        a=b;
+        b=t;
+    };
+    return a;
+};
+
+/** All multipliers coprime with the pool size are used in turn. For any such multiplier, the disks
+ * (j+i*m)%NumOfDisks, 0<=i<Length+NumOfSpares, are distinct, so the symbols and the spare units
+ * of each stripe reside on different disks, and each disk stores exactly one unit in each row of a stripe group.
+ * For prime NumOfDisks, each pair of disks shares Length*(Length-1)/2 stripes within the period
+ * of NumOfDisks*NumOfMultipliers stripes, which is also the number of symbol to disk mapping patterns
+ */
+CDeclusteredLayout::CDeclusteredLayout(unsigned Length,///code length
+                                       unsigned NumOfDisks,///pool size
+                                       unsigned NumOfSpares ///the number of spare slots
+                                      ):CLayout(Length,NumOfDisks,0,NumOfSpares),m_pMultipliers(0),m_NumOfMultipliers(0)
+{
+    if (Length+NumOfSpares>NumOfDisks)
+        throw Exception("Pool size %d is too small for %d symbols and %d spare units per stripe",NumOfDisks,Length,NumOfSpares);
+    m_pMultipliers=new unsigned[NumOfDisks];
+    for(unsigned m=1;m<NumOfDisks;m++)
+        if (GCD(m,NumOfDisks)==1)
+            m_pMultipliers[m_NumOfMultipliers++]=m;
+    if (!m_NumOfMultipliers)
+        //a single disk pool
+        m_pMultipliers[m_NumOfMultipliers++]=1;
+    m_NumOfPatterns=NumOfDisks*m_NumOfMultipliers;
+};
+
+CDeclusteredLayout::~CDeclusteredLayout()
+{
+    delete[]m_pMultipliers;
+};
+
+/** The weights are divided by their greatest common divisor, so that the period is as short as possible.
+ * The disks of each pattern are selected greedily. If the number of symbols still to be placed on any disk
+ * does not exceed the number of the remaining patterns, and their total is Length times this number,
+ * this remains true after Length disks with the largest numbers are selected, so all symbols are placed.
+ * The ties are broken in the order rotated by one disk in each pattern, so that the disks of equal weight are loaded evenly.
+ * The share of the check symbols of a disk placed so far is compared with its share of all symbols scaled by (Length-Dimension)/Length
+ */
+CWeightedLayout::CWeightedLayout(unsigned Length,///code length
+                                 unsigned Dimension,///the number of payload symbols
+                                 unsigned NumOfDisks,///pool size
+                                 const unsigned char* pWeights,///the weights of the disks. Zero entries stand for 1
+                                 unsigned RotationPeriod ///the number of consecutive stripes sharing the same mapping
+                                ):CLayout(Length,NumOfDisks,0,0),m_RotationPeriod(RotationPeriod),m_pSymbols(0),m_pDisks(0),m_pRows(0)
+{
+    if (Length>NumOfDisks)
+        throw Exception("Pool size %d is too small for %d symbols per stripe",NumOfDisks,Length);
+    unsigned Divisor=0;
+    for(unsigned d=0;d<NumOfDisks;d++)
+        Divisor=GCD((pWeights[d])?pWeights[d]:1,Divisor);
+    unsigned TotalWeight=0;
+    m_pSymbols=new unsigned[NumOfDisks];
+    for(unsigned d=0;d<NumOfDisks;d++)
+    {
+        m_pSymbols[d]=((pWeights[d])?pWeights[d]:1)/Divisor;
+        TotalWeight+=m_pSymbols[d];
+    };
+    m_NumOfPatterns=TotalWeight;
+    for(unsigned d=0;d<NumOfDisks;d++)
+    {
+        if (m_pSymbols[d]*Length>TotalWeight)
+        {
+            delete[]m_pSymbols;
+            throw Exception("The weight of disk %d exceeds 1/%d of the total weight",d,Length);
+        };
+        m_pSymbols[d]*=Length;
+    };
+    m_pDisks=new unsigned[m_NumOfPatterns*Length];
+    m_pRows=new unsigned[m_NumOfPatterns*Length];
+    //the symbols still to be placed on each disk, the symbols and the check symbols placed so far
+    unsigned* pLeft=new unsigned[NumOfDisks];
+    unsigned* pPlaced=new unsigned[NumOfDisks];
+    unsigned* pChecks=new unsigned[NumOfDisks];
+    bool* pSelected=new bool[NumOfDisks];
+    unsigned* pOrder=new unsigned[Length];
+    memcpy(pLeft,m_pSymbols,sizeof(unsigned)*NumOfDisks);
+    memset(pPlaced,0,sizeof(unsigned)*NumOfDisks);
+    memset(pChecks,0,sizeof(unsigned)*NumOfDisks);
+    for(unsigned p=0;p<m_NumOfPatterns;p++)
+    {
+        memset(pSelected,0,sizeof(bool)*NumOfDisks);
+        for(unsigned i=0;i<Length;i++)
+        {
+            unsigned Best=NumOfDisks;
+            for(unsigned k=0;k<NumOfDisks;k++)
+            {
+                unsigned d=(p+k)%NumOfDisks;
+                if (!pSelected[d]&&((Best==NumOfDisks)||(pLeft[d]>pLeft[Best])))
+                    Best=d;
+            };
+            pSelected[Best]=true;
+            pOrder[i]=Best;
+            pLeft[Best]--;
+            pPlaced[Best]++;
+        };
+        //the check symbols are assigned to the disks with the largest deficit of them
+        for(unsigned i=Length;i-->Dimension;)
+        {
+            unsigned Best=i;
+            for(unsigned k=0;k<i;k++)
+            {
+                unsigned d=pOrder[k],b=pOrder[Best];
+                if ((long long)pPlaced[d]*(Length-Dimension)-(long long)pChecks[d]*Length>
+                    (long long)pPlaced[b]*(Length-Dimension)-(long long)pChecks[b]*Length)
+                    Best=k;
+            };
+            swap(pOrder[i],pOrder[Best]);
+            pChecks[pOrder[i]]++;
+        };
+        for(unsigned i=0;i<Length;i++)
+        {
+            unsigned d=pOrder[i];
+            m_pDisks[p*Length+i]=d;
+            m_pRows[p*Length+i]=pPlaced[d]-1;
+        };
+    };
+    delete[]pLeft;
+    delete[]pPlaced;
+    delete[]pChecks;
+    delete[]pSelected;
+    delete[]pOrder;
+};
+
+CWeightedLayout::~CWeightedLayout()
+{
+    delete[]m_pSymbols;
+    delete[]m_pDisks;
+    delete[]m_pRows;
+};
+
+/** Each period occupies RotationPeriod rows of a disk for each of its symbols
+ */
+unsigned long long CWeightedLayout::GetNumOfStripes(unsigned long long DiskRows)const
+{
+    unsigned MaxSymbols=0;
+    for(unsigned d=0;d<m_NumOfDisks;d++)
+        MaxSymbols=max(MaxSymbols,m_pSymbols[d]);
+    return DiskRows/((unsigned long long)MaxSymbols*m_RotationPeriod)*m_NumOfPatterns*m_RotationPeriod;
+};
+
+/** The number of periods is limited by the disk which is filled first. If the weights are proportional
+ * to the disk sizes, all disks are filled
+ */
+unsigned long long CWeightedLayout::GetNumOfStripesOnDisks(const unsigned long long* pDiskRows ///the number of rows on each disk of the subarray
+                                                          )const
+{
+    unsigned long long NumOfPeriods=~0ull;
+    for(unsigned d=0;d<m_NumOfDisks;d++)
+        NumOfPeriods=min(NumOfPeriods,pDiskRows[d]/((unsigned long long)m_pSymbols[d]*m_RotationPeriod));
+    return NumOfPeriods*m_NumOfPatterns*m_RotationPeriod;
+};
+
+///construct the layout specified by the array configuration
+///@return the layout object. An exception is thrown if the configuration is invalid
+CLayout* CreateLayout(const RAIDParams& Params,///array configuration
+                      unsigned Length ///code length
+                     )
+{
+    if ((Params.Layout<0)||(Params.Layout>=ltEnd))
+        throw Exception("Unknown layout type %d",Params.Layout);
+    if ((Params.Layout!=ltDeclustered)&&(Params.Layout!=ltWeighted)&&((Params.PoolSize&&(Params.PoolSize!=Length))||Params.SpareDisks))
+        throw Exception("Layout %s requires PoolSize=%d and SpareDisks=0",ppLayoutNames[Params.Layout],Length);
+    unsigned PoolSize=(Params.PoolSize)?Params.PoolSize:Length;
+    for(unsigned i=(Params.Layout==ltWeighted)?PoolSize:0;i<MAXWEIGHTEDDISKS;i++)
+        if (Params.Weights[i])
+            throw Exception("Layout %s does not support the weights of disk %d",ppLayoutNames[Params.Layout],i);
+    switch (Params.Layout)
+    {
+    case ltCyclic:
+        if (!Params.RotationPeriod)
+            throw Exception("Rotation period must be positive");
+        return new CCyclicLayout(Length,false,Params.RotationPeriod);
+    case ltLeftSymmetric:
+        if (!Params.RotationPeriod)
+            throw Exception("Rotation period must be positive");
+        return new CCyclicLayout(Length,true,Params.RotationPeriod);
+    case ltDedicated:
+        return new CCyclicLayout(Length,false,0);
+    case ltDeclustered:
+    {
+        if (Params.RotationPeriod!=1)
+            throw Exception("Rotation period is not supported by the declustered layout");
+        //the spare slots are stored in the array state record as signed chars
+        if (Params.SpareDisks>127)
+            throw Exception("Too many spare disks: %d",Params.SpareDisks);
+        unsigned PoolSize=(Params.PoolSize)?Params.PoolSize:Length+Params.SpareDisks;
+        return new CDeclusteredLayout(Length,PoolSize,Params.SpareDisks);
+    };
+    case ltWeighted:
+        if (Params.SpareDisks)
+            throw Exception("Spare space is not supported by the weighted layout");
+        if (!Params.RotationPeriod)
+            throw Exception("Rotation period must be positive");
+        if (PoolSize>MAXWEIGHTEDDISKS)
+            throw Exception("Pool size %d exceeds %d",PoolSize,MAXWEIGHTEDDISKS);
+        return new CWeightedLayout(Length,Params.CodeDimension,PoolSize,Params.Weights,Params.RotationPeriod);
+    default:
+        throw Exception("Unknown layout type %d",Params.Layout);
+    };
+};
@@ -0,0 +1,173 @@
+/*********************************************************
+ * paritycache.cpp  - implementation of the check symbol cache of the RAID emulator
+ *
+ * Copyright(C) 2012 Saint-Petersburg State Polytechnic University
+ *
+ * Developed in the framework of the "Forward error correction for next generation storage systems" project
+ *
+ * Author: P. Trifonov petert@dcn.ftk.spbstu.ru
+ * ********************************************************/
+#include <iostream>
+#include <string.h>
+#include "misc.h"
+#include "arithmetic.h"
+#include "paritycache.h"
+
+using namespace std;
+
+/** The number of lines is limited by the number of segments, so that a small array is cached entirely.
+ * The memory used does not depend on the array size otherwise
+ */
+CParityCache::CParityCache(unsigned long long NumOfStripes,///the number of stripes in each subarray
+                           unsigned NumOfSubarrays,///the number of subarrays
+                           unsigned CheckSymbols,///the number of check symbols in a stripe
+                           unsigned SymbolSize,///size of a check symbol in bytes
+                           size_t Capacity ///cache capacity in bytes
+                          ):m_SymbolSize(SymbolSize),m_CheckSymbols(CheckSymbols),m_NumOfSubarrays(NumOfSubarrays),
+    m_NumOfSegments(NumOfStripes*NumOfSubarrays),m_Hand(0),m_Hits(0),m_Misses(0)
+{
+    size_t LineSize=(size_t)m_CheckSymbols*m_SymbolSize;
+    if (!LineSize||(Capacity<LineSize))
+        throw Exception("Parity cache capacity is too small");
+    unsigned long long NumOfLines=Capacity/LineSize;
+    m_NumOfLines=(size_t)((NumOfLines<m_NumOfSegments)?NumOfLines:m_NumOfSegments);
+    if (!InitCS(m_Lock))
+        throw Exception("Failed to initialize parity cache mutex");
+    m_pSegments=new unsigned long long[m_NumOfLines];
+    m_pValid=new unsigned char[(size_t)m_NumOfLines*m_CheckSymbols];
+    m_pReferenced=new unsigned char[m_NumOfLines];
+    m_pData=AlignedMalloc((size_t)m_NumOfLines*LineSize);
+    Reset();
+};
+
+CParityCache::~CParityCache()
+{
+    delete[]m_pSegments;
+    delete[]m_pValid;
+    delete[]m_pReferenced;
+    AlignedFree(m_pData);
+    DestroyCS(m_Lock);
+};
+
+/** Take a free line, if any. Otherwise, move the CLOCK hand over the lines, clearing the reference bits,
+ * until a line not referenced since the previous pass is found. This takes at most two passes
+ */
+size_t CParityCache::AllocateLine(unsigned long long Segment ///the segment to be cached
+                                 )
+{
+    size_t Line;
+    for(;;)
+    {
+        Line=m_Hand;
+        m_Hand=(m_Hand+1)%m_NumOfLines;
+        if (!m_pSegments[Line])
+            break;
+        if (m_pReferenced[Line])
+            m_pReferenced[Line]=0;
+        else
+        {
+            m_Lines.erase(m_pSegments[Line]-1);
+            break;
+        };
+    };
+    m_pSegments[Line]=Segment+1;
+    m_Lines[Segment]=Line;
+    memset(m_pValid+Line*m_CheckSymbols,0,m_CheckSymbols);
+    return Line;
+};
+
+/** A hit marks the line as referenced, so that the hot stripes stay in the cache
+ */
+bool CParityCache::Read(unsigned long long StripeID,///the stripe
+                        unsigned SubarrayID,///identifies the subarray
+                        unsigned CheckID,///the check symbol, starting from 0
+                        void* pDest ///destination buffer of m_SymbolSize bytes
+                       )
+{
+    unsigned long long Segment=StripeID*m_NumOfSubarrays+SubarrayID;
+    LockCS(m_Lock);
+    map<unsigned long long,size_t>::const_iterator L=m_Lines.find(Segment);
+    bool Hit=(L!=m_Lines.end())&&m_pValid[L->second*m_CheckSymbols+CheckID];
+    if (Hit)
+    {
+        memcpy(pDest,m_pData+(L->second*m_CheckSymbols+CheckID)*m_SymbolSize,m_SymbolSize);
+        m_pReferenced[L->second]=1;
+        m_Hits++;
+    }
+    else
+        m_Misses++;
+    UnlockCS(m_Lock);
+    return Hit;
+};
+
+/** The symbols read from the disks are inserted, while the written ones only refresh the lines of the stripes
+ * cached already, so that the full stripe writes do not evict the hot stripes
+ */
+void CParityCache::Store(unsigned long long StripeID,///the stripe
+                         unsigned SubarrayID,///identifies the subarray
+                         unsigned CheckID,///the check symbol, starting from 0
+                         const void* pSrc,///the current value of the symbol
+                         bool Insert ///true if the stripe must be cached. Otherwise, only the existing line is updated
+                        )
+{
+    unsigned long long Segment=StripeID*m_NumOfSubarrays+SubarrayID;
+    LockCS(m_Lock);
+    map<unsigned long long,size_t>::const_iterator L=m_Lines.find(Segment);
+    if ((L!=m_Lines.end())||Insert)
+    {
+        size_t Line=(L!=m_Lines.end())?L->second:AllocateLine(Segment);
+        memcpy(m_pData+(Line*m_CheckSymbols+CheckID)*m_SymbolSize,pSrc,m_SymbolSize);
+        m_pValid[Line*m_CheckSymbols+CheckID]=1;
+        m_pReferenced[Line]=1;
+    };
+    UnlockCS(m_Lock);
+};
+
+/** The line of the stripe is released if none of its symbols remain valid
+ */
+void CParityCache::Invalidate(unsigned long long StripeID,///the stripe
+                              unsigned SubarrayID,///identifies the subarray
+                              int CheckID ///the check symbol, or -1 if all of them are stale
+                             )
+{
+    unsigned long long Segment=StripeID*m_NumOfSubarrays+SubarrayID;
+    LockCS(m_Lock);
+    map<unsigned long long,size_t>::iterator L=m_Lines.find(Segment);
+    if (L!=m_Lines.end())
+    {
+        unsigned char* pValid=m_pValid+L->second*m_CheckSymbols;
+        if (CheckID>=0)
+            pValid[CheckID]=0;
+        unsigned NumOfValid=0;
+        for(unsigned i=0;(CheckID>=0)&&(i<m_CheckSymbols);i++)
+            NumOfValid+=pValid[i];
+        if (!NumOfValid)
+        {
+            m_pSegments[L->second]=0;
+            m_Lines.erase(L);
+        };
+    };
+    UnlockCS(m_Lock);
+};
+
+///forget all lines
+void CParityCache::Reset()
+{
+    LockCS(m_Lock);
+    m_Lines.clear();
+    memset(m_pSegments,0,sizeof(unsigned long long)*m_NumOfLines);
+    memset(m_pReferenced,0,m_NumOfLines);
+    m_Hand=0;
+    UnlockCS(m_Lock);
+};
+
+///print the hit statistics collected since the last call, if any
+void CParityCache::ReportStatistics()
+{
+    LockCS(m_Lock);
+    if (m_Hits+m_Misses)
+        cerr<<"Parity cache: "<<m_Hits<<" hits, "<<m_Misses<<" misses\n";
+    m_Hits=0;
+    m_Misses=0;
+    UnlockCS(m_Lock);
+};
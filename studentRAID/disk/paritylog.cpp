@@ -0,0 +1,488 @@
+/*********************************************************
+ * paritylog.cpp  - implementation of the parity log of the RAID emulator
+ *
+ * Copyright(C) 2012 Saint-Petersburg State Polytechnic University
+ *
+ * Developed in the framework of the "Forward error correction for next generation storage systems" project
+ *
+ * Author: P. Trifonov petert@dcn.ftk.spbstu.ru
+ * ********************************************************/
+#include <iostream>
+#include <algorithm>
+#include <string.h>
+#include <time.h>
+#include "misc.h"
+#include "arithmetic.h"
+#include "array.h"
+#include "paritylog.h"
+
+using namespace std;
+
+///parity log superblock signature
+#define PARITYLOGMAGIC 0x9A71D0C5
+///parity log record signature
+#define PARITYLOGRECORDMAGIC 0x9A71DE17
+
+///avoid padding of on-disk structures
+#pragma pack(push)
+#pragma pack(1)
+///the first block of the log device. It identifies the oldest record, which may be not yet applied to the array
+struct ParityLogSuperblock
+{
+    ///must be PARITYLOGMAGIC
+    unsigned MagicNumber;
+    ///size of a log block
+    unsigned BlockSize;
+    ///the number of stripe units in the check symbols of a stripe
+    unsigned CheckUnits;
+    ///sequence number of the first record to be replayed
+    unsigned long long Sequence;
+    ///CRC32 of all preceding fields
+    unsigned CRC;
+};
+
+///the first block of each record. It is followed by the differences of the check symbols
+struct ParityLogRecordHeader
+{
+    ///must be PARITYLOGRECORDMAGIC
+    unsigned MagicNumber;
+    ///sequence number of the record
+    unsigned long long Sequence;
+    ///the stripe of the subarray being updated
+    unsigned long long Segment;
+    ///CRC32 of the differences
+    unsigned DataCRC;
+    ///CRC32 of the header, computed with this field set to 0
+    unsigned CRC;
+};
+#pragma pack(pop)
+
+///compute CRC32 of a memory block
+static unsigned GetChecksum(const void* pData,size_t Size)
+{
+    unsigned CRC=0;
+    UpdateCRC32(CRC,Size,(const unsigned char*)pData);
+    return CRC;
+};
+
+/** Open the log device and check that it was created for the same array configuration.
+ * The device is divided into the slots of the same size, so that the location of each record
+ * is given by its sequence number
+ */
+CParityLog::CParityLog(CDiskArray& Array,///the array to be served
+                       const char* pFileName,///the name of the file emulating the log device
+                       size_t Capacity,///log capacity in bytes
+                       unsigned DeviceID ///identifier of the log device. This must be different from the IDs of the array disks
+                      ):m_Array(Array),m_Valid(false),m_BlockSize(Array.GetStripeUnitSize()),m_pRecord(0),
+    m_NextSequence(1),m_CheckpointSequence(1),m_Drainers(0),m_Failed(false),m_Running(false),m_Stop(false),
+    m_Flushing(false),m_Appended(0),m_Bypassed(0),m_Waited(0),m_Batches(0),m_AppliedSegments(0)
+{
+    CRAIDProcessor& Engine=m_Array.m_Engine;
+    if (!Engine.CanComputeCheckDeltas())
+        throw Exception("Parity logging is not supported by this code");
+    m_CheckUnits=(Engine.GetCodeLength()-Engine.GetDimension())*Engine.GetStripeUnitsPerSymbol();
+    m_NumOfSubarrays=Engine.GetInterleavingOrder();
+    unsigned long long NumOfBlocks=Capacity/m_BlockSize;
+    m_NumOfSlots=(NumOfBlocks)?(NumOfBlocks-1)/(1+m_CheckUnits):0;
+    if (m_NumOfSlots<2)
+        throw Exception("Parity log capacity is too small");
+    NumOfBlocks=1+m_NumOfSlots*(1+m_CheckUnits);
+    if (!InitCS(m_Lock))
+        throw Exception("Failed to initialize parity log mutex");
+    if (!InitCond(m_ApplySig)||!InitCond(m_CheckpointSig))
+        throw Exception("Parity log condition initialization failed");
+    InitCRC32();
+    m_pRecord=AlignedMalloc((1+(size_t)m_CheckUnits)*m_BlockSize);
+
+    const void* pCodeConfig;
+    unsigned CodeConfigSize=Engine.GetConfiguration(pCodeConfig);
+    if (m_Device.Initialize(pFileName,DeviceID,m_BlockSize,NumOfBlocks,CodeConfigSize)&&(m_Device.GetDiskState()==dsOffline))
+    {
+        void const* pCodeConfig2;
+        unsigned CodeConfigSize2=m_Device.GetArrayData(pCodeConfig2);
+        m_Valid=(CodeConfigSize2==CodeConfigSize)&&!memcmp(pCodeConfig,pCodeConfig2,CodeConfigSize);
+    };
+    if (m_Valid)
+        m_Device.SetDiskState(dsOnline);
+};
+
+CParityLog::~CParityLog()
+{
+    Stop();
+    AlignedFree(m_pRecord);
+    DestroyCond(m_ApplySig);
+    DestroyCond(m_CheckpointSig);
+    DestroyCS(m_Lock);
+};
+
+/** Write the superblock and make sure that it reaches the device
+ */
+bool CParityLog::WriteCheckpoint(unsigned long long Sequence ///sequence number of the oldest record to be replayed
+                                )
+{
+    unsigned char* pBlock=AlignedMalloc(m_BlockSize);
+    memset(pBlock,0,m_BlockSize);
+    ParityLogSuperblock& S=*(ParityLogSuperblock*)pBlock;
+    S.MagicNumber=PARITYLOGMAGIC;
+    S.BlockSize=m_BlockSize;
+    S.CheckUnits=m_CheckUnits;
+    S.Sequence=Sequence;
+    S.CRC=GetChecksum(&S,sizeof(S)-sizeof(S.CRC));
+    bool Result=m_Device.WriteData(0,1,pBlock)&&m_Device.Flush();
+    AlignedFree(pBlock);
+    return Result;
+};
+
+/** Create an empty log with the checkpoint pointing to its first record
+ */
+bool CParityLog::Init()
+{
+    if (m_Running)
+        return false;
+    m_NextSequence=m_CheckpointSequence=1;
+    m_Failed=false;
+    const void* pCodeConfig;
+    unsigned CodeConfigSize=m_Array.m_Engine.GetConfiguration(pCodeConfig);
+    if (m_Device.GetDiskState()==dsOnline)
+        m_Device.SetDiskState(dsOffline);
+    m_Device.SetArrayData(pCodeConfig,CodeConfigSize);
+    m_Valid=m_Device.ResetDisk()&&m_Device.Mount(true);
+    if (m_Valid)
+    {
+        m_Valid=WriteCheckpoint(1);
+        m_Valid&=m_Device.Unmount(time(NULL));
+    };
+    if (!m_Valid)
+        cerr<<"Failed to initialize the parity log device\n";
+    return m_Valid;
+};
+
+/** Collect the stripes referenced by the records with consecutive sequence numbers following the checkpoint.
+ * Some of their differences may be already applied to the check symbols, and some of the payload symbols
+ * may be not yet written, so the differences cannot be applied once again. Instead, the check symbols are re-encoded
+ * from the payload ones. Notice that the data of erased symbols of such stripes cannot be recovered
+ */
+bool CParityLog::Replay(bool Write ///true if the array is mounted for writing. Otherwise, the stale stripes are only reported
+                       )
+{
+    unsigned char* pBlock=AlignedMalloc(m_BlockSize);
+    bool Result=m_Device.ReadData(0,1,pBlock);
+    ParityLogSuperblock S=*(ParityLogSuperblock*)pBlock;
+    AlignedFree(pBlock);
+    if (!Result||(S.MagicNumber!=PARITYLOGMAGIC)||(S.BlockSize!=m_BlockSize)||(S.CheckUnits!=m_CheckUnits)||
+            (S.CRC!=GetChecksum(&S,sizeof(S)-sizeof(S.CRC))))
+    {
+        cerr<<"Invalid parity log superblock\n";
+        return false;
+    };
+    unsigned long long NumOfSegments=m_Array.m_NumOfStripes*m_NumOfSubarrays;
+    size_t DataSize=(size_t)m_CheckUnits*m_BlockSize;
+    vector<unsigned long long> Stale;
+    unsigned long long Sequence=S.Sequence;
+    while (Sequence-S.Sequence<m_NumOfSlots)
+    {
+        if (!m_Device.ReadData(1+(Sequence%m_NumOfSlots)*(1+m_CheckUnits),1+m_CheckUnits,m_pRecord))
+            break;
+        ParityLogRecordHeader H=*(ParityLogRecordHeader*)m_pRecord;
+        //stale records left from the previous passes over the log have smaller sequence numbers
+        if ((H.MagicNumber!=PARITYLOGRECORDMAGIC)||(H.Sequence!=Sequence)||(H.CRC!=GetChecksum(&H,sizeof(H)-sizeof(H.CRC)))||
+                (H.Segment>=NumOfSegments)||(GetChecksum(m_pRecord+m_BlockSize,DataSize)!=H.DataCRC))
+            break;
+        Stale.push_back(H.Segment);
+        Sequence++;
+    };
+    sort(Stale.begin(),Stale.end());
+    Stale.erase(unique(Stale.begin(),Stale.end()),Stale.end());
+    m_NextSequence=m_CheckpointSequence=Sequence;
+    if (!Write)
+    {
+        if (!Stale.empty())
+            cerr<<"The parity log is not replayed in the read-only mode, so the check symbols of "<<Stale.size()<<" stripes may be stale\n";
+        return true;
+    };
+    if (!Stale.empty())
+    {
+        CRAIDProcessor& Engine=m_Array.m_Engine;
+        unsigned UnitsPerStripe=m_Array.m_UnitsPerStripePrim;
+        unsigned char* pStripe=AlignedMalloc((size_t)UnitsPerStripe*m_BlockSize);
+        for(size_t i=0;Result&&(i<Stale.size());i++)
+        {
+            unsigned long long StripeID=Stale[i]/m_NumOfSubarrays;
+            unsigned SubarrayID=(unsigned)(Stale[i]%m_NumOfSubarrays);
+            size_t ThreadID=m_Array.LockStripes(StripeID,StripeID+1,SubarrayID);
+            Result=Engine.ReadData(StripeID,0,SubarrayID,UnitsPerStripe,pStripe,ThreadID)&&
+                   Engine.WriteData(StripeID,0,SubarrayID,UnitsPerStripe,pStripe,ThreadID);
+            m_Array.UnlockStripes(ThreadID);
+        };
+        AlignedFree(pStripe);
+        Result=Result&&m_Array.FlushDisks();
+        if (Result)
+            cerr<<"The array was not unmounted cleanly, the check symbols of "<<Stale.size()<<" stripes re-encoded from the parity log\n";
+        else
+            cerr<<"Parity log replay failed\n";
+    };
+    return Result&&WriteCheckpoint(Sequence);
+};
+
+/** Re-encode the stripes referenced by the records following the last checkpoint, make a new checkpoint
+ * and start the background thread. In the read-only mode, no records are appended, so the thread is not needed
+ */
+bool CParityLog::Start(bool Write ///true if the array is mounted for writing
+                      )
+{
+    if (!m_Valid)
+    {
+        cerr<<"Parity log device is not available\n";
+        return false;
+    };
+    if (m_Running||!m_Device.Mount(Write))
+        return false;
+    m_Failed=false;
+    m_Stop=false;
+    m_Flushing=false;
+    m_Appended=m_Bypassed=m_Waited=m_Batches=m_AppliedSegments=0;
+    if (!Replay(Write))
+    {
+        m_Device.Unmount(time(NULL));
+        return false;
+    };
+    if (!Write)
+        return true;
+    m_Running=StartThread(m_Applier,ApplyThread,this);
+    if (!m_Running)
+    {
+        cerr<<"Failed to start the parity log thread\n";
+        m_Device.Unmount(time(NULL));
+        return false;
+    };
+    return true;
+};
+
+/** Wait for the background thread to apply all records, and terminate it.
+ * The differences, which could not be applied, are discarded, but their records are still stored in the log
+ */
+bool CParityLog::Stop()
+{
+    if (m_Device.GetMountState()==msUnmounted)
+        return true;
+    bool Result=true;
+    if (m_Running)
+    {
+        Result=Drain();
+        LockCS(m_Lock);
+        m_Stop=true;
+        CondWakeAll(m_ApplySig);
+        UnlockCS(m_Lock);
+        JoinThread(m_Applier);
+        m_Running=false;
+        if (m_Appended||m_Bypassed)
+            cerr<<"Parity log: "<<m_Appended<<" records appended, "<<m_AppliedSegments<<" stripes updated in "<<m_Batches<<" batches, "
+                <<m_Waited<<" writes waited for a checkpoint, "<<m_Bypassed<<" writes bypassed the log\n";
+    };
+    for(map<unsigned long long,unsigned char*>::iterator D=m_Deltas.begin();D!=m_Deltas.end();D++)
+        AlignedFree(D->second);
+    m_Deltas.clear();
+    m_Pending.clear();
+    Result&=m_Device.Unmount(time(NULL));
+    return Result;
+};
+
+/** The record is written to the slot identified by its sequence number. If this slot is still occupied
+ * by a record not yet applied, the caller waits for the checkpoint being made, since the background thread needs no stripe locks
+ * for that. Otherwise, the caller has to update the check symbols in place, since waiting for the background thread
+ * while it locks the stripes of a batch may cause a deadlock. The first such write of each mount is reported,
+ * since this means that the log is too small for the write rate
+ */
+bool CParityLog::Append(unsigned long long StripeID,///the stripe being updated
+                        unsigned SubarrayID,///identifies the subarray
+                        const unsigned char* pDelta ///the differences between the new and old values of the check symbols
+                       )
+{
+    unsigned long long Segment=StripeID*m_NumOfSubarrays+SubarrayID;
+    size_t DataSize=(size_t)m_CheckUnits*m_BlockSize;
+    LockCS(m_Lock);
+    if (m_Running&&m_Flushing&&(m_NextSequence-m_CheckpointSequence>=m_NumOfSlots))
+    {
+        m_Waited++;
+        while (m_Flushing&&!m_Failed&&!m_Stop&&(m_NextSequence-m_CheckpointSequence>=m_NumOfSlots))
+            CondWait(m_CheckpointSig,m_Lock);
+    };
+    if (!m_Running||m_Failed||(m_NextSequence-m_CheckpointSequence>=m_NumOfSlots))
+    {
+        if (m_Running&&!m_Failed&&!m_Bypassed)
+            cerr<<"The parity log is full, so the small writes update the check symbols in place. ParityLogCapacity should be increased\n";
+        m_Bypassed++;
+        CondWake(m_ApplySig);
+        UnlockCS(m_Lock);
+        return false;
+    };
+    unsigned long long Sequence=m_NextSequence;
+    memset(m_pRecord,0,m_BlockSize);
+    ParityLogRecordHeader& H=*(ParityLogRecordHeader*)m_pRecord;
+    H.MagicNumber=PARITYLOGRECORDMAGIC;
+    H.Sequence=Sequence;
+    H.Segment=Segment;
+    memcpy(m_pRecord+m_BlockSize,pDelta,DataSize);
+    H.DataCRC=GetChecksum(pDelta,DataSize);
+    H.CRC=GetChecksum(&H,sizeof(H)-sizeof(H.CRC));
+    if (!m_Device.WriteData(1+(Sequence%m_NumOfSlots)*(1+m_CheckUnits),1+m_CheckUnits,m_pRecord))
+    {
+        cerr<<"Parity log write failed\n";
+        m_Failed=true;
+        CondWakeAll(m_CheckpointSig);
+        UnlockCS(m_Lock);
+        return false;
+    };
+    m_NextSequence++;
+    m_Appended++;
+    unsigned char*& pSum=m_Deltas[Segment];
+    if (pSum)
+        XOR(pSum,pDelta,(unsigned)DataSize);
+    else
+    {
+        pSum=AlignedMalloc(DataSize);
+        memcpy(pSum,pDelta,DataSize);
+        m_Pending.push_back(Segment);
+    };
+    if (4*(m_NextSequence-m_CheckpointSequence)>=m_NumOfSlots)
+        CondWake(m_ApplySig);
+    UnlockCS(m_Lock);
+    return true;
+};
+
+/** The differences are kept if they could not be applied
+ */
+bool CParityLog::Apply(unsigned long long StripeID,///the stripe
+                       unsigned SubarrayID,///identifies the subarray
+                       size_t ThreadID ///the scratch arena of a calling thread obtained from CDiskArray::LockStripes()
+                      )
+{
+    unsigned char* pSum=FindDeltas(StripeID*m_NumOfSubarrays+SubarrayID);
+    if (!pSum)
+        return true;
+    if (!m_Array.m_Engine.ApplyCheckDeltas(StripeID,SubarrayID,pSum,ThreadID))
+        return false;
+    Drop(StripeID,SubarrayID);
+    return true;
+};
+
+///discard the accumulated differences of a stripe, since its check symbols are re-encoded. The caller must hold the stripe lock
+void CParityLog::Drop(unsigned long long StripeID,///the stripe
+                      unsigned SubarrayID ///identifies the subarray
+                     )
+{
+    LockCS(m_Lock);
+    map<unsigned long long,unsigned char*>::iterator D=m_Deltas.find(StripeID*m_NumOfSubarrays+SubarrayID);
+    if (D!=m_Deltas.end())
+    {
+        AlignedFree(D->second);
+        m_Deltas.erase(D);
+    };
+    UnlockCS(m_Lock);
+};
+
+/** The sum may be used after the map lock is released, since it is changed only by the holders of the stripe lock
+ */
+unsigned char* CParityLog::FindDeltas(unsigned long long Segment ///the segment
+                                     )
+{
+    LockCS(m_Lock);
+    map<unsigned long long,unsigned char*>::const_iterator D=m_Deltas.find(Segment);
+    unsigned char* pSum=(D!=m_Deltas.end())?D->second:0;
+    UnlockCS(m_Lock);
+    return pSum;
+};
+
+/** Wake up the background thread and wait for a checkpoint beyond the records appended so far
+ */
+bool CParityLog::Drain()
+{
+    if (!m_Running)
+        return !m_Failed;
+    LockCS(m_Lock);
+    unsigned long long Target=m_NextSequence;
+    m_Drainers++;
+    CondWake(m_ApplySig);
+    while (!m_Failed&&(m_CheckpointSequence<Target))
+        CondWait(m_CheckpointSig,m_Lock);
+    m_Drainers--;
+    bool Result=!m_Failed;
+    UnlockCS(m_Lock);
+    return Result;
+};
+
+/** The records are written without flushing, so they become persistent together with the payload data
+ */
+bool CParityLog::FlushDevice()
+{
+    if (m_Device.GetMountState()!=msReadWrite)
+        return true;
+    return m_Device.Flush();
+};
+
+/** Once a quarter of the log is used, or some thread waits for the records to be applied, take all segments with the accumulated
+ * differences and apply them in the order of stripes under the stripe locks. Each stripe is locked separately,
+ * so that the foreground requests are not blocked for the duration of the batch.
+ * The segments updated after the batch was started are applied by it as well, or included into the next one.
+ * After the batch is applied, the array disks are flushed, and the checkpoint is moved beyond the records
+ * appended before the batch was started, so that their slots can be reused
+ */
+THREADPROC CParityLog::ApplyThread(void* pParams ///must be a pointer to CParityLog
+                                  )
+{
+    CParityLog& L=*(CParityLog*)pParams;
+    CDiskArray& A=L.m_Array;
+    LockCS(L.m_Lock);
+    while (!L.m_Stop)
+    {
+        if (L.m_Failed||(L.m_NextSequence==L.m_CheckpointSequence)||
+                (!L.m_Drainers&&(4*(L.m_NextSequence-L.m_CheckpointSequence)<L.m_NumOfSlots)))
+        {
+            CondWait(L.m_ApplySig,L.m_Lock);
+            continue;
+        };
+        unsigned long long Target=L.m_NextSequence;
+        vector<unsigned long long> Batch;
+        Batch.swap(L.m_Pending);
+        UnlockCS(L.m_Lock);
+        sort(Batch.begin(),Batch.end());
+        bool Result=true;
+        unsigned long long Applied=0;
+        for(size_t i=0;i<Batch.size();i++)
+        {
+            unsigned long long StripeID=Batch[i]/L.m_NumOfSubarrays;
+            unsigned SubarrayID=(unsigned)(Batch[i]%L.m_NumOfSubarrays);
+            double Arrival=A.m_Scheduler.Begin(iocBackground);
+            size_t ThreadID=A.LockStripes(StripeID,StripeID+1,SubarrayID);
+            if (L.FindDeltas(Batch[i]))
+            {
+                Result&=L.Apply(StripeID,SubarrayID,ThreadID);
+                Applied++;
+            };
+            A.UnlockStripes(ThreadID);
+            A.m_Scheduler.End(iocBackground,Arrival);
+        };
+        //the superblock may point beyond the applied records only after the check symbols reach the disks.
+        //The writers finding the log full meanwhile wait for the checkpoint
+        LockCS(L.m_Lock);
+        L.m_Flushing=true;
+        UnlockCS(L.m_Lock);
+        Result=Result&&A.FlushDisks()&&L.WriteCheckpoint(Target);
+        LockCS(L.m_Lock);
+        L.m_Flushing=false;
+        if (Result)
+        {
+            L.m_CheckpointSequence=Target;
+            L.m_Batches++;
+            L.m_AppliedSegments+=Applied;
+        }
+        else
+        {
+            cerr<<"Failed to apply the parity log\n";
+            L.m_Failed=true;
+        };
+        CondWakeAll(L.m_CheckpointSig);
+    };
+    UnlockCS(L.m_Lock);
+    return 0;
+};
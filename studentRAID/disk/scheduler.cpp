@@ -0,0 +1,201 @@
+/*********************************************************
+ * scheduler.cpp  - implementation of the I/O request scheduler of a disk array
+ *
+ * Copyright(C) 2012 Saint-Petersburg State Polytechnic University
+ *
+ * Developed in the framework of the "Forward error correction for next generation storage systems" project
+ *
+ * Author: P. Trifonov petert@dcn.ftk.spbstu.ru
+ * ********************************************************/
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include "misc.h"
+#include "scheduler.h"
+
+using namespace std;
+
+CIOScheduler::CIOScheduler():m_BackgroundRate(0),m_NextBackground(0),m_InFlight(0),m_NextTicket(0),
+    m_WindowRequests(0),m_WindowBackground(0),m_WindowStart(0),m_Throttled(0)
+{
+    if (!InitCS(m_Lock))
+        throw Exception("Failed to initialize scheduler mutex");
+    if (!InitCond(m_DispatchSig))
+        throw Exception("Failed to initialize scheduler condition variable");
+    Configure(QoSParams());
+};
+
+CIOScheduler::~CIOScheduler()
+{
+    DestroyCond(m_DispatchSig);
+    DestroyCS(m_Lock);
+};
+
+///@return histogram bucket for a given latency
+unsigned CIOScheduler::GetBucket(double Latency ///latency (sec)
+                                )
+{
+    double Microseconds=Latency*1E6;
+    if (Microseconds<=1)
+        return 0;
+    unsigned Bucket=(unsigned)(4*log(Microseconds)/log(2.0));
+    return min(Bucket,(unsigned)QOSHISTOGRAMSIZE-1);
+};
+
+///@return the upper bound of the latencies counted in a bucket (sec)
+double CIOScheduler::GetBucketBound(unsigned Bucket)
+{
+    return pow(2.0,(Bucket+1)/4.0)*1E-6;
+};
+
+///@return 99th percentile of the latencies in a histogram (sec)
+template<class T> double CIOScheduler::GetPercentile(const T* pHistogram ///the histogram
+                                                    )
+{
+    unsigned long long Total=0;
+    for(unsigned i=0;i<QOSHISTOGRAMSIZE;i++)
+        Total+=pHistogram[i];
+    if (!Total)
+        return 0;
+    unsigned long long Threshold=Total-Total/100;
+    unsigned long long Count=0;
+    for(unsigned i=0;i<QOSHISTOGRAMSIZE;i++)
+    {
+        Count+=pHistogram[i];
+        if (Count>=Threshold)
+            return GetBucketBound(i);
+    };
+    return GetBucketBound(QOSHISTOGRAMSIZE-1);
+};
+
+/**If the client latency target was missed, the background rate is halved. Unless the background requests
+ * were not paced, this starts from the rate observed in the last period.
+ * Otherwise, the rate is increased by 25%, until it reaches the configured limit, or stops being the bottleneck
+ */
+void CIOScheduler::Adjust(double Now ///current time
+                         )
+{
+    double Elapsed=Now-m_WindowStart;
+    if (Elapsed<QOSADJUSTPERIOD)
+        return;
+    if (m_Params.LatencyTarget>0)
+    {
+        if (m_WindowRequests&&(GetPercentile(m_WindowHistogram)>m_Params.LatencyTarget))
+        {
+            double Rate=(m_BackgroundRate>0)?m_BackgroundRate:m_WindowBackground/Elapsed;
+            m_BackgroundRate=max(Rate/2,QOSMINBACKGROUNDRATE);
+            m_Throttled++;
+        }
+        else
+        if (m_BackgroundRate>0)
+        {
+            if (m_Params.BackgroundRate>0)
+                m_BackgroundRate=min(m_BackgroundRate*1.25,m_Params.BackgroundRate);
+            else
+            if (m_WindowBackground<m_BackgroundRate*Elapsed/2)
+                //the background requests are not limited by the pacing any more
+                m_BackgroundRate=0;
+            else
+                m_BackgroundRate*=1.25;
+            CondWakeAll(m_DispatchSig);
+        };
+    };
+    memset(m_WindowHistogram,0,sizeof(m_WindowHistogram));
+    m_WindowRequests=0;
+    m_WindowBackground=0;
+    m_WindowStart=Now;
+};
+
+///set the scheduling policy and reset the statistics. There may be no requests in progress
+void CIOScheduler::Configure(const QoSParams& Params ///the new configuration
+                            )
+{
+    LockCS(m_Lock);
+    m_Params=Params;
+    m_BackgroundRate=Params.BackgroundRate;
+    m_NextBackground=0;
+    memset(m_Histogram,0,sizeof(m_Histogram));
+    memset(m_WindowHistogram,0,sizeof(m_WindowHistogram));
+    m_WindowRequests=0;
+    m_WindowBackground=0;
+    m_WindowStart=GetClock();
+    m_Throttled=0;
+    UnlockCS(m_Lock);
+};
+
+/**The background requests first wait for their turn given by the current rate.
+ * If the number of dispatched requests is limited, the request is queued with the deadline
+ * given by its class, and dispatched when it becomes the earliest one and a slot is available
+ */
+double CIOScheduler::Begin(eIOClasses Class ///the request class
+                          )
+{
+    LockCS(m_Lock);
+    double Arrival=GetClock();
+    double Now=Arrival;
+    Adjust(Now);
+    if (Class==iocBackground)
+    {
+        while ((m_BackgroundRate>0)&&(Now<m_NextBackground))
+        {
+            CondTimedWait(m_DispatchSig,m_Lock,(unsigned)((m_NextBackground-Now)*1000)+1);
+            Now=GetClock();
+            Adjust(Now);
+        };
+        if (m_BackgroundRate>0)
+            m_NextBackground=max(Now,m_NextBackground)+1/m_BackgroundRate;
+    };
+    if (m_Params.Depth)
+    {
+        pair<double,unsigned long long> Ticket(Now+m_Params.Deadlines[Class],m_NextTicket++);
+        m_Queue.insert(Ticket);
+        while ((m_InFlight>=m_Params.Depth)||(*m_Queue.begin()!=Ticket))
+            CondWait(m_DispatchSig,m_Lock);
+        m_Queue.erase(Ticket);
+        if (!m_Queue.empty())
+            //the next request may be dispatched as well
+            CondWakeAll(m_DispatchSig);
+    };
+    m_InFlight++;
+    UnlockCS(m_Lock);
+    return Arrival;
+};
+
+///report request completion
+void CIOScheduler::End(eIOClasses Class,///the request class
+                       double ArrivalTime ///the value returned by Begin()
+                      )
+{
+    LockCS(m_Lock);
+    double Now=GetClock();
+    m_InFlight--;
+    unsigned Bucket=GetBucket(Now-ArrivalTime);
+    m_Histogram[Class][Bucket]++;
+    if (Class==iocBackground)
+        m_WindowBackground++;
+    else
+    {
+        m_WindowHistogram[Bucket]++;
+        m_WindowRequests++;
+    };
+    Adjust(Now);
+    if (!m_Queue.empty())
+        CondWakeAll(m_DispatchSig);
+    UnlockCS(m_Lock);
+};
+
+///obtain the statistics of a request class since the last Configure() call
+void CIOScheduler::GetStatistics(eIOClasses Class,///the request class
+                                 unsigned long long& Requests,///the number of completed requests
+                                 double& Latency99,///99th percentile of request latency (sec)
+                                 unsigned long long& Throttled ///the number of times the background requests were throttled
+                                )
+{
+    LockCS(m_Lock);
+    Requests=0;
+    for(unsigned i=0;i<QOSHISTOGRAMSIZE;i++)
+        Requests+=m_Histogram[Class][i];
+    Latency99=GetPercentile(m_Histogram[Class]);
+    Throttled=m_Throttled;
+    UnlockCS(m_Lock);
+};
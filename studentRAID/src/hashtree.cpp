@@ -0,0 +1,184 @@
+/*********************************************************
+ * hashtree.cpp  - implementation of a hash tree over the stripes of a disk array
+ *
+ * Copyright(C) 2012 Saint-Petersburg State Polytechnic University
+ *
+ * Developed in the framework of the "Forward error correction for next generation storage systems" project
+ *
+ * Author: P. Trifonov petert@dcn.ftk.spbstu.ru
+ * ********************************************************/
+#include <string.h>
+#include <emmintrin.h>
+#include "misc.h"
+#include "hashtree.h"
+
+using namespace std;
+
+///odd constants used for mixing the hash state
+#define HASHPRIME1 0x9E3779B185EBCA87ull
+#define HASHPRIME2 0xC2B2AE3D27D4EB4Full
+#define HASHPRIME3 0x165667B19E3779F9ull
+
+///rotate left each 64-bit lane of a vector
+#define ROTL64X2(A,Bits) _mm_or_si128(_mm_slli_epi64(A,Bits),_mm_srli_epi64(A,64-(Bits)))
+
+///add a 16-byte data block to a pair of 64-bit accumulators.
+///The accumulators are rotated first, so that the result depends on the block position
+static inline __m128i Accumulate(__m128i Acc,///the accumulators
+                                 __m128i Data,///the data block
+                                 __m128i Key ///the key of this accumulator pair
+                                )
+{
+    __m128i K=_mm_xor_si128(Data,Key);
+    //32x32->64 bit product of the halves of each lane
+    __m128i Product=_mm_mul_epu32(K,_mm_srli_epi64(K,32));
+    Acc=ROTL64X2(Acc,23);
+    return _mm_add_epi64(Acc,_mm_add_epi64(Product,_mm_shuffle_epi32(Data,_MM_SHUFFLE(1,0,3,2))));
+};
+
+///final avalanche of a 64-bit value
+static inline unsigned long long Mix(unsigned long long H)
+{
+    H^=H>>33;
+    H*=0xFF51AFD7ED558CCDull;
+    H^=H>>33;
+    H*=0xC4CEB9FE1A85EC53ull;
+    H^=H>>33;
+    return H;
+};
+
+/** The data are processed by four independent 64-bit accumulators, which are
+ * combined by a scalar avalanche function at the end
+ */
+unsigned long long CHashTree::Hash(const void* pData,///the data
+                                   size_t Size,///data size in bytes
+                                   unsigned long long Seed ///the initial value
+                                  )
+{
+    const unsigned char* p=(const unsigned char*)pData;
+    __m128i Acc0=_mm_set_epi64x(Seed+HASHPRIME1,Seed^HASHPRIME2);
+    __m128i Acc1=_mm_set_epi64x(Seed^HASHPRIME3,Seed-HASHPRIME1);
+    const __m128i Key0=_mm_set_epi64x(HASHPRIME2,HASHPRIME3);
+    const __m128i Key1=_mm_set_epi64x(HASHPRIME1,HASHPRIME2^HASHPRIME3);
+    size_t i=0;
+    for(;i+32<=Size;i+=32)
+    {
+        Acc0=Accumulate(Acc0,_mm_loadu_si128((const __m128i*)(p+i)),Key0);
+        Acc1=Accumulate(Acc1,_mm_loadu_si128((const __m128i*)(p+i+16)),Key1);
+    };
+    if (i<Size)
+    {
+        //the tail is padded with zeroes. The size is accounted for below
+        unsigned char Tail[32];
+        memset(Tail,0,sizeof(Tail));
+        memcpy(Tail,p+i,Size-i);
+        Acc0=Accumulate(Acc0,_mm_loadu_si128((const __m128i*)Tail),Key0);
+        Acc1=Accumulate(Acc1,_mm_loadu_si128((const __m128i*)(Tail+16)),Key1);
+    };
+    unsigned long long Lanes[4];
+    _mm_storeu_si128((__m128i*)Lanes,Acc0);
+    _mm_storeu_si128((__m128i*)(Lanes+2),Acc1);
+    unsigned long long H=Seed^(Size*HASHPRIME1);
+    for(unsigned k=0;k<4;k++)
+        H=Mix(H^Lanes[k]);
+    return H;
+};
+
+///@return the hash of a pair of nodes, which is zero for a pair of empty ones
+unsigned long long CHashTree::Combine(unsigned long long Left,///the left node
+                                      unsigned long long Right ///the right node
+                                     )
+{
+    if (!Left&&!Right)
+        return 0;
+    unsigned long long Pair[2]={Left,Right};
+    return Hash(Pair,sizeof(Pair),HASHPRIME3);
+};
+
+CHashTree::CHashTree(unsigned long long NumOfLeaves ///the number of leaves
+                    ):m_NumOfLeaves(NumOfLeaves),m_Width(1)
+{
+    while (m_Width<NumOfLeaves)
+        m_Width*=2;
+    m_pNodes=new unsigned long long[2*m_Width];
+    memset(m_pNodes,0,sizeof(unsigned long long)*2*m_Width);
+    m_pStale=new unsigned char[m_Width];
+    memset(m_pStale,0,m_Width);
+};
+
+CHashTree::~CHashTree()
+{
+    delete[]m_pStale;
+    delete[]m_pNodes;
+};
+
+/** The ancestors of the leaf are marked as stale up to the first one which is already stale
+ */
+void CHashTree::SetLeaf(unsigned long long LeafID,///the leaf
+                        unsigned long long Hash ///its new hash
+                       )
+{
+    unsigned long long Node=m_Width+LeafID;
+    if (m_pNodes[Node]==Hash)
+        return;
+    m_pNodes[Node]=Hash;
+    for(Node/=2;(Node>=1)&&!m_pStale[Node];Node/=2)
+        m_pStale[Node]=1;
+};
+
+///set the hashes of all leaves
+void CHashTree::Load(const unsigned long long* pLeaves ///the leaf hashes
+                    )
+{
+    memcpy(m_pNodes+m_Width,pLeaves,sizeof(unsigned long long)*m_NumOfLeaves);
+    memset(m_pStale,1,m_Width);
+};
+
+///recompute a stale subtree
+///@return the hash of its root
+unsigned long long CHashTree::Update(unsigned long long Node ///the root of the subtree
+                                    )
+{
+    if ((Node<m_Width)&&m_pStale[Node])
+    {
+        m_pNodes[Node]=Combine(Update(2*Node),Update(2*Node+1));
+        m_pStale[Node]=0;
+    };
+    return m_pNodes[Node];
+};
+
+///@return the root hash
+unsigned long long CHashTree::GetRoot()
+{
+    return Update(1);
+};
+
+/** The subtrees are examined in the depth-first order, so the leaves are reported in the ascending order
+ */
+void CHashTree::Compare(CHashTree& A,///the first tree
+                        CHashTree& B,///the second tree
+                        std::vector<unsigned long long>& Leaves ///output: the differing leaves in the ascending order
+                       )
+{
+    Leaves.clear();
+    if (A.GetRoot()==B.GetRoot())
+        return;
+    vector<unsigned long long> Stack(1,1);
+    while (!Stack.empty())
+    {
+        unsigned long long Node=Stack.back();
+        Stack.pop_back();
+        if (A.m_pNodes[Node]==B.m_pNodes[Node])
+            continue;
+        if (Node>=A.m_Width)
+        {
+            if (Node-A.m_Width<A.m_NumOfLeaves)
+                Leaves.push_back(Node-A.m_Width);
+        }
+        else
+        {
+            Stack.push_back(2*Node+1);
+            Stack.push_back(2*Node);
+        };
+    };
+};
@@ -15,39 +15,42 @@
 /**
  * Allocate locking structures, initialize the mutexes
  */
-CRangeLocker::CRangeLocker(unsigned MaxThreads  ///maximal number of threads to obtain locks simultaneously
-                ): m_MaxThreads(MaxThreads),
-                       m_FreeStackTop(0),m_pActiveLocks(0)
+CRangeLocker::CRangeLocker(unsigned NumOfEntries  ///the number of lock entries to be preallocated
+                ): m_pActiveLocks(0),m_NextTicket(0)
 {
-
-    m_pLockPool=new LockedRange[MaxThreads];
-    m_ppFreeLocks=new LockedRange*[MaxThreads];
-
     if (!InitCS(m_GlobalMutex))
         throw Exception("Global mutex initialization failed");
-	if (!InitCond(m_FreePoolSig))
-        throw Exception("Buffer condition initialization failed");
-    for (unsigned i = 0; i < MaxThreads; i++)
-    {
-        if (!InitCond(m_pLockPool[i].Condition))
-            throw Exception("Range condition initialization failed");
-        m_ppFreeLocks[i] = m_pLockPool + i;
-        m_pLockPool[i].State = lsInvalid;
-    };
-   
+    for (unsigned i = 0; i < NUMOFLOCKVERSIONS; i++)
+        m_Granted[i] = m_Released[i] = 0;
+    for (unsigned i = 0; i < NumOfEntries; i++)
+        AddEntry();
 };
 
 CRangeLocker::~CRangeLocker()
 {
 	DestroyCS(m_GlobalMutex);
-	DestroyCond(m_FreePoolSig);
-    for (unsigned i = 0; i < m_MaxThreads; i++)
+    for (size_t i = 0; i < m_LockPool.size(); i++)
     {
-        DestroyCond(m_pLockPool[i].Condition);
+        DestroyCond(m_LockPool[i]->Condition);
+        delete m_LockPool[i];
     };
-    delete[]m_pLockPool;
-    delete[]m_ppFreeLocks;
+};
 
+/**
+ * The entries are never deallocated before the locker is destroyed, so their IDs remain valid
+ */
+void CRangeLocker::AddEntry()
+{
+    LockedRange* pRange = new LockedRange;
+    if (!InitCond(pRange->Condition))
+    {
+        delete pRange;
+        throw Exception("Range condition initialization failed");
+    };
+    pRange->State = lsInvalid;
+    pRange->ID = m_LockPool.size();
+    m_LockPool.push_back(pRange);
+    m_FreeLocks.push_back(pRange);
 };
 
 
@@ -68,21 +71,43 @@ void CRangeLocker::Wait(LockedRange* pLock ///a lock entry in the list
 };
 
 
-/** 1. Lock the global data structures
-    2. wait for some free space in the queue
-    3. Insert an entry into the list of active locks
-    4. Search the list for overlapping ranges
-    5. If a locked overlapping range is found, wait for it and go to 4
-    6. Otherwise, grant the lock
-    */
 size_t CRangeLocker::Lock(const unsigned long long RangeLow, ///lower bound
                           const unsigned long long RangeHigh ///upper bound 
                           )
+{
+    return Lock(RangeLow, RangeHigh, RangeHigh, RangeHigh);
+};
+
+/** 1. Lock the global data structures
+    2. Insert an entry into the list of active locks, allocating a new entry if all of them are in use
+    3. Search the list for the entries overlapping any of the ranges
+    4. If an overlapping entry is locked, or was requested earlier, wait for it and go to 3
+    5. Otherwise, grant both ranges
+    */
+size_t CRangeLocker::Lock(const unsigned long long RangeLow, ///lower bound of the first range
+                          const unsigned long long RangeHigh, ///upper bound of the first range
+                          const unsigned long long RangeLow2, ///lower bound of the second range
+                          const unsigned long long RangeHigh2 ///upper bound of the second range
+                          )
 {
     LockCS(m_GlobalMutex);
-    //make sure there are not so many active threads
-    while (m_FreeStackTop >= m_MaxThreads)
-        CondWait(m_FreePoolSig, m_GlobalMutex);
+    if (m_FreeLocks.empty())
+        AddEntry();
+    LockedRange* pRange = m_FreeLocks.back();
+    m_FreeLocks.pop_back();
+    pRange->Low = RangeLow;
+    pRange->High = RangeHigh;
+    pRange->Low2 = RangeLow2;
+    pRange->High2 = RangeHigh2;
+    pRange->WaitCount = 0;
+    pRange->Ticket = m_NextTicket++;
+    pRange->State = lsWaiting;
+    //insert it into the beginning of the list of locks
+    if (m_pActiveLocks)
+        m_pActiveLocks->pPrev=pRange;
+    pRange->pNext=m_pActiveLocks;
+    m_pActiveLocks=pRange;
+    pRange->pPrev=NULL;
     bool Block=true;
     //check if we have to wait for someone
     while(Block)
@@ -91,10 +116,10 @@ size_t CRangeLocker::Lock(const unsigned long long RangeLow, ///lower bound
         LockedRange* pCurRange=m_pActiveLocks;
         while(pCurRange)
         {
-            if (pCurRange->State==lsLocked)
+            if ((pCurRange->State==lsLocked)||((pCurRange->State==lsWaiting)&&(pCurRange->Ticket<pRange->Ticket)))
             {
                 //check if we intersect with this range
-                if ((RangeHigh>pCurRange->Low)&&(RangeLow<pCurRange->High))
+                if (Overlaps(*pCurRange,RangeLow,RangeHigh)||((RangeLow2<RangeHigh2)&&Overlaps(*pCurRange,RangeLow2,RangeHigh2)))
                 {
                     Block=true;
                     Wait(pCurRange);
@@ -104,20 +129,14 @@ size_t CRangeLocker::Lock(const unsigned long long RangeLow, ///lower bound
             pCurRange=pCurRange->pNext;
         };
     };
-    //no conflicts with active locks, grant one
-    LockedRange* pRange = m_ppFreeLocks[m_FreeStackTop++];
-    pRange->Low = RangeLow;
-    pRange->High = RangeHigh;
-    pRange->WaitCount = 0;
-    //insert it into the beginning of the list of locks
-    if (m_pActiveLocks)
-        m_pActiveLocks->pPrev=pRange;
-    pRange->pNext=m_pActiveLocks;
-    m_pActiveLocks=pRange;
-    pRange->pPrev=NULL;
+    //no conflicts with earlier requests, grant the lock
     pRange->State=lsLocked;
+    Advance(m_Granted,RangeLow,RangeHigh);
+    Advance(m_Granted,RangeLow2,RangeHigh2);
+    //the optimistic readers must see the lock before anything is modified under it
+    FullBarrier();
     UnlockCS(m_GlobalMutex);
-    return pRange-m_pLockPool;
+    return pRange->ID;
 };
 
 /** Notify all threads about unlock and remove the element from the list
@@ -127,7 +146,11 @@ void CRangeLocker::Unlock(size_t LockID ///the ID value returned by Lock
 {
     LockCS(m_GlobalMutex);
 	//cerr<<"Relese "<<ThreadID<<endl;
-    LockedRange& Lock = m_pLockPool[LockID ];
+    LockedRange& Lock = *m_LockPool[LockID];
+    //the optimistic readers must see everything modified under the lock before its release
+    FullBarrier();
+    Advance(m_Released, Lock.Low, Lock.High);
+    Advance(m_Released, Lock.Low2, Lock.High2);
     Lock.State = lsUnlocked;
     //remove it from the list of active entries
     if (Lock.pNext)
@@ -138,24 +161,86 @@ void CRangeLocker::Unlock(size_t LockID ///the ID value returned by Lock
         //this was the first element in the list
         m_pActiveLocks = Lock.pNext;
     //notify all threads about the unlock
-	CondWakeAll(m_pLockPool[LockID].Condition);
-    if (!m_pLockPool[LockID].WaitCount)
+	CondWakeAll(Lock.Condition);
+    if (!Lock.WaitCount)
         //nobody is waiting for it
-        Release(m_pLockPool + LockID);
+        Release(&Lock);
     UnlockCS(m_GlobalMutex);
 
 }
 
 /*
- * remove an entry from the active lock list, 
- * put the entry into the list of free ones 
- * and notify somebody about this
+ * remove an entry from the active lock list and
+ * put the entry into the list of free ones
  */
 void CRangeLocker::Release(LockedRange* pLock)
 {
     pLock->State = lsInvalid;
-    m_ppFreeLocks[--m_FreeStackTop] = pLock;
-	CondWake(m_FreePoolSig);
+    m_FreeLocks.push_back(pLock);
+}
+
+/** The second range of the entry is ignored if it is empty
+ */
+bool CRangeLocker::Overlaps(const LockedRange& Lock,///the lock entry
+                            unsigned long long RangeLow,///lower bound
+                            unsigned long long RangeHigh ///upper bound
+                            )
+{
+    if ((RangeHigh > Lock.Low) && (RangeLow < Lock.High))
+        return true;
+    return (Lock.Low2 < Lock.High2) && (RangeHigh > Lock.Low2) && (RangeLow < Lock.High2);
+}
+
+/** The range covers each counter at most once, so that the large ranges do not take long
+ */
+void CRangeLocker::Advance(volatile unsigned long long* pCounters,///the counters
+                           unsigned long long RangeLow,///lower bound
+                           unsigned long long RangeHigh ///upper bound
+                           )
+{
+    for (unsigned long long x = RangeLow; (x < RangeHigh) && (x - RangeLow < NUMOFLOCKVERSIONS); x++)
+        pCounters[x % NUMOFLOCKVERSIONS]++;
+}
+
+unsigned long long CRangeLocker::Sum(const volatile unsigned long long* pCounters,///the counters
+                                     unsigned long long RangeLow,///lower bound
+                                     unsigned long long RangeHigh ///upper bound
+                                     )
+{
+    unsigned long long S = 0;
+    for (unsigned long long x = RangeLow; (x < RangeHigh) && (x - RangeLow < NUMOFLOCKVERSIONS); x++)
+        S += pCounters[x % NUMOFLOCKVERSIONS];
+    return S;
+}
+
+/** The range is not locked if the number of the locks released for its counters is equal to the number of the locks granted.
+ * The released locks are counted after the granted ones, so that a lock granted and released meanwhile does not hide
+ * another one being held. Such a lock changes the version, so the read is not validated anyway
+ */
+bool CRangeLocker::BeginRead(const unsigned long long RangeLow, ///lower bound
+                             const unsigned long long RangeHigh, ///upper bound
+                             unsigned long long& Version ///output: the version of the range
+                             )const
+{
+    Version = Sum(m_Granted, RangeLow, RangeHigh);
+    FullBarrier();
+    if (Sum(m_Released, RangeLow, RangeHigh) != Version)
+        return false;
+    //the data must be read after the counters
+    FullBarrier();
+    return true;
+}
+
+/** The counters are never decremented, so the version changes if any lock was granted for the range
+ */
+bool CRangeLocker::EndRead(const unsigned long long RangeLow, ///lower bound
+                           const unsigned long long RangeHigh, ///upper bound
+                           unsigned long long Version ///the version returned by BeginRead()
+                           )const
+{
+    //the data must be read before the counters
+    FullBarrier();
+    return Sum(m_Granted, RangeLow, RangeHigh) == Version;
 }
 
 
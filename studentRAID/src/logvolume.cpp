@@ -0,0 +1,794 @@
+/*********************************************************
+ * logvolume.cpp  - implementation of a log-structured volume on top of a disk array
+ *
+ * Copyright(C) 2012 Saint-Petersburg State Polytechnic University
+ *
+ * Developed in the framework of the "Forward error correction for next generation storage systems" project
+ *
+ * Author: P. Trifonov petert@dcn.ftk.spbstu.ru
+ * ********************************************************/
+#include <iostream>
+#include <map>
+#include <string.h>
+#include "misc.h"
+#include "arithmetic.h"
+#include "logvolume.h"
+
+using namespace std;
+
+///checkpoint record signature
+#define LOGVOLUMEMAGIC 0x106F0E55
+///segment summary signature
+#define LOGSEGMENTMAGIC 0x5E6F0E55
+///version of the on-array format
+#define LOGVOLUMEVERSION 1
+///location of a logical block, which has never been written
+#define LOGUNMAPPED 0xFFFFFFFFu
+///the number of free segments, which can be used only by the cleaner
+#define LOGRESERVEDSEGMENTS 2
+///the cleaner is activated if the number of free segments drops below this value
+#define LOGCLEANSEGMENTS 8
+///a checkpoint is made after this number of segments is written
+#define LOGCHECKPOINTINTERVAL 64
+///the minimal number of segments in a volume
+#define LOGMINSEGMENTS (2*LOGCLEANSEGMENTS)
+///the maximal percentage of the segment space, which can be exposed as logical blocks
+#define LOGMAXUTILIZATION 90
+///the maximal number of blocks looked up at once by read()
+#define LOGREADBLOCKS 64
+
+///compute CRC32 of a memory block
+static unsigned GetChecksum(const void* pData,size_t Size)
+{
+    unsigned CRC=0;
+    UpdateCRC32(CRC,Size,(const unsigned char*)pData);
+    return CRC;
+};
+
+CLogVolume::CLogVolume(CDiskArray& A):m_Array(A),m_BlockSize(A.GetStripeUnitSize()),m_StripeSize(A.GetStripeSize()),
+    m_Loaded(false),m_Writable(false),m_SegmentBlocks(0),m_SummaryBlocks(0),m_SegmentStart(0),m_pMap(0),m_pLiveBlocks(0),
+    m_pReaders(0),m_pSegmentState(0),m_NumOfFreeSegments(0),m_NumOfCleanedSegments(0),m_NextSegment(0),
+    m_OpenSegment(LOGUNMAPPED),m_OpenBlocks(0),m_pSegmentBuffer(0),m_NextSequence(1),m_SegmentsSinceCheckpoint(0),
+    m_SegmentsWritten(0),m_SegmentsCleaned(0),m_BlocksRelocated(0),m_Failed(false),m_Stop(false),m_Running(false)
+{
+    if (!InitCS(m_Lock)||!InitCond(m_CleanSig)||!InitCond(m_SpaceSig))
+        throw Exception("Failed to initialize log-structured volume synchronization objects");
+    InitCRC32();
+    memset(&m_Header,0,sizeof(m_Header));
+};
+
+CLogVolume::~CLogVolume()
+{
+    if (m_Loaded)
+        Close();
+    ReleaseTables();
+    DestroyCond(m_SpaceSig);
+    DestroyCond(m_CleanSig);
+    DestroyCS(m_Lock);
+};
+
+/**The segment geometry is derived from the header. The mapping table buffer is padded
+ * to MapStripes stripes, so that it can be written directly
+ */
+void CLogVolume::AllocateTables()
+{
+    ReleaseTables();
+    m_SegmentBlocks=m_Header.SegmentStripes*(m_StripeSize/m_BlockSize);
+    m_SummaryBlocks=(unsigned)((sizeof(LogSegmentSummary)+sizeof(unsigned)*(size_t)m_SegmentBlocks+m_BlockSize-1)/m_BlockSize);
+    m_SegmentStart=2+2*m_Header.MapStripes;
+    m_pMap=(unsigned*)AlignedMalloc((size_t)(m_Header.MapStripes*m_StripeSize));
+    memset(m_pMap,0xFF,(size_t)(m_Header.MapStripes*m_StripeSize));
+    m_pLiveBlocks=new unsigned[m_Header.NumOfSegments];
+    memset(m_pLiveBlocks,0,sizeof(unsigned)*m_Header.NumOfSegments);
+    m_pReaders=new unsigned[m_Header.NumOfSegments];
+    memset(m_pReaders,0,sizeof(unsigned)*m_Header.NumOfSegments);
+    m_pSegmentState=new unsigned char[m_Header.NumOfSegments];
+    memset(m_pSegmentState,lsFree,m_Header.NumOfSegments);
+    m_pSegmentBuffer=AlignedMalloc(m_Header.SegmentStripes*m_StripeSize);
+    m_NumOfFreeSegments=m_Header.NumOfSegments;
+    m_NumOfCleanedSegments=0;
+    m_NextSegment=0;
+    m_OpenSegment=LOGUNMAPPED;
+    m_OpenBlocks=0;
+    m_SegmentsSinceCheckpoint=0;
+    m_Failed=false;
+};
+
+///release the in-memory structures
+void CLogVolume::ReleaseTables()
+{
+    AlignedFree((unsigned char*)m_pMap);
+    delete[]m_pLiveBlocks;
+    delete[]m_pReaders;
+    delete[]m_pSegmentState;
+    AlignedFree(m_pSegmentBuffer);
+    m_pMap=0;
+    m_pLiveBlocks=0;
+    m_pReaders=0;
+    m_pSegmentState=0;
+    m_pSegmentBuffer=0;
+    m_Loaded=false;
+};
+
+/**The block may reside in the open segment buffer. Otherwise, its segment cannot be reused
+ * while m_Lock is held, so it can be read from the array directly
+ */
+bool CLogVolume::ReadBlock(unsigned long long LogicalBlock,///the block to be read
+                           unsigned char* pDest ///destination buffer
+                          )
+{
+    unsigned P=m_pMap[LogicalBlock];
+    if (P==LOGUNMAPPED)
+    {
+        memset(pDest,0,m_BlockSize);
+        return true;
+    };
+    if (P/m_SegmentBlocks==m_OpenSegment)
+    {
+        memcpy(pDest,m_pSegmentBuffer+(size_t)(P%m_SegmentBlocks)*m_BlockSize,m_BlockSize);
+        return true;
+    };
+    CDiskArray::tHandle F=m_Array.open();
+    m_Array.seek(F,GetBlockOffset(P),SEEK_SET);
+    return m_Array.read(F,m_BlockSize,pDest)==m_BlockSize;
+};
+
+/**Free segments, which are not being read by anybody, are allocated round-robin.
+ * If only the reserved segments are left, the writers wait for the cleaner. The cleaned segments
+ * are released by a checkpoint, which is cheap at this point, since there is no open segment to be padded
+ */
+bool CLogVolume::OpenSegment(bool Cleaner ///true if called by the cleaner, which may use the reserved segments
+                            )
+{
+    while (m_OpenSegment==LOGUNMAPPED)
+    {
+        if (m_Failed)
+            return false;
+        if (m_NumOfCleanedSegments&&(m_NumOfFreeSegments<LOGCLEANSEGMENTS))
+        {
+            if (!WriteCheckpoint())
+                return false;
+            continue;
+        };
+        if ((m_NumOfFreeSegments>LOGRESERVEDSEGMENTS)||(Cleaner&&m_NumOfFreeSegments))
+        {
+            unsigned Segment=LOGUNMAPPED;
+            for(unsigned i=0;i<m_Header.NumOfSegments;i++)
+            {
+                unsigned S=(m_NextSegment+i)%m_Header.NumOfSegments;
+                if ((m_pSegmentState[S]==lsFree)&&!m_pReaders[S])
+                {
+                    Segment=S;
+                    break;
+                };
+            };
+            if (Segment!=LOGUNMAPPED)
+            {
+                m_pSegmentState[Segment]=lsOpen;
+                m_NumOfFreeSegments--;
+                m_NextSegment=(Segment+1)%m_Header.NumOfSegments;
+                m_OpenSegment=Segment;
+                m_OpenBlocks=0;
+                memset(m_pSegmentBuffer,0,(size_t)m_SummaryBlocks*m_BlockSize);
+                if (m_NumOfFreeSegments<LOGCLEANSEGMENTS)
+                    CondWake(m_CleanSig);
+                //the writers waiting for space may use the segment opened by the cleaner
+                CondWakeAll(m_SpaceSig);
+                return true;
+            };
+            //all free segments are being read
+        }else if (Cleaner||!m_Running)
+        {
+            cerr<<"Log-structured volume is out of space\n";
+            return false;
+        };
+        CondWake(m_CleanSig);
+        CondWait(m_SpaceSig,m_Lock);
+    };
+    return true;
+};
+
+/**The whole segment buffer is written at once, so that the array receives only full stripe writes.
+ * The checkpoint is made right after that if needed, since the open segment is empty at this point
+ */
+bool CLogVolume::SealSegment()
+{
+    LogSegmentSummary* pSummary=(LogSegmentSummary*)m_pSegmentBuffer;
+    pSummary->MagicNumber=LOGSEGMENTMAGIC;
+    pSummary->NumOfBlocks=m_OpenBlocks;
+    pSummary->Sequence=m_NextSequence++;
+    pSummary->DataChecksum=GetChecksum(m_pSegmentBuffer+(size_t)m_SummaryBlocks*m_BlockSize,(size_t)m_OpenBlocks*m_BlockSize);
+    pSummary->Checksum=0;
+    pSummary->Checksum=GetChecksum(m_pSegmentBuffer,sizeof(LogSegmentSummary)+sizeof(unsigned)*(size_t)m_OpenBlocks);
+    CDiskArray::tHandle F=m_Array.open();
+    m_Array.seek(F,GetBlockOffset(m_OpenSegment*m_SegmentBlocks),SEEK_SET);
+    long long Length=(long long)m_Header.SegmentStripes*m_StripeSize;
+    if (m_Array.write(F,Length,m_pSegmentBuffer)!=Length)
+    {
+        cerr<<"Failed to write segment "<<m_OpenSegment<<endl;
+        m_Failed=true;
+        CondWakeAll(m_SpaceSig);
+        return false;
+    };
+    m_pSegmentState[m_OpenSegment]=lsUsed;
+    m_OpenSegment=LOGUNMAPPED;
+    m_SegmentsWritten++;
+    m_SegmentsSinceCheckpoint++;
+    if (m_NumOfCleanedSegments||(m_SegmentsSinceCheckpoint>=LOGCHECKPOINTINTERVAL))
+        return WriteCheckpoint();
+    return true;
+};
+
+/**The mapping table copies and the checkpoint records are used alternately, so that
+ * an interrupted checkpoint leaves the previous one intact. The cleaned segments are released
+ * only after the new mapping table is persistent
+ */
+bool CLogVolume::WriteCheckpoint()
+{
+    LogVolumeHeader H=m_Header;
+    H.Sequence=m_NextSequence;
+    H.MapCopy=1-m_Header.MapCopy;
+    H.MapChecksum=GetChecksum(m_pMap,(size_t)H.NumOfBlocks*sizeof(unsigned));
+    H.Checksum=GetChecksum(&H,sizeof(H)-sizeof(H.Checksum));
+    CDiskArray::tHandle F=m_Array.open();
+    m_Array.seek(F,(2+H.MapCopy*H.MapStripes)*m_StripeSize,SEEK_SET);
+    long long Length=(long long)(H.MapStripes*m_StripeSize);
+    bool Result=m_Array.write(F,Length,(const unsigned char*)m_pMap)==Length;
+    if (Result)
+    {
+        //the segment buffer is not used, since there is no open segment
+        memset(m_pSegmentBuffer,0,m_StripeSize);
+        memcpy(m_pSegmentBuffer,&H,sizeof(H));
+        m_Array.seek(F,(unsigned long long)H.MapCopy*m_StripeSize,SEEK_SET);
+        Result=m_Array.write(F,m_StripeSize,m_pSegmentBuffer)==m_StripeSize;
+    };
+    if (!Result)
+    {
+        cerr<<"Failed to write log-structured volume checkpoint\n";
+        m_Failed=true;
+        CondWakeAll(m_SpaceSig);
+        return false;
+    };
+    m_Header=H;
+    m_SegmentsSinceCheckpoint=0;
+    for(unsigned i=0;m_NumOfCleanedSegments&&(i<m_Header.NumOfSegments);i++)
+        if (m_pSegmentState[i]==lsCleaned)
+        {
+            m_pSegmentState[i]=lsFree;
+            m_NumOfFreeSegments++;
+            m_NumOfCleanedSegments--;
+        };
+    CondWakeAll(m_SpaceSig);
+    return true;
+};
+
+/**The block is copied to the open segment buffer, and the mapping table is updated immediately,
+ * so that the subsequent reads find it there
+ */
+bool CLogVolume::AppendBlock(unsigned long long LogicalBlock,///the block being written
+                             const unsigned char* pData,///its content
+                             bool Cleaner ///true if called by the cleaner, which may use the reserved segments
+                            )
+{
+    if (!OpenSegment(Cleaner))
+        return false;
+    unsigned Offset=m_SummaryBlocks+m_OpenBlocks;
+    memcpy(m_pSegmentBuffer+(size_t)Offset*m_BlockSize,pData,m_BlockSize);
+    GetSummaryEntries(m_pSegmentBuffer)[m_OpenBlocks]=(unsigned)LogicalBlock;
+    m_OpenBlocks++;
+    unsigned Old=m_pMap[LogicalBlock];
+    if (Old!=LOGUNMAPPED)
+        m_pLiveBlocks[Old/m_SegmentBlocks]--;
+    m_pMap[LogicalBlock]=m_OpenSegment*m_SegmentBlocks+Offset;
+    m_pLiveBlocks[m_OpenSegment]++;
+    if (m_SummaryBlocks+m_OpenBlocks==m_SegmentBlocks)
+        return SealSegment();
+    return true;
+};
+
+/**Greedy policy: the segment with the smallest number of live blocks is selected,
+ * and its live blocks, i.e. the ones still referenced by the mapping table, are appended to the log
+ */
+bool CLogVolume::CleanSegment(unsigned char* pBuffer ///buffer for the segment data
+                             )
+{
+    unsigned Victim=LOGUNMAPPED;
+    for(unsigned i=0;i<m_Header.NumOfSegments;i++)
+        if ((m_pSegmentState[i]==lsUsed)&&((Victim==LOGUNMAPPED)||(m_pLiveBlocks[i]<m_pLiveBlocks[Victim])))
+            Victim=i;
+    if ((Victim==LOGUNMAPPED)||(m_pLiveBlocks[Victim]+m_SummaryBlocks>=m_SegmentBlocks))
+        //nothing to gain
+        return false;
+    if (m_pLiveBlocks[Victim])
+    {
+        CDiskArray::tHandle F=m_Array.open();
+        m_Array.seek(F,GetBlockOffset(Victim*m_SegmentBlocks),SEEK_SET);
+        long long Length=(long long)m_Header.SegmentStripes*m_StripeSize;
+        if (m_Array.read(F,Length,pBuffer)!=Length)
+        {
+            cerr<<"Failed to read segment "<<Victim<<endl;
+            return false;
+        };
+        const LogSegmentSummary* pSummary=(const LogSegmentSummary*)pBuffer;
+        if ((pSummary->MagicNumber!=LOGSEGMENTMAGIC)||(pSummary->NumOfBlocks+m_SummaryBlocks>m_SegmentBlocks))
+        {
+            cerr<<"Corrupted summary of segment "<<Victim<<endl;
+            return false;
+        };
+        unsigned NumOfBlocks=pSummary->NumOfBlocks;
+        const unsigned* pEntries=GetSummaryEntries(pBuffer);
+        for(unsigned i=0;m_pLiveBlocks[Victim]&&(i<NumOfBlocks);i++)
+        {
+            unsigned long long L=pEntries[i];
+            if ((L>=m_Header.NumOfBlocks)||(m_pMap[L]!=Victim*m_SegmentBlocks+m_SummaryBlocks+i))
+                //obsolete block
+                continue;
+            if (!AppendBlock(L,pBuffer+(size_t)(m_SummaryBlocks+i)*m_BlockSize,true))
+                return false;
+            m_BlocksRelocated++;
+        };
+    };
+    m_pSegmentState[Victim]=lsCleaned;
+    m_NumOfCleanedSegments++;
+    m_SegmentsCleaned++;
+    //the writers waiting for space may release the segment by a checkpoint
+    CondWakeAll(m_SpaceSig);
+    return true;
+};
+
+/**The lock is released after each segment, so that the writers are not blocked for too long
+ */
+THREADPROC CLogVolume::CleanerThread(void* pParams ///must be a pointer to CLogVolume
+                                    )
+{
+    CLogVolume& V=*(CLogVolume*)pParams;
+    unsigned char* pBuffer=AlignedMalloc(V.m_Header.SegmentStripes*V.m_StripeSize);
+    LockCS(V.m_Lock);
+    while (!V.m_Stop)
+    {
+        if (V.m_Failed||(V.m_NumOfFreeSegments+V.m_NumOfCleanedSegments>=LOGCLEANSEGMENTS))
+        {
+            CondWait(V.m_CleanSig,V.m_Lock);
+            continue;
+        };
+        if (!V.CleanSegment(pBuffer))
+        {
+            //release whatever was cleaned, if this does not require padding the open segment
+            if (V.m_NumOfCleanedSegments&&(V.m_OpenSegment==LOGUNMAPPED))
+                V.WriteCheckpoint();
+            CondWait(V.m_CleanSig,V.m_Lock);
+            continue;
+        };
+        UnlockCS(V.m_Lock);
+        LockCS(V.m_Lock);
+    };
+    UnlockCS(V.m_Lock);
+    AlignedFree(pBuffer);
+    return 0;
+};
+
+///start the cleaner thread
+void CLogVolume::StartCleaner()
+{
+    m_Stop=false;
+    m_Running=StartThread(m_Cleaner,CleanerThread,this);
+    if (!m_Running)
+        cerr<<"Failed to start the log-structured volume cleaner\n";
+};
+
+///terminate the cleaner thread
+void CLogVolume::StopCleaner()
+{
+    if (!m_Running)
+        return;
+    LockCS(m_Lock);
+    m_Stop=true;
+    CondWakeAll(m_CleanSig);
+    UnlockCS(m_Lock);
+    JoinThread(m_Cleaner);
+    LockCS(m_Lock);
+    m_Running=false;
+    //the writers waiting for space cannot expect anything from the cleaner any more
+    CondWakeAll(m_SpaceSig);
+    UnlockCS(m_Lock);
+};
+
+/**The geometry is chosen so that at least LOGCLEANSEGMENTS+1 segments remain free even if all
+ * logical blocks are live, which guarantees that the cleaner can always make progress.
+ * Both checkpoint slots are overwritten, and the sequence numbers start above any stale segment
+ * summary found on the array, so that nothing is rolled forward from a previous volume
+ */
+bool CLogVolume::Format(unsigned SegmentStripes,///the number of stripes in a segment
+                        unsigned Utilization ///the percentage of the segment space exposed as logical blocks
+                       )
+{
+    if (m_Loaded)
+        return false;
+    if (!SegmentStripes||!Utilization||(Utilization>LOGMAXUTILIZATION))
+    {
+        cerr<<"Invalid segment size or utilization (at most "<<LOGMAXUTILIZATION<<"% allowed)\n";
+        return false;
+    };
+    unsigned long long NumOfStripes=m_Array.GetCapacity()/m_StripeSize;
+    LogVolumeHeader H;
+    memset(&H,0,sizeof(H));
+    H.MagicNumber=LOGVOLUMEMAGIC;
+    H.Version=LOGVOLUMEVERSION;
+    H.BlockSize=m_BlockSize;
+    H.StripeSize=m_StripeSize;
+    H.SegmentStripes=SegmentStripes;
+    unsigned SegmentBlocks=SegmentStripes*(m_StripeSize/m_BlockSize);
+    unsigned SummaryBlocks=(unsigned)((sizeof(LogSegmentSummary)+sizeof(unsigned)*(size_t)SegmentBlocks+m_BlockSize-1)/m_BlockSize);
+    if (SummaryBlocks>=SegmentBlocks)
+    {
+        cerr<<"Segment size is too small\n";
+        return false;
+    };
+    unsigned DataBlocks=SegmentBlocks-SummaryBlocks;
+    //the mapping table size is estimated assuming that the whole array is occupied by segments
+    unsigned long long MaxBlocks=NumOfStripes/SegmentStripes*DataBlocks*Utilization/100;
+    H.MapStripes=(MaxBlocks*sizeof(unsigned)+m_StripeSize-1)/m_StripeSize;
+    if (!H.MapStripes)
+        H.MapStripes=1;
+    unsigned long long SegmentStart=2+2*H.MapStripes;
+    unsigned long long NumOfSegments=(NumOfStripes>SegmentStart)?(NumOfStripes-SegmentStart)/SegmentStripes:0;
+    if ((NumOfSegments<LOGMINSEGMENTS)||(NumOfSegments*SegmentBlocks>=LOGUNMAPPED))
+    {
+        cerr<<"The array cannot accommodate a log-structured volume with such segment size\n";
+        return false;
+    };
+    H.NumOfSegments=(unsigned)NumOfSegments;
+    H.NumOfBlocks=min(NumOfSegments*DataBlocks*Utilization/100,(NumOfSegments-LOGCLEANSEGMENTS-1)*DataBlocks);
+    H.MapCopy=1;
+
+    //invalidate the previous checkpoints
+    unsigned char* pBuffer=AlignedMalloc(2*m_StripeSize);
+    memset(pBuffer,0,2*m_StripeSize);
+    CDiskArray::tHandle F=m_Array.open();
+    bool Result=m_Array.write(F,2*m_StripeSize,pBuffer)==2*m_StripeSize;
+    AlignedFree(pBuffer);
+    if (!Result)
+    {
+        cerr<<"Failed to write log-structured volume header\n";
+        return false;
+    };
+
+    LockCS(m_Lock);
+    m_Header=H;
+    AllocateTables();
+    unsigned long long Sequence=1;
+    for(unsigned i=0;i<H.NumOfSegments;i++)
+    {
+        m_Array.seek(F,GetBlockOffset(i*m_SegmentBlocks),SEEK_SET);
+        if (m_Array.read(F,m_SummaryBlocks*m_BlockSize,m_pSegmentBuffer)!=m_SummaryBlocks*m_BlockSize)
+            continue;
+        LogSegmentSummary* pSummary=(LogSegmentSummary*)m_pSegmentBuffer;
+        if ((pSummary->MagicNumber==LOGSEGMENTMAGIC)&&(pSummary->Sequence>=Sequence))
+            Sequence=pSummary->Sequence+1;
+    };
+    m_NextSequence=Sequence;
+    Result=WriteCheckpoint();
+    m_Writable=Result;
+    m_Loaded=Result;
+    UnlockCS(m_Lock);
+    if (Result)
+        StartCleaner();
+    return Result;
+};
+
+///load the checkpoint record from a given stripe
+bool CLogVolume::LoadHeader(unsigned Slot,///the stripe to be inspected
+                            LogVolumeHeader& H ///output record
+                           )
+{
+    unsigned char* pBuffer=AlignedMalloc(m_StripeSize);
+    CDiskArray::tHandle F=m_Array.open();
+    m_Array.seek(F,(unsigned long long)Slot*m_StripeSize,SEEK_SET);
+    bool Result=m_Array.read(F,m_StripeSize,pBuffer)==m_StripeSize;
+    memcpy(&H,pBuffer,sizeof(H));
+    AlignedFree(pBuffer);
+    return Result&&(H.MagicNumber==LOGVOLUMEMAGIC)&&(H.Version==LOGVOLUMEVERSION)&&(H.MapCopy==Slot)&&
+           (H.Checksum==GetChecksum(&H,sizeof(H)-sizeof(H.Checksum)));
+};
+
+///load the mapping table written by a checkpoint
+bool CLogVolume::LoadMap(const LogVolumeHeader& H ///checkpoint record
+                        )
+{
+    CDiskArray::tHandle F=m_Array.open();
+    m_Array.seek(F,(2+H.MapCopy*H.MapStripes)*m_StripeSize,SEEK_SET);
+    long long Length=(long long)(H.MapStripes*m_StripeSize);
+    if (m_Array.read(F,Length,(unsigned char*)m_pMap)!=Length)
+        return false;
+    if (H.MapChecksum!=GetChecksum(m_pMap,(size_t)H.NumOfBlocks*sizeof(unsigned)))
+        return false;
+    //drop the entries, which cannot be valid
+    for(unsigned long long i=0;i<H.NumOfBlocks;i++)
+        if ((m_pMap[i]!=LOGUNMAPPED)&&(m_pMap[i]>=H.NumOfSegments*m_SegmentBlocks))
+            return false;
+    return true;
+};
+
+/**No segment is released between checkpoints, so the segments written after the latest one
+ * have consecutive sequence numbers. They are applied in this order until a missing or incomplete segment is found
+ */
+bool CLogVolume::RollForward()
+{
+    //sequence number of each segment written after the checkpoint, ordered by sequence
+    map<unsigned long long,unsigned> Segments;
+    CDiskArray::tHandle F=m_Array.open();
+    unsigned long long MaxSequence=m_Header.Sequence;
+    size_t SummarySize=(size_t)m_SummaryBlocks*m_BlockSize;
+    for(unsigned i=0;i<m_Header.NumOfSegments;i++)
+    {
+        m_Array.seek(F,GetBlockOffset(i*m_SegmentBlocks),SEEK_SET);
+        if (m_Array.read(F,SummarySize,m_pSegmentBuffer)!=(long long)SummarySize)
+            return false;
+        LogSegmentSummary* pSummary=(LogSegmentSummary*)m_pSegmentBuffer;
+        if (pSummary->MagicNumber!=LOGSEGMENTMAGIC)
+            continue;
+        if (pSummary->Sequence>=MaxSequence)
+            MaxSequence=pSummary->Sequence+1;
+        if (pSummary->Sequence>=m_Header.Sequence)
+            Segments[pSummary->Sequence]=i;
+    };
+    unsigned long long Expected=m_Header.Sequence;
+    long long Length=(long long)m_Header.SegmentStripes*m_StripeSize;
+    for(map<unsigned long long,unsigned>::const_iterator S=Segments.begin();S!=Segments.end();S++)
+    {
+        if (S->first!=Expected)
+            break;
+        m_Array.seek(F,GetBlockOffset(S->second*m_SegmentBlocks),SEEK_SET);
+        if (m_Array.read(F,Length,m_pSegmentBuffer)!=Length)
+            return false;
+        LogSegmentSummary* pSummary=(LogSegmentSummary*)m_pSegmentBuffer;
+        unsigned Checksum=pSummary->Checksum;
+        pSummary->Checksum=0;
+        if ((pSummary->NumOfBlocks+m_SummaryBlocks>m_SegmentBlocks)||
+                (Checksum!=GetChecksum(m_pSegmentBuffer,sizeof(LogSegmentSummary)+sizeof(unsigned)*(size_t)pSummary->NumOfBlocks))||
+                (pSummary->DataChecksum!=GetChecksum(m_pSegmentBuffer+SummarySize,(size_t)pSummary->NumOfBlocks*m_BlockSize)))
+            //the segment write was interrupted
+            break;
+        const unsigned* pEntries=GetSummaryEntries(m_pSegmentBuffer);
+        for(unsigned j=0;j<pSummary->NumOfBlocks;j++)
+            if (pEntries[j]<m_Header.NumOfBlocks)
+                m_pMap[pEntries[j]]=S->second*m_SegmentBlocks+m_SummaryBlocks+j;
+        Expected++;
+    };
+    if (Expected>m_Header.Sequence)
+        cerr<<"Rolled forward "<<Expected-m_Header.Sequence<<" segments\n";
+    m_NextSequence=MaxSequence;
+    return true;
+};
+
+/**The most recent checkpoint with a valid mapping table is used. The segment usage is reconstructed
+ * from the mapping table. For a writable volume, the result of roll-forward is made persistent by
+ * a new checkpoint, so that the segments left after an interrupted write can be safely reused
+ */
+bool CLogVolume::Open(bool Write ///true if the volume is going to be updated. The array must be write-mounted
+                     )
+{
+    if (m_Loaded)
+        return false;
+    LogVolumeHeader Headers[2];
+    bool Valid[2];
+    for(unsigned i=0;i<2;i++)
+        Valid[i]=LoadHeader(i,Headers[i]);
+    if (!Valid[0]&&!Valid[1])
+    {
+        cerr<<"No valid log-structured volume found on the array\n";
+        return false;
+    };
+    //try the latest checkpoint first
+    unsigned First=(Valid[1]&&(!Valid[0]||(Headers[1].Sequence>Headers[0].Sequence)))?1:0;
+    LockCS(m_Lock);
+    bool Result=false;
+    for(unsigned k=0;!Result&&(k<2);k++)
+    {
+        const LogVolumeHeader& H=Headers[First^k];
+        if (!Valid[First^k])
+            continue;
+        if ((H.BlockSize!=m_BlockSize)||(H.StripeSize!=m_StripeSize)||
+                ((2+2*H.MapStripes+(unsigned long long)H.NumOfSegments*H.SegmentStripes)*m_StripeSize>m_Array.GetCapacity()))
+        {
+            cerr<<"Log-structured volume geometry does not match the array\n";
+            break;
+        };
+        m_Header=H;
+        AllocateTables();
+        Result=LoadMap(H);
+        if (!Result)
+            cerr<<"Corrupted mapping table in checkpoint "<<(First^k)<<endl;
+    };
+    Result=Result&&RollForward();
+    if (!Result)
+    {
+        ReleaseTables();
+        UnlockCS(m_Lock);
+        return false;
+    };
+    for(unsigned long long i=0;i<m_Header.NumOfBlocks;i++)
+        if (m_pMap[i]!=LOGUNMAPPED)
+            m_pLiveBlocks[m_pMap[i]/m_SegmentBlocks]++;
+    for(unsigned i=0;i<m_Header.NumOfSegments;i++)
+        if (m_pLiveBlocks[i])
+        {
+            m_pSegmentState[i]=lsUsed;
+            m_NumOfFreeSegments--;
+        };
+    if (Write)
+        Result=WriteCheckpoint();
+    m_Writable=Write&&Result;
+    m_Loaded=Result;
+    UnlockCS(m_Lock);
+    if (m_Writable)
+        StartCleaner();
+    return Result;
+};
+
+/**The open segment is written even if it is incomplete, and a checkpoint is made
+ */
+bool CLogVolume::Close()
+{
+    if (!m_Loaded)
+        return false;
+    StopCleaner();
+    LockCS(m_Lock);
+    bool Result=!m_Failed;
+    if (m_Writable&&!m_Failed)
+    {
+        if (m_OpenSegment!=LOGUNMAPPED)
+        {
+            if (m_OpenBlocks)
+                Result=SealSegment();
+            else
+            {
+                m_pSegmentState[m_OpenSegment]=lsFree;
+                m_NumOfFreeSegments++;
+                m_OpenSegment=LOGUNMAPPED;
+            };
+        };
+        Result=Result&&WriteCheckpoint();
+    };
+    ReleaseTables();
+    UnlockCS(m_Lock);
+    return Result;
+};
+
+/**The incomplete open segment is written to the array. It will be recovered by roll-forward if needed
+ */
+bool CLogVolume::Sync()
+{
+    LockCS(m_Lock);
+    bool Result=m_Loaded&&m_Writable&&!m_Failed;
+    if (Result&&(m_OpenSegment!=LOGUNMAPPED)&&m_OpenBlocks)
+        Result=SealSegment();
+    UnlockCS(m_Lock);
+    return Result;
+};
+
+/**The blocks are looked up with the lock held, and their segments are pinned, so that they
+ * are not reused until the data is read from the array
+ */
+long long CLogVolume::read(unsigned long long Offset,///volume offset
+                           long long Size,///the number of bytes to be read
+                           unsigned char* pDest ///destination buffer
+                          )
+{
+    if ((Size<0)||!m_Loaded||(Offset+Size>GetCapacity()))
+        return -1;
+    unsigned char* pBuffer=AlignedMalloc(LOGREADBLOCKS*m_BlockSize);
+    unsigned Location[LOGREADBLOCKS];
+    CDiskArray::tHandle F=m_Array.open();
+    long long Remaining=Size;
+    bool Result=true;
+    while (Result&&Remaining)
+    {
+        unsigned long long FirstBlock=Offset/m_BlockSize;
+        unsigned Skip=(unsigned)(Offset%m_BlockSize);
+        unsigned NumOfBlocks=(unsigned)min((unsigned long long)LOGREADBLOCKS,(unsigned long long)(Skip+Remaining+m_BlockSize-1)/m_BlockSize);
+        LockCS(m_Lock);
+        for(unsigned i=0;i<NumOfBlocks;i++)
+        {
+            unsigned P=m_pMap[FirstBlock+i];
+            Location[i]=LOGUNMAPPED;
+            if (P==LOGUNMAPPED)
+                memset(pBuffer+(size_t)i*m_BlockSize,0,m_BlockSize);
+            else if (P/m_SegmentBlocks==m_OpenSegment)
+                memcpy(pBuffer+(size_t)i*m_BlockSize,m_pSegmentBuffer+(size_t)(P%m_SegmentBlocks)*m_BlockSize,m_BlockSize);
+            else
+            {
+                m_pReaders[P/m_SegmentBlocks]++;
+                Location[i]=P;
+            };
+        };
+        UnlockCS(m_Lock);
+        //read the runs of physically contiguous blocks
+        for(unsigned i=0;i<NumOfBlocks;)
+        {
+            if (Location[i]==LOGUNMAPPED)
+            {
+                i++;
+                continue;
+            };
+            unsigned j=i+1;
+            while ((j<NumOfBlocks)&&(Location[j]==Location[j-1]+1)&&(Location[j]/m_SegmentBlocks==Location[i]/m_SegmentBlocks))
+                j++;
+            m_Array.seek(F,GetBlockOffset(Location[i]),SEEK_SET);
+            long long Length=(long long)(j-i)*m_BlockSize;
+            if (Result&&(m_Array.read(F,Length,pBuffer+(size_t)i*m_BlockSize)!=Length))
+                Result=false;
+            i=j;
+        };
+        LockCS(m_Lock);
+        for(unsigned i=0;i<NumOfBlocks;i++)
+            if (Location[i]!=LOGUNMAPPED)
+            {
+                unsigned S=Location[i]/m_SegmentBlocks;
+                if (!--m_pReaders[S]&&(m_pSegmentState[S]==lsFree))
+                    CondWakeAll(m_SpaceSig);
+            };
+        UnlockCS(m_Lock);
+        unsigned long long Chunk=min((unsigned long long)Remaining,(unsigned long long)NumOfBlocks*m_BlockSize-Skip);
+        memcpy(pDest,pBuffer+Skip,(size_t)Chunk);
+        pDest+=Chunk;
+        Offset+=Chunk;
+        Remaining-=Chunk;
+    };
+    AlignedFree(pBuffer);
+    return (Result)?Size:-1;
+};
+
+/**Partially updated blocks are read and merged with the new data. The space in the open segment is
+ * obtained before that, so that the lock is not released between the read and the append
+ */
+long long CLogVolume::write(unsigned long long Offset,///volume offset
+                            long long Size,///the number of bytes to be written
+                            const unsigned char* pSrc ///source buffer
+                           )
+{
+    if ((Size<0)||!m_Loaded||!m_Writable||(Offset+Size>GetCapacity()))
+        return -1;
+    unsigned char* pBlock=0;
+    long long Remaining=Size;
+    bool Result=true;
+    LockCS(m_Lock);
+    while (Result&&Remaining)
+    {
+        unsigned long long L=Offset/m_BlockSize;
+        unsigned Skip=(unsigned)(Offset%m_BlockSize);
+        unsigned Chunk=(unsigned)min((unsigned long long)Remaining,(unsigned long long)(m_BlockSize-Skip));
+        if (Chunk==m_BlockSize)
+            Result=AppendBlock(L,pSrc,false);
+        else
+        {
+            if (!pBlock)
+                pBlock=AlignedMalloc(m_BlockSize);
+            Result=OpenSegment(false)&&ReadBlock(L,pBlock);
+            if (Result)
+            {
+                memcpy(pBlock+Skip,pSrc,Chunk);
+                Result=AppendBlock(L,pBlock,false);
+            };
+        };
+        pSrc+=Chunk;
+        Offset+=Chunk;
+        Remaining-=Chunk;
+    };
+    UnlockCS(m_Lock);
+    AlignedFree(pBlock);
+    return (Result)?Size:-1;
+};
+
+///obtain the cleaner statistics
+void CLogVolume::GetStatistics(unsigned long long& SegmentsWritten,///the number of segments written to the array
+                               unsigned long long& SegmentsCleaned,///the number of segments compacted by the cleaner
+                               unsigned long long& BlocksRelocated ///the number of live blocks moved by the cleaner
+                              )
+{
+    LockCS(m_Lock);
+    SegmentsWritten=m_SegmentsWritten;
+    SegmentsCleaned=m_SegmentsCleaned;
+    BlocksRelocated=m_BlocksRelocated;
+    UnlockCS(m_Lock);
+};
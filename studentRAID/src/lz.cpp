@@ -0,0 +1,186 @@
+/*********************************************************
+ * lz.cpp  - implementation of a fast LZ77 compressor
+ *
+ * Copyright(C) 2012 Saint-Petersburg State Polytechnic University
+ *
+ * Developed in the framework of the "Forward error correction for next generation storage systems" project
+ *
+ * Author: P. Trifonov petert@dcn.ftk.spbstu.ru
+ * ********************************************************/
+#include <string.h>
+#include "lz.h"
+
+///the shortest match
+#define LZMINMATCH 4
+///the largest match offset
+#define LZMAXOFFSET 65535
+///the number of bits of the hash table index
+#define LZHASHLOG 12
+///the last bytes of a block are always coded as literals, so that the match search does not read beyond its end
+#define LZLASTLITERALS 5
+///the largest length stored in a token field. The longer lengths are extended by the following bytes
+#define LZTOKENMAX 15
+
+///@return 4 bytes at an arbitrary address
+static inline unsigned Read32(const unsigned char* p)
+{
+    unsigned X;
+    memcpy(&X,p,sizeof(X));
+    return X;
+};
+
+///append the extension of a length exceeding LZTOKENMAX
+///@return the end of the compressed data, or 0 if it does not fit into the buffer
+static unsigned char* PutLength(unsigned char* pOut,///the end of the compressed data
+                                const unsigned char* pOutEnd,///the end of the destination buffer
+                                size_t Length ///the length minus LZTOKENMAX
+                               )
+{
+    for(;;)
+    {
+        if (pOut>=pOutEnd)
+            return 0;
+        if (Length<255)
+            break;
+        *pOut++=255;
+        Length-=255;
+    };
+    *pOut++=(unsigned char)Length;
+    return pOut;
+};
+
+///append a record to the compressed data
+///@return the end of the compressed data, or 0 if it does not fit into the buffer
+static unsigned char* PutRecord(unsigned char* pOut,///the end of the compressed data
+                                const unsigned char* pOutEnd,///the end of the destination buffer
+                                const unsigned char* pLiterals,///the literals
+                                size_t NumOfLiterals,///the number of literals
+                                size_t Offset,///the distance to the match
+                                size_t MatchLength ///the match length, or 0 for the last record
+                               )
+{
+    if (pOut>=pOutEnd)
+        return 0;
+    unsigned char* pToken=pOut++;
+    *pToken=(unsigned char)(((NumOfLiterals<LZTOKENMAX)?NumOfLiterals:LZTOKENMAX)<<4);
+    if ((NumOfLiterals>=LZTOKENMAX)&&!(pOut=PutLength(pOut,pOutEnd,NumOfLiterals-LZTOKENMAX)))
+        return 0;
+    if ((size_t)(pOutEnd-pOut)<NumOfLiterals)
+        return 0;
+    memcpy(pOut,pLiterals,NumOfLiterals);
+    pOut+=NumOfLiterals;
+    if (!MatchLength)
+        return pOut;
+    if (pOutEnd-pOut<2)
+        return 0;
+    *pOut++=(unsigned char)Offset;
+    *pOut++=(unsigned char)(Offset>>8);
+    size_t Length=MatchLength-LZMINMATCH;
+    *pToken|=(unsigned char)((Length<LZTOKENMAX)?Length:LZTOKENMAX);
+    if ((Length>=LZTOKENMAX)&&!(pOut=PutLength(pOut,pOutEnd,Length-LZTOKENMAX)))
+        return 0;
+    return pOut;
+};
+
+///read the extension of a length, adding it to the length
+///@return true on success, false if the compressed data ends prematurely
+static bool GetLength(const unsigned char*& pIn,///the compressed data
+                      const unsigned char* pInEnd,///the end of the compressed data
+                      size_t& Length ///the length to be extended
+                     )
+{
+    unsigned char Byte;
+    do
+    {
+        if (pIn>=pInEnd)
+            return false;
+        Byte=*pIn++;
+        Length+=Byte;
+    }
+    while (Byte==255);
+    return true;
+};
+
+/** The hash table keeps the last position of each hashed 4-byte prefix. The stale entries are harmless,
+ * since the candidate matches are verified
+ */
+size_t LZCompress(const void* pSrc,///the data to be compressed
+                  size_t SrcSize,///data size in bytes
+                  void* pDest,///destination buffer
+                  size_t DestCapacity ///size of the destination buffer
+                 )
+{
+    const unsigned char* pIn=(const unsigned char*)pSrc;
+    unsigned char* pOut=(unsigned char*)pDest;
+    const unsigned char* pOutEnd=pOut+DestCapacity;
+    unsigned Table[1<<LZHASHLOG];
+    memset(Table,0,sizeof(Table));
+    size_t Anchor=0;
+    size_t i=0;
+    while (i+LZMINMATCH+LZLASTLITERALS<=SrcSize)
+    {
+        unsigned Sequence=Read32(pIn+i);
+        unsigned Hash=(Sequence*2654435761u)>>(32-LZHASHLOG);
+        size_t Ref=Table[Hash];
+        Table[Hash]=(unsigned)i;
+        if ((Ref>=i)||(i-Ref>LZMAXOFFSET)||(Read32(pIn+Ref)!=Sequence))
+        {
+            i++;
+            continue;
+        };
+        size_t Length=LZMINMATCH;
+        while ((i+Length<SrcSize-LZLASTLITERALS)&&(pIn[Ref+Length]==pIn[i+Length]))
+            Length++;
+        pOut=PutRecord(pOut,pOutEnd,pIn+Anchor,i-Anchor,i-Ref,Length);
+        if (!pOut)
+            return 0;
+        i+=Length;
+        Anchor=i;
+    };
+    pOut=PutRecord(pOut,pOutEnd,pIn+Anchor,SrcSize-Anchor,0,0);
+    return (pOut)?pOut-(unsigned char*)pDest:0;
+};
+
+/** The matches may overlap the data being produced, so they are copied bytewise
+ */
+size_t LZDecompress(const void* pSrc,///the compressed data
+                    size_t SrcSize,///size of the compressed data in bytes
+                    void* pDest,///destination buffer
+                    size_t DestCapacity ///size of the destination buffer
+                   )
+{
+    const unsigned char* pIn=(const unsigned char*)pSrc;
+    const unsigned char* pInEnd=pIn+SrcSize;
+    unsigned char* pOut=(unsigned char*)pDest;
+    unsigned char* pOutEnd=pOut+DestCapacity;
+    while (pIn<pInEnd)
+    {
+        unsigned Token=*pIn++;
+        size_t NumOfLiterals=Token>>4;
+        if ((NumOfLiterals==LZTOKENMAX)&&!GetLength(pIn,pInEnd,NumOfLiterals))
+            return (size_t)-1;
+        if (((size_t)(pInEnd-pIn)<NumOfLiterals)||((size_t)(pOutEnd-pOut)<NumOfLiterals))
+            return (size_t)-1;
+        memcpy(pOut,pIn,NumOfLiterals);
+        pIn+=NumOfLiterals;
+        pOut+=NumOfLiterals;
+        //the last record has no match
+        if (pIn==pInEnd)
+            break;
+        if (pInEnd-pIn<2)
+            return (size_t)-1;
+        size_t Offset=pIn[0]|(pIn[1]<<8);
+        pIn+=2;
+        size_t Length=Token&LZTOKENMAX;
+        if ((Length==LZTOKENMAX)&&!GetLength(pIn,pInEnd,Length))
+            return (size_t)-1;
+        Length+=LZMINMATCH;
+        if (!Offset||(Offset>(size_t)(pOut-(unsigned char*)pDest))||((size_t)(pOutEnd-pOut)<Length))
+            return (size_t)-1;
+        const unsigned char* pRef=pOut-Offset;
+        for(size_t j=0;j<Length;j++)
+            pOut[j]=pRef[j];
+        pOut+=Length;
+    };
+    return pOut-(unsigned char*)pDest;
+};
@@ -9,6 +9,7 @@
 * ********************************************************/
 
 #include <iostream>
+#include <vector>
 #include <stdlib.h>
 #include <string>
 #include <string.h>
@@ -47,9 +48,33 @@ void Usage()
         "\t\t s  store a file on the array ( FileName )  \n"
         "\t\t g  get a file from the array ( FileName )  \n"
         "\t\t c  check array consistency\n"
-        "\t\t b  run performance benchmarks ( l|r a|n WriteRatio BlockSize ThreadCount Duration )\n"
+        "\t\t r  rebuild a failed disk into the distributed spare space ( DiskID )\n"
+        "\t\t t  discard the whole stripes within a range of the array ( Offset Length )\n"
+        "\t\t z  fill a range of the array with zeroes ( Offset Length )\n"
+        "\t\t y  copy a range of the array to another position ( Source Destination Length )\n"
+        "\t\t h  scrub the stripes modified since the last scrub\n"
+        "\t\t m  compare the array with another one using the hash trees ( ConfigFile )\n"
+        "\t\t b  run performance benchmarks ( l|r a|n WriteRatio BlockSize ThreadCount Duration [DiskEvents] )\n"
         "\t\t\t Access mode: l - linear, r - random\n"
-        "\t\t\t Access type: a - BlockSize aligned, n - non-aligned\n ";
+        "\t\t\t Access type: a - BlockSize aligned, n - non-aligned\n"
+        "\t\t\t Disk events: comma-separated Time:Command, where Time is in seconds, and Command is\n"
+        "\t\t\t f<Disk> - fail, s<Disk> - rebuild into spare space, r<Disk>=<File> - replace, a<Disk> - re-add\n"
+        "\t\t e  execute disk management commands, then check the array and verify its content ( DiskCommands )\n"
+        "\t\t\t Disk commands: comma-separated commands as in the disk events of the benchmarks\n"
+        "\t\t j  replace a failed disk while the data is read and verified, then check the array ( DiskID FileName ThreadCount )\n"
+        "\t\t a  write random stripe units concurrently, then verify and check the array before and after remount ( ThreadCount Duration [DiskID] )\n"
+        "\t\t\t DiskID: the disk to be failed before the verification\n"
+        "\t\t u  write many identical stripe units, then verify and check the array before and after remount ( DistinctUnits )\n"
+        "\t\t W  verify the atomicity of large overlapping writes ( RequestStripes ThreadCount Duration )\n"
+        "\t\t R  compare the random read throughput with and without locking the stripes ( BlockSize MaxThreadCount Duration )\n"
+        "\t\t f  create an object store ( MaxObjects )\n"
+        "\t\t p  put a file into the object store ( Key FileName )\n"
+        "\t\t o  get an object into a file ( Key FileName )\n"
+        "\t\t d  delete an object ( Key )\n"
+        "\t\t l  list stored objects\n"
+        "\t\t x  run object store benchmark ( MaxObjectSize ThreadCount Duration )\n"
+        "\t\t n  create a log-structured volume ( SegmentStripes Utilization% )\n"
+        "\t\t w  run log-structured volume random write benchmark ( BlockSize ThreadCount Duration )\n ";
 };
 
 /**Report a configuration file problem
@@ -73,6 +98,8 @@ static void conf_error(cfg_t *cfg, const char * fmt, va_list ap)
 cfg_opt_t disk_opts[] ={
     CFG_STR("file", NULL, CFGF_NONE),
     CFG_BOOL("online", cfg_true, CFGF_NONE),
+    //the disk capacity, if it differs from DiskCapacity
+    CFG_INT("capacity", 0, CFGF_NONE),
     CFG_END()
 };
 
@@ -80,6 +107,35 @@ cfg_opt_t disk_opts[] ={
 cfg_opt_t opts[] ={
     CFG_INT("DiskCapacity", 1024, CFGF_NONE),
     CFG_INT("MaxConcurrentThreads", 4, CFGF_NONE),
+    CFG_STR("Journal", NULL, CFGF_NONE),
+    CFG_INT("JournalCapacity", 4194304, CFGF_NONE),
+    CFG_BOOL("HashTree", cfg_false, CFGF_NONE),
+    CFG_STR("Cache", NULL, CFGF_NONE),
+    CFG_INT("CacheCapacity", 16777216, CFGF_NONE),
+    CFG_BOOL("CacheWriteBack", cfg_true, CFGF_NONE),
+    CFG_INT("CachePromotion", 2, CFGF_NONE),
+    CFG_INT("MirrorCapacity", 0, CFGF_NONE),
+    CFG_INT("CoolingTime", 0, CFGF_NONE),
+    CFG_STR("ParityLog", NULL, CFGF_NONE),
+    CFG_INT("ParityLogCapacity", 4194304, CFGF_NONE),
+    CFG_INT("ParityCacheCapacity", 0, CFGF_NONE),
+    CFG_STR("DeferredParity", NULL, CFGF_NONE),
+    CFG_FLOAT("MaxStaleness", 10, CFGF_NONE),
+    CFG_STR("Dedup", NULL, CFGF_NONE),
+    CFG_STR("Compression", NULL, CFGF_NONE),
+    CFG_INT("CompressionBlock", 32768, CFGF_NONE),
+    //the time the small writes wait for the concurrent writes to the same stripe, in milliseconds
+    CFG_FLOAT("CoalescingWindow", 0, CFGF_NONE),
+    //the number of stripes the large reads and writes lock at once
+    CFG_INT("LockWindow", 0, CFGF_NONE),
+    //the reads of a healthy array do not lock the stripes
+    CFG_BOOL("OptimisticReads", cfg_false, CFGF_NONE),
+    //request scheduling policy. The times are given in milliseconds
+    CFG_INT("QoSDepth", 0, CFGF_NONE),
+    CFG_FLOAT("QoSReadDeadline", 10, CFGF_NONE),
+    CFG_FLOAT("QoSWriteDeadline", 50, CFGF_NONE),
+    CFG_FLOAT("QoSLatencyTarget", 0, CFGF_NONE),
+    CFG_FLOAT("QoSBackgroundRate", 0, CFGF_NONE),
     CFG_STR("RAIDType", NULL, CFGF_NONE),
     CFG_SEC("disk", disk_opts, CFGF_MULTI),
     //all RAID types should be listed here
@@ -116,54 +172,138 @@ CRAIDProcessor* GetProcessor(cfg_t * pConfig)
     return 0;
 };
 
-int main(int argc, char **argv)
+///parse a configuration file and create the disk array described by it.
+///The configuration, the processor and the disk records must be released after the array is destroyed
+///@return the array, or 0 in case of error
+static CDiskArray* OpenArray(const char* pConfigFile,///the configuration file
+                             cfg_t*& cfg,///output: the parsed configuration, or 0
+                             CRAIDProcessor*& pProcessor,///output: the coding engine, or 0
+                             DiskConf*& pDisks ///output: the disk configuration records, or 0
+                            )
 {
-#ifdef _M_IX86
-    cerr<<"WARNING! THIS PROGRAM MAY WORK INCORRECTLY IF COMPILED IN 32-BIT MODE!\n";
-#endif
-
-    if (argc < 3)
-    {
-        Usage();
-        return 1;
-    };
-    cfg_t *cfg, *cfg_disk;
+    cfg_t *cfg_disk;
+    pProcessor = 0;
+    pDisks = 0;
     cfg = cfg_init(opts, CFGF_NONE);
     cfg_set_error_function(cfg, conf_error);
 
-    if (cfg_parse(cfg, argv[1]) != CFG_SUCCESS)
+    if (cfg_parse(cfg, pConfigFile) != CFG_SUCCESS)
     {
-        cerr << "Error parsing configuration file " << argv[1] << endl;
-        return 1;
+        cerr << "Error parsing configuration file " << pConfigFile << endl;
+        return 0;
     };
     unsigned DiskCapacity = cfg_getint(cfg, "DiskCapacity");
     unsigned NumOfDisks = cfg_size(cfg, "disk");
     unsigned MaxConcurrentThreads = cfg_getint(cfg, "MaxConcurrentThreads");
+    ArrayConf Conf;
+    Conf.pJournalFile = cfg_getstr(cfg, "Journal");
+    Conf.JournalCapacity = cfg_getint(cfg, "JournalCapacity");
+    Conf.HashTree = cfg_getbool(cfg, "HashTree") > 0;
+    CacheConf Cache;
+    Cache.pFileName = cfg_getstr(cfg, "Cache");
+    Cache.Capacity = cfg_getint(cfg, "CacheCapacity");
+    Cache.WriteBack = cfg_getbool(cfg, "CacheWriteBack") > 0;
+    Cache.PromotionThreshold = cfg_getint(cfg, "CachePromotion");
+    Cache.CoolingTime = cfg_getint(cfg, "CoolingTime");
+    unsigned MirrorCapacity = cfg_getint(cfg, "MirrorCapacity");
+    Conf.pParityLogFile = cfg_getstr(cfg, "ParityLog");
+    Conf.ParityLogCapacity = cfg_getint(cfg, "ParityLogCapacity");
+    Conf.ParityCacheCapacity = cfg_getint(cfg, "ParityCacheCapacity");
+    Conf.pDeferredParityFile = cfg_getstr(cfg, "DeferredParity");
+    Conf.MaxStaleness = cfg_getfloat(cfg, "MaxStaleness");
+    Conf.pDedupFile = cfg_getstr(cfg, "Dedup");
+    Conf.pCompressionFile = cfg_getstr(cfg, "Compression");
+    Conf.CompressionBlock = cfg_getint(cfg, "CompressionBlock");
+    Conf.CoalescingWindow = cfg_getfloat(cfg, "CoalescingWindow") / 1000;
+    Conf.LockWindow = cfg_getint(cfg, "LockWindow");
+    Conf.OptimisticReads = cfg_getbool(cfg, "OptimisticReads") > 0;
+    if (MirrorCapacity)
+    {
+        if (Cache.pFileName)
+        {
+            cerr << "The cache device and the mirrored tier cannot be used together\n";
+            return 0;
+        };
+        //the written segments are mirrored immediately, and moved to the erasure-coded stripes in background
+        Cache.Capacity = MirrorCapacity;
+        Cache.WriteBack = true;
+        Cache.PromotionThreshold = 1;
+    };
+    QoSParams QoS;
+    QoS.Depth = cfg_getint(cfg, "QoSDepth");
+    QoS.Deadlines[iocRead] = cfg_getfloat(cfg, "QoSReadDeadline") / 1000;
+    QoS.Deadlines[iocWrite] = cfg_getfloat(cfg, "QoSWriteDeadline") / 1000;
+    QoS.LatencyTarget = cfg_getfloat(cfg, "QoSLatencyTarget") / 1000;
+    QoS.BackgroundRate = cfg_getfloat(cfg, "QoSBackgroundRate");
     if (!NumOfDisks)
     {
-        cerr << "No disk configuration found in the configuration file " << argv[1] << endl;
-        return 1;
+        cerr << "No disk configuration found in the configuration file " << pConfigFile << endl;
+        return 0;
+    };
+
+    pDisks = new DiskConf[NumOfDisks ];
+    for (unsigned i = 0; i < NumOfDisks; i++)
+    {
+        cfg_disk = cfg_getnsec(cfg, "disk", i);
+        pDisks[i].pFileName = cfg_getstr(cfg_disk, "file");
+        pDisks[i].Online = cfg_getbool(cfg_disk, "online") > 0;
+        pDisks[i].Capacity = cfg_getint(cfg_disk, "capacity");
     };
 
+
+    pProcessor = GetProcessor(cfg);
+    if (!pProcessor)
+    {
+        cerr << "Failed to initialize RAID processor\n";
+        return 0;
+    };
+    if (Cache.pFileName || MirrorCapacity)
+        Conf.pCache = &Cache;
+    CDiskArray* pArray;
     try
     {
+        pArray = new CDiskArray(NumOfDisks, pDisks, DiskCapacity, *pProcessor, MaxConcurrentThreads, Conf);
+    }
+    catch (const Exception& ex)
+    {
+        cerr << ex.what() << endl;
+        delete pProcessor;
+        delete[]pDisks;
+        pProcessor = 0;
+        pDisks = 0;
+        return 0;
+    };
+    pArray->GetScheduler().Configure(QoS);
+    return pArray;
+};
 
-        DiskConf* pDisks = new DiskConf[NumOfDisks ];
-        for (unsigned i = 0; i < NumOfDisks; i++)
-        {
-            cfg_disk = cfg_getnsec(cfg, "disk", i);
-            pDisks[i].pFileName = cfg_getstr(cfg_disk, "file");
-            pDisks[i].Online = cfg_getbool(cfg_disk, "online") > 0;
-        };
+int main(int argc, char **argv)
+{
+#ifdef _M_IX86
+    cerr<<"WARNING! THIS PROGRAM MAY WORK INCORRECTLY IF COMPILED IN 32-BIT MODE!\n";
+#endif
 
+    if (argc < 3)
+    {
+        Usage();
+        return 1;
+    };
+    cfg_t *cfg = 0;
 
-        CRAIDProcessor* pProcessor = GetProcessor(cfg);
-        if (!pProcessor)
+    try
+    {
+        CRAIDProcessor* pProcessor;
+        DiskConf* pDisks;
+        CDiskArray* pArray = OpenArray(argv[1], cfg, pProcessor, pDisks);
+        if (!pArray)
         {
-            cerr << "Failed to initialize RAID processor\n";
+            if (cfg)
+                cfg_free(cfg);
+            delete pProcessor;
+            delete[]pDisks;
             return 1;
         };
-        CDiskArray Array(NumOfDisks, pDisks, DiskCapacity, *pProcessor, MaxConcurrentThreads );
+        CDiskArray& Array = *pArray;
         cout << "Array type is " << ppRAIDNames[Array.GetType()] << '*'<<Array.GetNumOfSubarrays()<< endl;
         cout << "Array state is " << pArrayStates[Array.GetState()] << endl;
         cout<<"Disk status ";
@@ -203,9 +343,55 @@ int main(int argc, char **argv)
         case 'c':
             Result = Check(Array);
             break;
+        case 'r':
+            if (argc == 4)
+            {
+                Result = RebuildDisk(Array, atoi(argv[3]));
+            }
+            else Usage();
+            break;
+        case 't':
+        case 'z':
+            if (argc == 5)
+            {
+                Result = DiscardRange(Array, atoll(argv[3]), atoll(argv[4]), c == 'z');
+            }
+            else Usage();
+            break;
+        case 'y':
+            if (argc == 6)
+            {
+                Result = CopyRange(Array, atoll(argv[3]), atoll(argv[4]), atoll(argv[5]));
+            }
+            else Usage();
+            break;
+        case 'h':
+            Result = ScrubArray(Array);
+            break;
+        case 'm':
+            if (argc == 4)
+            {
+                cfg_t* cfg2;
+                CRAIDProcessor* pProcessor2;
+                DiskConf* pDisks2;
+                CDiskArray* pArray2 = OpenArray(argv[3], cfg2, pProcessor2, pDisks2);
+                if (pArray2)
+                {
+                    Result = CompareArrays(Array, *pArray2);
+                    pArray2->Unmount();
+                }
+                else
+                    Result = 1;
+                delete pArray2;
+                cfg_free(cfg2);
+                delete pProcessor2;
+                delete[]pDisks2;
+            }
+            else Usage();
+            break;
         case 'b':
             {
-                if (argc == 9)
+                if ((argc == 9) || (argc == 10))
                 {
                     //run performance benchmarks
                     bool Random, Aligned;
@@ -237,18 +423,117 @@ int main(int argc, char **argv)
                     unsigned BlockSize = atoi(argv[6]);
                     unsigned ThreadCount = atoi(argv[7]);
                     unsigned MaxTime = atoi(argv[8]);
-                    Result=Benchmark(Array, Random, BlockSize, Aligned, WriteRatio, ThreadCount, MaxTime);
+                    const char* pDiskEvents = (argc == 10) ? argv[9] : 0;
+                    Result=Benchmark(Array, Random, BlockSize, Aligned, WriteRatio, ThreadCount, MaxTime, pDiskEvents);
                 }
                 else Usage();
                 break;
             }
+        case 'e':
+            if (argc == 4)
+            {
+                Result = DiskEventsVerify(Array, argv[3]);
+            }
+            else Usage();
+            break;
+        case 'j':
+            if (argc == 6)
+            {
+                Result = RepairVerify(Array, atoi(argv[3]), argv[4], atoi(argv[5]));
+            }
+            else Usage();
+            break;
+        case 'a':
+            if ((argc == 5) || (argc == 6))
+            {
+                Result = SmallWriteVerify(Array, atoi(argv[3]), atoi(argv[4]), (argc == 6) ? atoi(argv[5]) : -1);
+            }
+            else Usage();
+            break;
+        case 'u':
+            if (argc == 4)
+            {
+                Result = DuplicateVerify(Array, atoi(argv[3]));
+            }
+            else Usage();
+            break;
+        case 'W':
+            if (argc == 6)
+            {
+                Result = AtomicityVerify(Array, atoi(argv[3]), atoi(argv[4]), atoi(argv[5]));
+            }
+            else Usage();
+            break;
+        case 'R':
+            if (argc == 6)
+            {
+                Result = ReadScaling(Array, atoi(argv[3]), atoi(argv[4]), atoi(argv[5]));
+            }
+            else Usage();
+            break;
+        case 'f':
+            if (argc == 4)
+            {
+                Result = FormatObjectStore(Array, atoi(argv[3]));
+            }
+            else Usage();
+            break;
+        case 'p':
+            if (argc == 5)
+            {
+                Result = PutObject(Array, argv[3], argv[4]);
+            }
+            else Usage();
+            break;
+        case 'o':
+            if (argc == 5)
+            {
+                Result = GetObject(Array, argv[3], argv[4]);
+            }
+            else Usage();
+            break;
+        case 'd':
+            if (argc == 4)
+            {
+                Result = DeleteObject(Array, argv[3]);
+            }
+            else Usage();
+            break;
+        case 'l':
+            Result = ListObjects(Array);
+            break;
+        case 'x':
+            if (argc == 6)
+            {
+                Result = ObjectBenchmark(Array, atoi(argv[3]), atoi(argv[4]), atoi(argv[5]));
+            }
+            else Usage();
+            break;
+        case 'n':
+            if (argc == 5)
+            {
+                Result = FormatLogVolume(Array, atoi(argv[3]), atoi(argv[4]));
+            }
+            else Usage();
+            break;
+        case 'w':
+            if (argc == 6)
+            {
+                Result = LogBenchmark(Array, atoi(argv[3]), atoi(argv[4]), atoi(argv[5]));
+            }
+            else Usage();
+            break;
         default:
             {
                 Usage();
+                delete pArray;
                 cfg_free(cfg);
                 return 1;
             };
         };
+        //complete the pending writes while the processor is still available
+        Array.Unmount();
+        delete pArray;
         cfg_free(cfg);
         delete pProcessor;
         delete[]pDisks;
@@ -258,7 +543,8 @@ int main(int argc, char **argv)
     catch (const Exception& ex)
     {
         cerr << ex.what() << endl;
-        cfg_free(cfg);
+        if (cfg)
+            cfg_free(cfg);
         return 1;
     };
 
@@ -0,0 +1,594 @@
+/*********************************************************
+ * objstore.cpp  - implementation of an extent-based object store
+ *
+ * Copyright(C) 2012 Saint-Petersburg State Polytechnic University
+ *
+ * Developed in the framework of the "Forward error correction for next generation storage systems" project
+ *
+ * Author: P. Trifonov petert@dcn.ftk.spbstu.ru
+ * ********************************************************/
+#include <iostream>
+#include <string.h>
+#include "misc.h"
+#include "arithmetic.h"
+#include "objstore.h"
+
+using namespace std;
+
+///object store format identifier
+#define OBJSTOREMAGIC 0x0B1EC75E
+///object store format version
+#define OBJSTOREVERSION 2
+///the maximal number of stripes transferred via the intermediate buffer at once
+#define OBJECTBOUNCESTRIPES 16
+
+///compute CRC32 of a memory block
+static unsigned GetChecksum(const void* pData,size_t Size)
+{
+    unsigned CRC=0;
+    UpdateCRC32(CRC,Size,(const unsigned char*)pData);
+    return CRC;
+};
+
+CObjectStore::CObjectStore(CDiskArray& A):m_Array(A),m_StripeSize(A.GetStripeSize()),m_Loaded(false),
+    m_pIndex(0),m_pReaders(0),m_pRetired(0),m_pFreeEntries(0),m_NumOfFreeEntries(0),m_NextGeneration(1)
+{
+    if (!InitCS(m_Lock))
+        throw Exception("Failed to initialize object store mutex");
+    InitCRC32();
+    memset(&m_Header,0,sizeof(m_Header));
+};
+
+CObjectStore::~CObjectStore()
+{
+    ReleaseIndex();
+    DestroyCS(m_Lock);
+};
+
+///allocate the in-memory structures for a given index size
+void CObjectStore::AllocateIndex(unsigned MaxObjects)
+{
+    ReleaseIndex();
+    m_pIndex=new ObjectRecord[MaxObjects];
+    memset(m_pIndex,0,sizeof(ObjectRecord)*MaxObjects);
+    m_pReaders=new unsigned[MaxObjects];
+    memset(m_pReaders,0,sizeof(unsigned)*MaxObjects);
+    m_pRetired=new bool[MaxObjects];
+    memset(m_pRetired,0,sizeof(bool)*MaxObjects);
+    m_pFreeEntries=new unsigned[MaxObjects];
+    m_NumOfFreeEntries=0;
+    m_Names.clear();
+    m_FreeExtents.clear();
+};
+
+///release the in-memory structures
+void CObjectStore::ReleaseIndex()
+{
+    delete[]m_pIndex;
+    delete[]m_pReaders;
+    delete[]m_pRetired;
+    delete[]m_pFreeEntries;
+    m_pIndex=0;
+    m_pReaders=0;
+    m_pRetired=0;
+    m_pFreeEntries=0;
+    m_Loaded=false;
+};
+
+/**Insert the range into the free extent map, merging it with the neighbours
+ */
+void CObjectStore::FreeExtent(unsigned long long Start,unsigned long long Length)
+{
+    if (!Length) return;
+    map<unsigned long long,unsigned long long>::iterator Next=m_FreeExtents.lower_bound(Start);
+    if (Next!=m_FreeExtents.begin())
+    {
+        map<unsigned long long,unsigned long long>::iterator Prev=Next;
+        Prev--;
+        if (Prev->first+Prev->second==Start)
+        {
+            //extend the preceding free range
+            Start=Prev->first;
+            Length+=Prev->second;
+            m_FreeExtents.erase(Prev);
+        };
+    };
+    if ((Next!=m_FreeExtents.end())&&(Next->first==Start+Length))
+    {
+        //absorb the following free range
+        Length+=Next->second;
+        m_FreeExtents.erase(Next);
+    };
+    m_FreeExtents[Start]=Length;
+};
+
+/**Cut the range out of the free extent containing it
+ */
+void CObjectStore::ReserveExtent(unsigned long long Start,unsigned long long Length)
+{
+    map<unsigned long long,unsigned long long>::iterator E=m_FreeExtents.upper_bound(Start);
+    if (E==m_FreeExtents.begin())
+        throw Exception("Object store index references allocated space");
+    E--;
+    unsigned long long FreeStart=E->first;
+    unsigned long long FreeLength=E->second;
+    if (FreeStart+FreeLength<Start+Length)
+        throw Exception("Object store index references allocated space");
+    m_FreeExtents.erase(E);
+    if (Start>FreeStart)
+        m_FreeExtents[FreeStart]=Start-FreeStart;
+    if (FreeStart+FreeLength>Start+Length)
+        m_FreeExtents[Start+Length]=FreeStart+FreeLength-Start-Length;
+};
+
+/**Try to find a single free extent of sufficient size (best fit).
+ * If there is none, combine up to MAXOBJECTEXTENTS largest free extents.
+ */
+unsigned CObjectStore::AllocateExtents(unsigned long long Stripes2Allocate,///the requested size in stripes
+                                       ObjectExtent* pExtents ///output array of MAXOBJECTEXTENTS entries
+                                      )
+{
+    if (!Stripes2Allocate)
+        return 0;
+    map<unsigned long long,unsigned long long>::iterator Best=m_FreeExtents.end();
+    //the largest free extents in descending order
+    map<unsigned long long,unsigned long long>::iterator Largest[MAXOBJECTEXTENTS];
+    unsigned NumOfLargest=0;
+    for(map<unsigned long long,unsigned long long>::iterator E=m_FreeExtents.begin();E!=m_FreeExtents.end();E++)
+    {
+        if ((E->second>=Stripes2Allocate)&&((Best==m_FreeExtents.end())||(E->second<Best->second)))
+            Best=E;
+        //insertion sort into the list of the largest extents
+        unsigned i=NumOfLargest;
+        while((i>0)&&(Largest[i-1]->second<E->second))
+        {
+            if (i<MAXOBJECTEXTENTS)
+                Largest[i]=Largest[i-1];
+            i--;
+        };
+        if (i<MAXOBJECTEXTENTS)
+        {
+            Largest[i]=E;
+            if (NumOfLargest<MAXOBJECTEXTENTS)
+                NumOfLargest++;
+        };
+    };
+    if (Best!=m_FreeExtents.end())
+    {
+        pExtents[0].Start=Best->first;
+        pExtents[0].Length=Stripes2Allocate;
+        ReserveExtent(Best->first,Stripes2Allocate);
+        return 1;
+    };
+    unsigned long long Available=0;
+    unsigned N=0;
+    while((N<NumOfLargest)&&(Available<Stripes2Allocate))
+        Available+=Largest[N++]->second;
+    if (Available<Stripes2Allocate)
+        //no space left
+        return 0;
+    unsigned long long Remaining=Stripes2Allocate;
+    for(unsigned i=0;i<N;i++)
+    {
+        pExtents[i].Start=Largest[i]->first;
+        pExtents[i].Length=min(Remaining,Largest[i]->second);
+        Remaining-=pExtents[i].Length;
+    };
+    //iterators may be invalidated by ReserveExtent, so do it in a separate pass
+    for(unsigned i=0;i<N;i++)
+        ReserveExtent(pExtents[i].Start,pExtents[i].Length);
+    return N;
+};
+
+///release the extents of an index entry. Must be called with m_Lock held
+void CObjectStore::ReleaseExtents(const ObjectRecord& R)
+{
+    for(unsigned i=0;i<R.NumOfExtents;i++)
+        FreeExtent(R.Extents[i].Start,R.Extents[i].Length);
+};
+
+/**Drop the reference. A retired entry is recycled when nobody uses it anymore
+ */
+void CObjectStore::Unpin(unsigned EntryID)
+{
+    m_pReaders[EntryID]--;
+    if (!m_pReaders[EntryID]&&m_pRetired[EntryID])
+    {
+        ReleaseExtents(m_pIndex[EntryID]);
+        memset(m_pIndex+EntryID,0,sizeof(ObjectRecord));
+        m_pRetired[EntryID]=false;
+        m_pFreeEntries[m_NumOfFreeEntries++]=EntryID;
+    };
+};
+
+///write an index entry to the array
+///@return true on success
+bool CObjectStore::WriteRecord(unsigned EntryID,///position of the entry within the index
+                               const ObjectRecord& R ///the record to be written
+                              )
+{
+    CDiskArray::tHandle F=m_Array.open();
+    m_Array.seek(F,m_Header.IndexStart*m_StripeSize+(unsigned long long)EntryID*sizeof(ObjectRecord),SEEK_SET);
+    return m_Array.write(F,sizeof(ObjectRecord),(const unsigned char*)&R)==sizeof(ObjectRecord);
+};
+
+/**Data are transferred extent by extent. Whole stripes are passed directly to the array
+ * if the buffer is properly aligned, so that the array performs full-stripe encoding.
+ * The incomplete trailing stripe is padded with zeroes.
+ */
+bool CObjectStore::TransferData(const ObjectRecord& R,///object descriptor
+                                unsigned char* pData,///data buffer
+                                unsigned long long Size,///the number of bytes to transfer
+                                bool Write ///true if the data should be written to the array
+                               )
+{
+    bool Aligned=((size_t)pData%ARITHMETIC_ALIGNMENT)==0;
+    unsigned char* pBounce=0;
+    CDiskArray::tHandle F=m_Array.open();
+    bool Result=true;
+    for(unsigned e=0;Result&&(e<R.NumOfExtents)&&Size;e++)
+    {
+        unsigned long long Pos=R.Extents[e].Start*m_StripeSize;
+        unsigned long long Bytes2Transfer=min(Size,(unsigned long long)R.Extents[e].Length*m_StripeSize);
+        while(Result&&Bytes2Transfer)
+        {
+            m_Array.seek(F,Pos,SEEK_SET);
+            unsigned long long FullStripes=Bytes2Transfer/m_StripeSize;
+            if (Aligned&&FullStripes)
+            {
+                //transfer complete stripes directly
+                long long Chunk=FullStripes*m_StripeSize;
+                if (Write)
+                    Result=m_Array.write(F,Chunk,pData)==Chunk;
+                else
+                    Result=m_Array.read(F,Chunk,pData)==Chunk;
+                Pos+=Chunk;
+                pData+=Chunk;
+                Size-=Chunk;
+                Bytes2Transfer-=Chunk;
+                continue;
+            };
+            //use the intermediate buffer
+            if (!pBounce)
+                pBounce=AlignedMalloc(OBJECTBOUNCESTRIPES*m_StripeSize);
+            unsigned long long Stripes=(Bytes2Transfer+m_StripeSize-1)/m_StripeSize;
+            if (Stripes>OBJECTBOUNCESTRIPES)
+                Stripes=OBJECTBOUNCESTRIPES;
+            unsigned long long Chunk=min(Bytes2Transfer,Stripes*m_StripeSize);
+            long long Length=Stripes*m_StripeSize;
+            if (Write)
+            {
+                memcpy(pBounce,pData,(size_t)Chunk);
+                memset(pBounce+Chunk,0,(size_t)(Length-Chunk));
+                Result=m_Array.write(F,Length,pBounce)==Length;
+            }else
+            {
+                Result=m_Array.read(F,Length,pBounce)==Length;
+                memcpy(pData,pBounce,(size_t)Chunk);
+            };
+            Pos+=Length;
+            pData+=Chunk;
+            Size-=Chunk;
+            Bytes2Transfer-=Chunk;
+        };
+    };
+    AlignedFree(pBounce);
+    return Result&&!Size;
+};
+
+/**Write the header to the first stripe and clear the index area
+ */
+bool CObjectStore::Format(unsigned MaxObjects ///the number of index entries
+                         )
+{
+    if (!MaxObjects)
+        return false;
+    ObjectStoreHeader H;
+    memset(&H,0,sizeof(H));
+    H.MagicNumber=OBJSTOREMAGIC;
+    H.Version=OBJSTOREVERSION;
+    H.StripeSize=m_StripeSize;
+    H.MaxObjects=MaxObjects;
+    H.IndexStart=1;
+    H.IndexStripes=((unsigned long long)MaxObjects*sizeof(ObjectRecord)+m_StripeSize-1)/m_StripeSize;
+    H.NumOfStripes=m_Array.GetCapacity()/m_StripeSize;
+    if (H.IndexStart+H.IndexStripes>=H.NumOfStripes)
+    {
+        cerr<<"The object index does not fit into the array\n";
+        return false;
+    };
+    H.Checksum=GetChecksum(&H,sizeof(H)-sizeof(H.Checksum));
+
+    unsigned char* pBuffer=AlignedMalloc(OBJECTBOUNCESTRIPES*m_StripeSize);
+    memset(pBuffer,0,OBJECTBOUNCESTRIPES*m_StripeSize);
+    CDiskArray::tHandle F=m_Array.open();
+    //clear the index
+    bool Result=true;
+    m_Array.seek(F,H.IndexStart*m_StripeSize,SEEK_SET);
+    for(unsigned long long S=0;Result&&(S<H.IndexStripes);S+=OBJECTBOUNCESTRIPES)
+    {
+        long long Length=min((unsigned long long)OBJECTBOUNCESTRIPES,H.IndexStripes-S)*m_StripeSize;
+        Result=m_Array.write(F,Length,pBuffer)==Length;
+    };
+    //the header goes last, so that an interrupted format leaves no valid store
+    memcpy(pBuffer,&H,sizeof(H));
+    m_Array.seek(F,0,SEEK_SET);
+    Result=Result&&(m_Array.write(F,m_StripeSize,pBuffer)==m_StripeSize);
+    AlignedFree(pBuffer);
+    if (!Result)
+        return false;
+
+    LockCS(m_Lock);
+    m_Header=H;
+    AllocateIndex(MaxObjects);
+    for(unsigned i=MaxObjects;i>0;i--)
+        m_pFreeEntries[m_NumOfFreeEntries++]=i-1;
+    FreeExtent(H.IndexStart+H.IndexStripes,H.NumOfStripes-H.IndexStart-H.IndexStripes);
+    m_NextGeneration=1;
+    m_Loaded=true;
+    UnlockCS(m_Lock);
+    return true;
+};
+
+/**Read the header and the index. The free space map is reconstructed from the extents
+ * of valid index entries. If there are several records with the same name
+ * (e.g. a crash during object replacement), the latest one is used, and the remaining ones are discarded
+ */
+bool CObjectStore::Load()
+{
+    unsigned char* pBuffer=AlignedMalloc(m_StripeSize);
+    CDiskArray::tHandle F=m_Array.open();
+    if (m_Array.read(F,m_StripeSize,pBuffer)!=m_StripeSize)
+    {
+        AlignedFree(pBuffer);
+        cerr<<"Failed to read object store header\n";
+        return false;
+    };
+    ObjectStoreHeader H;
+    memcpy(&H,pBuffer,sizeof(H));
+    AlignedFree(pBuffer);
+    if ((H.MagicNumber!=OBJSTOREMAGIC)||(H.Version!=OBJSTOREVERSION)||
+            (H.Checksum!=GetChecksum(&H,sizeof(H)-sizeof(H.Checksum))))
+    {
+        cerr<<"No valid object store found on the array\n";
+        return false;
+    };
+    if ((H.StripeSize!=m_StripeSize)||(H.NumOfStripes*m_StripeSize>m_Array.GetCapacity()))
+    {
+        cerr<<"Object store geometry does not match the array\n";
+        return false;
+    };
+    //load the index
+    unsigned long long IndexSize=H.IndexStripes*m_StripeSize;
+    pBuffer=AlignedMalloc(IndexSize);
+    m_Array.seek(F,H.IndexStart*m_StripeSize,SEEK_SET);
+    if (m_Array.read(F,IndexSize,pBuffer)!=(long long)IndexSize)
+    {
+        AlignedFree(pBuffer);
+        cerr<<"Failed to read object store index\n";
+        return false;
+    };
+    LockCS(m_Lock);
+    m_Header=H;
+    AllocateIndex(H.MaxObjects);
+    memcpy(m_pIndex,pBuffer,sizeof(ObjectRecord)*H.MaxObjects);
+    AlignedFree(pBuffer);
+    FreeExtent(H.IndexStart+H.IndexStripes,H.NumOfStripes-H.IndexStart-H.IndexStripes);
+    m_NextGeneration=1;
+    bool Result=true;
+    for(unsigned i=H.MaxObjects;i>0;i--)
+    {
+        ObjectRecord& R=m_pIndex[i-1];
+        if (!R.Key[0]||(R.Checksum!=GetChecksum(&R,sizeof(R)-sizeof(R.Checksum))))
+        {
+            //free or corrupted entry
+            memset(&R,0,sizeof(R));
+            m_pFreeEntries[m_NumOfFreeEntries++]=i-1;
+            continue;
+        };
+        R.Key[OBJECTKEYSIZE-1]=0;
+        if (R.Generation>=m_NextGeneration)
+            m_NextGeneration=R.Generation+1;
+        map<string,unsigned>::iterator E=m_Names.find(R.Key);
+        if (E!=m_Names.end())
+        {
+            //keep the latest record
+            unsigned Stale=E->second;
+            if (m_pIndex[Stale].Generation>R.Generation)
+                Stale=i-1;
+            else
+            {
+                ReleaseExtents(m_pIndex[E->second]);
+                E->second=i-1;
+            };
+            memset(m_pIndex+Stale,0,sizeof(ObjectRecord));
+            m_pFreeEntries[m_NumOfFreeEntries++]=Stale;
+            if (Stale==i-1)
+                continue;
+        }else
+            m_Names[R.Key]=i-1;
+        try
+        {
+            for(unsigned j=0;j<R.NumOfExtents;j++)
+                ReserveExtent(R.Extents[j].Start,R.Extents[j].Length);
+        }catch(const Exception& ex)
+        {
+            cerr<<ex.what()<<": object "<<R.Key<<endl;
+            Result=false;
+        };
+    };
+    m_Loaded=Result;
+    UnlockCS(m_Lock);
+    return Result;
+};
+
+/**Allocate an index entry and extents, write the data, and then
+ * the index entry. Only after that the old version of the object is removed.
+ */
+bool CObjectStore::Put(const char* pKey,///object name
+                       const unsigned char* pData,///object data
+                       unsigned long long Size ///object size
+                      )
+{
+    size_t KeyLength=strlen(pKey);
+    if (!KeyLength||(KeyLength>=OBJECTKEYSIZE))
+        return false;
+    ObjectRecord R;
+    memset(&R,0,sizeof(R));
+    memcpy(R.Key,pKey,KeyLength);
+    R.Size=Size;
+    R.CRC32=GetChecksum(pData,(size_t)Size);
+    unsigned long long Stripes=(Size+m_StripeSize-1)/m_StripeSize;
+
+    LockCS(m_Lock);
+    if (!m_Loaded||!m_NumOfFreeEntries)
+    {
+        UnlockCS(m_Lock);
+        return false;
+    };
+    R.NumOfExtents=AllocateExtents(Stripes,R.Extents);
+    if (Stripes&&!R.NumOfExtents)
+    {
+        UnlockCS(m_Lock);
+        return false;
+    };
+    unsigned EntryID=m_pFreeEntries[--m_NumOfFreeEntries];
+    R.Generation=m_NextGeneration++;
+    R.Checksum=GetChecksum(&R,sizeof(R)-sizeof(R.Checksum));
+    //the entry is not visible by name yet, but keep its space reserved
+    m_pIndex[EntryID]=R;
+    m_pReaders[EntryID]=1;
+    UnlockCS(m_Lock);
+
+    bool Result=TransferData(R,(unsigned char*)pData,Size,true);
+    Result=Result&&WriteRecord(EntryID,R);
+
+    LockCS(m_Lock);
+    if (!Result)
+    {
+        m_pRetired[EntryID]=true;
+        Unpin(EntryID);
+        UnlockCS(m_Lock);
+        return false;
+    };
+    unsigned OldEntryID=EntryID;
+    map<string,unsigned>::iterator E=m_Names.find(R.Key);
+    if (E==m_Names.end())
+    {
+        m_Names[R.Key]=EntryID;
+        m_pReaders[EntryID]--;
+        UnlockCS(m_Lock);
+        return true;
+    };
+    if (m_pIndex[E->second].Generation<R.Generation)
+    {
+        //replace the older version
+        OldEntryID=E->second;
+        E->second=EntryID;
+        m_pReaders[EntryID]--;
+        m_pReaders[OldEntryID]++;
+    };
+    //otherwise, a concurrent Put() has already stored a newer version, so discard ours
+    UnlockCS(m_Lock);
+    ObjectRecord Empty;
+    memset(&Empty,0,sizeof(Empty));
+    WriteRecord(OldEntryID,Empty);
+    LockCS(m_Lock);
+    m_pRetired[OldEntryID]=true;
+    Unpin(OldEntryID);
+    UnlockCS(m_Lock);
+    return true;
+};
+
+///@return the size of an object, or -1 if it does not exist
+long long CObjectStore::GetSize(const char* pKey)
+{
+    LockCS(m_Lock);
+    long long Size=-1;
+    map<string,unsigned>::iterator E=m_Names.find(pKey);
+    if (E!=m_Names.end())
+        Size=m_pIndex[E->second].Size;
+    UnlockCS(m_Lock);
+    return Size;
+};
+
+/**The index entry is pinned while the data is read, so that a concurrent Delete() or Put()
+ * cannot reuse its extents
+ */
+long long CObjectStore::Get(const char* pKey,///object name
+                            unsigned char* pDest,///destination buffer
+                            unsigned long long BufferSize ///size of the destination buffer
+                           )
+{
+    LockCS(m_Lock);
+    map<string,unsigned>::iterator E=m_Names.find(pKey);
+    if ((E==m_Names.end())||(m_pIndex[E->second].Size>BufferSize))
+    {
+        UnlockCS(m_Lock);
+        return -1;
+    };
+    unsigned EntryID=E->second;
+    ObjectRecord R=m_pIndex[EntryID];
+    m_pReaders[EntryID]++;
+    UnlockCS(m_Lock);
+
+    bool Result=TransferData(R,pDest,R.Size,false);
+
+    LockCS(m_Lock);
+    Unpin(EntryID);
+    UnlockCS(m_Lock);
+    if (!Result)
+        return -1;
+    if (GetChecksum(pDest,(size_t)R.Size)!=R.CRC32)
+    {
+        cerr<<"Checksum mismatch for object "<<pKey<<endl;
+        return -1;
+    };
+    return R.Size;
+};
+
+/**Remove the object from the name map and clear its index entry.
+ * The space is released as soon as all readers finish
+ */
+bool CObjectStore::Delete(const char* pKey)
+{
+    LockCS(m_Lock);
+    map<string,unsigned>::iterator E=m_Names.find(pKey);
+    if (E==m_Names.end())
+    {
+        UnlockCS(m_Lock);
+        return false;
+    };
+    unsigned EntryID=E->second;
+    m_Names.erase(E);
+    m_pReaders[EntryID]++;
+    UnlockCS(m_Lock);
+    ObjectRecord Empty;
+    memset(&Empty,0,sizeof(Empty));
+    bool Result=WriteRecord(EntryID,Empty);
+    LockCS(m_Lock);
+    m_pRetired[EntryID]=true;
+    Unpin(EntryID);
+    UnlockCS(m_Lock);
+    return Result;
+};
+
+///call the specified function for each stored object
+void CObjectStore::Enumerate(tObjectCallback pCallback,void* pContext)
+{
+    LockCS(m_Lock);
+    for(map<string,unsigned>::iterator E=m_Names.begin();E!=m_Names.end();E++)
+        pCallback(E->first.c_str(),m_pIndex[E->second].Size,pContext);
+    UnlockCS(m_Lock);
+};
+
+///@return the number of free stripes
+unsigned long long CObjectStore::GetFreeStripes()
+{
+    LockCS(m_Lock);
+    unsigned long long S=0;
+    for(map<unsigned long long,unsigned long long>::iterator E=m_FreeExtents.begin();E!=m_FreeExtents.end();E++)
+        S+=E->second;
+    UnlockCS(m_Lock);
+    return S;
+};
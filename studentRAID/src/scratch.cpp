@@ -0,0 +1,120 @@
+/*********************************************************
+ * scratch.cpp  - implementation of a pool of scratch memory arenas
+ *
+ * Copyright(C) 2012 Saint-Petersburg State Polytechnic University
+ *
+ * Developed in the framework of the "Forward error correction for next generation storage systems" project
+ *
+ * Author: P. Trifonov petert@dcn.ftk.spbstu.ru
+ * ********************************************************/
+#include <string.h>
+#include "misc.h"
+#include "arithmetic.h"
+#include "scratch.h"
+
+using namespace std;
+
+CScratchPool::CScratchPool():m_ArenaSize(0),m_ppArenas(0),m_Capacity(0),m_NumOfArenas(0),m_pFreeArenas(0),m_NumOfFreeArenas(0)
+{
+    if (!InitCS(m_Lock))
+        throw Exception("Failed to initialize scratch pool mutex");
+};
+
+CScratchPool::~CScratchPool()
+{
+    Clear();
+    DestroyCS(m_Lock);
+};
+
+///deallocate all arenas
+void CScratchPool::Clear()
+{
+    for(size_t i=0;i<m_Blocks.size();i++)
+        AlignedFree(m_Blocks[i]);
+    m_Blocks.clear();
+    for(size_t i=0;i<m_RetiredTables.size();i++)
+        delete[]m_RetiredTables[i];
+    m_RetiredTables.clear();
+    delete[]m_ppArenas;
+    delete[]m_pFreeArenas;
+    m_ppArenas=0;
+    m_pFreeArenas=0;
+    m_Capacity=0;
+    m_NumOfArenas=0;
+    m_NumOfFreeArenas=0;
+};
+
+/**The arenas are carved from a single block, which is aligned to the cache line boundary.
+ * If the address table is full, it is replaced with a copy of double size. The old table is kept,
+ * since other threads may still read it to locate their arenas
+ */
+void CScratchPool::Grow(size_t NumOfArenas ///the number of arenas to be added
+                       )
+{
+    if (!NumOfArenas)
+        return;
+    if (m_NumOfArenas+NumOfArenas>m_Capacity)
+    {
+        size_t Capacity=max(m_Capacity*2,m_NumOfArenas+NumOfArenas);
+        unsigned char** ppArenas=new unsigned char*[Capacity];
+        size_t* pFreeArenas=new size_t[Capacity];
+        if (m_NumOfArenas)
+            memcpy(ppArenas,m_ppArenas,sizeof(unsigned char*)*m_NumOfArenas);
+        if (m_NumOfFreeArenas)
+            memcpy(pFreeArenas,m_pFreeArenas,sizeof(size_t)*m_NumOfFreeArenas);
+        if (m_ppArenas)
+            m_RetiredTables.push_back((unsigned char**)m_ppArenas);
+        delete[]m_pFreeArenas;
+        m_pFreeArenas=pFreeArenas;
+        m_Capacity=Capacity;
+        //the new entries must be visible before the table
+        FullBarrier();
+        m_ppArenas=ppArenas;
+    };
+    unsigned char* pBlock=AlignedMalloc(NumOfArenas*m_ArenaSize+CACHELINESIZE);
+    memset(pBlock,0,NumOfArenas*m_ArenaSize+CACHELINESIZE);
+    m_Blocks.push_back(pBlock);
+    unsigned char* pArena=pBlock+(CACHELINESIZE-(size_t)pBlock%CACHELINESIZE)%CACHELINESIZE;
+    for(size_t i=0;i<NumOfArenas;i++)
+    {
+        m_ppArenas[m_NumOfArenas]=pArena+i*m_ArenaSize;
+        m_pFreeArenas[m_NumOfFreeArenas++]=m_NumOfArenas++;
+    };
+};
+
+/**Arena size is rounded up, so that no two arenas share a cache line
+ */
+void CScratchPool::Reset(size_t ArenaSize,///the number of bytes needed by a request
+                         size_t NumOfArenas ///the number of arenas to be preallocated
+                        )
+{
+    Clear();
+    if (!ArenaSize)
+        ArenaSize=1;
+    m_ArenaSize=(ArenaSize+CACHELINESIZE-1)/CACHELINESIZE*CACHELINESIZE;
+    LockCS(m_Lock);
+    Grow(NumOfArenas);
+    UnlockCS(m_Lock);
+};
+
+/**The pool is extended by as many arenas as it already has, so that the number of allocations
+ * grows logarithmically with the peak concurrency
+ */
+size_t CScratchPool::Acquire()
+{
+    LockCS(m_Lock);
+    if (!m_NumOfFreeArenas)
+        Grow(max(m_NumOfArenas,(size_t)1));
+    size_t ArenaID=m_pFreeArenas[--m_NumOfFreeArenas];
+    UnlockCS(m_Lock);
+    return ArenaID;
+};
+
+///return the arena to the pool
+void CScratchPool::Release(size_t ArenaID ///the value returned by Acquire()
+                          )
+{
+    LockCS(m_Lock);
+    m_pFreeArenas[m_NumOfFreeArenas++]=ArenaID;
+    UnlockCS(m_Lock);
+};
@@ -0,0 +1,134 @@
+/*********************************************************
+ * taskpool.cpp  - implementation of a pool of worker threads
+ *
+ * Copyright(C) 2012 Saint-Petersburg State Polytechnic University
+ *
+ * Developed in the framework of the "Forward error correction for next generation storage systems" project
+ *
+ * Author: P. Trifonov petert@dcn.ftk.spbstu.ru
+ * ********************************************************/
+#include "misc.h"
+#include "taskpool.h"
+
+using namespace std;
+
+CTaskPool::CTaskPool():m_pThreads(0),m_NumOfThreads(0),m_Stop(false)
+{
+    if (!InitCS(m_Lock))
+        throw Exception("Failed to initialize task pool mutex");
+    if (!InitCond(m_TaskSig)||!InitCond(m_DoneSig))
+        throw Exception("Failed to initialize task pool condition variables");
+};
+
+CTaskPool::~CTaskPool()
+{
+    Stop();
+    DestroyCond(m_DoneSig);
+    DestroyCond(m_TaskSig);
+    DestroyCS(m_Lock);
+};
+
+/** Take the tasks from the head of the queue, and report their completion to the threads waiting for their batches
+ */
+THREADPROC CTaskPool::WorkerThread(void* pParams ///must be a pointer to CTaskPool
+                                  )
+{
+    CTaskPool& P=*(CTaskPool*)pParams;
+    LockCS(P.m_Lock);
+    while (!P.m_Stop)
+    {
+        if (P.m_Queue.empty())
+        {
+            CondWait(P.m_TaskSig,P.m_Lock);
+            continue;
+        };
+        Task T=P.m_Queue.front();
+        P.m_Queue.pop_front();
+        UnlockCS(P.m_Lock);
+        T.pFunction(T.pParams);
+        LockCS(P.m_Lock);
+        if (!--*T.pPending)
+            CondWakeAll(P.m_DoneSig);
+    };
+    UnlockCS(P.m_Lock);
+    return 0;
+};
+
+///spawn the pool threads. The pool must not be running
+unsigned CTaskPool::Start(unsigned NumOfThreads ///the number of threads to be spawned
+                         )
+{
+    m_Stop=false;
+    m_pThreads=new tThread[NumOfThreads];
+    m_NumOfThreads=0;
+    while ((m_NumOfThreads<NumOfThreads)&&StartThread(m_pThreads[m_NumOfThreads],WorkerThread,this))
+        m_NumOfThreads++;
+    return m_NumOfThreads;
+};
+
+///terminate the pool threads. There may be no batches in progress
+void CTaskPool::Stop()
+{
+    if (!m_pThreads)
+        return;
+    LockCS(m_Lock);
+    m_Stop=true;
+    CondWakeAll(m_TaskSig);
+    UnlockCS(m_Lock);
+    for(unsigned i=0;i<m_NumOfThreads;i++)
+        JoinThread(m_pThreads[i]);
+    delete[]m_pThreads;
+    m_pThreads=0;
+    m_NumOfThreads=0;
+};
+
+/** All tasks except the first one are queued. After the first task is completed, the calling thread
+ * executes its tasks remaining in the queue, and waits for the ones taken by the pool threads
+ */
+void CTaskPool::Run(tTaskFunction pFunction,///the function executing the tasks
+                    void* pParams,///the array of task arguments
+                    size_t ParamSize,///size of each element of the array
+                    unsigned NumOfTasks ///the number of tasks
+                   )
+{
+    if (!NumOfTasks)
+        return;
+    unsigned char* pTaskParams=(unsigned char*)pParams;
+    if (!m_NumOfThreads)
+    {
+        for(unsigned i=0;i<NumOfTasks;i++)
+            pFunction(pTaskParams+i*ParamSize);
+        return;
+    };
+    unsigned Pending=NumOfTasks-1;
+    LockCS(m_Lock);
+    for(unsigned i=1;i<NumOfTasks;i++)
+    {
+        Task T={pFunction,pTaskParams+i*ParamSize,&Pending};
+        m_Queue.push_back(T);
+        CondWake(m_TaskSig);
+    };
+    UnlockCS(m_Lock);
+    pFunction(pTaskParams);
+    LockCS(m_Lock);
+    deque<Task>::iterator it=m_Queue.begin();
+    while (it!=m_Queue.end())
+    {
+        if (it->pPending!=&Pending)
+        {
+            it++;
+            continue;
+        };
+        Task T=*it;
+        m_Queue.erase(it);
+        UnlockCS(m_Lock);
+        T.pFunction(T.pParams);
+        LockCS(m_Lock);
+        Pending--;
+        //the queue may have been modified meanwhile
+        it=m_Queue.begin();
+    };
+    while (Pending)
+        CondWait(m_DoneSig,m_Lock);
+    UnlockCS(m_Lock);
+};
@@ -20,6 +20,8 @@
 #endif
 
 #include "usecase.h"
+#include "objstore.h"
+#include "logvolume.h"
 #include "arithmetic.h"
 #include "misc.h"
 #include "sync.h"
@@ -322,6 +324,155 @@ int Check(CDiskArray& A///the array to be checked
     };
 };
 
+/** Rebuild the disk and report the time spent
+ */
+int RebuildDisk(CDiskArray& A,///the array to be repaired
+                unsigned DiskID ///the disk to be rebuilt
+               )
+{
+    if (!A.Mount(true))
+    {
+        cerr << "Array mount failed\n";
+        return 3;
+    };
+    double StartTime, StopTime, Dummy;
+    GetTimes(Dummy, Dummy, StartTime);
+    bool Result = A.Rebuild(DiskID);
+    GetTimes(Dummy, Dummy, StopTime);
+    A.Unmount();
+    if (!Result)
+    {
+        cout << "Rebuild failed\n";
+        return 3;
+    };
+    cout << "Disk " << DiskID << " was rebuilt in " << StopTime - StartTime << " sec\n";
+    unsigned long long Requests,Throttled;
+    double Latency;
+    A.GetScheduler().GetStatistics(iocBackground,Requests,Latency,Throttled);
+    cout << "Rebuild requests: " << Requests << ", throttled " << Throttled << " times\n";
+    return 0;
+};
+
+/** Release or zero a range of the array and report the time spent
+ */
+int DiscardRange(CDiskArray& A,///the array to be used
+                 unsigned long long Offset,///start of the range
+                 unsigned long long Length,///length of the range
+                 bool Zero ///true if the range must be filled with zeroes, otherwise only the whole stripes are discarded
+                )
+{
+    if (!A.Mount(true))
+    {
+        cerr << "Array mount failed\n";
+        return 3;
+    };
+    CDiskArray::tHandle F = A.open();
+    if (A.seek(F, Offset, SEEK_SET) < 0)
+    {
+        cerr << "Invalid offset\n";
+        return 3;
+    };
+    double StartTime, StopTime, Dummy;
+    GetTimes(Dummy, Dummy, StartTime);
+    long long Result = (Zero) ? A.write_zeroes(F, Length) : A.discard(F, Length);
+    GetTimes(Dummy, Dummy, StopTime);
+    if (Result < 0)
+    {
+        cout << "Discard failed\n";
+        return 3;
+    };
+    cout << Result << " bytes were " << ((Zero) ? "zeroed" : "discarded") << " in " << StopTime - StartTime << " sec\n";
+    return 0;
+};
+
+/** Copy a range within the array and report the time spent
+ */
+int CopyRange(CDiskArray& A,///the array to be used
+              unsigned long long Source,///start of the source range
+              unsigned long long Destination,///start of the destination range
+              unsigned long long Length ///length of the range
+             )
+{
+    if (!A.Mount(true))
+    {
+        cerr << "Array mount failed\n";
+        return 3;
+    };
+    CDiskArray::tHandle Src = A.open();
+    CDiskArray::tHandle Dst = A.open();
+    if ((A.seek(Src, Source, SEEK_SET) < 0) || (A.seek(Dst, Destination, SEEK_SET) < 0))
+    {
+        cerr << "Invalid offset\n";
+        return 3;
+    };
+    double StartTime, StopTime, Dummy;
+    GetTimes(Dummy, Dummy, StartTime);
+    long long Result = A.copy_range(Src, Dst, Length);
+    GetTimes(Dummy, Dummy, StopTime);
+    if (Result < 0)
+    {
+        cout << "Copy failed\n";
+        return 3;
+    };
+    cout << Result << " bytes were copied in " << StopTime - StartTime << " sec\n";
+    return 0;
+};
+
+/** Scrub the array and report the time spent and the root hashes
+ */
+int ScrubArray(CDiskArray& A ///the array to be scrubbed
+              )
+{
+    if (!A.HasHashTree())
+    {
+        cerr << "The hash tree is not enabled in the configuration file\n";
+        return 3;
+    };
+    if (!A.Mount(true))
+    {
+        cerr << "Array mount failed\n";
+        return 3;
+    };
+    unsigned long long Scrubbed, Invalid;
+    double StartTime = GetClock();
+    bool Result = A.Scrub(Scrubbed, Invalid);
+    cout << Scrubbed << " stripes were scrubbed in " << GetClock() - StartTime << " sec, " << Invalid << " of them are invalid\n";
+    cout << "Root hash " << hex << A.GetRootHash(false) << ", verified root hash " << A.GetRootHash(true) << dec << endl;
+    return (Result) ? 0 : 3;
+};
+
+/** The consecutive differing stripes are reported as a single byte range
+ */
+int CompareArrays(CDiskArray& A,///the first array
+                  CDiskArray& B ///the second array
+                 )
+{
+    if (!A.Mount(false) || !B.Mount(false))
+    {
+        cerr << "Array mount failed\n";
+        return 3;
+    };
+    vector<unsigned long long> Stripes;
+    double StartTime = GetClock();
+    if (!A.Compare(B, Stripes))
+    {
+        cout << "Comparison failed\n";
+        return 3;
+    };
+    double StopTime = GetClock();
+    unsigned long long StripeSize = A.GetStripeSize();
+    for (size_t i = 0; i < Stripes.size();)
+    {
+        size_t j = i + 1;
+        while ((j < Stripes.size()) && (Stripes[j] == Stripes[j - 1] + 1))
+            j++;
+        cout << "Range [" << Stripes[i] * StripeSize << ", " << (Stripes[j - 1] + 1) * StripeSize << ") differs\n";
+        i = j;
+    };
+    cout << Stripes.size() << " stripes differ, compared in " << StopTime - StartTime << " sec\n";
+    return (Stripes.empty()) ? 0 : 3;
+};
+
 ///this structure will be used to pass the parameters to the testing thread
 ///and get the results back
 
@@ -448,6 +599,75 @@ void*
 	return 0;
 };
 
+/** Execute a disk management command while the benchmark threads keep running. The commands are
+ * f<Disk> (fail), s<Disk> (rebuild into the spare space), r<Disk>=<File> (replace), a<Disk> (re-add)
+ * @return true on success
+ */
+static bool DiskCommand(CDiskArray& A,///the array to be managed
+                        const string& Command ///the command
+                       )
+{
+    if (Command.size()<2)
+    {
+        cerr << "Invalid disk command " << Command << endl;
+        return false;
+    };
+    unsigned DiskID = atoi(Command.c_str() + 1);
+    size_t FileName = Command.find('=');
+    switch (Command[0])
+    {
+    case 'f':
+        return A.FailDisk(DiskID);
+    case 's':
+        return A.Rebuild(DiskID);
+    case 'a':
+        return A.ReAddDisk(DiskID);
+    case 'r':
+        if (FileName != string::npos)
+            return A.ReplaceDisk(DiskID, Command.c_str() + FileName + 1);
+        break;
+    };
+    cerr << "Invalid disk command " << Command << endl;
+    return false;
+};
+
+///wait until the given number of seconds elapses since the start time
+static void WaitUntil(double StartTime,///start time given by GetClock()
+                      unsigned Seconds ///the number of seconds
+                     )
+{
+    double Now = GetClock();
+    while (Now < StartTime + Seconds)
+    {
+#ifdef WIN32
+        Sleep((unsigned)((StartTime + Seconds - Now)*1000) + 1);
+#else
+        usleep((useconds_t)((StartTime + Seconds - Now)*1000000) + 1);
+#endif
+        Now = GetClock();
+    };
+};
+
+///report the number of I/O operations per second completed by the benchmark threads since the previous call
+static void ReportPeriod(const BenchmarkData* pData,///the benchmark threads
+                         unsigned ThreadCount,///the number of benchmark threads
+                         double StartTime,///start time of the benchmark given by GetClock()
+                         double& LastTime,///the time of the previous call, updated on return
+                         unsigned long long& LastIOCount ///the number of operations at the previous call, updated on return
+                        )
+{
+    double Now = GetClock();
+    //the events may follow each other immediately
+    if (Now < LastTime + 1E-3)
+        return;
+    unsigned long long IOCount = 0;
+    for (unsigned i = 0; i < ThreadCount; i++)
+        IOCount += pData[i].IOCount;
+    cout << "[" << LastTime - StartTime << ", " << Now - StartTime << "] sec: "
+        << (IOCount - LastIOCount) / (Now - LastTime) << " I/O operations per second\n";
+    LastTime = Now;
+    LastIOCount = IOCount;
+};
 
 ///run performance benchmarks
 int Benchmark(CDiskArray& A, ///the array to be benchmarked
@@ -456,7 +676,8 @@ int Benchmark(CDiskArray& A, ///the array to be benchmarked
                bool Aligned, ///true if the read-write requests should be aligned to BlockSize multiple
                double WriteRatio, ///the fraction of write requests
                unsigned ThreadCount, ///number of threads to spawn
-               unsigned MaxDuration ///maximal benchmark duration (sec)
+               unsigned MaxDuration, ///maximal benchmark duration (sec)
+               const char* pDiskEvents ///comma-separated list of Time:Command disk management events (see DiskCommand()), or 0
                )
 {
 
@@ -500,12 +721,37 @@ int Benchmark(CDiskArray& A, ///the array to be benchmarked
 #endif
 
     };
-#ifdef WIN32
-	Sleep(MaxDuration*1000);
-#else
+#ifndef WIN32
     pthread_attr_destroy(&attr);
-	sleep(MaxDuration);
 #endif
+    //the disk events are applied in the given order, and the throughput of the periods between them is reported
+    double StartTime = GetClock();
+    double LastTime = StartTime;
+    unsigned long long LastIOCount = 0;
+    bool Events = pDiskEvents && *pDiskEvents;
+    while (pDiskEvents && *pDiskEvents)
+    {
+        unsigned Time;
+        int Length = 0;
+        if ((sscanf(pDiskEvents, "%u:%n", &Time, &Length) < 1) || !Length)
+        {
+            cerr << "Invalid disk event " << pDiskEvents << endl;
+            break;
+        };
+        const char* pEnd = strchr(pDiskEvents + Length, ',');
+        string Command(pDiskEvents + Length, (pEnd) ? pEnd - pDiskEvents - Length : strlen(pDiskEvents + Length));
+        pDiskEvents = (pEnd) ? pEnd + 1 : 0;
+        WaitUntil(StartTime, Time);
+        ReportPeriod(pData, ThreadCount, StartTime, LastTime, LastIOCount);
+        //the short periods are not reported, so the duration of the command is given separately
+        double CommandStart = GetClock();
+        bool Result = DiskCommand(A, Command);
+        cout << "Disk command " << Command << ((Result) ? " completed" : " failed") << " in " << GetClock() - CommandStart << " sec\n";
+        ReportPeriod(pData, ThreadCount, StartTime, LastTime, LastIOCount);
+    };
+    WaitUntil(StartTime, MaxDuration);
+    if (Events)
+        ReportPeriod(pData, ThreadCount, StartTime, LastTime, LastIOCount);
     BenchmarkDone=true;
     //wait for all threads and collect the statistics
     unsigned long long BytesWritten = 0, BytesRead = 0, IOCount = 0;
@@ -535,8 +781,1243 @@ int Benchmark(CDiskArray& A, ///the array to be benchmarked
         <<"Read throughput (bytes/s): "<<BytesRead/TimeSpentU<<'\t'<<BytesRead/TimeSpentT<<'\t'<<BytesRead/TimeSpentW<<'\n'
         <<"Write throughput (bytes/s): "<<BytesWritten/TimeSpentU<<'\t'<<BytesWritten/TimeSpentT<<'\t'<<BytesWritten/TimeSpentW<<'\n'
         <<"I/O operations per second: "<<IOCount/TimeSpentU<<'\t'<<IOCount/TimeSpentT<<'\t'<<IOCount/TimeSpentW<<endl;
+    unsigned long long Requests,Throttled;
+    double ReadLatency,WriteLatency;
+    A.GetScheduler().GetStatistics(iocRead,Requests,ReadLatency,Throttled);
+    A.GetScheduler().GetStatistics(iocWrite,Requests,WriteLatency,Throttled);
+    cout<<"99th percentile of request latency (ms): read "<<ReadLatency*1000<<", write "<<WriteLatency*1000<<endl;
+    unsigned long long StaleStripes;
+    double Lag=A.GetRedundancyLag(StaleStripes);
+    if (StaleStripes)
+        cout<<"Redundancy lag: "<<StaleStripes<<" stripes with stale check symbols, the oldest one is stale for "<<Lag<<" sec\n";
+
+    delete[]Threads;
+    delete[]pData;
+    return 0;
+}
+
+///fill the buffer with the bytes determined by their offsets within the array and the seed
+static void FillPattern(unsigned char* pData,///the buffer to be filled
+                        unsigned long long Size,///the number of bytes
+                        unsigned long long Offset,///the array offset of the buffer
+                        unsigned long long Seed ///identifies the pattern
+                       )
+{
+    for (unsigned long long i = 0; i < Size; i++)
+        pData[i] = (unsigned char) ((((Offset + i) / 8 + Seed) * 6364136223846793005ull) >> (8 * ((Offset + i) % 8)));
+};
+
+///@return the offset of the first byte not matching FillPattern() within the buffer, or Size if all of them match
+static unsigned long long VerifyPattern(const unsigned char* pData,///the buffer to be verified
+                                        unsigned long long Size,///the number of bytes
+                                        unsigned long long Offset,///the array offset of the buffer
+                                        unsigned long long Seed ///identifies the pattern
+                                       )
+{
+    for (unsigned long long i = 0; i < Size; i++)
+        if (pData[i] != (unsigned char) ((((Offset + i) / 8 + Seed) * 6364136223846793005ull) >> (8 * ((Offset + i) % 8))))
+            return i;
+    return Size;
+};
+
+/** The commands are executed one after another, so that each of them completes before the next one starts.
+ * The array must remain consistent and keep the data written before them
+ */
+int DiskEventsVerify(CDiskArray& A, ///the array to be inspected
+                     const char* pCommands ///comma-separated list of disk management commands (see Benchmark())
+                    )
+{
+    if (!A.Mount(true))
+    {
+        cerr << "Array mount failed\n";
+        return 2;
+    };
+    unsigned long long Size = A.GetCapacity();
+    unsigned long long Seed = time(NULL);
+    unsigned char* pData = new unsigned char[Size];
+    FillPattern(pData, Size, 0, Seed);
+    CDiskArray::tHandle F = A.open();
+    if (A.write(F, Size, pData) != Size)
+    {
+        cerr << "Write failed\n";
+        delete[]pData;
+        A.Unmount();
+        return 2;
+    };
+    int Result = 0;
+    while (*pCommands)
+    {
+        const char* pEnd = strchr(pCommands, ',');
+        string Command(pCommands, (pEnd) ? pEnd - pCommands : strlen(pCommands));
+        pCommands = (pEnd) ? pEnd + 1 : pCommands + Command.size();
+        bool Done = DiskCommand(A, Command);
+        cout << "Disk command " << Command << ((Done) ? " completed" : " failed") << ", array state is "
+             << ((A.GetState() == asNormal) ? "normal" : (A.GetState() == asDegraded) ? "degraded" : "failed") << endl;
+        if (!Done)
+        {
+            Result = 3;
+            break;
+        };
+    };
+    if (!A.Check())
+    {
+        cerr << "Array self-check failed\n";
+        Result = 3;
+    };
+    memset(pData, 0, Size);
+    A.seek(F, 0, SEEK_SET);
+    if (A.read(F, Size, pData) != Size)
+    {
+        cerr << "Read failed\n";
+        Result = 3;
+    }
+    else
+    {
+        unsigned long long Offset = VerifyPattern(pData, Size, 0, Seed);
+        if (Offset < Size)
+        {
+            cerr << "Verify failed at offset " << Offset << endl;
+            Result = 3;
+        };
+    };
+    delete[]pData;
+    A.Unmount();
+    if (!Result)
+        cerr << "Verification successful\n";
+    return Result;
+};
 
+///this structure passes the parameters to the verifying reader thread and gets the results back
+struct VerifyReaderData
+{
+    ///the array to be tested
+    CDiskArray* pArray;
+    ///the pattern the array was filled with by FillPattern()
+    unsigned long long Seed;
+    ///the initial state of the random number generator
+    unsigned long long RNGState;
+    ///the number of reads completed
+    unsigned long long Reads;
+    ///the number of reads which failed or returned wrong data
+    unsigned long long Errors;
+};
+
+///read random ranges of up to 4 stripe units and compare them with the pattern
+static THREADPROC VerifyReaderThread(void* pParams ///must be a pointer to VerifyReaderData
+                                    )
+{
+    VerifyReaderData& D = *(VerifyReaderData*) pParams;
+    unsigned UnitSize = D.pArray->GetStripeUnitSize();
+    unsigned long long NumOfUnits = D.pArray->GetCapacity() / UnitSize;
+    unsigned char* pData = new unsigned char[4 * UnitSize];
+    CDiskArray::tHandle F = D.pArray->open();
+    while (!BenchmarkDone)
+    {
+        unsigned long long Offset = (Rand(D.RNGState) % NumOfUnits) * UnitSize;
+        unsigned Size = (unsigned) min(1 + Rand(D.RNGState) % 4, NumOfUnits - Offset / UnitSize) * UnitSize;
+        D.pArray->seek(F, Offset, SEEK_SET);
+        if ((D.pArray->read(F, Size, pData) != Size) || (VerifyPattern(pData, Size, Offset, D.Seed) < Size))
+        {
+            if (!D.Errors)
+                cerr << "Read of " << Size << " bytes at offset " << Offset << " failed or returned wrong data\n";
+            D.Errors++;
+        };
+        D.Reads++;
+    };
+    delete[]pData;
+    return 0;
+};
+
+/** The reads of the stripes not yet reached by the rebuild reconstruct the units of the replaced disk and write them to it.
+ * The array must be consistent afterwards, and all reads must return the data written before the failure
+ */
+int RepairVerify(CDiskArray& A, ///the array to be inspected
+                 unsigned DiskID, ///the disk to be replaced
+                 const char* pFileName, ///the name of the file emulating the new disk
+                 unsigned ThreadCount ///the number of reading threads
+                )
+{
+    if (!A.Mount(true))
+    {
+        cerr << "Array mount failed\n";
+        return 2;
+    };
+    unsigned long long Size = A.GetCapacity();
+    unsigned long long Seed = time(NULL);
+    unsigned char* pData = new unsigned char[Size];
+    FillPattern(pData, Size, 0, Seed);
+    CDiskArray::tHandle F = A.open();
+    if ((A.write(F, Size, pData) != Size) || !A.FailDisk(DiskID))
+    {
+        cerr << "Failed to fill the array or to fail disk " << DiskID << endl;
+        delete[]pData;
+        A.Unmount();
+        return 2;
+    };
+    VerifyReaderData* pReaders = new VerifyReaderData[ThreadCount];
+    tThread* Threads = new tThread[ThreadCount];
+    BenchmarkDone = false;
+    for (unsigned i = 0; i < ThreadCount; i++)
+    {
+        pReaders[i].pArray = &A;
+        pReaders[i].Seed = Seed;
+        pReaders[i].RNGState = i + 1;
+        pReaders[i].Reads = pReaders[i].Errors = 0;
+        StartThread(Threads[i], VerifyReaderThread, pReaders + i);
+    };
+    double StartTime = GetClock();
+    bool Replaced = A.ReplaceDisk(DiskID, pFileName);
+    double StopTime = GetClock();
+    BenchmarkDone = true;
+    unsigned long long Reads = 0, Errors = 0;
+    for (unsigned i = 0; i < ThreadCount; i++)
+    {
+        JoinThread(Threads[i]);
+        Reads += pReaders[i].Reads;
+        Errors += pReaders[i].Errors;
+    };
     delete[]Threads;
+    delete[]pReaders;
+    cout << "Disk " << DiskID << ((Replaced) ? " was replaced and rebuilt in " : " replacement failed after ") << StopTime - StartTime
+         << " sec, " << Reads << " concurrent reads, " << Errors << " failed\n";
+    int Result = (Replaced && !Errors) ? 0 : 3;
+    if (!A.Check())
+    {
+        cerr << "Array self-check failed\n";
+        Result = 3;
+    };
+    A.seek(F, 0, SEEK_SET);
+    if ((A.read(F, Size, pData) != Size) || (VerifyPattern(pData, Size, 0, Seed) < Size))
+    {
+        cerr << "Verify failed\n";
+        Result = 3;
+    };
+    delete[]pData;
+    A.Unmount();
+    if (!Result)
+        cerr << "Verification successful\n";
+    return Result;
+};
+
+///fill a block with the content identified by the seed. It does not depend on the block position
+static void FillBlock(unsigned char* pData,///the block to be filled
+                      unsigned Size,///block size
+                      unsigned long long Seed ///identifies the content
+                     )
+{
+    unsigned long long RNGState = Seed;
+    for (unsigned i = 0; i < Size; i++)
+        pData[i] = (unsigned char) (Rand(RNGState) >> 56);
+};
+
+/** The blocks are read in groups, and compared with the content given by their seeds
+ * @return true if all of them match
+ */
+static bool VerifyBlocks(CDiskArray& A,///the array to be verified
+                         const unsigned long long* pSeeds,///the seed of each block
+                         unsigned BlockSize,///block size
+                         unsigned long long NumOfBlocks ///the number of blocks from the start of the array
+                        )
+{
+    const unsigned GroupSize = 256;
+    unsigned char* pData = new unsigned char[GroupSize * BlockSize];
+    unsigned char* pExpected = new unsigned char[BlockSize];
+    CDiskArray::tHandle F = A.open();
+    bool Result = true;
+    for (unsigned long long b = 0; Result && (b < NumOfBlocks); b += GroupSize)
+    {
+        unsigned Blocks = (unsigned) min((unsigned long long) GroupSize, NumOfBlocks - b);
+        if (A.read(F, Blocks * BlockSize, pData) != Blocks * BlockSize)
+        {
+            cerr << "Read failed at block " << b << endl;
+            Result = false;
+            break;
+        };
+        for (unsigned i = 0; i < Blocks; i++)
+        {
+            FillBlock(pExpected, BlockSize, pSeeds[b + i]);
+            if (memcmp(pExpected, pData + i * BlockSize, BlockSize))
+            {
+                cerr << "Verify failed at block " << b + i << endl;
+                Result = false;
+                break;
+            };
+        };
+    };
+    delete[]pExpected;
+    delete[]pData;
+    return Result;
+};
+
+///write the blocks given by their seeds from the start of the array
+///@return true on success
+static bool WriteBlocks(CDiskArray& A,///the array to be written
+                        const unsigned long long* pSeeds,///the seed of each block
+                        unsigned BlockSize,///block size
+                        unsigned long long NumOfBlocks ///the number of blocks
+                       )
+{
+    const unsigned GroupSize = 256;
+    unsigned char* pData = new unsigned char[GroupSize * BlockSize];
+    CDiskArray::tHandle F = A.open();
+    bool Result = true;
+    for (unsigned long long b = 0; Result && (b < NumOfBlocks); b += GroupSize)
+    {
+        unsigned Blocks = (unsigned) min((unsigned long long) GroupSize, NumOfBlocks - b);
+        for (unsigned i = 0; i < Blocks; i++)
+            FillBlock(pData + i * BlockSize, BlockSize, pSeeds[b + i]);
+        Result = (A.write(F, Blocks * BlockSize, pData) == Blocks * BlockSize);
+    };
+    delete[]pData;
+    return Result;
+};
+
+/** Verify the blocks and check the array, then remount it and repeat this, so that the data
+ * kept in memory by the array is not mistaken for the data on the disks
+ * @return 0 on success
+ */
+static int RemountVerify(CDiskArray& A,///the array to be verified. It must be mounted
+                         const unsigned long long* pSeeds,///the seed of each block
+                         unsigned BlockSize,///block size
+                         unsigned long long NumOfBlocks ///the number of blocks from the start of the array
+                        )
+{
+    int Result = 0;
+    for (unsigned Pass = 0; Pass < 2; Pass++)
+    {
+        if (Pass && !A.Mount(true))
+        {
+            cerr << "Array remount failed\n";
+            return 3;
+        };
+        if (!VerifyBlocks(A, pSeeds, BlockSize, NumOfBlocks))
+            Result = 3;
+        if (!A.Check())
+        {
+            cerr << "Array self-check failed\n";
+            Result = 3;
+        };
+        A.Unmount();
+    };
+    if (!Result)
+        cerr << "Verification successful\n";
+    return Result;
+};
+
+///this structure passes the parameters to the small write testing thread and gets the results back
+struct SmallWriteData
+{
+    unsigned ThreadID;
+    ///the number of writing threads. Each of them writes the blocks, whose number modulo ThreadCount is equal to its ID
+    unsigned ThreadCount;
+    ///the array to be tested
+    CDiskArray* pArray;
+    ///the seed of the current content of each block
+    unsigned long long* pSeeds;
+    ///the number of blocks
+    unsigned long long NumOfBlocks;
+    ///the number of writes completed
+    unsigned long long Writes;
+    ///the number of failed writes
+    unsigned long long Errors;
+};
+
+///write random blocks of the thread with the new content, and record their seeds
+static THREADPROC SmallWriteThread(void* pParams ///must be a pointer to SmallWriteData
+                                  )
+{
+    SmallWriteData& D = *(SmallWriteData*) pParams;
+    unsigned BlockSize = D.pArray->GetStripeUnitSize();
+    unsigned long long OwnBlocks = (D.NumOfBlocks - D.ThreadID + D.ThreadCount - 1) / D.ThreadCount;
+    unsigned long long RNGState = D.ThreadID + 1;
+    unsigned char* pData = new unsigned char[BlockSize];
+    CDiskArray::tHandle F = D.pArray->open();
+    while (!BenchmarkDone && OwnBlocks)
+    {
+        unsigned long long Block = (Rand(RNGState) % OwnBlocks) * D.ThreadCount + D.ThreadID;
+        unsigned long long Seed = ((unsigned long long) (D.ThreadID + 1) << 40) + D.Writes;
+        FillBlock(pData, BlockSize, Seed);
+        D.pArray->seek(F, Block * BlockSize, SEEK_SET);
+        if (D.pArray->write(F, BlockSize, pData) == BlockSize)
+            D.pSeeds[Block] = Seed;
+        else
+            D.Errors++;
+        D.Writes++;
+    };
     delete[]pData;
     return 0;
-}
\ No newline at end of file
+};
+
+/** Each thread owns every ThreadCount-th stripe unit, so that the threads update the same stripes concurrently,
+ * while the final content of each unit is known. The payload of the stripes with stale check symbols cannot be recovered
+ * after a failure, so the disk is failed once the background threads have re-encoded them
+ */
+int SmallWriteVerify(CDiskArray& A, ///the array to be inspected
+                     unsigned ThreadCount, ///the number of writing threads
+                     unsigned MaxDuration, ///duration of the writes (sec)
+                     int DiskID ///the disk to be failed once the writes complete, or -1
+                    )
+{
+    if (!ThreadCount)
+    {
+        cerr << "Invalid thread count\n";
+        return 1;
+    };
+    if (!A.Mount(true))
+    {
+        cerr << "Array mount failed\n";
+        return 2;
+    };
+    unsigned BlockSize = A.GetStripeUnitSize();
+    unsigned long long NumOfBlocks = A.GetCapacity() / BlockSize;
+    unsigned long long* pSeeds = new unsigned long long[NumOfBlocks];
+    for (unsigned long long b = 0; b < NumOfBlocks; b++)
+        pSeeds[b] = b;
+    if (!WriteBlocks(A, pSeeds, BlockSize, NumOfBlocks))
+    {
+        cerr << "Write failed\n";
+        delete[]pSeeds;
+        A.Unmount();
+        return 2;
+    };
+    SmallWriteData* pData = new SmallWriteData[ThreadCount];
+    tThread* Threads = new tThread[ThreadCount];
+    BenchmarkDone = false;
+    for (unsigned i = 0; i < ThreadCount; i++)
+    {
+        memset(pData + i, 0, sizeof (SmallWriteData));
+        pData[i].ThreadID = i;
+        pData[i].ThreadCount = ThreadCount;
+        pData[i].pArray = &A;
+        pData[i].pSeeds = pSeeds;
+        pData[i].NumOfBlocks = NumOfBlocks;
+        StartThread(Threads[i], SmallWriteThread, pData + i);
+    };
+    WaitUntil(GetClock(), MaxDuration);
+    BenchmarkDone = true;
+    unsigned long long Writes = 0, Errors = 0;
+    for (unsigned i = 0; i < ThreadCount; i++)
+    {
+        JoinThread(Threads[i]);
+        Writes += pData[i].Writes;
+        Errors += pData[i].Errors;
+    };
+    delete[]Threads;
+    delete[]pData;
+    cout << Writes << " writes of " << BlockSize << " bytes, " << Errors << " failed\n";
+    if (DiskID >= 0)
+    {
+        unsigned long long StaleStripes;
+        double Lag = A.GetRedundancyLag(StaleStripes);
+        double StartTime = GetClock();
+        while (StaleStripes && (GetClock() < StartTime + 60))
+        {
+            WaitUntil(GetClock(), 1);
+            A.GetRedundancyLag(StaleStripes);
+        };
+        cout << "The redundancy lag was " << Lag << " sec, it was restored in " << GetClock() - StartTime << " sec\n";
+        if (StaleStripes || !A.FailDisk(DiskID))
+            Errors++;
+    };
+    int Result = RemountVerify(A, pSeeds, BlockSize, NumOfBlocks);
+    delete[]pSeeds;
+    return (Errors) ? 3 : Result;
+};
+
+/** The units with the same content are written both within a request and by different requests. Every third unit
+ * is then overwritten with another one of them, so that the references to the shared units are both added and dropped
+ */
+int DuplicateVerify(CDiskArray& A, ///the array to be inspected
+                    unsigned Distinct ///the number of distinct stripe units
+                   )
+{
+    if (!Distinct)
+    {
+        cerr << "Invalid number of distinct units\n";
+        return 1;
+    };
+    if (!A.Mount(true))
+    {
+        cerr << "Array mount failed\n";
+        return 2;
+    };
+    unsigned BlockSize = A.GetStripeUnitSize();
+    unsigned long long NumOfBlocks = A.GetCapacity() / BlockSize;
+    unsigned long long* pSeeds = new unsigned long long[NumOfBlocks];
+    for (unsigned long long b = 0; b < NumOfBlocks; b++)
+        pSeeds[b] = b % Distinct;
+    bool Result = WriteBlocks(A, pSeeds, BlockSize, NumOfBlocks);
+    unsigned char* pData = new unsigned char[BlockSize];
+    CDiskArray::tHandle F = A.open();
+    for (unsigned long long b = 0; Result && (b < NumOfBlocks); b += 3)
+    {
+        pSeeds[b] = (b / 3) % Distinct;
+        FillBlock(pData, BlockSize, pSeeds[b]);
+        A.seek(F, b * BlockSize, SEEK_SET);
+        Result = (A.write(F, BlockSize, pData) == BlockSize);
+    };
+    delete[]pData;
+    if (!Result)
+    {
+        cerr << "Write failed\n";
+        delete[]pSeeds;
+        A.Unmount();
+        return 2;
+    };
+    cout << NumOfBlocks << " units of " << BlockSize << " bytes with " << Distinct << " distinct values written\n";
+    int Status = RemountVerify(A, pSeeds, BlockSize, NumOfBlocks);
+    delete[]pSeeds;
+    return Status;
+};
+
+///this structure passes the parameters to the atomicity testing thread and gets the results back
+struct AtomicityData
+{
+    unsigned ThreadID;
+    ///the array to be tested
+    CDiskArray* pArray;
+    ///the size of the requests
+    unsigned long long Size;
+    ///true for the writers, false for the readers
+    bool Writer;
+    ///the number of requests completed
+    unsigned long long Requests;
+    ///the number of stripes read with the data of several writes
+    unsigned long long TornStripes;
+    ///the number of requests read with the data of several writes
+    unsigned long long TornRequests;
+    ///the number of failed requests
+    unsigned long long Errors;
+};
+
+/** The writers fill the whole range with a word identifying the writer and the request.
+ * The readers count the stripes and the requests where several such words were found
+ */
+static THREADPROC AtomicityThread(void* pParams ///must be a pointer to AtomicityData
+                                 )
+{
+    AtomicityData& D = *(AtomicityData*) pParams;
+    unsigned long long Words = D.Size / sizeof (unsigned long long);
+    unsigned long long StripeWords = D.pArray->GetStripeSize() / sizeof (unsigned long long);
+    unsigned long long* pData = new unsigned long long[Words];
+    while (!BenchmarkDone)
+    {
+        CDiskArray::tHandle F = D.pArray->open();
+        if (D.Writer)
+        {
+            unsigned long long Stamp = ((unsigned long long) (D.ThreadID + 1) << 40) + D.Requests;
+            for (unsigned long long i = 0; i < Words; i++)
+                pData[i] = Stamp;
+            if (D.pArray->write(F, D.Size, (unsigned char*) pData) != D.Size)
+                D.Errors++;
+        }
+        else
+        {
+            if (D.pArray->read(F, D.Size, (unsigned char*) pData) != D.Size)
+                D.Errors++;
+            else
+            {
+                bool Torn = false;
+                for (unsigned long long i = 0; i < Words; i += StripeWords)
+                {
+                    for (unsigned long long j = i + 1; j < min(i + StripeWords, Words); j++)
+                        if (pData[j] != pData[i])
+                        {
+                            D.TornStripes++;
+                            break;
+                        };
+                    Torn |= (pData[i] != pData[0]);
+                };
+                D.TornRequests += Torn;
+            };
+        };
+        D.Requests++;
+    };
+    delete[]pData;
+    return 0;
+};
+
+/** The writers and the readers access the same range from its start, so that the large requests overlap completely.
+ * The stripes must always be read atomically. The requests must be read atomically unless LockWindow is set
+ */
+int AtomicityVerify(CDiskArray& A, ///the array to be inspected
+                    unsigned RequestStripes, ///the number of stripes in each request
+                    unsigned ThreadCount, ///the number of writers, and of readers, to spawn
+                    unsigned MaxDuration ///test duration (sec)
+                   )
+{
+    unsigned long long Size = (unsigned long long) RequestStripes * A.GetStripeSize();
+    if (!Size || (Size > A.GetCapacity()) || !ThreadCount)
+    {
+        cerr << "Invalid request size or thread count\n";
+        return 1;
+    };
+    if (!A.Mount(true))
+    {
+        cerr << "Array mount failed\n";
+        return 2;
+    };
+    AtomicityData* pData = new AtomicityData[2 * ThreadCount];
+    tThread* Threads = new tThread[2 * ThreadCount];
+    BenchmarkDone = false;
+    for (unsigned i = 0; i < 2 * ThreadCount; i++)
+    {
+        memset(pData + i, 0, sizeof (AtomicityData));
+        pData[i].ThreadID = i;
+        pData[i].pArray = &A;
+        pData[i].Size = Size;
+        pData[i].Writer = (i < ThreadCount);
+        StartThread(Threads[i], AtomicityThread, pData + i);
+    };
+    WaitUntil(GetClock(), MaxDuration);
+    BenchmarkDone = true;
+    unsigned long long Writes = 0, Reads = 0, TornStripes = 0, TornRequests = 0, Errors = 0;
+    for (unsigned i = 0; i < 2 * ThreadCount; i++)
+    {
+        JoinThread(Threads[i]);
+        ((pData[i].Writer) ? Writes : Reads) += pData[i].Requests;
+        TornStripes += pData[i].TornStripes;
+        TornRequests += pData[i].TornRequests;
+        Errors += pData[i].Errors;
+    };
+    delete[]Threads;
+    delete[]pData;
+    cout << Writes << " writes and " << Reads << " reads of " << RequestStripes << " stripes, " << Errors << " failed\n"
+         << "Torn stripes: " << TornStripes << ", torn requests: " << TornRequests
+         << ((A.GetLockWindow()) ? " (allowed by LockWindow)\n" : "\n");
+    bool Consistent = A.Check();
+    if (!Consistent)
+        cerr << "Array self-check failed\n";
+    A.Unmount();
+    if (Errors || TornStripes || (TornRequests && !A.GetLockWindow()) || !Consistent)
+    {
+        cerr << "Verification failed\n";
+        return 3;
+    };
+    cerr << "Verification successful\n";
+    return 0;
+};
+
+/** The array is filled first, since the stripes which were never written are read without disk access.
+ * The throughput of the reads locking the stripes and of the optimistic ones is measured alternately by the same threads
+ */
+int ReadScaling(CDiskArray& A, ///the array to be benchmarked
+                unsigned BlockSize, ///size of the data blocks to be read
+                unsigned ThreadCount, ///the maximal number of threads to spawn
+                unsigned MaxDuration ///duration of each measurement (sec)
+               )
+{
+    if (!BlockSize||(BlockSize>A.GetCapacity()))
+    {
+        cerr << "Invalid block size\n";
+        return 1;
+    };
+    if (!A.Mount(true))
+    {
+        cerr << "Array mount failed\n";
+        return 2;
+    };
+    unsigned long long Capacity = A.GetCapacity();
+    unsigned long long RNGState = 1;
+    unsigned char* pBuffer = new unsigned char[A.GetStripeSize()];
+    for (unsigned i = 0; i < A.GetStripeSize(); i++)
+        pBuffer[i] = (unsigned char) Rand(RNGState);
+    CDiskArray::tHandle F = A.open();
+    while (F < (long long) Capacity)
+    {
+        if (A.write(F, min((unsigned long long) A.GetStripeSize(), Capacity - F), pBuffer) < 0)
+        {
+            cerr << "Write failed\n";
+            delete[]pBuffer;
+            return 3;
+        };
+    };
+    delete[]pBuffer;
+    cout << "Random aligned read throughput with block size " << BlockSize << " (I/O operations per second)\n"
+         << "Threads\tLocked\tOptimistic\tSpeedup\n";
+    BenchmarkData* pData = new BenchmarkData[ThreadCount];
+    tThread* Threads = new tThread[ThreadCount];
+    for (unsigned T = 1; T <= ThreadCount; T = (T < ThreadCount && 2 * T > ThreadCount) ? ThreadCount : 2 * T)
+    {
+        double Throughput[2];
+        for (unsigned Optimistic = 0; Optimistic < 2; Optimistic++)
+        {
+            A.SetOptimisticReads(Optimistic != 0);
+            BenchmarkDone = false;
+            for (unsigned i = 0; i < T; i++)
+            {
+                pData[i].pArray = &A;
+                pData[i].Random = true;
+                pData[i].BlockSize = BlockSize;
+                pData[i].Aligned = true;
+                pData[i].WriteRatio = 0;
+                pData[i].ThreadID = i;
+                StartThread(Threads[i], BenchThread, pData + i);
+            };
+            double StartTime = GetClock();
+            WaitUntil(StartTime, MaxDuration);
+            BenchmarkDone = true;
+            unsigned long long IOCount = 0;
+            for (unsigned i = 0; i < T; i++)
+            {
+                JoinThread(Threads[i]);
+                IOCount += pData[i].IOCount;
+            };
+            Throughput[Optimistic] = IOCount / (GetClock() - StartTime);
+        };
+        cout << T << '\t' << Throughput[0] << '\t' << Throughput[1] << '\t' << Throughput[1] / Throughput[0] << endl;
+    };
+    delete[]Threads;
+    delete[]pData;
+    return 0;
+};
+
+///create an empty object store on the array
+///@return 0 on success
+int FormatObjectStore(CDiskArray& A,///the array to be used
+                      unsigned MaxObjects ///the maximal number of objects
+                     )
+{
+    if (!A.Mount(true))
+    {
+        cerr << "Array mount failed\n";
+        return 3;
+    };
+    CObjectStore S(A);
+    if (!S.Format(MaxObjects))
+    {
+        cerr << "Object store formatting failed\n";
+        return 3;
+    };
+    cout << "Object store created, " << S.GetFreeStripes() << " stripes available\n";
+    A.Unmount();
+    return 0;
+};
+
+/**Read the file and store it as a named object
+ */
+int PutObject(CDiskArray& A,///the array to be used
+              const char* pKey,///object name
+              const char* pFilename ///the name of the file to be stored
+             )
+{
+    if (!A.Mount(true))
+    {
+        cerr << "Array mount failed\n";
+        return 3;
+    };
+    CObjectStore S(A);
+    if (!S.Load())
+        return 3;
+    int File = open(pFilename, FILE_IO_OPTIONS);
+    if (File < 0)
+    {
+        cerr << "Failed to open file " << pFilename << endl;
+        return 3;
+    };
+    off64_t FileSize = lseek64(File, 0, SEEK_END);
+    lseek64(File, 0, SEEK_SET);
+    //aligned buffer enables direct full-stripe writes
+    unsigned char* pData = AlignedMalloc(FileSize+1);
+    if (read(File, pData, (unsigned) FileSize) != FileSize)
+    {
+        cerr << "Failed to read data from " << pFilename;
+        AlignedFree(pData);
+        return 3;
+    };
+    close(File);
+    bool Result = S.Put(pKey, pData, FileSize);
+    AlignedFree(pData);
+    if (!Result)
+    {
+        cerr << "Failed to store object " << pKey << endl;
+        return 3;
+    };
+    cerr << "Object stored successfully\n";
+    A.Unmount();
+    return 0;
+};
+
+/**Read a named object and save it to the file
+ */
+int GetObject(CDiskArray& A,///the array to be used
+              const char* pKey,///object name
+              const char* pFilename ///the name of the file to be created
+             )
+{
+    if (!A.Mount(false))
+    {
+        cerr << "Array mount failed\n";
+        return 3;
+    };
+    CObjectStore S(A);
+    if (!S.Load())
+        return 3;
+    long long Size = S.GetSize(pKey);
+    if (Size < 0)
+    {
+        cerr << "Object " << pKey << " not found\n";
+        return 3;
+    };
+    unsigned char* pData = AlignedMalloc(Size+1);
+    if (S.Get(pKey, pData, Size) != Size)
+    {
+        cerr << "Failed to read object " << pKey << endl;
+        AlignedFree(pData);
+        return 3;
+    };
+    int File = open(pFilename, O_RDWR | O_CREAT | O_TRUNC | FILE_IO_OPTIONS, 0644);
+    if (File < 0)
+    {
+        cerr << "Error opening file " << pFilename << endl;
+        AlignedFree(pData);
+        return 3;
+    };
+    if (write(File, pData, (unsigned) Size) != Size)
+    {
+        cerr << "Failed to write data to " << pFilename;
+        AlignedFree(pData);
+        return 3;
+    };
+    close(File);
+    AlignedFree(pData);
+    cerr << "Object extracted successfully\n";
+    A.Unmount();
+    return 0;
+};
+
+///delete a named object
+///@return 0 on success
+int DeleteObject(CDiskArray& A,///the array to be used
+                 const char* pKey ///object name
+                )
+{
+    if (!A.Mount(true))
+    {
+        cerr << "Array mount failed\n";
+        return 3;
+    };
+    CObjectStore S(A);
+    if (!S.Load())
+        return 3;
+    if (!S.Delete(pKey))
+    {
+        cerr << "Object " << pKey << " not found\n";
+        return 3;
+    };
+    cerr << "Object deleted successfully\n";
+    A.Unmount();
+    return 0;
+};
+
+///print object name and size
+static void PrintObject(const char* pKey, unsigned long long Size, void* pContext)
+{
+    cout << pKey << '\t' << Size << endl;
+    (*(unsigned*) pContext)++;
+};
+
+///list the objects stored in the array
+///@return 0 on success
+int ListObjects(CDiskArray& A///the array to be used
+               )
+{
+    if (!A.Mount(false))
+    {
+        cerr << "Array mount failed\n";
+        return 3;
+    };
+    CObjectStore S(A);
+    if (!S.Load())
+        return 3;
+    unsigned Count = 0;
+    S.Enumerate(PrintObject, &Count);
+    cout << Count << " objects, " << S.GetFreeStripes() << " free stripes\n";
+    A.Unmount();
+    return 0;
+};
+
+///the number of objects each thread of the object benchmark works with
+#define OBJECTSPERTHREAD 8
+
+///parameters and results of an object benchmarking thread
+struct ObjectBenchmarkData
+{
+    unsigned ThreadID;
+    ///the store to be tested
+    CObjectStore* pStore;
+    ///maximal size of the objects
+    unsigned MaxObjectSize;
+    ///the number of put, get and delete operations
+    unsigned long long Puts, Gets, Deletes;
+    ///the total number of bytes written and read
+    unsigned long long BytesWritten, BytesRead;
+    ///the number of failed operations
+    unsigned long long Errors;
+};
+
+///fill the buffer with a pseudorandom sequence determined by the seed
+static void FillObject(unsigned char* pData, unsigned Size, unsigned long long Seed)
+{
+    for (unsigned i = 0; i < Size; i++)
+        pData[i] = (unsigned char) (Rand(Seed) >> 56);
+};
+
+/**Each thread manages its own set of objects, so that the content of each of them is known,
+ * while the allocator and the index are shared by all threads
+ */
+#ifdef WIN32
+unsigned __stdcall
+#else
+void*
+#endif
+	ObjectThread(void* pParams ///must be a pointer to ObjectBenchmarkData
+                 )
+{
+    ObjectBenchmarkData& D = *(ObjectBenchmarkData*) pParams;
+    unsigned long long RNGState = (unsigned long long) pParams;
+    //seed and size of each stored object, Size is -1 if the object does not exist
+    unsigned long long Seeds[OBJECTSPERTHREAD];
+    long long Sizes[OBJECTSPERTHREAD];
+    for (unsigned i = 0; i < OBJECTSPERTHREAD; i++)
+        Sizes[i] = -1;
+    unsigned char* pData = AlignedMalloc(D.MaxObjectSize+1);
+    unsigned char* pExpected = new unsigned char[D.MaxObjectSize+1];
+    char Key[OBJECTKEYSIZE];
+    while (!BenchmarkDone)
+    {
+        unsigned ObjectID = (Rand(RNGState) >> 32) % OBJECTSPERTHREAD;
+        sprintf(Key, "bench-%u-%u", D.ThreadID, ObjectID);
+        unsigned Op = (Rand(RNGState) >> 32) % 8;
+        if ((Sizes[ObjectID] < 0) || (Op < 3))
+        {
+            //(re)write the object
+            unsigned Size = (unsigned) ((Rand(RNGState) >> 32) % (D.MaxObjectSize+1));
+            unsigned long long Seed = Rand(RNGState);
+            FillObject(pData, Size, Seed);
+            if (D.pStore->Put(Key, pData, Size))
+            {
+                Seeds[ObjectID] = Seed;
+                Sizes[ObjectID] = Size;
+                D.BytesWritten += Size;
+            }
+            else D.Errors++;
+            D.Puts++;
+        }
+        else if (Op == 3)
+        {
+            if (!D.pStore->Delete(Key))
+                D.Errors++;
+            Sizes[ObjectID] = -1;
+            D.Deletes++;
+        }
+        else
+        {
+            long long Size = D.pStore->Get(Key, pData, D.MaxObjectSize);
+            FillObject(pExpected, (unsigned) Sizes[ObjectID], Seeds[ObjectID]);
+            if ((Size != Sizes[ObjectID]) || memcmp(pData, pExpected, (size_t) Size))
+                D.Errors++;
+            else
+                D.BytesRead += Size;
+            D.Gets++;
+        };
+    };
+    AlignedFree(pData);
+    delete[]pExpected;
+    return 0;
+};
+
+///concurrently put, get and delete objects, verifying their content
+int ObjectBenchmark(CDiskArray& A, ///the array to be benchmarked
+                    unsigned MaxObjectSize, ///maximal size of the objects
+                    unsigned ThreadCount, ///number of threads to spawn
+                    unsigned MaxDuration ///maximal benchmark duration (sec)
+                   )
+{
+    if (!A.Mount(true))
+    {
+        cerr << "Array mount failed\n";
+        return 2;
+    };
+    CObjectStore S(A);
+    if (!S.Load())
+        return 2;
+    cout << "Running object store benchmark with " << ThreadCount << " threads and object size up to " << MaxObjectSize << endl;
+    ObjectBenchmarkData* pData = new ObjectBenchmarkData[ThreadCount];
+#ifdef WIN32
+	HANDLE* Threads = new HANDLE[ThreadCount];
+#else
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+    pthread_t* Threads = new pthread_t[ThreadCount];
+#endif
+    double StartTimeU,StartTimeS,StartTimeW;
+    GetTimes(StartTimeU,StartTimeS,StartTimeW);
+    for (unsigned i = 0; i < ThreadCount; i++)
+    {
+        memset(pData+i, 0, sizeof(ObjectBenchmarkData));
+        pData[i].ThreadID = i;
+        pData[i].pStore = &S;
+        pData[i].MaxObjectSize = MaxObjectSize;
+#ifdef WIN32
+		Threads[i]=(HANDLE) _beginthreadex(NULL,0,ObjectThread,pData+i,0,0);
+#else
+        pthread_create(Threads + i, &attr, ObjectThread, pData + i);
+#endif
+    };
+#ifdef WIN32
+	Sleep(MaxDuration*1000);
+#else
+    pthread_attr_destroy(&attr);
+	sleep(MaxDuration);
+#endif
+    BenchmarkDone=true;
+    unsigned long long Puts = 0, Gets = 0, Deletes = 0, BytesWritten = 0, BytesRead = 0, Errors = 0;
+    for (unsigned i = 0; i < ThreadCount; i++)
+    {
+#ifdef WIN32
+		WaitForSingleObject(Threads[i],INFINITE);
+		CloseHandle(Threads[i]);
+#else
+        void* status;
+		pthread_join(Threads[i], &status);
+#endif
+        Puts += pData[i].Puts;
+        Gets += pData[i].Gets;
+        Deletes += pData[i].Deletes;
+        BytesWritten += pData[i].BytesWritten;
+        BytesRead += pData[i].BytesRead;
+        Errors += pData[i].Errors;
+    };
+    double StopTimeU,StopTimeS,StopTimeW;
+    GetTimes(StopTimeU,StopTimeS,StopTimeW);
+    double TimeSpentW=StopTimeW-StartTimeW;
+    cout<<"Put/get/delete operations per second: "<<Puts/TimeSpentW<<'\t'<<Gets/TimeSpentW<<'\t'<<Deletes/TimeSpentW<<'\n'
+        <<"Write throughput (bytes/s): "<<BytesWritten/TimeSpentW<<'\n'
+        <<"Read throughput (bytes/s): "<<BytesRead/TimeSpentW<<'\n'
+        <<"Failed operations: "<<Errors<<endl;
+    delete[]Threads;
+    delete[]pData;
+    return (Errors) ? 3 : 0;
+};
+
+///create an empty log-structured volume on the array
+///@return 0 on success
+int FormatLogVolume(CDiskArray& A,///the array to be used
+                    unsigned SegmentStripes,///the number of stripes in a segment
+                    unsigned Utilization ///the percentage of the segment space exposed as logical blocks
+                   )
+{
+    if (!A.Mount(true))
+    {
+        cerr << "Array mount failed\n";
+        return 3;
+    };
+    CLogVolume V(A);
+    if (!V.Format(SegmentStripes, Utilization))
+    {
+        cerr << "Log-structured volume formatting failed\n";
+        return 3;
+    };
+    cout << "Log-structured volume created, capacity " << V.GetCapacity() << " bytes\n";
+    if (!V.Close())
+        return 3;
+    A.Unmount();
+    return 0;
+};
+
+///parameters and results of a log-structured volume benchmarking thread
+struct LogBenchmarkData
+{
+    unsigned ThreadID;
+    ///the volume to be tested
+    CLogVolume* pVolume;
+    ///size of the requests
+    unsigned BlockSize;
+    ///the first request-sized block of the region owned by the thread
+    unsigned long long FirstBlock;
+    ///the number of request-sized blocks in the region
+    unsigned long long NumOfBlocks;
+    ///the seed of the content of each block, 0 if the block was never written
+    unsigned long long* pSeeds;
+    ///the total number of bytes written and read
+    unsigned long long BytesWritten, BytesRead;
+    ///the number of failed operations
+    unsigned long long Errors;
+};
+
+///fill the buffer with the content expected for a given seed
+static void FillLogBlock(unsigned char* pData, unsigned Size, unsigned long long Seed)
+{
+    if (Seed)
+        FillObject(pData, Size, Seed);
+    else
+        memset(pData, 0, Size);
+};
+
+/**Each thread owns a region of the volume and issues random aligned writes to it,
+ * occasionally reading a block back, so that its content can be verified
+ */
+#ifdef WIN32
+unsigned __stdcall
+#else
+void*
+#endif
+	LogThread(void* pParams ///must be a pointer to LogBenchmarkData
+                 )
+{
+    LogBenchmarkData& D = *(LogBenchmarkData*) pParams;
+    unsigned long long RNGState = (unsigned long long) pParams;
+    unsigned char* pData = AlignedMalloc(D.BlockSize);
+    unsigned char* pExpected = new unsigned char[D.BlockSize];
+    while (!BenchmarkDone)
+    {
+        unsigned long long Block = (Rand(RNGState) >> 16) % D.NumOfBlocks;
+        unsigned long long Offset = (D.FirstBlock + Block) * D.BlockSize;
+        if ((Rand(RNGState) >> 32) % 4)
+        {
+            unsigned long long Seed = Rand(RNGState) | 1;
+            FillObject(pData, D.BlockSize, Seed);
+            if (D.pVolume->write(Offset, D.BlockSize, pData) == D.BlockSize)
+            {
+                D.pSeeds[Block] = Seed;
+                D.BytesWritten += D.BlockSize;
+            }
+            else D.Errors++;
+        }
+        else
+        {
+            FillLogBlock(pExpected, D.BlockSize, D.pSeeds[Block]);
+            if ((D.pVolume->read(Offset, D.BlockSize, pData) != D.BlockSize) || memcmp(pData, pExpected, D.BlockSize))
+                D.Errors++;
+            else
+                D.BytesRead += D.BlockSize;
+        };
+    };
+    AlignedFree(pData);
+    delete[]pExpected;
+    return 0;
+};
+
+/**After the benchmark, the volume is closed and reopened, and the content of all blocks is verified
+ */
+int LogBenchmark(CDiskArray& A, ///the array to be benchmarked
+                 unsigned BlockSize, ///size of the data blocks to be written
+                 unsigned ThreadCount, ///number of threads to spawn
+                 unsigned MaxDuration ///maximal benchmark duration (sec)
+                )
+{
+    if (!A.Mount(true))
+    {
+        cerr << "Array mount failed\n";
+        return 2;
+    };
+    CLogVolume V(A);
+    if (!V.Open(true))
+        return 2;
+    unsigned long long BlocksPerThread = (ThreadCount && BlockSize) ? V.GetCapacity() / BlockSize / ThreadCount : 0;
+    if (!BlocksPerThread)
+    {
+        cerr << "Invalid block size or thread count\n";
+        return 2;
+    };
+    cout << "Running log-structured volume benchmark with " << ThreadCount << " threads and block size " << BlockSize << endl;
+    //the volume content is not known, so overwrite it first
+    unsigned char* pZero = AlignedMalloc(BlockSize);
+    memset(pZero, 0, BlockSize);
+    for (unsigned long long i = 0; i < BlocksPerThread * ThreadCount; i++)
+        if (V.write(i * BlockSize, BlockSize, pZero) != BlockSize)
+        {
+            cerr << "Failed to clear the volume\n";
+            AlignedFree(pZero);
+            return 2;
+        };
+    AlignedFree(pZero);
+    unsigned long long SegmentsWritten0, SegmentsCleaned0, BlocksRelocated0;
+    V.GetStatistics(SegmentsWritten0, SegmentsCleaned0, BlocksRelocated0);
+    LogBenchmarkData* pData = new LogBenchmarkData[ThreadCount];
+#ifdef WIN32
+	HANDLE* Threads = new HANDLE[ThreadCount];
+#else
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+    pthread_t* Threads = new pthread_t[ThreadCount];
+#endif
+    double StartTimeU,StartTimeS,StartTimeW;
+    GetTimes(StartTimeU,StartTimeS,StartTimeW);
+    for (unsigned i = 0; i < ThreadCount; i++)
+    {
+        memset(pData+i, 0, sizeof(LogBenchmarkData));
+        pData[i].ThreadID = i;
+        pData[i].pVolume = &V;
+        pData[i].BlockSize = BlockSize;
+        pData[i].FirstBlock = i * BlocksPerThread;
+        pData[i].NumOfBlocks = BlocksPerThread;
+        pData[i].pSeeds = new unsigned long long[BlocksPerThread];
+        memset(pData[i].pSeeds, 0, sizeof(unsigned long long) * BlocksPerThread);
+#ifdef WIN32
+		Threads[i]=(HANDLE) _beginthreadex(NULL,0,LogThread,pData+i,0,0);
+#else
+        pthread_create(Threads + i, &attr, LogThread, pData + i);
+#endif
+    };
+#ifdef WIN32
+	Sleep(MaxDuration*1000);
+#else
+    pthread_attr_destroy(&attr);
+	sleep(MaxDuration);
+#endif
+    BenchmarkDone=true;
+    unsigned long long BytesWritten = 0, BytesRead = 0, Errors = 0;
+    for (unsigned i = 0; i < ThreadCount; i++)
+    {
+#ifdef WIN32
+		WaitForSingleObject(Threads[i],INFINITE);
+		CloseHandle(Threads[i]);
+#else
+        void* status;
+		pthread_join(Threads[i], &status);
+#endif
+        BytesWritten += pData[i].BytesWritten;
+        BytesRead += pData[i].BytesRead;
+        Errors += pData[i].Errors;
+    };
+    double StopTimeU,StopTimeS,StopTimeW;
+    GetTimes(StopTimeU,StopTimeS,StopTimeW);
+    double TimeSpentW=StopTimeW-StartTimeW;
+    unsigned long long SegmentsWritten, SegmentsCleaned, BlocksRelocated;
+    V.GetStatistics(SegmentsWritten, SegmentsCleaned, BlocksRelocated);
+    cout<<"Write throughput (bytes/s): "<<BytesWritten/TimeSpentW<<'\n'
+        <<"Read throughput (bytes/s): "<<BytesRead/TimeSpentW<<'\n'
+        <<"Segments written/cleaned: "<<SegmentsWritten-SegmentsWritten0<<'\t'<<SegmentsCleaned-SegmentsCleaned0<<'\n'
+        <<"Blocks relocated by the cleaner: "<<BlocksRelocated-BlocksRelocated0<<'\n'
+        <<"Failed operations: "<<Errors<<endl;
+    //verify the content after the checkpoint is reloaded
+    if (!V.Close() || !V.Open(false))
+        Errors++;
+    else
+    {
+        unsigned char* pBuffer = AlignedMalloc(BlockSize);
+        unsigned char* pExpected = new unsigned char[BlockSize];
+        unsigned long long Mismatches = 0;
+        for (unsigned i = 0; i < ThreadCount; i++)
+            for (unsigned long long j = 0; j < BlocksPerThread; j++)
+            {
+                FillLogBlock(pExpected, BlockSize, pData[i].pSeeds[j]);
+                if ((V.read((pData[i].FirstBlock + j) * BlockSize, BlockSize, pBuffer) != BlockSize) || memcmp(pBuffer, pExpected, BlockSize))
+                    Mismatches++;
+            };
+        cout<<"Blocks failed verification after reopening: "<<Mismatches<<endl;
+        Errors += Mismatches;
+        AlignedFree(pBuffer);
+        delete[]pExpected;
+        V.Close();
+    };
+    for (unsigned i = 0; i < ThreadCount; i++)
+        delete[]pData[i].pSeeds;
+    delete[]Threads;
+    delete[]pData;
+    return (Errors) ? 3 : 0;
+};